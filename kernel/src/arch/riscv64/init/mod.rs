@@ -11,7 +11,7 @@ use crate::{
     smp::cpu::ProcessorId,
 };
 
-use super::{cpu::init_local_context, interrupt::entry::handle_exception};
+use super::{cpu::init_local_context, interrupt::entry::handle_exception, time::time_early_init};
 
 #[derive(Debug)]
 pub struct ArchBootParams {
@@ -116,6 +116,7 @@ pub fn early_setup_arch() -> Result<(), SystemError> {
     print_node(fdt.find_node("/").unwrap(), 0);
 
     unsafe { parse_dtb() };
+    time_early_init(&fdt);
 
     for x in mem_block_manager().to_iter() {
         kdebug!("before efi: {x:?}");
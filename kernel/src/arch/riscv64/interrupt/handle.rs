@@ -2,7 +2,13 @@ use core::hint::spin_loop;
 
 use system_error::SystemError;
 
-use crate::{kdebug, kerror};
+use crate::{
+    kdebug, kerror,
+    mm::{
+        fault::{FaultFlags, PageFaultHandler},
+        VirtAddr,
+    },
+};
 
 use super::TrapFrame;
 
@@ -146,27 +152,40 @@ fn do_trap_user_env_call(_trap_frame: &mut TrapFrame) -> Result<(), SystemError>
 // 9-11 reserved
 
 /// 处理指令页错误异常 #12
-fn do_trap_insn_page_fault(_trap_frame: &mut TrapFrame) -> Result<(), SystemError> {
-    kerror!("riscv64_do_irq: do_insn_page_fault");
-    loop {
-        spin_loop();
-    }
+fn do_trap_insn_page_fault(trap_frame: &mut TrapFrame) -> Result<(), SystemError> {
+    return do_page_fault(trap_frame, FaultFlags::FAULT_FLAG_INSTRUCTION);
 }
 
 /// 处理页加载错误异常 #13
-fn do_trap_load_page_fault(_trap_frame: &mut TrapFrame) -> Result<(), SystemError> {
-    kerror!("riscv64_do_irq: do_trap_load_page_fault");
-    loop {
-        spin_loop();
-    }
+fn do_trap_load_page_fault(trap_frame: &mut TrapFrame) -> Result<(), SystemError> {
+    return do_page_fault(trap_frame, FaultFlags::empty());
 }
 
 // 14 reserved
 
 /// 处理页存储错误异常 #15
-fn do_trap_store_page_fault(_trap_frame: &mut TrapFrame) -> Result<(), SystemError> {
-    kerror!("riscv64_do_irq: do_trap_store_page_fault");
-    loop {
-        spin_loop();
+fn do_trap_store_page_fault(trap_frame: &mut TrapFrame) -> Result<(), SystemError> {
+    return do_page_fault(trap_frame, FaultFlags::FAULT_FLAG_WRITE);
+}
+
+/// 页错误异常的公共处理流程：尝试为用户地址空间按需分配物理页
+fn do_page_fault(trap_frame: &mut TrapFrame, mut flags: FaultFlags) -> Result<(), SystemError> {
+    let address = VirtAddr::new(trap_frame.badaddr);
+    if trap_frame.from_user() {
+        flags |= FaultFlags::FAULT_FLAG_USER;
+    }
+
+    let r = PageFaultHandler::handle_user_fault(address, flags);
+    if r.is_err() {
+        kerror!(
+            "riscv64_do_irq: page fault can not be handled, address: {:?}, flags: {:?}, epc: {:#x}",
+            address,
+            flags,
+            trap_frame.epc
+        );
+        loop {
+            spin_loop();
+        }
     }
+    return r;
 }
@@ -8,8 +8,10 @@ use crate::{
         allocator::{
             buddy::BuddyAllocator,
             page_frame::{FrameAllocator, PageFrameCount, PageFrameUsage, PhysPageFrame},
+            per_cpu_pages::{pcp_allocate, pcp_free, pcp_usage},
         },
         page::PageFlags,
+        page_meta::{page_meta_on_allocate, page_meta_on_free},
         MemoryManagementArch, PageTableKind, PhysAddr, VirtAddr,
     },
 };
@@ -18,6 +20,7 @@ use self::init::riscv_mm_init;
 
 pub mod bump;
 pub(super) mod init;
+pub mod percpu;
 
 pub type PageMapper = crate::mm::page::PageMapper<RiscV64MMArch, LockedFrameAllocator>;
 
@@ -189,25 +192,20 @@ pub struct LockedFrameAllocator;
 
 impl FrameAllocator for LockedFrameAllocator {
     unsafe fn allocate(&mut self, count: PageFrameCount) -> Option<(PhysAddr, PageFrameCount)> {
-        if let Some(ref mut allocator) = *INNER_ALLOCATOR.lock_irqsave() {
-            return allocator.allocate(count);
-        } else {
-            return None;
+        let r = pcp_allocate(&INNER_ALLOCATOR, count);
+        if let Some((paddr, count)) = r {
+            page_meta_on_allocate(paddr, count);
         }
+        return r;
     }
 
     unsafe fn free(&mut self, address: crate::mm::PhysAddr, count: PageFrameCount) {
         assert!(count.data().is_power_of_two());
-        if let Some(ref mut allocator) = *INNER_ALLOCATOR.lock_irqsave() {
-            return allocator.free(address, count);
-        }
+        page_meta_on_free(address, count);
+        pcp_free(&INNER_ALLOCATOR, address, count);
     }
 
     unsafe fn usage(&self) -> PageFrameUsage {
-        if let Some(ref mut allocator) = *INNER_ALLOCATOR.lock_irqsave() {
-            return allocator.usage();
-        } else {
-            panic!("usage error");
-        }
+        return pcp_usage(&INNER_ALLOCATOR).expect("usage error");
     }
 }
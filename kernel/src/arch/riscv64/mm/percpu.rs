@@ -0,0 +1,42 @@
+//! riscv64的每CPU数据区
+//!
+//! tp寄存器指向的LocalContext本身就是一个PerCpu变量，通过它获取当前cpu的id，再查表得到数据区的起始地址。
+
+use core::sync::atomic::{AtomicU64, Ordering};
+
+use crate::{
+    arch::cpu::current_cpu_id,
+    mm::{
+        percpu::{PerCpu, PerCpuArch},
+        VirtAddr,
+    },
+    smp::cpu::ProcessorId,
+};
+
+pub struct RiscV64PerCpuArch;
+
+impl PerCpuArch for RiscV64PerCpuArch {
+    const HEADER_SIZE: usize = 0;
+
+    unsafe fn init_area(_cpu: ProcessorId, _base: VirtAddr) {}
+
+    unsafe fn setup_this_cpu(_cpu: ProcessorId, _base: VirtAddr) {}
+
+    #[inline(always)]
+    fn this_cpu_base() -> VirtAddr {
+        return PerCpu::area_base(current_cpu_id());
+    }
+
+    #[inline(always)]
+    unsafe fn this_cpu_read_u64(offset: usize) -> u64 {
+        let ptr = (Self::this_cpu_base().data() + offset) as *const AtomicU64;
+        return (*ptr).load(Ordering::Relaxed);
+    }
+
+    #[inline(always)]
+    unsafe fn this_cpu_add_u64(offset: usize, val: u64) {
+        // 读取数据区地址之后可能被迁移到其他cpu，使用amoadd保证计数不会丢失
+        let ptr = (Self::this_cpu_base().data() + offset) as *const AtomicU64;
+        (*ptr).fetch_add(val, Ordering::Relaxed);
+    }
+}
@@ -24,6 +24,8 @@ pub use self::pci::RiscV64PciArch as PciArch;
 pub use self::pio::RiscV64PortIOArch as CurrentPortIOArch;
 pub use self::time::RiscV64TimeArch as CurrentTimeArch;
 
+pub use self::mm::percpu::RiscV64PerCpuArch as CurrentPerCpuArch;
+
 pub use self::elf::RiscV64ElfArch as CurrentElfArch;
 
 pub use crate::arch::smp::RiscV64SMPArch as CurrentSMPArch;
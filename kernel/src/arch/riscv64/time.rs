@@ -1,8 +1,53 @@
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+use fdt::Fdt;
+
 use crate::time::TimeArch;
+
+/// QEMU virt平台的`time`寄存器频率，设备树中没有`timebase-frequency`时使用
+const DEFAULT_TIMEBASE_FREQ: usize = 10_000_000;
+
+/// `time`寄存器的计数频率（单位：Hz）
+static TIMEBASE_FREQ: AtomicUsize = AtomicUsize::new(0);
+
+/// 从设备树的`/cpus`节点读取`time`寄存器的计数频率
+pub fn time_early_init(fdt: &Fdt) {
+    let freq = fdt
+        .find_node("/cpus")
+        .and_then(|node| node.property("timebase-frequency"))
+        .and_then(|prop| prop.as_usize())
+        .unwrap_or_else(|| {
+            kwarn!(
+                "No timebase-frequency in fdt, assume {} Hz",
+                DEFAULT_TIMEBASE_FREQ
+            );
+            DEFAULT_TIMEBASE_FREQ
+        });
+    TIMEBASE_FREQ.store(freq, Ordering::SeqCst);
+    kinfo!("Timebase frequency: {} Hz", freq);
+}
+
 pub struct RiscV64TimeArch;
 
 impl TimeArch for RiscV64TimeArch {
+    /// 读取`time`寄存器。与`cycle`寄存器不同，它以固定的频率计数，并且S态总是可以访问
     fn get_cycles() -> usize {
-        riscv::register::cycle::read()
+        riscv::register::time::read()
+    }
+
+    fn cycles2ns(cycles: usize) -> usize {
+        let freq = TIMEBASE_FREQ.load(Ordering::Relaxed);
+        if freq == 0 {
+            // 尚未从设备树读取频率
+            return 0;
+        }
+        return (cycles as u128 * 1_000_000_000 / freq as u128) as usize;
+    }
+
+    fn set_next_event(delta_ns: u64) {
+        let freq = TIMEBASE_FREQ.load(Ordering::Relaxed) as u128;
+        let delta = (delta_ns as u128 * freq / 1_000_000_000) as u64;
+        let now = riscv::register::time::read64();
+        sbi_rt::set_timer(now.saturating_add(delta));
     }
 }
@@ -1,13 +1,13 @@
-use x86::cpuid::{cpuid, CpuIdResult};
-
 use crate::smp::cpu::{ProcessorId, SmpCpuManager};
 
+use super::mm::percpu::X86_64PerCpuArch;
+
 /// 获取当前cpu的apic id
+///
+/// 从gs指向的每CPU数据区中读取，而不是执行开销很大的cpuid指令
 #[inline]
 pub fn current_cpu_id() -> ProcessorId {
-    let cpuid_res: CpuIdResult = cpuid!(0x1);
-    let cpu_id = (cpuid_res.ebx >> 24) & 0xff;
-    return ProcessorId::new(cpu_id);
+    return X86_64PerCpuArch::current_cpu_id();
 }
 
 /// 重置cpu
@@ -10,18 +10,18 @@ use crate::exception::irqdesc::{
 use crate::exception::manage::irq_manager;
 use crate::exception::IrqNumber;
 
-use crate::kdebug;
 use crate::mm::percpu::PerCpu;
-use crate::sched::core::sched_update_jiffies;
 use crate::smp::core::smp_get_processor_id;
 use crate::smp::cpu::ProcessorId;
 use crate::time::clocksource::HZ;
+use crate::time::tick::{tick_handle_event, tick_setup_local};
+use crate::{kdebug, kinfo};
 use alloc::string::ToString;
 use alloc::sync::Arc;
 pub use drop;
 use system_error::SystemError;
 use x86::cpuid::cpuid;
-use x86::msr::{wrmsr, IA32_X2APIC_DIV_CONF, IA32_X2APIC_INIT_COUNT};
+use x86::msr::{wrmsr, IA32_TSC_DEADLINE, IA32_X2APIC_DIV_CONF, IA32_X2APIC_INIT_COUNT};
 
 use super::lapic_vector::local_apic_chip;
 use super::xapic::XApicOffset;
@@ -85,6 +85,16 @@ pub fn apic_timer_init() {
 
     LocalApicTimerIntrController.install();
     LocalApicTimerIntrController.enable();
+    // 由时钟中断模拟层决定下一次中断的时刻
+    tick_setup_local();
+}
+
+/// 设置当前cpu的APIC定时器，在delta_ns纳秒之后产生一次中断
+///
+/// 只在单次触发模式和TSC-Deadline模式下有效
+pub fn apic_timer_set_next_event(delta_ns: u64) {
+    let cpu_id = smp_get_processor_id();
+    local_apic_timer_instance(cpu_id).program_next_event(delta_ns);
 }
 
 /// 初始化本地APIC定时器的中断描述符
@@ -106,11 +116,9 @@ fn init_bsp_apic_timer() {
     kdebug!("init_bsp_apic_timer");
     assert!(smp_get_processor_id().data() == 0);
     let mut local_apic_timer = local_apic_timer_instance_mut(ProcessorId::new(0));
-    local_apic_timer.init(
-        LocalApicTimerMode::Periodic,
-        LocalApicTimer::periodic_default_initial_count(),
-        LocalApicTimer::DIVISOR as u32,
-    );
+    let mode = local_apic_timer.oneshot_mode();
+    kinfo!("APIC timer mode: {:?}", mode);
+    local_apic_timer.init(mode, 0, LocalApicTimer::DIVISOR as u32);
     kdebug!("init_bsp_apic_timer done");
 }
 
@@ -120,11 +128,8 @@ fn init_ap_apic_timer() {
     assert!(cpu_id.data() != 0);
 
     let mut local_apic_timer = local_apic_timer_instance_mut(cpu_id);
-    local_apic_timer.init(
-        LocalApicTimerMode::Periodic,
-        LocalApicTimer::periodic_default_initial_count(),
-        LocalApicTimer::DIVISOR as u32,
-    );
+    let mode = local_apic_timer.oneshot_mode();
+    local_apic_timer.init(mode, 0, LocalApicTimer::DIVISOR as u32);
     kdebug!("init_ap_apic_timer done");
 }
 
@@ -195,6 +200,7 @@ impl LocalApicTimer {
     }
 
     /// 周期模式下的默认初始值
+    #[allow(dead_code)]
     pub fn periodic_default_initial_count() -> u64 {
         let cpu_khz = TSCManager::cpu_khz();
 
@@ -213,8 +219,58 @@ impl LocalApicTimer {
         self.triggered = false;
         match mode {
             LocalApicTimerMode::Periodic => self.install_periodic_mode(initial_count, divisor),
-            LocalApicTimerMode::Oneshot => todo!(),
-            LocalApicTimerMode::Deadline => todo!(),
+            LocalApicTimerMode::Oneshot => self.install_oneshot_mode(divisor),
+            LocalApicTimerMode::Deadline => self.install_deadline_mode(),
+        }
+    }
+
+    /// 选择单次触发的工作模式：TSC为常数并且支持TSC-Deadline时使用TSC-Deadline模式
+    fn oneshot_mode(&self) -> LocalApicTimerMode {
+        if self.is_deadline_mode_supported() && Self::is_tsc_invariant() {
+            return LocalApicTimerMode::Deadline;
+        }
+        return LocalApicTimerMode::Oneshot;
+    }
+
+    fn install_oneshot_mode(&mut self, divisor: u32) {
+        self.mode = LocalApicTimerMode::Oneshot;
+        self.set_divisor(divisor);
+        self.setup_lvt(
+            APIC_TIMER_IRQ_NUM.data() as u8,
+            true,
+            LocalApicTimerMode::Oneshot,
+        );
+        // 初始值为0时定时器不会产生中断，直到第一次调用program_next_event()
+        self.set_initial_cnt(0);
+    }
+
+    fn install_deadline_mode(&mut self) {
+        self.mode = LocalApicTimerMode::Deadline;
+        self.setup_lvt(
+            APIC_TIMER_IRQ_NUM.data() as u8,
+            true,
+            LocalApicTimerMode::Deadline,
+        );
+    }
+
+    /// 在delta_ns纳秒之后产生一次中断
+    fn program_next_event(&self, delta_ns: u64) {
+        match self.mode {
+            LocalApicTimerMode::Oneshot => {
+                // APIC定时器每毫秒计数cpu_khz/DIVISOR次（参见periodic_default_initial_count）
+                let count = delta_ns as u128 * TSCManager::cpu_khz() as u128
+                    / (self.divisor as u128 * 1_000_000);
+                let count = count.clamp(1, u32::MAX as u128) as u64;
+                CurrentApic.set_timer_initial_count(count);
+            }
+            LocalApicTimerMode::Deadline => {
+                let cycles = delta_ns as u128 * TSCManager::tsc_khz() as u128 / 1_000_000;
+                unsafe {
+                    let deadline = x86::time::rdtsc() + cycles.max(1) as u64;
+                    wrmsr(IA32_TSC_DEADLINE, deadline);
+                }
+            }
+            LocalApicTimerMode::Periodic => {}
         }
     }
 
@@ -268,14 +324,22 @@ impl LocalApicTimer {
     ///
     /// 此函数调用cpuid，请避免多次调用此函数。
     /// 如果支持TSC-Deadline模式，则除非TSC为常数，否则不会启用该模式。
-    #[allow(dead_code)]
     pub fn is_deadline_mode_supported(&self) -> bool {
         let res = cpuid!(1);
         return (res.ecx & (1 << 24)) != 0;
     }
 
+    /// 检查TSC的频率是否为常数（不受cpu频率调节和深度睡眠状态的影响）
+    fn is_tsc_invariant() -> bool {
+        let max_ext = cpuid!(0x80000000).eax;
+        if max_ext < 0x80000007 {
+            return false;
+        }
+        return (cpuid!(0x80000007).edx & (1 << 8)) != 0;
+    }
+
     pub(super) fn handle_irq() -> Result<IrqReturn, SystemError> {
-        sched_update_jiffies();
+        tick_handle_event();
         return Ok(IrqReturn::Handled);
     }
 }
@@ -11,7 +11,7 @@ use crate::{
         CurrentPortIOArch,
     },
     kdebug, kinfo,
-    mm::PhysAddr,
+    mm::{page::tlb_shootdown_cpu_online, PhysAddr},
     smp::core::smp_get_processor_id,
 };
 
@@ -518,6 +518,8 @@ impl LocalAPIC for CurrentApic {
         }
 
         kinfo!("Apic initialized.");
+        // 从现在开始，当前CPU可以接收刷新TLB的IPI
+        tlb_shootdown_cpu_online();
         return true;
     }
 
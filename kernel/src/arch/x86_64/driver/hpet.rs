@@ -19,7 +19,6 @@ use crate::{
         irqdata::IrqHandlerData,
         irqdesc::{IrqHandleFlags, IrqHandler, IrqReturn},
         manage::irq_manager,
-        softirq::{softirq_vectors, SoftirqNumber},
         InterruptArch, IrqNumber,
     },
     kdebug, kerror, kinfo,
@@ -31,7 +30,7 @@ use crate::{
         mmio_buddy::{mmio_pool, MMIOSpaceGuard},
         PhysAddr,
     },
-    time::timer::{clock, timer_get_first_expire, update_timer_jiffies},
+    time::timer::{run_local_timers, update_timer_jiffies},
 };
 
 static mut HPET_INSTANCE: Option<Hpet> = None;
@@ -240,11 +239,7 @@ impl Hpet {
             assert!(CurrentIrqArch::is_irq_enabled() == false);
             update_timer_jiffies(Self::HPET0_INTERVAL_USEC, Self::HPET0_INTERVAL_USEC as i64);
 
-            if let Ok(first_expire) = timer_get_first_expire() {
-                if first_expire <= clock() {
-                    softirq_vectors().raise_softirq(SoftirqNumber::TIMER);
-                }
-            }
+            run_local_timers();
         }
     }
 }
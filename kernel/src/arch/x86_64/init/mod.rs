@@ -17,6 +17,7 @@ use super::{
         hpet::{hpet_init, hpet_instance},
         tsc::TSCManager,
     },
+    mm::percpu::X86_64PerCpuArch,
     MMArch,
 };
 
@@ -58,6 +59,9 @@ unsafe extern "C" fn kernel_main(
     x86::dtables::lgdt(&gdtp);
     x86::dtables::lidt(&idtp);
 
+    // 在此之后才能获取当前cpu的id
+    X86_64PerCpuArch::early_init();
+
     compiler_fence(Ordering::SeqCst);
     multiboot2_init(mb2_info, (mb2_magic & 0xFFFF_FFFF) as u32);
     compiler_fence(Ordering::SeqCst);
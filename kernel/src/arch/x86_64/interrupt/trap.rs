@@ -1,8 +1,17 @@
 use system_error::SystemError;
 
 use crate::{
-    arch::CurrentIrqArch, exception::InterruptArch, kerror, kwarn, mm::VirtAddr, print,
-    process::ProcessManager, smp::core::smp_get_processor_id,
+    arch::{ipc::signal::Signal, CurrentIrqArch},
+    exception::InterruptArch,
+    kerror, kwarn,
+    mm::{
+        fault::{FaultFlags, PageFaultHandler},
+        VirtAddr,
+    },
+    print,
+    process::ProcessManager,
+    smp::core::smp_get_processor_id,
+    syscall::Syscall,
 };
 
 use super::{
@@ -324,36 +333,83 @@ Segment Selector Index: {:#x}\n
 /// 处理页错误 14 #PF
 #[no_mangle]
 unsafe extern "C" fn do_page_fault(regs: &'static TrapFrame, error_code: u64) {
+    let address = VirtAddr::new(x86::controlregs::cr2());
+    let error_code = X86PfErrorCode::from_bits_truncate(error_code as u32);
+
+    // 访问用户空间地址导致的缺页：尝试按需分配物理页
+    if address.check_user() && !error_code.contains(X86PfErrorCode::X86_PF_RSVD) {
+        let mut flags = FaultFlags::empty();
+        if error_code.contains(X86PfErrorCode::X86_PF_WRITE) {
+            flags |= FaultFlags::FAULT_FLAG_WRITE;
+        }
+        if error_code.contains(X86PfErrorCode::X86_PF_USER) {
+            flags |= FaultFlags::FAULT_FLAG_USER;
+        }
+        if error_code.contains(X86PfErrorCode::X86_PF_INSTR) {
+            flags |= FaultFlags::FAULT_FLAG_INSTRUCTION;
+        }
+        if error_code.contains(X86PfErrorCode::X86_PF_PROT) {
+            flags |= FaultFlags::FAULT_FLAG_PRESENT;
+        }
+
+        // 处理缺页时需要获取地址空间的锁，而持有锁的CPU可能正在等待当前CPU应答TLB shootdown，
+        // 因此如果触发异常的上下文允许中断，就在这里重新打开中断
+        if regs.rflags & (1 << 9) != 0 {
+            CurrentIrqArch::interrupt_enable();
+        }
+
+        match PageFaultHandler::handle_user_fault(address, flags) {
+            Ok(_) => return,
+            Err(e) if error_code.contains(X86PfErrorCode::X86_PF_USER) => {
+                // 用户程序访问了非法的地址，向其发送SIGSEGV信号
+                kerror!(
+                    "User page fault: pid: {:?}, rip: {:#x}, address: {:?}, error code: {:?}, err: {:?}",
+                    ProcessManager::current_pid(),
+                    regs.rip,
+                    address,
+                    error_code,
+                    e
+                );
+                let r = Syscall::kill(ProcessManager::current_pid(), Signal::SIGSEGV as i32);
+                if r.is_err() {
+                    kerror!("In do_page_fault: generate SIGSEGV signal failed");
+                }
+                return;
+            }
+            Err(_) => {}
+        }
+    }
+
     kerror!(
         "do_page_fault(14), \tError code: {:#x},\trsp: {:#x},\trip: {:#x},\t CPU: {}, \tpid: {:?}, \nFault Address: {:#x}",
-        error_code,
+        error_code.bits(),
         regs.rsp,
         regs.rip,
         smp_get_processor_id().data(),
         ProcessManager::current_pid(),
-        x86::controlregs::cr2()
+        address.data()
     );
 
-    if (error_code & 0x01) == 0 {
+    if !error_code.contains(X86PfErrorCode::X86_PF_PROT) {
         print!("Page Not Present,\t");
     }
-    if (error_code & 0x02) != 0 {
+    if error_code.contains(X86PfErrorCode::X86_PF_WRITE) {
         print!("Write Access,\t");
     } else {
         print!("Read Access,\t");
     }
 
-    if (error_code & 0x04) != 0 {
+    if error_code.contains(X86PfErrorCode::X86_PF_USER) {
         print!("Fault in user(3),\t");
     } else {
         print!("Fault in supervisor(0,1,2),\t");
     }
 
-    if (error_code & 0x08) != 0 {
+    if error_code.contains(X86PfErrorCode::X86_PF_RSVD) {
         print!("Reserved bit violation cause fault,\t");
     }
 
-    if (error_code & 0x10) != 0 {
+    if error_code.contains(X86PfErrorCode::X86_PF_INSTR) {
         print!("Instruction fetch cause fault,\t");
     }
     print!("\n");
@@ -362,6 +418,22 @@ unsafe extern "C" fn do_page_fault(regs: &'static TrapFrame, error_code: u64) {
     panic!("Page Fault");
 }
 
+bitflags! {
+    /// 缺页异常的错误码
+    pub struct X86PfErrorCode: u32 {
+        /// 0: 页面不存在 1: 访问权限不足
+        const X86_PF_PROT = 1 << 0;
+        /// 0: 读访问 1: 写访问
+        const X86_PF_WRITE = 1 << 1;
+        /// 0: 内核态访问 1: 用户态访问
+        const X86_PF_USER = 1 << 2;
+        /// 页表项中的保留位被置位
+        const X86_PF_RSVD = 1 << 3;
+        /// 取指令导致的异常
+        const X86_PF_INSTR = 1 << 4;
+    }
+}
+
 /// 处理x87 FPU错误 16 #MF
 #[no_mangle]
 unsafe extern "C" fn do_x87_FPU_error(regs: &'static TrapFrame, error_code: u64) {
@@ -1,6 +1,7 @@
 pub mod barrier;
 pub mod bump;
 mod c_adapter;
+pub mod percpu;
 
 use alloc::vec::Vec;
 use hashbrown::HashSet;
@@ -17,7 +18,9 @@ use crate::libs::lib_ui::screen_manager::scm_disable_put_to_window;
 use crate::libs::spinlock::SpinLock;
 
 use crate::mm::allocator::page_frame::{FrameAllocator, PageFrameCount, PageFrameUsage};
+use crate::mm::allocator::per_cpu_pages::{pcp_allocate, pcp_free, pcp_usage};
 use crate::mm::memblock::mem_block_manager;
+use crate::mm::page_meta::{page_meta_on_allocate, page_meta_on_free};
 use crate::{
     arch::MMArch,
     mm::allocator::{buddy::BuddyAllocator, bump::BumpAllocator},
@@ -601,26 +604,21 @@ pub struct LockedFrameAllocator;
 
 impl FrameAllocator for LockedFrameAllocator {
     unsafe fn allocate(&mut self, count: PageFrameCount) -> Option<(PhysAddr, PageFrameCount)> {
-        if let Some(ref mut allocator) = *INNER_ALLOCATOR.lock_irqsave() {
-            return allocator.allocate(count);
-        } else {
-            return None;
+        let r = pcp_allocate(&INNER_ALLOCATOR, count);
+        if let Some((paddr, count)) = r {
+            page_meta_on_allocate(paddr, count);
         }
+        return r;
     }
 
     unsafe fn free(&mut self, address: crate::mm::PhysAddr, count: PageFrameCount) {
         assert!(count.data().is_power_of_two());
-        if let Some(ref mut allocator) = *INNER_ALLOCATOR.lock_irqsave() {
-            return allocator.free(address, count);
-        }
+        page_meta_on_free(address, count);
+        pcp_free(&INNER_ALLOCATOR, address, count);
     }
 
     unsafe fn usage(&self) -> PageFrameUsage {
-        if let Some(ref mut allocator) = *INNER_ALLOCATOR.lock_irqsave() {
-            return allocator.usage();
-        } else {
-            panic!("usage error");
-        }
+        return pcp_usage(&INNER_ALLOCATOR).expect("usage error");
     }
 }
 
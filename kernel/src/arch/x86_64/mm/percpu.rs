@@ -0,0 +1,150 @@
+//! x86_64的每CPU数据区
+//!
+//! 内核态下，gs寄存器的基址始终指向当前cpu的数据区，用户态的gsbase则暂存在KernelGsbase寄存器中，
+//! 二者在进入/退出内核时由swapgs交换。
+//!
+//! 数据区的开头是`X86_64PerCpuHeader`：syscall入口通过gs:0x0获取当前进程的系统调用栈，
+//! 并通过gs:0x8暂存用户栈指针。
+
+use core::arch::asm;
+
+use kdepends::memoffset::offset_of;
+use x86::{
+    cpuid::{cpuid, CpuIdResult},
+    msr::{wrmsr, IA32_GS_BASE},
+};
+
+use crate::{
+    mm::{
+        percpu::{PerCpu, PerCpuArch},
+        VirtAddr,
+    },
+    smp::cpu::ProcessorId,
+};
+
+/// 每个cpu的数据区的头部，成员的偏移量被汇编代码使用，不能随意修改
+#[repr(C)]
+#[derive(Debug)]
+struct X86_64PerCpuHeader {
+    /// 当前进程的系统调用栈（gs:0x0）
+    kstack: usize,
+    /// syscall入口暂存的用户栈指针（gs:0x8）
+    user_rsp: usize,
+    /// 当前cpu的id（gs:0x10）
+    cpu_id: usize,
+    /// 数据区自身的地址（gs:0x18）
+    base: usize,
+}
+
+/// `PerCpu::init()`之前，BSP使用的临时的头部
+static mut BOOT_PERCPU_HEADER: X86_64PerCpuHeader = X86_64PerCpuHeader {
+    kstack: 0,
+    user_rsp: 0,
+    cpu_id: 0,
+    base: 0,
+};
+
+pub struct X86_64PerCpuArch;
+
+impl X86_64PerCpuArch {
+    /// BSP进入内核后立即调用：在数据区分配之前，让gs指向一个临时的头部，使得`current_cpu_id()`可以使用
+    pub unsafe fn early_init() {
+        let header = &mut BOOT_PERCPU_HEADER;
+        header.cpu_id = Self::apic_id();
+        header.base = header as *mut X86_64PerCpuHeader as usize;
+        wrmsr(IA32_GS_BASE, header.base as u64);
+    }
+
+    /// AP进入Rust代码后立即调用：让gs指向这个cpu的数据区
+    pub unsafe fn ap_init() {
+        let cpu = ProcessorId::new(Self::apic_id() as u32);
+        Self::setup_this_cpu(cpu, PerCpu::area_base(cpu));
+    }
+
+    /// 通过cpuid获取当前cpu的apic id，只在设置gs之前使用
+    fn apic_id() -> usize {
+        let cpuid_res: CpuIdResult = cpuid!(0x1);
+        return ((cpuid_res.ebx >> 24) & 0xff) as usize;
+    }
+
+    /// 获取当前cpu的id
+    #[inline(always)]
+    pub fn current_cpu_id() -> ProcessorId {
+        let cpu_id: u32;
+        unsafe {
+            asm!(
+                "mov {0:e}, dword ptr gs:[{off}]",
+                out(reg) cpu_id,
+                off = const(offset_of!(X86_64PerCpuHeader, cpu_id)),
+                options(nostack, preserves_flags, readonly)
+            );
+        }
+        return ProcessorId::new(cpu_id);
+    }
+
+    /// 设置syscall入口使用的系统调用栈（进程切换、返回用户态之前调用）
+    #[inline(always)]
+    pub fn set_kstack(kstack: VirtAddr) {
+        unsafe {
+            asm!(
+                "mov qword ptr gs:[{off}], {0}",
+                in(reg) kstack.data(),
+                off = const(offset_of!(X86_64PerCpuHeader, kstack)),
+                options(nostack, preserves_flags)
+            );
+        }
+    }
+}
+
+impl PerCpuArch for X86_64PerCpuArch {
+    const HEADER_SIZE: usize = 64;
+
+    unsafe fn init_area(cpu: ProcessorId, base: VirtAddr) {
+        let header = &mut *(base.data() as *mut X86_64PerCpuHeader);
+        header.kstack = 0;
+        header.user_rsp = 0;
+        header.cpu_id = cpu.data() as usize;
+        header.base = base.data();
+    }
+
+    unsafe fn setup_this_cpu(_cpu: ProcessorId, base: VirtAddr) {
+        // 此时还没有切换到用户态的进程，不需要迁移临时头部中的系统调用栈
+        wrmsr(IA32_GS_BASE, base.data() as u64);
+    }
+
+    #[inline(always)]
+    fn this_cpu_base() -> VirtAddr {
+        let base: usize;
+        unsafe {
+            asm!(
+                "mov {0}, qword ptr gs:[{off}]",
+                out(reg) base,
+                off = const(offset_of!(X86_64PerCpuHeader, base)),
+                options(nostack, preserves_flags, readonly)
+            );
+        }
+        return VirtAddr::new(base);
+    }
+
+    #[inline(always)]
+    unsafe fn this_cpu_read_u64(offset: usize) -> u64 {
+        let val: u64;
+        asm!(
+            "mov {0}, qword ptr gs:[{1}]",
+            out(reg) val,
+            in(reg) offset,
+            options(nostack, preserves_flags, readonly)
+        );
+        return val;
+    }
+
+    #[inline(always)]
+    unsafe fn this_cpu_add_u64(offset: usize, val: u64) {
+        asm!(
+            "add qword ptr gs:[{0}], {1}",
+            in(reg) offset,
+            in(reg) val,
+            options(nostack)
+        );
+    }
+}
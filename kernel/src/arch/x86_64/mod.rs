@@ -34,6 +34,8 @@ pub use kvm::X86_64KVMArch as KVMArch;
 pub use crate::arch::ipc::signal::X86_64SignalArch as CurrentSignalArch;
 pub use crate::arch::time::X86_64TimeArch as CurrentTimeArch;
 
+pub use crate::arch::mm::percpu::X86_64PerCpuArch as CurrentPerCpuArch;
+
 pub use crate::arch::elf::X86_64ElfArch as CurrentElfArch;
 
 pub use crate::arch::smp::X86_64SMPArch as CurrentSMPArch;
@@ -1,19 +1,44 @@
-use core::hint::spin_loop;
+use core::{arch::asm, hint::spin_loop};
 
-use crate::{arch::CurrentIrqArch, exception::InterruptArch, kBUG, process::ProcessManager};
+use crate::{
+    arch::{sched::sched, CurrentIrqArch},
+    exception::InterruptArch,
+    kBUG,
+    process::{ProcessFlags, ProcessManager},
+    time::tick::{tick_nohz_idle_enter, tick_nohz_idle_exit},
+};
 
 impl ProcessManager {
     /// 每个核的idle进程
     pub fn arch_idle_func() -> ! {
         loop {
-            if CurrentIrqArch::is_irq_enabled() {
-                unsafe {
-                    x86::halt();
-                }
-            } else {
+            if !CurrentIrqArch::is_irq_enabled() {
                 kBUG!("Idle process should not be scheduled with IRQs disabled.");
                 spin_loop();
+                continue;
+            }
+
+            if ProcessManager::current_pcb()
+                .flags()
+                .contains(ProcessFlags::NEED_SCHEDULE)
+            {
+                sched();
+                continue;
+            }
+
+            // 关中断之后再次检查，避免在停止时钟中断之后错过唤醒
+            unsafe { CurrentIrqArch::interrupt_disable() };
+            tick_nohz_idle_enter();
+            if ProcessManager::current_pcb()
+                .flags()
+                .contains(ProcessFlags::NEED_SCHEDULE)
+            {
+                unsafe { CurrentIrqArch::interrupt_enable() };
+            } else {
+                // sti的下一条指令执行完之前不会响应中断，因此sti;hlt之间不会丢失中断
+                unsafe { asm!("sti; hlt", options(nomem, nostack)) };
             }
+            tick_nohz_idle_exit();
         }
     }
 }
@@ -21,7 +21,7 @@ use crate::{
     kerror, kwarn,
     libs::spinlock::SpinLockGuard,
     mm::{
-        percpu::{PerCpu, PerCpuVar},
+        percpu::{PerCpu, PerCpuArch, PerCpuVar},
         VirtAddr,
     },
     process::{
@@ -29,6 +29,7 @@ use crate::{
         KernelStack, ProcessControlBlock, ProcessFlags, ProcessManager, SwitchResult,
         SWITCH_RESULT,
     },
+    smp::core::smp_get_processor_id,
     syscall::Syscall,
 };
 
@@ -38,7 +39,10 @@ use self::{
     table::{switch_fs_and_gs, KERNEL_DS, USER_DS},
 };
 
-use super::{fpu::FpState, interrupt::TrapFrame, syscall::X86_64GSData, CurrentIrqArch};
+use super::{
+    fpu::FpState, interrupt::TrapFrame, mm::percpu::X86_64PerCpuArch, syscall::X86_64GSData,
+    CurrentIrqArch,
+};
 
 pub mod idle;
 pub mod kthread;
@@ -115,7 +119,6 @@ impl ArchPCBInfo {
             gsbase: 0,
             gsdata: X86_64GSData {
                 kaddr: VirtAddr::new(0),
-                uaddr: VirtAddr::new(0),
             },
             fs: KERNEL_DS,
             gs: KERNEL_DS,
@@ -189,12 +192,11 @@ impl ArchPCBInfo {
         }
     }
 
+    /// 保存用户态的gsbase
+    ///
+    /// 内核态下，gs指向每CPU数据区，当前进程用户态的gsbase暂存在KernelGsbase寄存器中
     pub unsafe fn save_gsbase(&mut self) {
-        if x86::controlregs::cr4().contains(Cr4::CR4_ENABLE_FSGSBASE) {
-            self.gsbase = x86::current::segmentation::rdgsbase() as usize;
-        } else {
-            self.gsbase = x86::msr::rdmsr(x86::msr::IA32_GS_BASE) as usize;
-        }
+        self.gsbase = x86::msr::rdmsr(x86::msr::IA32_KERNEL_GSBASE) as usize;
     }
 
     pub unsafe fn restore_fsbase(&mut self) {
@@ -205,20 +207,14 @@ impl ArchPCBInfo {
         }
     }
 
+    /// 恢复用户态的gsbase到KernelGsbase寄存器，返回用户态时由swapgs换入
     pub unsafe fn restore_gsbase(&mut self) {
-        if x86::controlregs::cr4().contains(Cr4::CR4_ENABLE_FSGSBASE) {
-            x86::current::segmentation::wrgsbase(self.gsbase as u64);
-        } else {
-            x86::msr::wrmsr(x86::msr::IA32_GS_BASE, self.gsbase as u64);
-        }
+        x86::msr::wrmsr(x86::msr::IA32_KERNEL_GSBASE, self.gsbase as u64);
     }
 
-    /// 将gsdata写入KernelGsbase寄存器
-    pub unsafe fn store_kernel_gsbase(&self) {
-        x86::msr::wrmsr(
-            x86::msr::IA32_KERNEL_GSBASE,
-            &self.gsdata as *const X86_64GSData as u64,
-        );
+    /// 将系统调用栈写入当前cpu的数据区，供syscall入口使用
+    pub fn load_syscall_stack(&self) {
+        X86_64PerCpuArch::set_kstack(self.gsdata.kaddr);
     }
 
     /// ### 初始化系统调用栈，不得与PCB内核栈冲突(即传入的应该是一个新的栈，避免栈损坏)
@@ -430,12 +426,12 @@ impl ProcessManager {
     }
 
     unsafe fn switch_gsbase(prev: &Arc<ProcessControlBlock>, next: &Arc<ProcessControlBlock>) {
-        asm!("swapgs", options(nostack, preserves_flags));
+        // 内核态的gs始终指向当前cpu的数据区，只需要切换KernelGsbase中的用户态gsbase
         prev.arch_info_irqsave().save_gsbase();
-        next.arch_info_irqsave().restore_gsbase();
-        // 将下一个进程的kstack写入kernel_gsbase
-        next.arch_info_irqsave().store_kernel_gsbase();
-        asm!("swapgs", options(nostack, preserves_flags));
+        let mut next_arch = next.arch_info_irqsave();
+        next_arch.restore_gsbase();
+        // 将下一个进程的系统调用栈写入当前cpu的数据区
+        next_arch.load_syscall_stack();
     }
 }
 
@@ -561,13 +557,17 @@ pub unsafe fn arch_switch_to_user(path: String, argv: Vec<String>, envp: Vec<Str
     arch_guard.fs = USER_DS;
     arch_guard.gs = USER_DS;
 
-    // 将内核gs数据压进cpu
-    arch_guard.store_kernel_gsbase();
-
+    // 加载gs段选择子会清零gsbase，所以要先记下当前cpu的数据区
+    let cpu = smp_get_processor_id();
     switch_fs_and_gs(
         SegmentSelector::from_bits_truncate(arch_guard.fs.bits()),
         SegmentSelector::from_bits_truncate(arch_guard.gs.bits()),
     );
+    X86_64PerCpuArch::setup_this_cpu(cpu, PerCpu::area_base(cpu));
+
+    // 返回用户态时，由ret_from_intr中的swapgs换入用户态的gsbase
+    arch_guard.restore_gsbase();
+    arch_guard.load_syscall_stack();
     arch_guard.rip = new_rip.data();
 
     drop(arch_guard);
@@ -605,7 +605,6 @@ unsafe extern "sysv64" fn ready_to_switch_to_user(
 ) -> ! {
     *(trapframe_vaddr as *mut TrapFrame) = trap_frame;
     asm!(
-        "swapgs",
         "mov rsp, {trapframe_vaddr}",
         "push {new_rip}",
         "ret",
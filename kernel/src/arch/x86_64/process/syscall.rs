@@ -74,18 +74,29 @@ impl Syscall {
         param.init_info_mut().envs = envp;
 
         // 把proc_init_info写到用户栈上
-
+        // 用户栈的物理页是按需分配的，写入时可能触发缺页异常，因此不能持有地址空间的锁，
+        // 而是先在栈信息的副本上操作，完成后再更新栈顶地址
+        let mut ustack = unsafe {
+            address_space
+                .read()
+                .user_stack
+                .as_ref()
+                .expect("No user stack found")
+                .clone_info_only()
+        };
         let (user_sp, argv_ptr) = unsafe {
             param
                 .init_info()
-                .push_at(
-                    address_space
-                        .write()
-                        .user_stack_mut()
-                        .expect("No user stack found"),
-                )
+                .push_at(&mut ustack)
                 .expect("Failed to push proc_init_info to user stack")
         };
+        unsafe {
+            address_space
+                .write()
+                .user_stack_mut()
+                .expect("No user stack found")
+                .set_sp(ustack.sp())
+        };
 
         // kdebug!("write proc_init_info to user stack done");
 
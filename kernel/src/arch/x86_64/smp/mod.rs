@@ -18,7 +18,7 @@ use crate::{
     smp::{core::smp_get_processor_id, cpu::ProcessorId, SMPArch},
 };
 
-use super::{acpi::early_acpi_boot_init, CurrentIrqArch};
+use super::{acpi::early_acpi_boot_init, mm::percpu::X86_64PerCpuArch, CurrentIrqArch};
 
 extern "C" {
     fn smp_ap_start_stage2();
@@ -35,6 +35,8 @@ struct ApStartStackInfo {
 #[no_mangle]
 unsafe extern "C" fn smp_ap_start() -> ! {
     CurrentIrqArch::interrupt_disable();
+    // 在获取cpu id之前，先让gs指向这个cpu的数据区
+    X86_64PerCpuArch::ap_init();
     let vaddr = cpu_core_info[smp_get_processor_id().data() as usize].stack_start as usize;
     compiler_fence(core::sync::atomic::Ordering::SeqCst);
     let v = ApStartStackInfo { vaddr };
@@ -21,19 +21,17 @@ use super::{
 
 pub mod nr;
 
-/// ### 存储PCB系统调用栈以及在syscall过程中暂存用户态rsp的结构体
+/// ### 存储PCB系统调用栈的结构体
 ///
-/// 在syscall指令中将会从该结构体中读取系统调用栈和暂存rsp,
-/// 使用`gsbase`寄存器实现，后续如果需要使用gsbase寄存器，需要相应设置正确的偏移量
+/// 进程被调度到cpu上时，系统调用栈会被写入该cpu的数据区（gs:0x0），syscall指令从那里读取它
 #[repr(C)]
 #[derive(Debug, Clone)]
 pub(super) struct X86_64GSData {
     pub(super) kaddr: VirtAddr,
-    pub(super) uaddr: VirtAddr,
 }
 
 impl X86_64GSData {
-    /// ### 设置系统调用栈，将会在下一个调度后写入KernelGsbase
+    /// ### 设置系统调用栈，将会在下一个调度后写入cpu的数据区
     pub fn set_kstack(&mut self, kstack: VirtAddr) {
         self.kaddr = kstack;
     }
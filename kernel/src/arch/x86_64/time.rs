@@ -1,9 +1,24 @@
 use crate::time::TimeArch;
 
+use super::driver::{apic::apic_timer::apic_timer_set_next_event, tsc::TSCManager};
+
 pub struct X86_64TimeArch;
 
 impl TimeArch for X86_64TimeArch {
     fn get_cycles() -> usize {
         unsafe { x86::time::rdtsc() as usize }
     }
+
+    fn cycles2ns(cycles: usize) -> usize {
+        let tsc_khz = TSCManager::tsc_khz();
+        if tsc_khz == 0 {
+            // TSC尚未完成校准
+            return 0;
+        }
+        return (cycles as u128 * 1_000_000 / tsc_khz as u128) as usize;
+    }
+
+    fn set_next_event(delta_ns: u64) {
+        apic_timer_set_next_event(delta_ns);
+    }
 }
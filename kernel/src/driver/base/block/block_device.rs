@@ -17,7 +17,10 @@ use alloc::{sync::Arc, vec::Vec};
 use core::any::Any;
 use system_error::SystemError;
 
-use super::disk_info::Partition;
+use super::{
+    disk_info::Partition,
+    request_queue::{BlkPlug, RequestQueue},
+};
 
 /// 该文件定义了 Device 和 BlockDevice 的接口
 /// Notice 设备错误码使用 Posix 规定的 int32_t 的错误码表示，而不是自己定义错误enum
@@ -239,40 +242,23 @@ pub trait BlockDevice: Device {
     /// @brief 返回当前磁盘上的所有分区的Arc指针数组
     fn partitions(&self) -> Vec<Arc<Partition>>;
 
+    /// @brief 返回块设备的请求队列。
+    /// 没有请求队列的块设备，读写请求会被直接交给read_at()/write_at()执行
+    fn request_queue(&self) -> Option<Arc<RequestQueue>> {
+        return None;
+    }
+
     fn write_at_bytes(&self, offset: usize, len: usize, buf: &[u8]) -> Result<usize, SystemError> {
         // assert!(len <= buf.len());
         if len > buf.len() {
             return Err(SystemError::E2BIG);
         }
 
-        let iter = BlockIter::new_multiblock(offset, offset + len, self.blk_size_log2());
-        let multi = iter.multiblock;
-
-        for range in iter {
-            let buf_begin = range.origin_begin() - offset; // 本次读操作的起始位置/已经读了这么多字节
-            let buf_end = range.origin_end() - offset;
-            let buf_slice = &buf[buf_begin..buf_end];
-            let count: usize = (range.lba_end - range.lba_start).try_into().unwrap();
-            let full = multi && range.is_multi() || !multi && range.is_full();
-
-            if full {
-                self.write_at(range.lba_start, count, buf_slice)?;
-            } else {
-                if self.blk_size_log2() > BLK_SIZE_LOG2_LIMIT {
-                    return Err(SystemError::E2BIG);
-                }
-
-                let mut temp = Vec::new();
-                temp.resize(1usize << self.blk_size_log2(), 0);
-                // 由于块设备每次读写都是整块的，在不完整写入之前，必须把不完整的地方补全
-                self.read_at(range.lba_start, 1, &mut temp[..])?;
-                // 把数据从临时buffer复制到目标buffer
-                temp[range.begin..range.end].copy_from_slice(&buf_slice);
-                self.write_at(range.lba_start, 1, &temp[..])?;
-            }
-        }
+        // 整块的部分经过请求队列合并、调度后写入
+        let mut plug = BlkPlug::new(self);
+        plug.write_bytes(offset, len, buf)?;
+        plug.finish()?;
         return Ok(len);
-        //self.0.lock().write_at(lba_id_start, count, buf)
     }
 
     fn read_at_bytes(
@@ -285,41 +271,10 @@ pub trait BlockDevice: Device {
             return Err(SystemError::E2BIG);
         }
 
-        let iter = BlockIter::new_multiblock(offset, offset + len, self.blk_size_log2());
-        let multi = iter.multiblock;
-
-        // 枚举每一个range
-        for range in iter {
-            let buf_begin = range.origin_begin() - offset; // 本次读操作的起始位置/已经读了这么多字节
-            let buf_end = range.origin_end() - offset;
-            let buf_slice = &mut buf[buf_begin..buf_end];
-            let count: usize = (range.lba_end - range.lba_start).try_into().unwrap();
-            let full = multi && range.is_multi() || !multi && range.is_full();
-
-            // 读取整个block作为有效数据
-            if full {
-                // 调用 BlockDevice::read_at() 直接把引用传进去，不是把整个数组move进去
-                self.read_at(range.lba_start, count, buf_slice)?;
-            } else {
-                // 判断块的长度不能超过最大值
-                if self.blk_size_log2() > BLK_SIZE_LOG2_LIMIT {
-                    return Err(SystemError::E2BIG);
-                }
-
-                let mut temp = Vec::new();
-                temp.resize(1usize << self.blk_size_log2(), 0);
-                self.read_at(range.lba_start, 1, &mut temp[..])?;
-
-                // 把数据从临时buffer复制到目标buffer
-                buf_slice.copy_from_slice(&temp[range.begin..range.end]);
-            }
-        }
+        let mut plug = BlkPlug::new(self);
+        plug.read_bytes(offset, len, buf)?;
+        plug.finish()?;
         return Ok(len);
-
-        // kdebug!(
-        //     "ahci read at {lba_id_start}, count={count}, lock={:?}",
-        //     self.0
-        // );
     }
 }
 
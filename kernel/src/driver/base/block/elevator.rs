@@ -0,0 +1,305 @@
+//! 块设备的I/O调度器（电梯算法）
+//!
+//! 调度器保存尚未派发给驱动的请求，负责：
+//! - 把新的bio合并到相邻的请求中（前向合并、后向合并）
+//! - 决定下一个派发给驱动的请求
+//!
+//! 目前实现了两种调度器：
+//! - noop: 按照提交的顺序派发，只做合并
+//! - deadline: 按照LBA排序派发（单向电梯），同时为每个请求设置期限，防止请求饿死
+
+use core::fmt::Debug;
+
+use alloc::{
+    boxed::Box,
+    collections::{BTreeMap, BTreeSet, VecDeque},
+    sync::Arc,
+};
+
+use crate::time::timer::{clock, next_n_ms_timer_jiffies};
+
+use super::{
+    block_device::BlockId,
+    request_queue::{Bio, BioType, Request},
+};
+
+/// 调度器的类型
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ElevatorType {
+    Noop,
+    Deadline,
+}
+
+impl ElevatorType {
+    pub fn create(&self) -> Box<dyn Elevator> {
+        match self {
+            ElevatorType::Noop => Box::new(NoopElevator::new()),
+            ElevatorType::Deadline => Box::new(DeadlineElevator::new()),
+        }
+    }
+}
+
+/// I/O调度器应当实现的接口
+pub trait Elevator: Debug + Send + Sync {
+    fn name(&self) -> &'static str;
+
+    /// 把bio加入调度器。优先合并到已有的请求中，否则为它创建新的请求
+    ///
+    /// ## 参数
+    ///
+    /// - `bio` - 要加入的bio
+    /// - `max_blocks` - 合并后的请求最多包含的块数
+    ///
+    /// ## 返回值
+    ///
+    /// bio是否被合并到了已有的请求中
+    fn add_bio(&mut self, bio: Arc<Bio>, max_blocks: usize) -> bool;
+
+    /// 加入一个已经构造好的请求（切换调度器时使用）
+    fn add_request(&mut self, req: Request);
+
+    /// 取出下一个要派发给驱动的请求
+    fn dispatch(&mut self) -> Option<Request>;
+
+    fn is_empty(&self) -> bool;
+}
+
+/// noop调度器：先进先出，只做合并
+#[derive(Debug)]
+pub struct NoopElevator {
+    queue: VecDeque<Request>,
+}
+
+impl NoopElevator {
+    pub fn new() -> Self {
+        Self {
+            queue: VecDeque::new(),
+        }
+    }
+}
+
+impl Elevator for NoopElevator {
+    fn name(&self) -> &'static str {
+        "noop"
+    }
+
+    fn add_bio(&mut self, bio: Arc<Bio>, max_blocks: usize) -> bool {
+        // 最近加入的请求最有可能与新的bio相邻
+        for req in self.queue.iter_mut().rev() {
+            if req.try_back_merge(&bio, max_blocks) || req.try_front_merge(&bio, max_blocks) {
+                return true;
+            }
+        }
+        self.queue.push_back(Request::new(bio, 0));
+        return false;
+    }
+
+    fn add_request(&mut self, req: Request) {
+        self.queue.push_back(req);
+    }
+
+    fn dispatch(&mut self) -> Option<Request> {
+        self.queue.pop_front()
+    }
+
+    fn is_empty(&self) -> bool {
+        self.queue.is_empty()
+    }
+}
+
+/// 读请求的期限（毫秒）
+const DEADLINE_READ_EXPIRE_MS: u64 = 500;
+/// 写请求的期限（毫秒）
+const DEADLINE_WRITE_EXPIRE_MS: u64 = 5000;
+/// 按照LBA顺序连续派发的请求数量上限（一个批次）
+const DEADLINE_FIFO_BATCH: usize = 16;
+/// 有写请求等待时，读请求最多可以连续被优先派发的批次数
+const DEADLINE_WRITES_STARVED: usize = 2;
+
+/// deadline调度器中，一个方向（读/写）的请求
+#[derive(Debug, Default)]
+struct DeadlineDir {
+    /// 请求编号 -> 请求
+    reqs: BTreeMap<u64, Request>,
+    /// 按照(起始LBA, 请求编号)排序的索引
+    sorted: BTreeSet<(BlockId, u64)>,
+    /// 按照加入的先后顺序排列的请求编号（同一方向的期限是单调的）。
+    /// 已经派发的请求不会立即从这里删除
+    fifo: VecDeque<u64>,
+}
+
+impl DeadlineDir {
+    fn fifo_head(&mut self) -> Option<u64> {
+        while let Some(id) = self.fifo.front() {
+            if self.reqs.contains_key(id) {
+                return Some(*id);
+            }
+            self.fifo.pop_front();
+        }
+        return None;
+    }
+
+    fn insert(&mut self, id: u64, req: Request) {
+        self.sorted.insert((req.lba_start(), id));
+        self.fifo.push_back(id);
+        self.reqs.insert(id, req);
+    }
+
+    fn take(&mut self, id: u64) -> Request {
+        let req = self.reqs.remove(&id).unwrap();
+        self.sorted.remove(&(req.lba_start(), id));
+        return req;
+    }
+}
+
+/// deadline调度器
+///
+/// 读写请求分别按照LBA排序。每次按照LBA递增的顺序连续派发同一方向上的一批请求；
+/// 一个批次结束后优先派发读请求，但写请求不会被饿死。
+/// 如果某个方向上最早的请求已经超过期限，则从它开始派发下一批请求。
+#[derive(Debug)]
+pub struct DeadlineElevator {
+    dirs: [DeadlineDir; 2],
+    next_id: u64,
+    /// 上一次派发的请求的方向
+    last_dir: usize,
+    /// 上一次派发的请求的结束位置
+    last_pos: BlockId,
+    /// 当前批次已经派发的请求数量
+    batching: usize,
+    /// 在有写请求等待的情况下，读请求被优先派发的批次数
+    starved: usize,
+}
+
+impl DeadlineElevator {
+    pub fn new() -> Self {
+        Self {
+            dirs: [DeadlineDir::default(), DeadlineDir::default()],
+            next_id: 0,
+            last_dir: BioType::Read as usize,
+            last_pos: 0,
+            batching: 0,
+            starved: 0,
+        }
+    }
+
+    fn expire_jiffies(op: BioType) -> u64 {
+        match op {
+            BioType::Read => next_n_ms_timer_jiffies(DEADLINE_READ_EXPIRE_MS),
+            BioType::Write => next_n_ms_timer_jiffies(DEADLINE_WRITE_EXPIRE_MS),
+        }
+    }
+
+    /// 在当前方向上，LBA不小于上次派发位置的第一个请求
+    fn next_sorted(&self, dir: usize) -> Option<u64> {
+        return self.dirs[dir]
+            .sorted
+            .range((self.last_pos, 0)..)
+            .next()
+            .map(|(_, id)| *id);
+    }
+
+    fn fifo_expired(&mut self, dir: usize) -> bool {
+        let d = &mut self.dirs[dir];
+        if let Some(id) = d.fifo_head() {
+            return d.reqs.get(&id).unwrap().deadline() <= clock();
+        }
+        return false;
+    }
+
+    fn take(&mut self, dir: usize, id: u64) -> Request {
+        let req = self.dirs[dir].take(id);
+        self.last_dir = dir;
+        self.last_pos = req.lba_end();
+        self.batching += 1;
+        return req;
+    }
+}
+
+impl Elevator for DeadlineElevator {
+    fn name(&self) -> &'static str {
+        "deadline"
+    }
+
+    fn add_bio(&mut self, bio: Arc<Bio>, max_blocks: usize) -> bool {
+        let d = &mut self.dirs[bio.op() as usize];
+
+        // 后向合并：起始位置在bio之前，并且最靠近bio的请求
+        if let Some(&(_, id)) = d.sorted.range(..=(bio.lba_start(), u64::MAX)).next_back() {
+            if d.reqs
+                .get_mut(&id)
+                .unwrap()
+                .try_back_merge(&bio, max_blocks)
+            {
+                return true;
+            }
+        }
+
+        // 前向合并：起始位置恰好在bio之后的请求。合并后请求的起始位置改变，需要更新索引
+        if let Some(&(lba, id)) = d.sorted.range((bio.lba_end(), 0)..).next() {
+            let req = d.reqs.get_mut(&id).unwrap();
+            if req.try_front_merge(&bio, max_blocks) {
+                d.sorted.remove(&(lba, id));
+                d.sorted.insert((req.lba_start(), id));
+                return true;
+            }
+        }
+
+        let id = self.next_id;
+        self.next_id += 1;
+        let deadline = Self::expire_jiffies(bio.op());
+        d.insert(id, Request::new(bio, deadline));
+        return false;
+    }
+
+    fn add_request(&mut self, mut req: Request) {
+        let id = self.next_id;
+        self.next_id += 1;
+        req.set_deadline(Self::expire_jiffies(req.op()));
+        self.dirs[req.op() as usize].insert(id, req);
+    }
+
+    fn dispatch(&mut self) -> Option<Request> {
+        // 继续当前批次
+        if self.batching < DEADLINE_FIFO_BATCH {
+            if let Some(id) = self.next_sorted(self.last_dir) {
+                return Some(self.take(self.last_dir, id));
+            }
+        }
+
+        // 开始新的批次，选择方向
+        let read = BioType::Read as usize;
+        let write = BioType::Write as usize;
+        let has_reads = !self.dirs[read].reqs.is_empty();
+        let has_writes = !self.dirs[write].reqs.is_empty();
+        let dir = if has_reads && !(has_writes && self.starved >= DEADLINE_WRITES_STARVED) {
+            if has_writes {
+                self.starved += 1;
+            }
+            read
+        } else if has_writes {
+            self.starved = 0;
+            write
+        } else {
+            return None;
+        };
+
+        // 换了方向、最早的请求已经超时，或者已经到达磁盘末端时，从最早的请求开始
+        let next = if dir == self.last_dir && !self.fifo_expired(dir) {
+            self.next_sorted(dir)
+        } else {
+            None
+        };
+        let id = match next {
+            Some(id) => id,
+            None => self.dirs[dir].fifo_head().unwrap(),
+        };
+
+        self.batching = 0;
+        return Some(self.take(dir, id));
+    }
+
+    fn is_empty(&self) -> bool {
+        self.dirs.iter().all(|d| d.reqs.is_empty())
+    }
+}
@@ -1,5 +1,7 @@
 pub mod block_device;
 pub mod disk_info;
+pub mod elevator;
+pub mod request_queue;
 
 #[derive(Debug)]
 #[allow(dead_code)]
@@ -0,0 +1,534 @@
+//! 块设备的请求队列
+//!
+//! 文件系统对块设备的读写以bio的形式提交。bio先在`BlkPlug`中积攒（plug），
+//! 然后按照LBA排序，一次性加入块设备的请求队列（unplug）。
+//! 请求队列中的I/O调度器把LBA相邻的bio合并成更大的请求，并决定请求的派发顺序。
+//!
+//! 请求由提交者自己派发：提交者在等待自己的bio完成期间，从队列中取出请求，调用驱动的`read_at`/`write_at`。
+//! 因此多个提交者可以同时向驱动派发请求（例如AHCI的NCQ）。
+
+use core::{
+    hint::spin_loop,
+    marker::PhantomData,
+    slice::{from_raw_parts, from_raw_parts_mut},
+    sync::atomic::{AtomicUsize, Ordering},
+};
+
+use alloc::{boxed::Box, collections::VecDeque, sync::Arc, vec::Vec};
+use system_error::SystemError;
+
+use crate::{
+    arch::{sched::sched, CurrentIrqArch},
+    exception::InterruptArch,
+    libs::{spinlock::SpinLock, wait_queue::WaitQueue},
+    mm::VirtAddr,
+    process::ProcessManager,
+};
+
+use super::{
+    block_device::{BlockDevice, BlockId, BlockIter, BLK_SIZE_LOG2_LIMIT},
+    elevator::{Elevator, ElevatorType},
+};
+
+/// 一个BlkPlug中最多积攒的bio数量，超过后先提交已经积攒的bio
+const BLK_MAX_PLUG_BIOS: usize = 64;
+
+/// bio的操作类型
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum BioType {
+    Read = 0,
+    Write = 1,
+}
+
+/// 一次对连续的块的读写操作
+///
+/// bio只记录数据缓冲区的地址，缓冲区由创建它的`BlkPlug`借用，保证在bio完成之前有效
+#[derive(Debug)]
+pub struct Bio {
+    op: BioType,
+    lba_start: BlockId,
+    count: usize,
+    /// 数据缓冲区的虚拟地址
+    buf: usize,
+    /// 数据缓冲区的长度（字节）
+    len: usize,
+    /// bio完成后被设置
+    result: SpinLock<Option<Result<(), SystemError>>>,
+    wait_queue: WaitQueue,
+}
+
+impl Bio {
+    fn new(op: BioType, lba_start: BlockId, count: usize, buf: usize, len: usize) -> Arc<Self> {
+        Arc::new(Self {
+            op,
+            lba_start,
+            count,
+            buf,
+            len,
+            result: SpinLock::new(None),
+            wait_queue: WaitQueue::INIT,
+        })
+    }
+
+    pub fn op(&self) -> BioType {
+        self.op
+    }
+
+    pub fn lba_start(&self) -> BlockId {
+        self.lba_start
+    }
+
+    /// 结束位置（不包含）
+    pub fn lba_end(&self) -> BlockId {
+        self.lba_start + self.count
+    }
+
+    fn is_done(&self) -> bool {
+        self.result.lock_irqsave().is_some()
+    }
+
+    fn complete(&self, r: Result<(), SystemError>) {
+        self.result.lock_irqsave().replace(r);
+        self.wait_queue.wakeup_all(None);
+    }
+
+    /// 等待bio完成。如果当前进程不能睡眠（关中断、持有自旋锁），则忙等
+    fn wait(&self) -> Result<(), SystemError> {
+        loop {
+            let can_sleep = CurrentIrqArch::is_irq_enabled()
+                && ProcessManager::current_pcb().preempt_count() == 0;
+            let irq_guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
+            let guard = self.result.lock();
+            if let Some(r) = guard.as_ref() {
+                return r.clone();
+            }
+
+            if can_sleep {
+                unsafe { self.wait_queue.sleep_without_schedule() };
+                drop(guard);
+                drop(irq_guard);
+                sched();
+            } else {
+                drop(guard);
+                drop(irq_guard);
+                spin_loop();
+            }
+        }
+    }
+}
+
+/// 派发给驱动的请求，由一个或多个LBA连续、操作类型相同的bio组成
+#[derive(Debug)]
+pub struct Request {
+    op: BioType,
+    lba_start: BlockId,
+    count: usize,
+    /// 按照LBA递增的顺序排列
+    bios: VecDeque<Arc<Bio>>,
+    /// 请求的期限（jiffies），由调度器使用
+    deadline: u64,
+}
+
+impl Request {
+    pub fn new(bio: Arc<Bio>, deadline: u64) -> Self {
+        let mut bios = VecDeque::new();
+        let (op, lba_start, count) = (bio.op, bio.lba_start, bio.count);
+        bios.push_back(bio);
+        Self {
+            op,
+            lba_start,
+            count,
+            bios,
+            deadline,
+        }
+    }
+
+    pub fn op(&self) -> BioType {
+        self.op
+    }
+
+    pub fn lba_start(&self) -> BlockId {
+        self.lba_start
+    }
+
+    /// 结束位置（不包含）
+    pub fn lba_end(&self) -> BlockId {
+        self.lba_start + self.count
+    }
+
+    pub fn deadline(&self) -> u64 {
+        self.deadline
+    }
+
+    pub fn set_deadline(&mut self, deadline: u64) {
+        self.deadline = deadline;
+    }
+
+    /// 如果bio紧接在请求之后，则把它合并到请求的末尾
+    pub fn try_back_merge(&mut self, bio: &Arc<Bio>, max_blocks: usize) -> bool {
+        if bio.op != self.op
+            || bio.lba_start != self.lba_end()
+            || self.count + bio.count > max_blocks
+        {
+            return false;
+        }
+        self.count += bio.count;
+        self.bios.push_back(bio.clone());
+        return true;
+    }
+
+    /// 如果bio紧接在请求之前，则把它合并到请求的开头
+    pub fn try_front_merge(&mut self, bio: &Arc<Bio>, max_blocks: usize) -> bool {
+        if bio.op != self.op
+            || bio.lba_end() != self.lba_start
+            || self.count + bio.count > max_blocks
+        {
+            return false;
+        }
+        self.lba_start = bio.lba_start;
+        self.count += bio.count;
+        self.bios.push_front(bio.clone());
+        return true;
+    }
+}
+
+/// 块设备的请求队列
+#[derive(Debug)]
+pub struct RequestQueue {
+    elevator: SpinLock<Box<dyn Elevator>>,
+    /// 一个请求最多包含的块数（由驱动的能力决定）
+    max_blocks: usize,
+    /// 提交的bio数量
+    nr_bios: AtomicUsize,
+    /// 被合并到已有请求中的bio数量
+    nr_merges: AtomicUsize,
+    /// 派发给驱动的请求数量
+    nr_requests: AtomicUsize,
+}
+
+impl RequestQueue {
+    pub fn new(elevator: ElevatorType, max_blocks: usize) -> Arc<Self> {
+        Arc::new(Self {
+            elevator: SpinLock::new(elevator.create()),
+            max_blocks,
+            nr_bios: AtomicUsize::new(0),
+            nr_merges: AtomicUsize::new(0),
+            nr_requests: AtomicUsize::new(0),
+        })
+    }
+
+    pub fn elevator_name(&self) -> &'static str {
+        self.elevator.lock().name()
+    }
+
+    /// 切换I/O调度器，尚未派发的请求转移到新的调度器中
+    pub fn set_elevator(&self, elevator: ElevatorType) {
+        let mut new = elevator.create();
+        let mut guard = self.elevator.lock();
+        while let Some(req) = guard.dispatch() {
+            new.add_request(req);
+        }
+        *guard = new;
+    }
+
+    /// 返回 (提交的bio数量, 合并的bio数量, 派发的请求数量)
+    pub fn stats(&self) -> (usize, usize, usize) {
+        (
+            self.nr_bios.load(Ordering::Relaxed),
+            self.nr_merges.load(Ordering::Relaxed),
+            self.nr_requests.load(Ordering::Relaxed),
+        )
+    }
+
+    fn insert(&self, bios: &[Arc<Bio>]) {
+        let mut merges = 0;
+        let mut elevator = self.elevator.lock();
+        for bio in bios {
+            if elevator.add_bio(bio.clone(), self.max_blocks) {
+                merges += 1;
+            }
+        }
+        drop(elevator);
+        self.nr_bios.fetch_add(bios.len(), Ordering::Relaxed);
+        self.nr_merges.fetch_add(merges, Ordering::Relaxed);
+    }
+
+    /// 派发请求，直到`bios`全部完成
+    fn run<D: BlockDevice + ?Sized>(&self, dev: &D, bios: &[Arc<Bio>]) {
+        for bio in bios {
+            while !bio.is_done() {
+                let req = self.elevator.lock().dispatch();
+                match req {
+                    Some(req) => self.execute(dev, req),
+                    // bio所在的请求已经被其他进程派发
+                    None => {
+                        bio.wait().ok();
+                    }
+                }
+            }
+        }
+    }
+
+    /// 把请求交给驱动执行
+    fn execute<D: BlockDevice + ?Sized>(&self, dev: &D, req: Request) {
+        self.nr_requests.fetch_add(1, Ordering::Relaxed);
+        let len: usize = req.bios.iter().map(|b| b.len).sum();
+        // 所有bio的缓冲区在虚拟地址上连续时（例如读取文件中连续的簇），直接使用它们的缓冲区
+        let contiguous = req
+            .bios
+            .iter()
+            .zip(req.bios.iter().skip(1))
+            .all(|(a, b)| a.buf + a.len == b.buf);
+
+        let r = if contiguous {
+            let buf_ptr = req.bios.front().unwrap().buf;
+            match req.op {
+                BioType::Read => {
+                    let buf = unsafe { from_raw_parts_mut(buf_ptr as *mut u8, len) };
+                    dev.read_at(req.lba_start, req.count, buf)
+                }
+                BioType::Write => {
+                    let buf = unsafe { from_raw_parts(buf_ptr as *const u8, len) };
+                    dev.write_at(req.lba_start, req.count, buf)
+                }
+            }
+        } else {
+            // 否则使用一个临时缓冲区
+            let mut bounce: Vec<u8> = Vec::new();
+            bounce.resize(len, 0);
+            match req.op {
+                BioType::Read => {
+                    let r = dev.read_at(req.lba_start, req.count, &mut bounce);
+                    if r.is_ok() {
+                        let mut offset = 0;
+                        for bio in req.bios.iter() {
+                            let buf = unsafe { from_raw_parts_mut(bio.buf as *mut u8, bio.len) };
+                            buf.copy_from_slice(&bounce[offset..offset + bio.len]);
+                            offset += bio.len;
+                        }
+                    }
+                    r
+                }
+                BioType::Write => {
+                    let mut offset = 0;
+                    for bio in req.bios.iter() {
+                        let buf = unsafe { from_raw_parts(bio.buf as *const u8, bio.len) };
+                        bounce[offset..offset + bio.len].copy_from_slice(buf);
+                        offset += bio.len;
+                    }
+                    dev.write_at(req.lba_start, req.count, &bounce)
+                }
+            }
+        };
+
+        let r = r.map(|_| ());
+        for bio in req.bios.iter() {
+            bio.complete(r.clone());
+        }
+    }
+}
+
+/// 用户缓冲区只在所属进程的地址空间中有效，而队列中的请求可能由其他进程派发，
+/// 因此指向用户缓冲区的读写不经过请求队列，由提交者直接同步执行
+fn is_user_buf(buf: &[u8]) -> bool {
+    return VirtAddr::new(buf.as_ptr() as usize).check_user();
+}
+
+/// 积攒一组bio，在`finish()`时一次性提交给块设备的请求队列，并等待它们完成
+///
+/// bio借用的缓冲区的生命周期为`'a`，BlkPlug被drop时，尚未提交的bio也会被提交并等待完成。
+/// 如果块设备没有请求队列，或者缓冲区位于用户空间，bio会被立即同步执行。
+///
+/// ## 使用方法
+///
+/// ```ignore
+/// let mut plug = BlkPlug::new(disk.as_ref());
+/// plug.read(lba0, count0, &mut buf[0..len0])?;
+/// plug.read(lba1, count1, &mut buf[len0..])?;
+/// plug.finish()?;
+/// ```
+pub struct BlkPlug<'a, D: BlockDevice + ?Sized> {
+    dev: &'a D,
+    queue: Option<Arc<RequestQueue>>,
+    bios: Vec<Arc<Bio>>,
+    _marker: PhantomData<&'a mut [u8]>,
+}
+
+impl<'a, D: BlockDevice + ?Sized> BlkPlug<'a, D> {
+    pub fn new(dev: &'a D) -> Self {
+        Self {
+            dev,
+            queue: dev.request_queue(),
+            bios: Vec::new(),
+            _marker: PhantomData,
+        }
+    }
+
+    fn check(&self, count: usize, len: usize) -> Result<(), SystemError> {
+        if count << self.dev.blk_size_log2() > len {
+            return Err(SystemError::E2BIG);
+        }
+        return Ok(());
+    }
+
+    fn add(&mut self, bio: Arc<Bio>) -> Result<(), SystemError> {
+        self.bios.push(bio);
+        if self.bios.len() >= BLK_MAX_PLUG_BIOS {
+            return self.flush();
+        }
+        return Ok(());
+    }
+
+    /// 从第lba_start个块开始，读取count个块到buf中
+    pub fn read(
+        &mut self,
+        lba_start: BlockId,
+        count: usize,
+        buf: &'a mut [u8],
+    ) -> Result<(), SystemError> {
+        self.check(count, buf.len())?;
+        if count == 0 {
+            return Ok(());
+        }
+        if self.queue.is_none() || is_user_buf(buf) {
+            return self.dev.read_at(lba_start, count, buf).map(|_| ());
+        }
+        let len = count << self.dev.blk_size_log2();
+        let bio = Bio::new(
+            BioType::Read,
+            lba_start,
+            count,
+            buf.as_mut_ptr() as usize,
+            len,
+        );
+        return self.add(bio);
+    }
+
+    /// 从第lba_start个块开始，把buf中的count个块写入设备
+    pub fn write(
+        &mut self,
+        lba_start: BlockId,
+        count: usize,
+        buf: &'a [u8],
+    ) -> Result<(), SystemError> {
+        self.check(count, buf.len())?;
+        if count == 0 {
+            return Ok(());
+        }
+        if self.queue.is_none() || is_user_buf(buf) {
+            return self.dev.write_at(lba_start, count, buf).map(|_| ());
+        }
+        let len = count << self.dev.blk_size_log2();
+        let bio = Bio::new(BioType::Write, lba_start, count, buf.as_ptr() as usize, len);
+        return self.add(bio);
+    }
+
+    /// 读取设备上[offset, offset+len)范围内的字节。
+    ///
+    /// 整块的部分作为bio积攒起来，不完整的块会被立即同步读取
+    pub fn read_bytes(
+        &mut self,
+        offset: usize,
+        len: usize,
+        buf: &'a mut [u8],
+    ) -> Result<(), SystemError> {
+        if len > buf.len() {
+            return Err(SystemError::E2BIG);
+        }
+        let blk_size_log2 = self.dev.blk_size_log2();
+        let mut remain: &'a mut [u8] = &mut buf[..len];
+        for range in BlockIter::new_multiblock(offset, offset + len, blk_size_log2) {
+            let (buf_slice, rest) = core::mem::take(&mut remain).split_at_mut(range.len());
+            remain = rest;
+
+            if range.is_multi() {
+                self.read(range.lba_start, range.lba_end - range.lba_start, buf_slice)?;
+            } else {
+                // 判断块的长度不能超过最大值
+                if blk_size_log2 > BLK_SIZE_LOG2_LIMIT {
+                    return Err(SystemError::E2BIG);
+                }
+                let mut temp: Vec<u8> = Vec::new();
+                temp.resize(1usize << blk_size_log2, 0);
+                let mut plug = BlkPlug::new(self.dev);
+                plug.read(range.lba_start, 1, &mut temp)?;
+                plug.finish()?;
+                // 把数据从临时buffer复制到目标buffer
+                buf_slice.copy_from_slice(&temp[range.begin..range.end]);
+            }
+        }
+        return Ok(());
+    }
+
+    /// 把buf写入设备上[offset, offset+len)的范围。
+    ///
+    /// 整块的部分作为bio积攒起来，不完整的块会被立即同步地读出、修改、写回
+    pub fn write_bytes(
+        &mut self,
+        offset: usize,
+        len: usize,
+        buf: &'a [u8],
+    ) -> Result<(), SystemError> {
+        if len > buf.len() {
+            return Err(SystemError::E2BIG);
+        }
+        let blk_size_log2 = self.dev.blk_size_log2();
+        let mut remain: &'a [u8] = &buf[..len];
+        for range in BlockIter::new_multiblock(offset, offset + len, blk_size_log2) {
+            let (buf_slice, rest) = remain.split_at(range.len());
+            remain = rest;
+
+            if range.is_multi() {
+                self.write(range.lba_start, range.lba_end - range.lba_start, buf_slice)?;
+            } else {
+                if blk_size_log2 > BLK_SIZE_LOG2_LIMIT {
+                    return Err(SystemError::E2BIG);
+                }
+                let mut temp: Vec<u8> = Vec::new();
+                temp.resize(1usize << blk_size_log2, 0);
+                // 由于块设备每次读写都是整块的，在不完整写入之前，必须把不完整的地方补全
+                let mut plug = BlkPlug::new(self.dev);
+                plug.read(range.lba_start, 1, &mut temp)?;
+                plug.finish()?;
+                temp[range.begin..range.end].copy_from_slice(buf_slice);
+                let mut plug = BlkPlug::new(self.dev);
+                plug.write(range.lba_start, 1, &temp)?;
+                plug.finish()?;
+            }
+        }
+        return Ok(());
+    }
+
+    /// 提交积攒的bio，并等待它们完成
+    fn flush(&mut self) -> Result<(), SystemError> {
+        if self.bios.is_empty() {
+            return Ok(());
+        }
+        let bios = core::mem::take(&mut self.bios);
+        let queue = self.queue.as_ref().unwrap();
+        let mut sorted = bios.clone();
+        sorted.sort_by_key(|b| (b.op, b.lba_start));
+        queue.insert(&sorted);
+        queue.run(self.dev, &bios);
+
+        let mut r = Ok(());
+        for bio in bios.iter() {
+            if let Err(e) = bio.wait() {
+                r = Err(e);
+            }
+        }
+        return r;
+    }
+
+    /// 提交所有积攒的bio，并等待它们完成
+    pub fn finish(mut self) -> Result<(), SystemError> {
+        return self.flush();
+    }
+}
+
+impl<'a, D: BlockDevice + ?Sized> Drop for BlkPlug<'a, D> {
+    fn drop(&mut self) {
+        // bio借用的缓冲区在此之后失效，必须等待它们完成
+        self.flush().ok();
+    }
+}
@@ -1,6 +1,9 @@
-use super::{_port, hba::HbaCmdTable, virt_2_phys};
+use super::cmd_queue::{AhciCmdQueue, AHCI_MAX_SECTORS, PRDT_ENTRY_MAX_BYTES};
+use super::hba::HBA_PRDT_ENTRIES;
 use crate::driver::base::block::block_device::{BlockDevice, BlockId};
 use crate::driver::base::block::disk_info::Partition;
+use crate::driver::base::block::elevator::ElevatorType;
+use crate::driver::base::block::request_queue::RequestQueue;
 use crate::driver::base::block::SeekFrom;
 use crate::driver::base::class::Class;
 use crate::driver::base::device::bus::Bus;
@@ -9,30 +12,25 @@ use crate::driver::base::device::driver::Driver;
 use crate::driver::base::device::{Device, DeviceType, IdTable};
 use crate::driver::base::kobject::{KObjType, KObject, KObjectState};
 use crate::driver::base::kset::KSet;
-use crate::driver::disk::ahci::HBA_PxIS_TFES;
 
 use crate::filesystem::kernfs::KernFSInode;
 use crate::filesystem::mbr::MbrDiskPartionTable;
 
-use crate::kdebug;
+use crate::kerror;
 use crate::libs::rwlock::{RwLockReadGuard, RwLockWriteGuard};
 use crate::libs::{spinlock::SpinLock, vec_cursor::VecCursor};
-use crate::mm::{phys_2_virt, verify_area, VirtAddr};
-use crate::{
-    driver::disk::ahci::hba::{
-        FisRegH2D, FisType, HbaCmdHeader, ATA_CMD_READ_DMA_EXT, ATA_CMD_WRITE_DMA_EXT,
-        ATA_DEV_BUSY, ATA_DEV_DRQ,
-    },
-    kerror,
-};
+use crate::mm::gup::PinnedUserPages;
+use crate::mm::{virt_2_phys, PhysAddr, VirtAddr};
+use crate::{kdebug, kinfo, kwarn};
 use system_error::SystemError;
 
+use alloc::collections::VecDeque;
 use alloc::sync::Weak;
 use alloc::{string::String, sync::Arc, vec::Vec};
 
 use core::fmt::Debug;
+use core::mem::size_of;
 use core::sync::atomic::{compiler_fence, Ordering};
-use core::{mem::size_of, ptr::write_bytes};
 
 /// @brief: 只支持MBR分区格式的磁盘结构体
 pub struct AhciDisk {
@@ -44,6 +42,10 @@ pub struct AhciDisk {
     pub port_num: u8,
     /// 指向LockAhciDisk的弱引用
     self_ref: Weak<LockedAhciDisk>,
+    /// 端口的命令队列
+    queue: Arc<AhciCmdQueue>,
+    /// 块设备层的请求队列
+    request_queue: Arc<RequestQueue>,
 }
 
 /// @brief: 带锁的AhciDisk
@@ -68,293 +70,172 @@ impl AhciDisk {
         count: usize,          // 读取lba的数量
         buf: &mut [u8],
     ) -> Result<usize, SystemError> {
-        assert!((buf.len() & 511) == 0);
-        compiler_fence(core::sync::atomic::Ordering::SeqCst);
-        let check_length = ((count - 1) >> 4) + 1; // prdt length
-        if count * 512 > buf.len() || check_length > 8 as usize {
-            kerror!("ahci read: e2big");
-            // 不可能的操作
-            return Err(SystemError::E2BIG);
-        } else if count == 0 {
-            return Ok(0);
-        }
-
-        let port = _port(self.ctrl_num, self.port_num);
-        volatile_write!(port.is, u32::MAX); // Clear pending interrupt bits
-
-        let slot = port.find_cmdslot().unwrap_or(u32::MAX);
-
-        if slot == u32::MAX {
-            return Err(SystemError::EIO);
-        }
-
-        #[allow(unused_unsafe)]
-        let cmdheader: &mut HbaCmdHeader = unsafe {
-            (phys_2_virt(
-                volatile_read!(port.clb) as usize
-                    + slot as usize * size_of::<HbaCmdHeader>() as usize,
-            ) as *mut HbaCmdHeader)
-                .as_mut()
-                .unwrap()
-        };
-
-        cmdheader.cfl = (size_of::<FisRegH2D>() / size_of::<u32>()) as u8;
-
-        volatile_set_bit!(cmdheader.cfl, 1 << 6, false); //  Read/Write bit : Read from device
-        volatile_write!(cmdheader.prdtl, check_length as u16); // PRDT entries count
-
-        // 设置数据存放地址
-        let mut buf_ptr = buf as *mut [u8] as *mut usize as usize;
-
-        // 由于目前的内存管理机制无法把用户空间的内存地址转换为物理地址，所以只能先把数据拷贝到内核空间
-        // TODO：在内存管理重构后，可以直接使用用户空间的内存地址
-
-        let user_buf = verify_area(VirtAddr::new(buf_ptr as usize), buf.len()).is_ok();
-        let mut kbuf = if user_buf {
-            let mut x: Vec<u8> = Vec::new();
-            x.resize(buf.len(), 0);
-            Some(x)
-        } else {
-            None
-        };
-
-        if kbuf.is_some() {
-            buf_ptr = kbuf.as_mut().unwrap().as_mut_ptr() as usize;
-        }
+        return ahci_read_at(&self.queue, lba_id_start, count, buf);
+    }
 
-        #[allow(unused_unsafe)]
-        let cmdtbl = unsafe {
-            (phys_2_virt(volatile_read!(cmdheader.ctba) as usize) as *mut HbaCmdTable)
-                .as_mut()
-                .unwrap() // 必须使用 as_mut ，得到的才是原来的变量
-        };
-        let mut tmp_count = count;
-
-        unsafe {
-            // 清空整个table的旧数据
-            write_bytes(cmdtbl, 0, 1);
-        }
-        // kdebug!("cmdheader.prdtl={}", volatile_read!(cmdheader.prdtl));
-
-        // 8K bytes (16 sectors) per PRDT
-        for i in 0..((volatile_read!(cmdheader.prdtl) - 1) as usize) {
-            volatile_write!(cmdtbl.prdt_entry[i].dba, virt_2_phys(buf_ptr) as u64);
-            cmdtbl.prdt_entry[i].dbc = 8 * 1024 - 1;
-            volatile_set_bit!(cmdtbl.prdt_entry[i].dbc, 1 << 31, true); // 允许中断 prdt_entry.i
-            buf_ptr += 8 * 1024;
-            tmp_count -= 16;
-        }
+    fn sync(&self) -> Result<(), SystemError> {
+        // 由于目前没有block cache, 因此sync返回成功即可
+        return Ok(());
+    }
+}
 
-        // Last entry
-        let las = (volatile_read!(cmdheader.prdtl) - 1) as usize;
-        volatile_write!(cmdtbl.prdt_entry[las].dba, virt_2_phys(buf_ptr) as u64);
-        cmdtbl.prdt_entry[las].dbc = ((tmp_count << 9) - 1) as u32; // 数据长度
-
-        volatile_set_bit!(cmdtbl.prdt_entry[las].dbc, 1 << 31, true); // 允许中断
-
-        // 设置命令
-        let cmdfis = unsafe {
-            ((&mut cmdtbl.cfis) as *mut [u8] as *mut usize as *mut FisRegH2D)
-                .as_mut()
-                .unwrap()
-        };
-        volatile_write!(cmdfis.fis_type, FisType::RegH2D as u8);
-        volatile_set_bit!(cmdfis.pm, 1 << 7, true); // command_bit set
-        volatile_write!(cmdfis.command, ATA_CMD_READ_DMA_EXT);
-
-        volatile_write!(cmdfis.lba0, (lba_id_start & 0xFF) as u8);
-        volatile_write!(cmdfis.lba1, ((lba_id_start >> 8) & 0xFF) as u8);
-        volatile_write!(cmdfis.lba2, ((lba_id_start >> 16) & 0xFF) as u8);
-        volatile_write!(cmdfis.lba3, ((lba_id_start >> 24) & 0xFF) as u8);
-        volatile_write!(cmdfis.lba4, ((lba_id_start >> 32) & 0xFF) as u8);
-        volatile_write!(cmdfis.lba5, ((lba_id_start >> 40) & 0xFF) as u8);
-
-        volatile_write!(cmdfis.countl, (count & 0xFF) as u8);
-        volatile_write!(cmdfis.counth, ((count >> 8) & 0xFF) as u8);
-
-        volatile_write!(cmdfis.device, 1 << 6); // LBA Mode
-
-        // 等待之前的操作完成
-        let mut spin_count = 0;
-        const SPIN_LIMIT: u32 = 10000;
-
-        while (volatile_read!(port.tfd) as u8 & (ATA_DEV_BUSY | ATA_DEV_DRQ)) > 0
-            && spin_count < SPIN_LIMIT
-        {
-            spin_count += 1;
-        }
+/// 把数据缓冲区转换为物理地址区间，然后执行读写命令
+///
+/// 用户缓冲区所在的物理页会在I/O期间被固定，设备直接通过DMA读写这些物理页；
+/// 内核缓冲区位于线性映射区，物理上是连续的
+fn ahci_rw(
+    queue: &AhciCmdQueue,
+    lba_id_start: BlockId,
+    count: usize,
+    buf_ptr: usize,
+    write: bool,
+) -> Result<(), SystemError> {
+    let len = count * 512;
+    let vaddr = VirtAddr::new(buf_ptr);
+    if vaddr.check_user() {
+        // 读磁盘时，设备会写入用户缓冲区
+        let pinned = PinnedUserPages::pin(vaddr, len, !write)?;
+        let segs = pinned.segments(PRDT_ENTRY_MAX_BYTES);
+        return ahci_rw_segs(queue, lba_id_start as u64, &segs, write);
+    }
+
+    let mut segs: Vec<(PhysAddr, usize)> = Vec::new();
+    let mut offset = 0;
+    while offset < len {
+        let seg_len = core::cmp::min(PRDT_ENTRY_MAX_BYTES, len - offset);
+        segs.push((PhysAddr::new(virt_2_phys(buf_ptr + offset)), seg_len));
+        offset += seg_len;
+    }
+    return ahci_rw_segs(queue, lba_id_start as u64, &segs, write);
+}
 
-        if spin_count == SPIN_LIMIT {
-            kerror!("Port is hung");
-            return Err(SystemError::EIO);
+/// 把物理地址区间拆分成多个读写命令执行
+///
+/// 一个命令最多使用`HBA_PRDT_ENTRIES`个PRDT项、读写`AHCI_MAX_SECTORS`个扇区，并且必须覆盖整数个扇区，
+/// 因此在超出限制时，在扇区边界处切分区间（物理页不连续的大缓冲区需要的PRDT项可能超过一个命令的上限）
+///
+/// ## 参数
+///
+/// - `lba` - 起始扇区号
+/// - `segs` - 数据缓冲区的物理地址区间，总长度必须是扇区大小的整数倍
+/// - `write` - 是否为写命令
+fn ahci_rw_segs(
+    queue: &AhciCmdQueue,
+    mut lba: u64,
+    segs: &[(PhysAddr, usize)],
+    write: bool,
+) -> Result<(), SystemError> {
+    let max_bytes = AHCI_MAX_SECTORS * 512;
+    let mut pending: VecDeque<(PhysAddr, usize)> = segs.iter().copied().collect();
+    while !pending.is_empty() {
+        let mut cmd: Vec<(PhysAddr, usize)> = Vec::new();
+        let mut cmd_len = 0;
+        while cmd.len() < HBA_PRDT_ENTRIES && cmd_len < max_bytes {
+            let (addr, len) = match pending.pop_front() {
+                Some(seg) => seg,
+                None => break,
+            };
+            let take = core::cmp::min(len, max_bytes - cmd_len);
+            if take < len {
+                pending.push_front((addr + take, len - take));
+            }
+            cmd.push((addr, take));
+            cmd_len += take;
         }
 
-        volatile_set_bit!(port.ci, 1 << slot, true); // Issue command
-                                                     // kdebug!("To wait ahci read complete.");
-                                                     // 等待操作完成
-        loop {
-            if (volatile_read!(port.ci) & (1 << slot)) == 0 {
-                break;
-            }
-            if (volatile_read!(port.is) & HBA_PxIS_TFES) > 0 {
-                kerror!("Read disk error");
-                return Err(SystemError::EIO);
+        // 不足一个扇区的尾部退回给下一个命令
+        let mut tail = cmd_len % 512;
+        cmd_len -= tail;
+        while tail > 0 {
+            let (addr, len) = cmd.pop().unwrap();
+            if len > tail {
+                cmd.push((addr, len - tail));
+                pending.push_front((addr + (len - tail), tail));
+                tail = 0;
+            } else {
+                pending.push_front((addr, len));
+                tail -= len;
             }
         }
-
-        if kbuf.is_some() {
-            buf.copy_from_slice(kbuf.as_ref().unwrap());
+        if cmd_len == 0 {
+            // 剩余的数据不足一个扇区
+            return Err(SystemError::EINVAL);
         }
 
-        compiler_fence(core::sync::atomic::Ordering::SeqCst);
-        // successfully read
-        return Ok(count * 512);
+        let count = cmd_len / 512;
+        queue.rw(lba, count, &cmd, write)?;
+        lba += count as u64;
     }
+    return Ok(());
+}
 
-    fn write_at(
-        &self,
-        lba_id_start: BlockId,
-        count: usize,
-        buf: &[u8],
-    ) -> Result<usize, SystemError> {
-        assert!((buf.len() & 511) == 0);
-        compiler_fence(core::sync::atomic::Ordering::SeqCst);
-        let check_length = ((count - 1) >> 4) + 1; // prdt length
-        if count * 512 > buf.len() || check_length > 8 as usize {
-            // 不可能的操作
-            return Err(SystemError::E2BIG);
-        } else if count == 0 {
-            return Ok(0);
-        }
-
-        let port = _port(self.ctrl_num, self.port_num);
-
-        volatile_write!(port.is, u32::MAX); // Clear pending interrupt bits
-
-        let slot = port.find_cmdslot().unwrap_or(u32::MAX);
-
-        if slot == u32::MAX {
-            return Err(SystemError::EIO);
-        }
-
-        compiler_fence(core::sync::atomic::Ordering::SeqCst);
-        #[allow(unused_unsafe)]
-        let cmdheader: &mut HbaCmdHeader = unsafe {
-            (phys_2_virt(
-                volatile_read!(port.clb) as usize
-                    + slot as usize * size_of::<HbaCmdHeader>() as usize,
-            ) as *mut HbaCmdHeader)
-                .as_mut()
-                .unwrap()
-        };
-        compiler_fence(core::sync::atomic::Ordering::SeqCst);
-
-        volatile_write_bit!(
-            cmdheader.cfl,
-            (1 << 5) - 1 as u8,
-            (size_of::<FisRegH2D>() / size_of::<u32>()) as u8
-        ); // Command FIS size
-
-        volatile_set_bit!(cmdheader.cfl, 7 << 5, true); // (p,c,w)都设置为1, Read/Write bit :  Write from device
-        volatile_write!(cmdheader.prdtl, check_length as u16); // PRDT entries count
-
-        // 设置数据存放地址
-        compiler_fence(core::sync::atomic::Ordering::SeqCst);
-        let mut buf_ptr = buf as *const [u8] as *mut usize as usize;
-
-        // 由于目前的内存管理机制无法把用户空间的内存地址转换为物理地址，所以只能先把数据拷贝到内核空间
-        // TODO：在内存管理重构后，可以直接使用用户空间的内存地址
-        let user_buf = verify_area(VirtAddr::new(buf_ptr as usize), buf.len()).is_ok();
-        let mut kbuf = if user_buf {
-            let mut x: Vec<u8> = Vec::with_capacity(buf.len());
-            x.resize(buf.len(), 0);
-            x.copy_from_slice(buf);
-            Some(x)
-        } else {
-            None
-        };
-
-        if kbuf.is_some() {
-            buf_ptr = kbuf.as_mut().unwrap().as_mut_ptr() as usize;
-        }
-
-        #[allow(unused_unsafe)]
-        let cmdtbl = unsafe {
-            (phys_2_virt(volatile_read!(cmdheader.ctba) as usize) as *mut HbaCmdTable)
-                .as_mut()
-                .unwrap()
-        };
-        let mut tmp_count = count;
-        compiler_fence(core::sync::atomic::Ordering::SeqCst);
-
-        unsafe {
-            // 清空整个table的旧数据
-            write_bytes(cmdtbl, 0, 1);
-        }
-
-        // 8K bytes (16 sectors) per PRDT
-        for i in 0..((volatile_read!(cmdheader.prdtl) - 1) as usize) {
-            volatile_write!(cmdtbl.prdt_entry[i].dba, virt_2_phys(buf_ptr) as u64);
-            volatile_write_bit!(cmdtbl.prdt_entry[i].dbc, (1 << 22) - 1, 8 * 1024 - 1); // 数据长度
-            volatile_set_bit!(cmdtbl.prdt_entry[i].dbc, 1 << 31, true); // 允许中断
-            buf_ptr += 8 * 1024;
-            tmp_count -= 16;
-        }
-
-        // Last entry
-        let las = (volatile_read!(cmdheader.prdtl) - 1) as usize;
-        volatile_write!(cmdtbl.prdt_entry[las].dba, virt_2_phys(buf_ptr) as u64);
-        volatile_set_bit!(cmdtbl.prdt_entry[las].dbc, 1 << 31, true); // 允许中断
-        volatile_write_bit!(
-            cmdtbl.prdt_entry[las].dbc,
-            (1 << 22) - 1,
-            ((tmp_count << 9) - 1) as u32
-        ); // 数据长度
-
-        // 设置命令
-        let cmdfis = unsafe {
-            ((&mut cmdtbl.cfis) as *mut [u8] as *mut usize as *mut FisRegH2D)
-                .as_mut()
-                .unwrap()
-        };
-        volatile_write!(cmdfis.fis_type, FisType::RegH2D as u8);
-        volatile_set_bit!(cmdfis.pm, 1 << 7, true); // command_bit set
-        volatile_write!(cmdfis.command, ATA_CMD_WRITE_DMA_EXT);
-
-        volatile_write!(cmdfis.lba0, (lba_id_start & 0xFF) as u8);
-        volatile_write!(cmdfis.lba1, ((lba_id_start >> 8) & 0xFF) as u8);
-        volatile_write!(cmdfis.lba2, ((lba_id_start >> 16) & 0xFF) as u8);
-        volatile_write!(cmdfis.lba3, ((lba_id_start >> 24) & 0xFF) as u8);
-        volatile_write!(cmdfis.lba4, ((lba_id_start >> 32) & 0xFF) as u8);
-        volatile_write!(cmdfis.lba5, ((lba_id_start >> 40) & 0xFF) as u8);
-
-        volatile_write!(cmdfis.countl, (count & 0xFF) as u8);
-        volatile_write!(cmdfis.counth, ((count >> 8) & 0xFF) as u8);
-
-        volatile_write!(cmdfis.device, 1 << 6); // LBA Mode
-
-        volatile_set_bit!(port.ci, 1 << slot, true); // Issue command
-
-        // 等待操作完成
-        loop {
-            if (volatile_read!(port.ci) & (1 << slot)) == 0 {
-                break;
-            }
-            if (volatile_read!(port.is) & HBA_PxIS_TFES) > 0 {
-                kerror!("Write disk error");
-                return Err(SystemError::EIO);
-            }
-        }
-
-        compiler_fence(core::sync::atomic::Ordering::SeqCst);
-        // successfully read
-        return Ok(count * 512);
+/// 从磁盘读取数据。不持有磁盘的锁，多个请求可以同时在端口的命令队列中排队
+fn ahci_read_at(
+    queue: &AhciCmdQueue,
+    lba_id_start: BlockId, // 起始lba编号
+    count: usize,          // 读取lba的数量
+    buf: &mut [u8],
+) -> Result<usize, SystemError> {
+    assert!((buf.len() & 511) == 0);
+    if count * 512 > buf.len() {
+        kerror!("ahci read: e2big");
+        // 不可能的操作
+        return Err(SystemError::E2BIG);
+    } else if count == 0 {
+        return Ok(0);
+    }
+
+    let buf_ptr = buf.as_mut_ptr() as usize;
+    compiler_fence(Ordering::SeqCst);
+    if buf_ptr & 1 != 0 {
+        // PRDT要求数据的地址按字对齐，只能先读到内核的缓冲区中
+        let mut kbuf: Vec<u8> = Vec::new();
+        kbuf.resize(count * 512, 0);
+        ahci_rw(
+            queue,
+            lba_id_start,
+            count,
+            kbuf.as_mut_ptr() as usize,
+            false,
+        )?;
+        buf[..count * 512].copy_from_slice(&kbuf);
+    } else {
+        ahci_rw(queue, lba_id_start, count, buf_ptr, false)?;
     }
+    compiler_fence(Ordering::SeqCst);
 
-    fn sync(&self) -> Result<(), SystemError> {
-        // 由于目前没有block cache, 因此sync返回成功即可
-        return Ok(());
-    }
+    // successfully read
+    return Ok(count * 512);
+}
+
+/// 向磁盘写入数据。不持有磁盘的锁，多个请求可以同时在端口的命令队列中排队
+fn ahci_write_at(
+    queue: &AhciCmdQueue,
+    lba_id_start: BlockId,
+    count: usize,
+    buf: &[u8],
+) -> Result<usize, SystemError> {
+    assert!((buf.len() & 511) == 0);
+    if count * 512 > buf.len() {
+        // 不可能的操作
+        return Err(SystemError::E2BIG);
+    } else if count == 0 {
+        return Ok(0);
+    }
+
+    let buf_ptr = buf.as_ptr() as usize;
+    compiler_fence(Ordering::SeqCst);
+    if buf_ptr & 1 != 0 {
+        // PRDT要求数据的地址按字对齐，只能先复制到内核的缓冲区中
+        let kbuf: Vec<u8> = buf[..count * 512].to_vec();
+        ahci_rw(queue, lba_id_start, count, kbuf.as_ptr() as usize, true)?;
+    } else {
+        ahci_rw(queue, lba_id_start, count, buf_ptr, true)?;
+    }
+    compiler_fence(Ordering::SeqCst);
+
+    // successfully write
+    return Ok(count * 512);
 }
 
 impl LockedAhciDisk {
@@ -363,7 +244,20 @@ impl LockedAhciDisk {
         flags: u16,
         ctrl_num: u8,
         port_num: u8,
+        queue: Arc<AhciCmdQueue>,
     ) -> Result<Arc<LockedAhciDisk>, SystemError> {
+        // 根据设备的能力，决定是否使用NCQ
+        match queue.identify() {
+            Ok(identify) => queue.setup_ncq(&identify),
+            Err(e) => kwarn!("{}: IDENTIFY DEVICE failed: {:?}, NCQ disabled", name, e),
+        }
+        kinfo!(
+            "{}: ncq: {}, queue depth: {}",
+            name,
+            queue.ncq(),
+            queue.depth()
+        );
+
         // 构建磁盘结构体
         let result: Arc<LockedAhciDisk> = Arc::new(LockedAhciDisk(SpinLock::new(AhciDisk {
             name,
@@ -372,6 +266,8 @@ impl LockedAhciDisk {
             ctrl_num,
             port_num,
             self_ref: Weak::default(),
+            queue,
+            request_queue: RequestQueue::new(ElevatorType::Deadline, AHCI_MAX_SECTORS),
         })));
 
         let table: MbrDiskPartionTable = result.read_mbr_table()?;
@@ -560,6 +456,10 @@ impl BlockDevice for LockedAhciDisk {
         todo!()
     }
 
+    fn request_queue(&self) -> Option<Arc<RequestQueue>> {
+        return Some(self.0.lock().request_queue.clone());
+    }
+
     fn partitions(&self) -> Vec<Arc<Partition>> {
         return self.0.lock().partitions.clone();
     }
@@ -571,7 +471,9 @@ impl BlockDevice for LockedAhciDisk {
         count: usize,          // 读取lba的数量
         buf: &mut [u8],
     ) -> Result<usize, SystemError> {
-        self.0.lock().read_at(lba_id_start, count, buf)
+        // 不在I/O期间持有磁盘的锁
+        let queue = self.0.lock().queue.clone();
+        ahci_read_at(&queue, lba_id_start, count, buf)
     }
 
     #[inline]
@@ -581,6 +483,7 @@ impl BlockDevice for LockedAhciDisk {
         count: usize,
         buf: &[u8],
     ) -> Result<usize, SystemError> {
-        self.0.lock().write_at(lba_id_start, count, buf)
+        let queue = self.0.lock().queue.clone();
+        ahci_write_at(&queue, lba_id_start, count, buf)
     }
 }
@@ -0,0 +1,436 @@
+//! AHCI端口的命令队列
+//!
+//! 每个端口有32个命令槽，每个命令槽有自己的命令头和命令表。提交者先申请一个空闲的命令槽，
+//! 在这个槽的命令表中构造命令，然后把槽号写入PxCI（NCQ命令还要先写入PxSACT）。
+//! 命令完成时，端口产生中断，中断处理函数根据PxCI/PxSACT找出已经完成的命令槽，并唤醒等待的进程。
+//!
+//! - 设备支持NCQ时，使用READ/WRITE FPDMA QUEUED命令，最多可以有32个命令同时在设备上排队
+//! - 否则，同一时间只有一个命令被提交（队列深度为1）
+//! - 如果控制器的中断没有安装成功，或者等待者不能睡眠（关中断、持有自旋锁），则由等待者轮询端口的状态
+
+use core::{
+    hint::spin_loop,
+    mem::size_of,
+    ptr::write_bytes,
+    sync::atomic::{AtomicBool, AtomicU32, Ordering},
+};
+
+use alloc::{sync::Arc, vec::Vec};
+use system_error::SystemError;
+
+use crate::{
+    arch::{sched::sched, CurrentIrqArch, MMArch},
+    driver::disk::ahci::hba::{
+        FisRegH2D, FisType, HbaCmdHeader, HbaCmdTable, ATA_CMD_READ_DMA_EXT,
+        ATA_CMD_READ_FPDMA_QUEUED, ATA_CMD_WRITE_DMA_EXT, ATA_CMD_WRITE_FPDMA_QUEUED,
+        HBA_PORT_IS_ERR,
+    },
+    exception::{
+        irqdata::IrqHandlerData,
+        irqdesc::{IrqHandler, IrqReturn},
+        InterruptArch, IrqNumber,
+    },
+    kerror,
+    libs::{spinlock::SpinLock, wait_queue::WaitQueue},
+    mm::{phys_2_virt, virt_2_phys, MemoryManagementArch, PhysAddr},
+    process::ProcessManager,
+};
+
+use super::hba::{HbaMem, HbaPort, HbaPrdtEntry, ATA_CMD_IDENTIFY, HBA_PRDT_ENTRIES};
+
+/// AHCI控制器的中断号的起始值（第i个控制器使用 AHCI_IRQ_BASE + i）
+///
+/// 目前缺少对PCI设备中断号的统一管理，所以这里需要指定中断号。不能与其他中断重复
+pub const AHCI_IRQ_BASE: u32 = 58;
+
+/// 每个PRDT项最多描述的字节数（AHCI规范规定为4M）
+pub const PRDT_ENTRY_MAX_BYTES: usize = 4 << 20;
+/// 一个命令最多读写的扇区数。
+/// 保证即使缓冲区的每一页在物理上都不连续（并且起始地址没有按页对齐），PRDT项也足够使用
+pub const AHCI_MAX_SECTORS: usize = (HBA_PRDT_ENTRIES - 1) * MMArch::PAGE_SIZE / 512;
+
+/// 所有端口的命令队列，供中断处理函数使用
+static AHCI_CMD_QUEUES: SpinLock<Vec<Arc<AhciCmdQueue>>> = SpinLock::new(Vec::new());
+
+#[derive(Debug)]
+pub struct AhciCmdQueue {
+    ctrl_num: u8,
+    port_num: u8,
+    /// HBA寄存器的虚拟地址
+    hba: usize,
+    /// 控制器的中断是否可用
+    irq_enabled: bool,
+    /// 是否使用NCQ
+    ncq: AtomicBool,
+    /// 队列深度（可以同时被提交的命令数）
+    depth: AtomicU32,
+    inner: SpinLock<InnerCmdQueue>,
+    /// 等待空闲命令槽的进程
+    slot_wait: WaitQueue,
+    /// 等待命令完成的进程
+    done_wait: WaitQueue,
+}
+
+#[derive(Debug, Default)]
+struct InnerCmdQueue {
+    /// 已经被分配出去的命令槽
+    allocated: u32,
+    /// 已经提交给HBA、尚未完成的命令槽
+    issued: u32,
+    /// 已经完成、等待提交者回收的命令槽
+    completed: u32,
+    /// 执行出错的命令槽
+    failed: u32,
+}
+
+impl AhciCmdQueue {
+    /// 创建端口的命令队列，初始时不使用NCQ，队列深度为1
+    pub fn new(
+        hba: &'static mut HbaMem,
+        ctrl_num: u8,
+        port_num: u8,
+        irq_enabled: bool,
+    ) -> Arc<Self> {
+        let r = Arc::new(Self {
+            ctrl_num,
+            port_num,
+            hba: hba as *mut HbaMem as usize,
+            irq_enabled,
+            ncq: AtomicBool::new(false),
+            depth: AtomicU32::new(1),
+            inner: SpinLock::new(InnerCmdQueue::default()),
+            slot_wait: WaitQueue::INIT,
+            done_wait: WaitQueue::INIT,
+        });
+        AHCI_CMD_QUEUES.lock_irqsave().push(r.clone());
+        return r;
+    }
+
+    #[inline(always)]
+    fn hba(&self) -> &'static mut HbaMem {
+        unsafe { (self.hba as *mut HbaMem).as_mut().unwrap() }
+    }
+
+    #[inline(always)]
+    fn port(&self) -> &'static mut HbaPort {
+        &mut self.hba().ports[self.port_num as usize]
+    }
+
+    /// 根据控制器和设备的能力，设置是否使用NCQ，以及队列深度
+    ///
+    /// ## 参数
+    ///
+    /// - `identify` - 设备对IDENTIFY DEVICE命令的响应
+    pub fn setup_ncq(&self, identify: &[u16]) {
+        let cap = volatile_read!(self.hba().cap);
+        // CAP.SNCQ: 控制器支持NCQ；CAP.NCS: 命令槽的数量-1
+        let hba_ncq = cap & (1 << 30) != 0;
+        let slots = (cap >> 8) & 0x1f;
+        // IDENTIFY word 76 bit 8: 设备支持NCQ；word 75 bit 0~4: 设备的队列深度-1
+        let dev_ncq = identify[76] != 0xffff && identify[76] & (1 << 8) != 0;
+        let dev_depth = (identify[75] & 0x1f) as u32;
+
+        if hba_ncq && dev_ncq {
+            self.depth
+                .store(core::cmp::min(slots, dev_depth) + 1, Ordering::Relaxed);
+            self.ncq.store(true, Ordering::Relaxed);
+        }
+    }
+
+    /// 队列深度
+    pub fn depth(&self) -> u32 {
+        self.depth.load(Ordering::Relaxed)
+    }
+
+    pub fn ncq(&self) -> bool {
+        self.ncq.load(Ordering::Relaxed)
+    }
+
+    /// 当前进程能否睡眠等待中断（否则只能轮询）
+    fn can_sleep(&self) -> bool {
+        return self.irq_enabled
+            && CurrentIrqArch::is_irq_enabled()
+            && ProcessManager::current_pcb().preempt_count() == 0;
+    }
+
+    /// 申请一个空闲的命令槽。如果所有命令槽都被占用，则等待
+    fn alloc_slot(&self) -> u32 {
+        let mask = if self.depth() >= 32 {
+            u32::MAX
+        } else {
+            (1 << self.depth()) - 1
+        };
+        loop {
+            let can_sleep = self.can_sleep();
+            let irq_guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
+            let mut guard = self.inner.lock();
+            let free = !guard.allocated & mask;
+            if free != 0 {
+                let slot = free.trailing_zeros();
+                guard.allocated |= 1 << slot;
+                return slot;
+            }
+
+            if can_sleep {
+                // 被信号提前唤醒也没有关系，醒来后会重新检查
+                unsafe { self.slot_wait.sleep_without_schedule() };
+                drop(guard);
+                drop(irq_guard);
+                sched();
+            } else {
+                drop(guard);
+                drop(irq_guard);
+                self.handle_completions();
+                spin_loop();
+            }
+        }
+    }
+
+    /// 把命令槽提交给HBA
+    fn issue(&self, slot: u32) {
+        let mut guard = self.inner.lock_irqsave();
+        guard.issued |= 1 << slot;
+        let port = self.port();
+        // PxSACT和PxCI都是写1有效，写0无影响，因此只写入当前槽对应的位
+        if self.ncq() {
+            volatile_write!(port.sact, 1 << slot);
+        }
+        volatile_write!(port.ci, 1 << slot);
+    }
+
+    /// 等待命令槽中的命令完成，并释放命令槽
+    fn wait(&self, slot: u32) -> Result<(), SystemError> {
+        let bit = 1 << slot;
+        loop {
+            let can_sleep = self.can_sleep();
+            let irq_guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
+            let mut guard = self.inner.lock();
+            if guard.completed & bit != 0 {
+                let failed = guard.failed & bit != 0;
+                guard.completed &= !bit;
+                guard.failed &= !bit;
+                guard.allocated &= !bit;
+                drop(guard);
+                drop(irq_guard);
+                self.slot_wait.wakeup(None);
+
+                if failed {
+                    return Err(SystemError::EIO);
+                }
+                return Ok(());
+            }
+
+            if can_sleep {
+                unsafe { self.done_wait.sleep_without_schedule() };
+                drop(guard);
+                drop(irq_guard);
+                sched();
+            } else {
+                drop(guard);
+                drop(irq_guard);
+                self.handle_completions();
+                spin_loop();
+            }
+        }
+    }
+
+    /// 检查端口的状态，回收已经完成的命令，并唤醒等待的进程
+    ///
+    /// 由中断处理函数调用，在无法使用中断时，也由等待者轮询调用
+    pub fn handle_completions(&self) {
+        let mut guard = self.inner.lock_irqsave();
+        let port = self.port();
+        let is = volatile_read!(port.is);
+        volatile_write!(port.is, is);
+
+        let done = if is & HBA_PORT_IS_ERR != 0 {
+            // 出错后端口会停止处理命令。把所有未完成的命令都视为失败，然后重启端口
+            kerror!(
+                "AHCI: ctrl {} port {} error, is={:#x}, tfd={:#x}, serr={:#x}",
+                self.ctrl_num,
+                self.port_num,
+                is,
+                volatile_read!(port.tfd),
+                volatile_read!(port.serr)
+            );
+            let failed = guard.issued;
+            guard.failed |= failed;
+            port.stop();
+            volatile_write!(port.serr, volatile_read!(port.serr));
+            volatile_write!(port.is, u32::MAX);
+            port.start();
+            failed
+        } else {
+            let active = volatile_read!(port.ci) | volatile_read!(port.sact);
+            guard.issued & !active
+        };
+
+        guard.issued &= !done;
+        guard.completed |= done;
+        drop(guard);
+
+        if done != 0 {
+            self.done_wait.wakeup_all(None);
+        }
+    }
+
+    /// 执行一个读写命令
+    ///
+    /// ## 参数
+    ///
+    /// - `lba` - 起始扇区号
+    /// - `count` - 扇区数量
+    /// - `segs` - 数据缓冲区的物理地址区间，每个区间的地址和长度都必须是偶数，长度不能超过`PRDT_ENTRY_MAX_BYTES`
+    /// - `write` - 是否为写命令
+    pub fn rw(
+        &self,
+        lba: u64,
+        count: usize,
+        segs: &[(PhysAddr, usize)],
+        write: bool,
+    ) -> Result<(), SystemError> {
+        if count == 0 {
+            return Ok(());
+        }
+        let len: usize = segs.iter().map(|(_, l)| *l).sum();
+        if segs.len() > HBA_PRDT_ENTRIES || len < count << 9 {
+            kerror!("ahci rw: e2big");
+            return Err(SystemError::E2BIG);
+        }
+        if segs
+            .iter()
+            .any(|(addr, l)| addr.data() & 1 != 0 || l & 1 != 0 || *l > PRDT_ENTRY_MAX_BYTES)
+        {
+            return Err(SystemError::EINVAL);
+        }
+
+        let slot = self.alloc_slot();
+        let cmd = match (self.ncq(), write) {
+            (true, false) => ATA_CMD_READ_FPDMA_QUEUED,
+            (true, true) => ATA_CMD_WRITE_FPDMA_QUEUED,
+            (false, false) => ATA_CMD_READ_DMA_EXT,
+            (false, true) => ATA_CMD_WRITE_DMA_EXT,
+        };
+        let cmdfis = self.build_cmd(slot, segs, write);
+        volatile_write!(cmdfis.command, cmd);
+
+        volatile_write!(cmdfis.lba0, (lba & 0xFF) as u8);
+        volatile_write!(cmdfis.lba1, ((lba >> 8) & 0xFF) as u8);
+        volatile_write!(cmdfis.lba2, ((lba >> 16) & 0xFF) as u8);
+        volatile_write!(cmdfis.lba3, ((lba >> 24) & 0xFF) as u8);
+        volatile_write!(cmdfis.lba4, ((lba >> 32) & 0xFF) as u8);
+        volatile_write!(cmdfis.lba5, ((lba >> 40) & 0xFF) as u8);
+        volatile_write!(cmdfis.device, 1 << 6); // LBA Mode
+
+        if self.ncq() {
+            // NCQ命令的扇区数量放在feature寄存器中，count寄存器存放命令的tag（等于命令槽号）
+            volatile_write!(cmdfis.featurel, (count & 0xFF) as u8);
+            volatile_write!(cmdfis.featureh, ((count >> 8) & 0xFF) as u8);
+            volatile_write!(cmdfis.countl, (slot << 3) as u8);
+        } else {
+            volatile_write!(cmdfis.countl, (count & 0xFF) as u8);
+            volatile_write!(cmdfis.counth, ((count >> 8) & 0xFF) as u8);
+        }
+
+        self.issue(slot);
+        return self.wait(slot);
+    }
+
+    /// 发送IDENTIFY DEVICE命令，获取设备的信息（256个字）
+    pub fn identify(&self) -> Result<Vec<u16>, SystemError> {
+        let mut buf: Vec<u16> = vec![0; 256];
+        let slot = self.alloc_slot();
+        let segs = [(PhysAddr::new(virt_2_phys(buf.as_mut_ptr() as usize)), 512)];
+        let cmdfis = self.build_cmd(slot, &segs, false);
+        volatile_write!(cmdfis.command, ATA_CMD_IDENTIFY);
+        self.issue(slot);
+        self.wait(slot)?;
+        return Ok(buf);
+    }
+
+    /// 在命令槽中构造命令头、PRDT，并返回需要继续填写的命令FIS
+    fn build_cmd(
+        &self,
+        slot: u32,
+        segs: &[(PhysAddr, usize)],
+        write: bool,
+    ) -> &'static mut FisRegH2D {
+        let port = self.port();
+        let cmdheader: &mut HbaCmdHeader = unsafe {
+            (phys_2_virt(
+                volatile_read!(port.clb) as usize + slot as usize * size_of::<HbaCmdHeader>(),
+            ) as *mut HbaCmdHeader)
+                .as_mut()
+                .unwrap()
+        };
+        let prdtl = segs.len();
+        let mut cfl = (size_of::<FisRegH2D>() / size_of::<u32>()) as u8; // Command FIS size
+        if write {
+            cfl |= 1 << 6; // Write: host to device
+        }
+        volatile_write!(cmdheader.cfl, cfl);
+        volatile_write!(cmdheader.prdtl, prdtl as u16);
+
+        let cmdtbl = unsafe {
+            (phys_2_virt(volatile_read!(cmdheader.ctba) as usize) as *mut HbaCmdTable)
+                .as_mut()
+                .unwrap()
+        };
+        unsafe {
+            // 清空命令FIS和本次使用的PRDT项的旧数据（整个table有16K，不必全部清空）
+            write_bytes(
+                cmdtbl as *mut HbaCmdTable as *mut u8,
+                0,
+                size_of::<HbaCmdTable>() - (HBA_PRDT_ENTRIES - prdtl) * size_of::<HbaPrdtEntry>(),
+            );
+        }
+
+        for (i, (addr, bytes)) in segs.iter().enumerate() {
+            volatile_write!(cmdtbl.prdt_entry[i].dba, addr.data() as u64);
+            // 数据长度（减1），只在最后一项请求中断
+            let mut dbc = (bytes - 1) as u32;
+            if i == prdtl - 1 {
+                dbc |= 1 << 31;
+            }
+            volatile_write!(cmdtbl.prdt_entry[i].dbc, dbc);
+        }
+
+        let cmdfis = unsafe {
+            ((&mut cmdtbl.cfis) as *mut [u8] as *mut usize as *mut FisRegH2D)
+                .as_mut()
+                .unwrap()
+        };
+        volatile_write!(cmdfis.fis_type, FisType::RegH2D as u8);
+        volatile_write!(cmdfis.pm, 1 << 7); // command_bit set
+        return cmdfis;
+    }
+}
+
+/// AHCI控制器的中断处理函数
+#[derive(Debug)]
+pub struct AhciIrqHandler;
+
+impl IrqHandler for AhciIrqHandler {
+    fn handle(
+        &self,
+        irq: IrqNumber,
+        _static_data: Option<&dyn IrqHandlerData>,
+        _dynamic_data: Option<Arc<dyn IrqHandlerData>>,
+    ) -> Result<IrqReturn, SystemError> {
+        let ctrl_num = irq.data().wrapping_sub(AHCI_IRQ_BASE);
+        let mut ret = IrqReturn::NotHandled;
+
+        let queues = AHCI_CMD_QUEUES.lock_irqsave();
+        for queue in queues.iter().filter(|q| q.ctrl_num as u32 == ctrl_num) {
+            let hba = queue.hba();
+            let bit = 1 << queue.port_num;
+            if volatile_read!(hba.is) & bit != 0 {
+                // 先清除端口的中断状态，再清除HBA的中断状态
+                queue.handle_completions();
+                volatile_write!(hba.is, bit);
+                ret = IrqReturn::Handled;
+            }
+        }
+        return Ok(ret);
+    }
+}
@@ -10,6 +10,8 @@ use crate::mm::phys_2_virt;
 /// 根据 AHCI 写出 HBA 的 Command
 pub const ATA_CMD_READ_DMA_EXT: u8 = 0x25; // 读操作，并且退出
 pub const ATA_CMD_WRITE_DMA_EXT: u8 = 0x35; // 写操作，并且退出
+pub const ATA_CMD_READ_FPDMA_QUEUED: u8 = 0x60; // NCQ读
+pub const ATA_CMD_WRITE_FPDMA_QUEUED: u8 = 0x61; // NCQ写
 #[allow(dead_code)]
 pub const ATA_CMD_IDENTIFY: u8 = 0xEC;
 #[allow(dead_code)]
@@ -23,8 +25,12 @@ pub const HBA_PORT_CMD_CR: u32 = 1 << 15;
 pub const HBA_PORT_CMD_FR: u32 = 1 << 14;
 pub const HBA_PORT_CMD_FRE: u32 = 1 << 4;
 pub const HBA_PORT_CMD_ST: u32 = 1;
-#[allow(dead_code)]
 pub const HBA_PORT_IS_ERR: u32 = 1 << 30 | 1 << 29 | 1 << 28 | 1 << 27;
+/// 端口中断使能：D2H寄存器FIS、PIO Setup FIS、DMA Setup FIS、Set Device Bits FIS（NCQ完成）、
+/// 描述符处理完成，以及各类错误
+pub const HBA_PORT_IE_DEFAULT: u32 = 1 << 0 | 1 << 1 | 1 << 2 | 1 << 3 | 1 << 5 | HBA_PORT_IS_ERR;
+/// GHC.IE: HBA的全局中断使能
+pub const HBA_GHC_IE: u32 = 1 << 1;
 pub const HBA_SSTS_PRESENT: u32 = 0x3;
 pub const HBA_SIG_ATA: u32 = 0x00000101;
 pub const HBA_SIG_ATAPI: u32 = 0xEB140101;
@@ -92,6 +98,9 @@ pub struct HbaPrdtEntry {
     pub dbc: u32, // Byte count, 4M max, interrupt = 1
 }
 
+/// 每个 Command Table 中的 PRDT 项数。使得 Command Table 的大小恰好为16K
+pub const HBA_PRDT_ENTRIES: usize = 1016;
+
 /// HAB Command Table
 /// 每个 Port 一个 Table，主机和设备的交互都靠这个数据结构
 #[repr(packed)]
@@ -103,7 +112,7 @@ pub struct HbaCmdTable {
     // 0x50
     _rsv: [u8; 48], // Reserved
     // 0x80
-    pub prdt_entry: [HbaPrdtEntry; 8], // Physical region descriptor table entries, 0 ~ 65535, 需要注意不要越界 这里设置8的原因是，目前CmdTable只预留了8个PRDT项的空间
+    pub prdt_entry: [HbaPrdtEntry; HBA_PRDT_ENTRIES], // Physical region descriptor table entries, 0 ~ 65535, 需要注意不要越界
 }
 
 /// HBA Command Header
@@ -176,6 +185,12 @@ impl HbaPort {
         }
     }
 
+    /// 使能端口的中断（命令完成、出错时产生中断）
+    pub fn enable_interrupts(&mut self) {
+        volatile_write!(self.is, u32::MAX);
+        volatile_write!(self.ie, HBA_PORT_IE_DEFAULT);
+    }
+
     /// @return: 返回一个空闲 cmd table 的 id; 如果没有，则返回 Option::None
     pub fn find_cmdslot(&self) -> Option<u32> {
         let slots = volatile_read!(self.sact) | volatile_read!(self.ci);
@@ -214,16 +229,18 @@ impl HbaPort {
         }
 
         // 赋值 command table base address
-        // Command table offset: 40K + 8K*portno
-        // Command table size = 256*32 = 8K per port
+        // 每个命令槽一个 Command Table，大小为 size_of::<HbaCmdTable>()
         let mut cmdheaders = phys_2_virt(clb as usize) as *mut u64 as *mut HbaCmdHeader;
         for i in 0..32 as usize {
-            volatile_write!((*cmdheaders).prdtl, 0); // 一开始没有询问，prdtl = 0（预留了8个PRDT项的空间）
+            volatile_write!((*cmdheaders).prdtl, 0); // 一开始没有询问，prdtl = 0（预留了HBA_PRDT_ENTRIES个PRDT项的空间）
             volatile_write!((*cmdheaders).ctba, ctbas[i]);
-            // 这里限制了 prdtl <= 8, 所以一共用了256bytes，如果需要修改，可以修改这里
             compiler_fence(core::sync::atomic::Ordering::SeqCst);
             unsafe {
-                ptr::write_bytes(phys_2_virt(ctbas[i] as usize) as *mut u64, 0, 256);
+                ptr::write_bytes(
+                    phys_2_virt(ctbas[i] as usize) as *mut u8,
+                    0,
+                    size_of::<HbaCmdTable>(),
+                );
             }
             cmdheaders = (cmdheaders as usize + size_of::<HbaCmdHeader>()) as *mut HbaCmdHeader;
         }
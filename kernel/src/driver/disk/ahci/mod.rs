@@ -1,27 +1,35 @@
 // 导出 ahci 相关的 module
 pub mod ahci_inode;
 pub mod ahcidisk;
+pub mod cmd_queue;
 pub mod hba;
 
 use crate::driver::base::block::block_device::BlockDevice;
 use crate::driver::base::block::disk_info::BLK_GF_AHCI;
+use crate::driver::base::device::DeviceId;
 // 依赖的rust工具包
+use crate::arch::MMArch;
 use crate::driver::pci::pci::{
-    get_pci_device_structure_mut, PciDeviceStructure, PCI_DEVICE_LINKEDLIST,
+    get_pci_device_structure_mut, PciDeviceStructure, PciDeviceStructureGeneralDevice,
+    PCI_DEVICE_LINKEDLIST,
 };
+use crate::driver::pci::pci_irq::{IrqCommonMsg, IrqSpecificMsg, PciInterrupt, PciIrqMsg, IRQ};
+use crate::exception::IrqNumber;
 use crate::filesystem::devfs::devfs_register;
-use crate::kerror;
 use crate::libs::rwlock::RwLockWriteGuard;
 use crate::libs::spinlock::{SpinLock, SpinLockGuard};
-use crate::mm::virt_2_phys;
+use crate::mm::allocator::page_frame::{allocate_page_frames, PageFrameCount};
+use crate::mm::{virt_2_phys, MemoryManagementArch};
 use crate::{
     driver::disk::ahci::{
         ahcidisk::LockedAhciDisk,
+        cmd_queue::{AhciCmdQueue, AhciIrqHandler, AHCI_IRQ_BASE},
         hba::HbaMem,
-        hba::{HbaPort, HbaPortType},
+        hba::{HbaCmdTable, HbaPort, HbaPortType, HBA_GHC_IE},
     },
     kdebug,
 };
+use crate::{kerror, kwarn};
 use ahci_inode::LockedAhciInode;
 use alloc::{
     boxed::Box,
@@ -31,6 +39,7 @@ use alloc::{
     sync::Arc,
     vec::Vec,
 };
+use core::mem::size_of;
 use core::sync::atomic::compiler_fence;
 use system_error::SystemError;
 
@@ -60,6 +69,30 @@ fn ahci_device_search<'a>(
     return Ok(result);
 }
 
+/// 为AHCI控制器安装MSI中断，中断号为`AHCI_IRQ_BASE + ctrl_num`
+fn ahci_irq_init(
+    device: &mut PciDeviceStructureGeneralDevice,
+    ctrl_num: usize,
+) -> Result<(), SystemError> {
+    let irq_vector = device.irq_vector_mut().ok_or(SystemError::ENOSYS)?;
+    irq_vector.push(IrqNumber::new(AHCI_IRQ_BASE + ctrl_num as u32));
+    device
+        .irq_init(IRQ::PCI_IRQ_MSI)
+        .ok_or(SystemError::ENOSYS)?;
+    let msg = PciIrqMsg {
+        irq_common_message: IrqCommonMsg::init_from(
+            0,
+            format!("AHCI_{}_IRQ", ctrl_num),
+            &AhciIrqHandler,
+            DeviceId::new(None, Some(format!("ahci_{}", ctrl_num))).unwrap(),
+        ),
+        irq_specific_message: IrqSpecificMsg::msi_default(),
+    };
+    device.irq_install(msg).or(Err(SystemError::EIO))?;
+    device.irq_enable(true).or(Err(SystemError::EIO))?;
+    return Ok(());
+}
+
 /// @brief: 初始化 ahci
 pub fn ahci_init() -> Result<(), SystemError> {
     let mut list = PCI_DEVICE_LINKEDLIST.write();
@@ -70,9 +103,11 @@ pub fn ahci_init() -> Result<(), SystemError> {
     for device in ahci_device {
         let standard_device = device.as_standard_device_mut().unwrap();
         standard_device.bar_ioremap();
-        // 对于每一个ahci控制器分配一块空间
+        // 命令队列通过DMA读写内存
+        standard_device.enable_master();
+        // 对于每一个ahci控制器分配一块空间，存放所有端口的 Command List 和 Received FIS
         let ahci_port_base_vaddr =
-            Box::leak(Box::new([0u8; (1 << 20) as usize])) as *mut u8 as usize;
+            Box::leak(Box::new([0u8; (40 << 10) as usize])) as *mut u8 as usize;
         let virtaddr = standard_device
             .bar()
             .ok_or(SystemError::EACCES)?
@@ -88,6 +123,23 @@ pub fn ahci_init() -> Result<(), SystemError> {
         let pi = volatile_read!(hba_mem.pi);
         let hba_mem_index = hba_mem_list.len() - 1;
         drop(hba_mem_list);
+
+        // 中断安装失败时，命令队列退化为轮询方式
+        let irq_enabled = match ahci_irq_init(standard_device, hba_mem_index) {
+            Ok(_) => true,
+            Err(e) => {
+                kwarn!(
+                    "ahci ctrl {}: failed to install irq: {:?}, fall back to polling",
+                    hba_mem_index,
+                    e
+                );
+                false
+            }
+        };
+        if irq_enabled {
+            volatile_set_bit!(hba_mem.ghc, HBA_GHC_IE, true);
+        }
+
         // 初始化所有的port
         let mut id = 0;
         for j in 0..32 {
@@ -108,24 +160,35 @@ pub fn ahci_init() -> Result<(), SystemError> {
                         // 计算地址
                         let fb = virt_2_phys(ahci_port_base_vaddr + (32 << 10) + (j << 8));
                         let clb = virt_2_phys(ahci_port_base_vaddr + (j << 10));
+                        // 每个命令槽的 Command Table 为16K，32个命令槽共需要512K物理上连续的内存
+                        let ctba_count =
+                            PageFrameCount::new(32 * size_of::<HbaCmdTable>() / MMArch::PAGE_SIZE);
+                        let (ctba_base, _) = unsafe { allocate_page_frames(ctba_count) }
+                            .ok_or(SystemError::ENOMEM)?;
                         let ctbas = (0..32)
-                            .map(|x| {
-                                virt_2_phys(
-                                    ahci_port_base_vaddr + (40 << 10) + (j << 13) + (x << 8),
-                                ) as u64
-                            })
+                            .map(|x| (ctba_base.data() + x * size_of::<HbaCmdTable>()) as u64)
                             .collect::<Vec<_>>();
 
                         // 初始化 port
                         hba_mem_port.init(clb as u64, fb as u64, &ctbas);
+                        if irq_enabled {
+                            hba_mem_port.enable_interrupts();
+                        }
                         drop(hba_mem_list);
                         compiler_fence(core::sync::atomic::Ordering::SeqCst);
+                        let queue = AhciCmdQueue::new(
+                            unsafe { (virtaddr.data() as *mut HbaMem).as_mut().unwrap() },
+                            hba_mem_index as u8,
+                            j as u8,
+                            irq_enabled,
+                        );
                         // 创建 disk
                         disks_list.push(LockedAhciDisk::new(
                             format!("ahci_disk_{}", id),
                             BLK_GF_AHCI,
                             hba_mem_index as u8,
                             j as u8,
+                            queue,
                         )?);
                         id += 1; // ID 从0开始
 
@@ -14,6 +14,7 @@ use super::e1000e_driver::e1000e_driver_init;
 use crate::driver::base::device::DeviceId;
 use crate::driver::net::dma::{dma_alloc, dma_dealloc};
 use crate::driver::net::irq_handle::DefaultNetIrqHandler;
+use crate::driver::net::offload::{rx_csum_verify, NetOffload, RxCsumStatus};
 use crate::driver::pci::pci::{
     get_pci_device_structure_mut, PciDeviceStructure, PciDeviceStructureGeneralDevice, PciError,
     PCI_DEVICE_LINKEDLIST,
@@ -84,9 +85,9 @@ struct E1000ERecvDesc {
     addr: u64,
     len: u16,
     chksum: u16,
-    status: u16,
+    status: u8,
     error: u8,
-    special: u8,
+    special: u16,
 }
 #[derive(Copy, Clone)]
 // Buffer的Copy只是指针操作，不涉及实际数据的复制，因此要小心使用，确保不同的buffer不会使用同一块内存
@@ -170,6 +171,7 @@ pub struct E1000EDevice {
     interrupt_regs: NonNull<InterruptRegs>,
     rctl_regs: NonNull<ReceiveCtrlRegs>,
     receive_regs: NonNull<ReceiveRegs>,
+    rxcsum_regs: NonNull<ReceiveCsumRegs>,
     tctl_regs: NonNull<TransmitCtrlRegs>,
     transimit_regs: NonNull<TransimitRegs>,
     pcie_regs: NonNull<PCIeRegs>,
@@ -197,6 +199,9 @@ pub struct E1000EDevice {
 }
 
 impl E1000EDevice {
+    /// 网卡支持的卸载功能。初始化时总是打开收包校验和卸载，因此是常量，读取时不需要加锁
+    pub const OFFLOAD: NetOffload = NetOffload::RX_CSUM_IPV4.union(NetOffload::RX_CSUM_L4);
+
     // 从PCI标准设备进行驱动初始化
     // init the device for PCI standard device struct
     #[allow(unused_assignments)]
@@ -249,6 +254,8 @@ impl E1000EDevice {
             get_register_ptr(vaddress, E1000E_RECEIVE_CTRL_REG_OFFSET);
         let receive_regs: NonNull<ReceiveRegs> =
             get_register_ptr(vaddress, E1000E_RECEIVE_REGS_OFFSET);
+        let rxcsum_regs: NonNull<ReceiveCsumRegs> =
+            get_register_ptr(vaddress, E1000E_RECEIVE_CSUM_REG_OFFSET);
         let tctl_regs: NonNull<TransmitCtrlRegs> =
             get_register_ptr(vaddress, E1000E_TRANSMIT_CTRL_REG_OFFSET);
         let transimit_regs: NonNull<TransimitRegs> =
@@ -366,6 +373,13 @@ impl E1000EDevice {
                     | E1000E_RCTL_BSEX
                     | E1000E_RCTL_SECRC
             );
+            // 开启收包校验和卸载，由网卡校验IPv4首部与TCP/UDP的校验和，结果写在descriptor中
+            // Enable IP and TCP/UDP receive checksum offload
+            volwrite!(
+                rxcsum_regs,
+                rxcsum,
+                E1000E_RXCSUM_IPOFLD | E1000E_RXCSUM_TUOFLD
+            );
 
             // Transmit Initialization 14.7
             // 开启发包descriptor的回写功能
@@ -410,6 +424,7 @@ impl E1000EDevice {
             interrupt_regs,
             rctl_regs,
             receive_regs,
+            rxcsum_regs,
             tctl_regs,
             transimit_regs,
             pcie_regs,
@@ -429,21 +444,47 @@ impl E1000EDevice {
     }
     pub fn e1000e_receive(&mut self) -> Option<E1000EBuffer> {
         self.e1000e_intr();
-        let mut rdt = unsafe { volread!(self.receive_regs, rdt0) } as usize;
-        let index = (rdt + 1) % self.recv_desc_ring.len();
-        let desc = &mut self.recv_desc_ring[index];
-        if (desc.status & E1000E_RXD_STATUS_DD) == 0 {
-            return None;
+        loop {
+            let mut rdt = unsafe { volread!(self.receive_regs, rdt0) } as usize;
+            let index = (rdt + 1) % self.recv_desc_ring.len();
+            let desc = &mut self.recv_desc_ring[index];
+            if (desc.status & E1000E_RXD_STATUS_DD) == 0 {
+                return None;
+            }
+            let csum_status = Self::rx_csum_status(desc);
+            let mut buffer = self.recv_buffers[index];
+            let new_buffer = E1000EBuffer::new(PAGE_SIZE);
+            self.recv_buffers[index] = new_buffer;
+            desc.addr = new_buffer.as_paddr() as u64;
+            desc.status = 0;
+            buffer.set_length(desc.len as usize);
+            rdt = index;
+            unsafe { volwrite!(self.receive_regs, rdt0, rdt as u32) };
+            // 校验和错误的数据包直接丢弃，继续取下一个
+            // drop the packet with bad checksum
+            if !rx_csum_verify(buffer.as_slice(), csum_status) {
+                buffer.free_buffer();
+                continue;
+            }
+            // kdebug!("e1000e: receive packet");
+            return Some(buffer);
         }
-        let mut buffer = self.recv_buffers[index];
-        let new_buffer = E1000EBuffer::new(PAGE_SIZE);
-        self.recv_buffers[index] = new_buffer;
-        desc.addr = new_buffer.as_paddr() as u64;
-        buffer.set_length(desc.len as usize);
-        rdt = index;
-        unsafe { volwrite!(self.receive_regs, rdt0, rdt as u32) };
-        // kdebug!("e1000e: receive packet");
-        return Some(buffer);
+    }
+
+    /// 从收包descriptor中读出网卡的校验结果 pp.55 Table 3-13
+    fn rx_csum_status(desc: &E1000ERecvDesc) -> RxCsumStatus {
+        // IXSM置位表示网卡忽略了这个数据包的校验和
+        if (desc.status & E1000E_RXD_STATUS_IXSM) != 0 {
+            return RxCsumStatus::default();
+        }
+        let ipv4_checked = (desc.status & E1000E_RXD_STATUS_IPCS) != 0;
+        let l4_checked = (desc.status & (E1000E_RXD_STATUS_TCPCS | E1000E_RXD_STATUS_UDPCS)) != 0;
+        return RxCsumStatus {
+            ipv4_checked,
+            ipv4_error: ipv4_checked && (desc.error & E1000E_RXD_ERROR_IPE) != 0,
+            l4_checked,
+            l4_error: l4_checked && (desc.error & E1000E_RXD_ERROR_TCPE) != 0,
+        };
     }
 
     pub fn e1000e_can_transmit(&self) -> bool {
@@ -484,17 +525,15 @@ impl E1000EDevice {
         unsafe { volwrite!(self.interrupt_regs, icr, icr) };
     }
 
-    // 切换是否接受分组到达的中断
-    // change whether the receive timer interrupt is enabled
-    // Note: this method is not completely implemented and not used in the current version
-    #[allow(dead_code)]
+    // 切换是否接受分组到达的中断。IMS寄存器写1只能打开中断，关闭中断需要向IMC寄存器写1
+    // change whether the receive interrupts are enabled. Writing 1b to IMS only sets the mask bits,
+    // so the bits have to be cleared through IMC
     pub fn e1000e_intr_set(&mut self, state: bool) {
-        let mut ims = unsafe { volread!(self.interrupt_regs, ims) };
+        let rx_intr = E1000E_IMS_RXT0 | E1000E_IMS_RXDMT0;
         match state {
-            true => ims = ims | E1000E_IMS_RXT0,
-            false => ims = ims & !E1000E_IMS_RXT0,
+            true => unsafe { volwrite!(self.interrupt_regs, ims, rx_intr) },
+            false => unsafe { volwrite!(self.interrupt_regs, imc, rx_intr) },
         }
-        unsafe { volwrite!(self.interrupt_regs, ims, ims) };
     }
 
     // 实现了一部分napi机制的收包函数, 现在还没有投入使用
@@ -709,6 +748,10 @@ struct ReceiveAddressRegs {
     ral0: Volatile<u32>, //0x05400
     rah0: Volatile<u32>, //0x05404
 }
+// 收包校验和控制
+struct ReceiveCsumRegs {
+    rxcsum: Volatile<u32>, //0x05000
+}
 // PCIe 通用控制
 struct PCIeRegs {
     gcr: Volatile<u32>, //0x05b00
@@ -729,6 +772,7 @@ const E1000E_RECEIVE_CTRL_REG_OFFSET: u64 = 0x00100;
 const E1000E_RECEIVE_REGS_OFFSET: u64 = 0x02800;
 const E1000E_TRANSMIT_CTRL_REG_OFFSET: u64 = 0x00400;
 const E1000E_TRANSMIT_REGS_OFFSET: u64 = 0x03800;
+const E1000E_RECEIVE_CSUM_REG_OFFSET: u64 = 0x05000;
 const E1000E_RECEIVE_ADDRESS_REGS_OFFSET: u64 = 0x05400;
 const E1000E_PCIE_REGS_OFFSET: u64 = 0x05b00;
 const E1000E_MTA_REGS_START_OFFSET: u64 = 0x05200;
@@ -765,6 +809,10 @@ const E1000E_RCTL_BSIZE_4K: u32 = 3 << 16;
 const E1000E_RCTL_BSEX: u32 = 1 << 25;
 const E1000E_RCTL_SECRC: u32 = 1 << 26;
 
+// RXCSUM
+const E1000E_RXCSUM_IPOFLD: u32 = 1 << 8;
+const E1000E_RXCSUM_TUOFLD: u32 = 1 << 9;
+
 // TCTL
 const E1000E_TCTL_EN: u32 = 1 << 1;
 const E1000E_TCTL_PSP: u32 = 1 << 3;
@@ -779,7 +827,15 @@ const E1000E_TIPG_IPGR1: u32 = 2 << 10;
 const E1000E_TIPG_IPGR2: u32 = 10 << 20;
 
 // RxDescriptorStatus
-const E1000E_RXD_STATUS_DD: u16 = 1 << 0;
+const E1000E_RXD_STATUS_DD: u8 = 1 << 0;
+const E1000E_RXD_STATUS_IXSM: u8 = 1 << 2;
+const E1000E_RXD_STATUS_UDPCS: u8 = 1 << 4;
+const E1000E_RXD_STATUS_TCPCS: u8 = 1 << 5;
+const E1000E_RXD_STATUS_IPCS: u8 = 1 << 6;
+
+// RxDescriptorErrors
+const E1000E_RXD_ERROR_TCPE: u8 = 1 << 5;
+const E1000E_RXD_ERROR_IPE: u8 = 1 << 6;
 
 // TxDescriptorStatus
 const E1000E_TXD_STATUS_DD: u8 = 1 << 0;
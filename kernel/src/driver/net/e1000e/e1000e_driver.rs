@@ -10,7 +10,11 @@ use crate::{
     },
     kinfo,
     libs::spinlock::SpinLock,
-    net::{generate_iface_id, NET_DRIVERS},
+    net::{
+        generate_iface_id,
+        napi::{NapiBudgetDevice, NapiStruct},
+        NET_DRIVERS,
+    },
     time::Instant,
 };
 use alloc::{
@@ -70,6 +74,7 @@ pub struct E1000EInterface {
     iface_id: usize,
     iface: SpinLock<smoltcp::iface::Interface>,
     name: String,
+    napi: NapiStruct,
 }
 impl phy::RxToken for E1000ERxToken {
     fn consume<R, F>(mut self, f: F) -> R
@@ -164,6 +169,8 @@ impl phy::Device for E1000EDriver {
            If None, there is no fixed limit on burst size, e.g. if network buffers are dynamically allocated.
         */
         caps.max_burst_size = Some(1);
+        // 网卡已经校验过的校验和，协议栈不再重复校验
+        caps.checksum = E1000EDevice::OFFLOAD.checksum_caps();
         return caps;
     }
 }
@@ -188,6 +195,7 @@ impl E1000EInterface {
             iface_id,
             iface: SpinLock::new(iface),
             name: format!("eth{}", iface_id),
+            napi: NapiStruct::new(),
         });
 
         return result;
@@ -273,6 +281,22 @@ impl NetDriver for E1000EInterface {
         return Err(SystemError::EAGAIN_OR_EWOULDBLOCK);
     }
 
+    fn napi_poll(&self, sockets: &mut smoltcp::iface::SocketSet, budget: usize) -> usize {
+        let timestamp: smoltcp::time::Instant = Instant::now().into();
+        let mut device = NapiBudgetDevice::new(self.driver.force_get_mut(), budget);
+        self.iface.lock().poll(timestamp, &mut device, sockets);
+        return device.received();
+    }
+
+    #[inline]
+    fn napi(&self) -> &NapiStruct {
+        return &self.napi;
+    }
+
+    fn set_rx_irq(&self, enable: bool) {
+        self.driver.inner.lock_irqsave().e1000e_intr_set(enable);
+    }
+
     #[inline(always)]
     fn inner_iface(&self) -> &SpinLock<smoltcp::iface::Interface> {
         return &self.iface;
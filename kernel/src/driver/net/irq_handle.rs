@@ -7,10 +7,12 @@ use crate::{
         irqdesc::{IrqHandler, IrqReturn},
         IrqNumber,
     },
-    net::net_core::poll_ifaces_try_lock_onetime,
+    net::napi::napi_schedule_all,
 };
 
 /// 默认的网卡中断处理函数
+///
+/// 这个处理函数不知道中断来自哪一张网卡，因此调度所有网卡的NAPI轮询
 #[derive(Debug)]
 pub struct DefaultNetIrqHandler;
 
@@ -21,7 +23,7 @@ impl IrqHandler for DefaultNetIrqHandler {
         _static_data: Option<&dyn IrqHandlerData>,
         _dynamic_data: Option<Arc<dyn IrqHandlerData>>,
     ) -> Result<IrqReturn, SystemError> {
-        poll_ifaces_try_lock_onetime().ok();
+        napi_schedule_all();
         Ok(IrqReturn::Handled)
     }
 }
@@ -5,12 +5,13 @@ use smoltcp::{
 };
 
 use super::base::device::driver::Driver;
-use crate::libs::spinlock::SpinLock;
+use crate::{libs::spinlock::SpinLock, net::napi::NapiStruct};
 use system_error::SystemError;
 
 mod dma;
 pub mod e1000e;
 pub mod irq_handle;
+pub mod offload;
 pub mod virtio_net;
 
 pub trait NetDriver: Driver {
@@ -24,6 +25,17 @@ pub trait NetDriver: Driver {
 
     fn poll(&self, sockets: &mut iface::SocketSet) -> Result<(), SystemError>;
 
+    /// @brief 在NET_RX软中断中轮询网卡，最多从网卡取出budget个数据包
+    ///
+    /// @return 本轮取出的数据包数量。等于budget时，表示网卡上可能还有未处理的数据包
+    fn napi_poll(&self, sockets: &mut iface::SocketSet, budget: usize) -> usize;
+
+    /// @brief 获取网卡的NAPI状态
+    fn napi(&self) -> &NapiStruct;
+
+    /// @brief 打开/关闭网卡的收包中断。不支持屏蔽收包中断的网卡可以不实现
+    fn set_rx_irq(&self, _enable: bool) {}
+
     fn update_ip_addrs(&self, ip_addrs: &[wire::IpCidr]) -> Result<(), SystemError>;
 
     /// @brief 获取smoltcp的网卡接口类型
@@ -0,0 +1,131 @@
+//! 网卡卸载（offload）功能
+//!
+//! 网卡通过`NetOffload`声明自己在收包时能够替协议栈完成哪些校验和计算，
+//! 再由`NetOffload::checksum_caps`转换成smoltcp的`ChecksumCapabilities`，让协议栈跳过这部分校验。
+//!
+//! smoltcp的校验和能力是按网卡设置的，而网卡并不能校验所有的数据包（例如IP分片、网卡不认识的协议），
+//! 因此声明了卸载功能的驱动，必须对每个收到的数据包调用`rx_csum_verify`：
+//! 网卡已经校验过的部分直接采用网卡的结果，没有校验的部分由软件补上。
+
+use smoltcp::{
+    phy::{Checksum, ChecksumCapabilities},
+    wire::{
+        EthernetFrame, EthernetProtocol, IpAddress, IpProtocol, Ipv4Packet, Ipv6Packet, TcpPacket,
+        UdpPacket,
+    },
+};
+
+bitflags! {
+    /// 网卡的卸载功能
+    pub struct NetOffload: u32 {
+        /// 网卡在收包时校验IPv4首部的校验和
+        const RX_CSUM_IPV4 = 1 << 0;
+        /// 网卡在收包时校验TCP/UDP的校验和
+        const RX_CSUM_L4 = 1 << 1;
+    }
+}
+
+impl NetOffload {
+    /// 根据网卡的卸载功能，生成smoltcp的校验和能力
+    ///
+    /// 网卡负责校验的协议设置为`Checksum::Tx`：协议栈只在发包时计算校验和，收包时不再校验
+    pub fn checksum_caps(&self) -> ChecksumCapabilities {
+        let mut caps = ChecksumCapabilities::default();
+        if self.contains(NetOffload::RX_CSUM_IPV4) {
+            caps.ipv4 = Checksum::Tx;
+        }
+        if self.contains(NetOffload::RX_CSUM_L4) {
+            caps.tcp = Checksum::Tx;
+            caps.udp = Checksum::Tx;
+        }
+        return caps;
+    }
+}
+
+/// 网卡对一个数据包的校验结果
+#[derive(Debug, Clone, Copy, Default)]
+pub struct RxCsumStatus {
+    /// 网卡校验了IPv4首部的校验和
+    pub ipv4_checked: bool,
+    /// IPv4首部的校验和错误
+    pub ipv4_error: bool,
+    /// 网卡校验了TCP/UDP的校验和
+    pub l4_checked: bool,
+    /// TCP/UDP的校验和错误
+    pub l4_error: bool,
+}
+
+/// 补全网卡没有完成的校验
+///
+/// ## 参数
+///
+/// - `frame` 收到的以太网帧
+/// - `status` 网卡对这个数据包的校验结果
+///
+/// ## 返回值
+///
+/// - `true` 校验和正确（或者不是由网卡负责校验的协议），数据包可以交给协议栈
+/// - `false` 校验和错误，应当丢弃这个数据包
+pub fn rx_csum_verify(frame: &[u8], status: RxCsumStatus) -> bool {
+    if status.ipv4_error || status.l4_error {
+        return false;
+    }
+    if status.ipv4_checked && status.l4_checked {
+        return true;
+    }
+
+    // 解析失败的数据包交给协议栈处理，协议栈自己会丢弃它
+    let frame = match EthernetFrame::new_checked(frame) {
+        Ok(frame) => frame,
+        Err(_) => return true,
+    };
+    let (src, dst, protocol, payload) = match frame.ethertype() {
+        EthernetProtocol::Ipv4 => {
+            let packet = match Ipv4Packet::new_checked(frame.payload()) {
+                Ok(packet) => packet,
+                Err(_) => return true,
+            };
+            if !status.ipv4_checked && !packet.verify_checksum() {
+                return false;
+            }
+            if status.l4_checked || packet.more_frags() || packet.frag_offset() != 0 {
+                // 分片无法单独校验传输层校验和
+                return true;
+            }
+            (
+                IpAddress::from(packet.src_addr()),
+                IpAddress::from(packet.dst_addr()),
+                packet.next_header(),
+                packet.payload(),
+            )
+        }
+        EthernetProtocol::Ipv6 => {
+            if status.l4_checked {
+                return true;
+            }
+            let packet = match Ipv6Packet::new_checked(frame.payload()) {
+                Ok(packet) => packet,
+                Err(_) => return true,
+            };
+            (
+                IpAddress::from(packet.src_addr()),
+                IpAddress::from(packet.dst_addr()),
+                packet.next_header(),
+                packet.payload(),
+            )
+        }
+        _ => return true,
+    };
+
+    match protocol {
+        IpProtocol::Tcp => match TcpPacket::new_checked(payload) {
+            Ok(packet) => return packet.verify_checksum(&src, &dst),
+            Err(_) => return true,
+        },
+        IpProtocol::Udp => match UdpPacket::new_checked(payload) {
+            Ok(packet) => return packet.verify_checksum(&src, &dst),
+            Err(_) => return true,
+        },
+        _ => return true,
+    }
+}
@@ -1,6 +1,7 @@
 use core::{
     cell::UnsafeCell,
     fmt::Debug,
+    mem::size_of,
     ops::{Deref, DerefMut},
 };
 
@@ -21,19 +22,25 @@ use crate::{
         virtio::{irq::virtio_irq_manager, virtio_impl::HalImpl, VirtIODevice},
     },
     exception::{irqdesc::IrqReturn, IrqNumber},
-    kerror, kinfo,
+    init::boot_params,
+    kerror, kinfo, kwarn,
     libs::spinlock::SpinLock,
-    net::{generate_iface_id, net_core::poll_ifaces_try_lock_onetime, NET_DRIVERS},
+    net::{
+        generate_iface_id,
+        napi::{napi_schedule, NapiBudgetDevice, NapiStruct},
+        NET_DRIVERS,
+    },
+    process::KernelStack,
     time::Instant,
 };
 use system_error::SystemError;
 
 /// @brief Virtio网络设备驱动(加锁)
-pub struct VirtioNICDriver<T: Transport> {
-    pub inner: Arc<SpinLock<VirtIONet<HalImpl, T, 2>>>,
+pub struct VirtioNICDriver<T: Transport, const QS: usize> {
+    pub inner: Arc<SpinLock<VirtIONet<HalImpl, T, QS>>>,
 }
 
-impl<T: Transport> Clone for VirtioNICDriver<T> {
+impl<T: Transport, const QS: usize> Clone for VirtioNICDriver<T, QS> {
     fn clone(&self) -> Self {
         return VirtioNICDriver {
             inner: self.inner.clone(),
@@ -45,43 +52,44 @@ impl<T: Transport> Clone for VirtioNICDriver<T> {
 ///
 /// 由于smoltcp的设计，导致需要在poll的时候获取网卡驱动的可变引用，
 /// 同时需要在token的consume里面获取可变引用。为了避免双重加锁，所以需要这个包裹器。
-struct VirtioNICDriverWrapper<T: Transport>(UnsafeCell<VirtioNICDriver<T>>);
-unsafe impl<T: Transport> Send for VirtioNICDriverWrapper<T> {}
-unsafe impl<T: Transport> Sync for VirtioNICDriverWrapper<T> {}
+struct VirtioNICDriverWrapper<T: Transport, const QS: usize>(UnsafeCell<VirtioNICDriver<T, QS>>);
+unsafe impl<T: Transport, const QS: usize> Send for VirtioNICDriverWrapper<T, QS> {}
+unsafe impl<T: Transport, const QS: usize> Sync for VirtioNICDriverWrapper<T, QS> {}
 
-impl<T: Transport> Deref for VirtioNICDriverWrapper<T> {
-    type Target = VirtioNICDriver<T>;
+impl<T: Transport, const QS: usize> Deref for VirtioNICDriverWrapper<T, QS> {
+    type Target = VirtioNICDriver<T, QS>;
     fn deref(&self) -> &Self::Target {
         unsafe { &*self.0.get() }
     }
 }
-impl<T: Transport> DerefMut for VirtioNICDriverWrapper<T> {
+impl<T: Transport, const QS: usize> DerefMut for VirtioNICDriverWrapper<T, QS> {
     fn deref_mut(&mut self) -> &mut Self::Target {
         unsafe { &mut *self.0.get() }
     }
 }
 
-impl<T: Transport> VirtioNICDriverWrapper<T> {
-    fn force_get_mut(&self) -> &mut VirtioNICDriver<T> {
+impl<T: Transport, const QS: usize> VirtioNICDriverWrapper<T, QS> {
+    fn force_get_mut(&self) -> &mut VirtioNICDriver<T, QS> {
         unsafe { &mut *self.0.get() }
     }
 }
 
-impl<T: Transport> Debug for VirtioNICDriver<T> {
+impl<T: Transport, const QS: usize> Debug for VirtioNICDriver<T, QS> {
     fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
         f.debug_struct("VirtioNICDriver").finish()
     }
 }
 
-pub struct VirtioInterface<T: Transport> {
-    driver: VirtioNICDriverWrapper<T>,
+pub struct VirtioInterface<T: Transport, const QS: usize> {
+    driver: VirtioNICDriverWrapper<T, QS>,
     iface_id: usize,
     iface: SpinLock<smoltcp::iface::Interface>,
     name: String,
     dev_id: Arc<DeviceId>,
+    napi: NapiStruct,
 }
 
-impl<T: Transport> Debug for VirtioInterface<T> {
+impl<T: Transport, const QS: usize> Debug for VirtioInterface<T, QS> {
     fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
         f.debug_struct("VirtioInterface")
             .field("driver", self.driver.deref())
@@ -92,8 +100,8 @@ impl<T: Transport> Debug for VirtioInterface<T> {
     }
 }
 
-impl<T: Transport> VirtioInterface<T> {
-    pub fn new(mut driver: VirtioNICDriver<T>, dev_id: Arc<DeviceId>) -> Arc<Self> {
+impl<T: Transport, const QS: usize> VirtioInterface<T, QS> {
+    pub fn new(mut driver: VirtioNICDriver<T, QS>, dev_id: Arc<DeviceId>) -> Arc<Self> {
         let iface_id = generate_iface_id();
         let mut iface_config = smoltcp::iface::Config::new();
 
@@ -106,22 +114,26 @@ impl<T: Transport> VirtioInterface<T> {
         ));
         let iface = smoltcp::iface::Interface::new(iface_config, &mut driver);
 
-        let driver: VirtioNICDriverWrapper<T> = VirtioNICDriverWrapper(UnsafeCell::new(driver));
+        let driver: VirtioNICDriverWrapper<T, QS> = VirtioNICDriverWrapper(UnsafeCell::new(driver));
         let result = Arc::new(VirtioInterface {
             driver,
             iface_id,
             iface: SpinLock::new(iface),
             name: format!("eth{}", iface_id),
             dev_id,
+            napi: NapiStruct::new(),
         });
 
         return result;
     }
 }
 
-impl<T: Transport + 'static> VirtIODevice for VirtioInterface<T> {
+impl<T: Transport + 'static, const QS: usize> VirtIODevice for VirtioInterface<T, QS> {
     fn handle_irq(&self, _irq: IrqNumber) -> Result<IrqReturn, SystemError> {
-        poll_ifaces_try_lock_onetime().ok();
+        let iface = NET_DRIVERS.read_irqsave().get(&self.iface_id).cloned();
+        if let Some(iface) = iface {
+            napi_schedule(iface);
+        }
         return Ok(IrqReturn::Handled);
     }
 
@@ -130,15 +142,16 @@ impl<T: Transport + 'static> VirtIODevice for VirtioInterface<T> {
     }
 }
 
-impl<T: Transport> Drop for VirtioInterface<T> {
+impl<T: Transport, const QS: usize> Drop for VirtioInterface<T, QS> {
     fn drop(&mut self) {
         // 从全局的网卡接口信息表中删除这个网卡的接口信息
         NET_DRIVERS.write_irqsave().remove(&self.iface_id);
     }
 }
 
-impl<T: 'static + Transport> VirtioNICDriver<T> {
-    pub fn new(driver_net: VirtIONet<HalImpl, T, 2>) -> Self {
+impl<T: 'static + Transport, const QS: usize> VirtioNICDriver<T, QS> {
+    /// 参数直接接收已经放在堆上的`VirtIONet`：当队列较深时它有数KB大，不应在栈上多次移动
+    pub fn new(inner: Arc<SpinLock<VirtIONet<HalImpl, T, QS>>>) -> Self {
         let mut iface_config = smoltcp::iface::Config::new();
 
         // todo: 随机设定这个值。
@@ -146,32 +159,37 @@ impl<T: 'static + Transport> VirtioNICDriver<T> {
         iface_config.random_seed = 12345;
 
         iface_config.hardware_addr = Some(wire::HardwareAddress::Ethernet(
-            smoltcp::wire::EthernetAddress(driver_net.mac_address()),
+            smoltcp::wire::EthernetAddress(inner.lock().mac_address()),
         ));
 
-        let inner: Arc<SpinLock<VirtIONet<HalImpl, T, 2>>> = Arc::new(SpinLock::new(driver_net));
         let result = VirtioNICDriver { inner };
         return result;
     }
 }
 
-pub struct VirtioNetToken<T: Transport> {
-    driver: VirtioNICDriver<T>,
+pub struct VirtioNetToken<T: Transport, const QS: usize> {
+    driver: VirtioNICDriver<T, QS>,
     rx_buffer: Option<virtio_drivers::device::net::RxBuffer>,
 }
 
-impl<'a, T: Transport> VirtioNetToken<T> {
+impl<'a, T: Transport, const QS: usize> VirtioNetToken<T, QS> {
     pub fn new(
-        driver: VirtioNICDriver<T>,
+        driver: VirtioNICDriver<T, QS>,
         rx_buffer: Option<virtio_drivers::device::net::RxBuffer>,
     ) -> Self {
         return Self { driver, rx_buffer };
     }
 }
 
-impl<T: Transport> phy::Device for VirtioNICDriver<T> {
-    type RxToken<'a> = VirtioNetToken<T> where Self: 'a;
-    type TxToken<'a> = VirtioNetToken<T> where Self: 'a;
+impl<T: Transport, const QS: usize> phy::Device for VirtioNICDriver<T, QS> {
+    type RxToken<'a>
+        = VirtioNetToken<T, QS>
+    where
+        Self: 'a;
+    type TxToken<'a>
+        = VirtioNetToken<T, QS>
+    where
+        Self: 'a;
 
     fn receive(
         &mut self,
@@ -207,12 +225,13 @@ impl<T: Transport> phy::Device for VirtioNICDriver<T> {
            The network device is unable to send or receive bursts large than the value returned by this function.
            If None, there is no fixed limit on burst size, e.g. if network buffers are dynamically allocated.
         */
-        caps.max_burst_size = Some(1);
+        // 接收队列中预先放好了QS个缓冲区，网卡最多可以连续收到QS个数据包
+        caps.max_burst_size = Some(QS);
         return caps;
     }
 }
 
-impl<T: Transport> phy::TxToken for VirtioNetToken<T> {
+impl<T: Transport, const QS: usize> phy::TxToken for VirtioNetToken<T, QS> {
     fn consume<R, F>(self, len: usize, f: F) -> R
     where
         F: FnOnce(&mut [u8]) -> R,
@@ -227,7 +246,7 @@ impl<T: Transport> phy::TxToken for VirtioNetToken<T> {
     }
 }
 
-impl<T: Transport> phy::RxToken for VirtioNetToken<T> {
+impl<T: Transport, const QS: usize> phy::RxToken for VirtioNetToken<T, QS> {
     fn consume<R, F>(self, f: F) -> R
     where
         F: FnOnce(&mut [u8]) -> R,
@@ -244,18 +263,130 @@ impl<T: Transport> phy::RxToken for VirtioNetToken<T> {
     }
 }
 
+/// virtio-net收发队列的默认深度
+const VIRTIO_NET_DEFAULT_QUEUE_SIZE: usize = 256;
+/// virtio-net收发队列的最小深度
+const VIRTIO_NET_MIN_QUEUE_SIZE: usize = 16;
+/// virtio-net收发队列的最大深度
+const VIRTIO_NET_MAX_QUEUE_SIZE: usize = 1024;
+/// `VirtIONet`结构体的大小上限
+///
+/// `VirtIONet`内含与队列深度成正比的数组，而`VirtIONet::new`在栈上构造并按值返回，
+/// 移入堆之前栈上会同时存在不止一份。因此把它限制在内核栈的四分之一以内
+const VIRTIO_NET_MAX_DRIVER_SIZE: usize = KernelStack::SIZE / 4;
+/// 每个接收缓冲区的大小
+const VIRTIO_NET_RX_BUF_LEN: usize = 4096;
+
+/// 从内核命令行中读取virtio-net的队列深度（`virtio_net.queue_size=`）
+///
+/// 队列深度必须是2的幂，且在`VIRTIO_NET_MIN_QUEUE_SIZE`和`VIRTIO_NET_MAX_QUEUE_SIZE`之间，其他取值使用默认值
+fn virtio_net_queue_size() -> usize {
+    let boot_params = boot_params().read();
+    for arg in boot_params
+        .boot_cmdline_str()
+        .split(|c: char| c.is_whitespace() || c == '\0')
+    {
+        if let Some(value) = arg.strip_prefix("virtio_net.queue_size=") {
+            match value.parse::<usize>() {
+                Ok(size)
+                    if size.is_power_of_two()
+                        && (VIRTIO_NET_MIN_QUEUE_SIZE..=VIRTIO_NET_MAX_QUEUE_SIZE)
+                            .contains(&size) =>
+                {
+                    return size
+                }
+                _ => {
+                    kwarn!(
+                        "virtio_net: unsupported queue size '{}', use {}",
+                        value,
+                        VIRTIO_NET_DEFAULT_QUEUE_SIZE
+                    );
+                }
+            }
+        }
+    }
+    return VIRTIO_NET_DEFAULT_QUEUE_SIZE;
+}
+
+/// 获取指定队列深度对应的`VirtIONet`的大小，以及初始化函数
+///
+/// 队列深度是virtio-drivers的常量泛型参数，因此需要为每个深度分别实例化
+fn virtio_net_variant<T: Transport + 'static>(queue_size: usize) -> (usize, fn(T, Arc<DeviceId>)) {
+    match queue_size {
+        1024 => (
+            size_of::<VirtIONet<HalImpl, T, 1024>>(),
+            virtio_net_init::<T, 1024>,
+        ),
+        512 => (
+            size_of::<VirtIONet<HalImpl, T, 512>>(),
+            virtio_net_init::<T, 512>,
+        ),
+        256 => (
+            size_of::<VirtIONet<HalImpl, T, 256>>(),
+            virtio_net_init::<T, 256>,
+        ),
+        128 => (
+            size_of::<VirtIONet<HalImpl, T, 128>>(),
+            virtio_net_init::<T, 128>,
+        ),
+        64 => (
+            size_of::<VirtIONet<HalImpl, T, 64>>(),
+            virtio_net_init::<T, 64>,
+        ),
+        32 => (
+            size_of::<VirtIONet<HalImpl, T, 32>>(),
+            virtio_net_init::<T, 32>,
+        ),
+        _ => (
+            size_of::<VirtIONet<HalImpl, T, VIRTIO_NET_MIN_QUEUE_SIZE>>(),
+            virtio_net_init::<T, VIRTIO_NET_MIN_QUEUE_SIZE>,
+        ),
+    }
+}
+
 /// @brief virtio-net 驱动的初始化与测试
+///
+/// 如果设备支持的队列深度（例如QEMU默认的256）小于请求的深度，或者对应的`VirtIONet`过大，
+/// 则逐级减半，而不是让网卡初始化失败
 pub fn virtio_net<T: Transport + 'static>(transport: T, dev_id: Arc<DeviceId>) {
-    let driver_net: VirtIONet<HalImpl, T, 2> =
-        match VirtIONet::<HalImpl, T, 2>::new(transport, 4096) {
+    let requested = virtio_net_queue_size();
+    // 在VirtIONet::new消耗掉transport之前检查，否则初始化失败之后无法重试
+    let device_max = transport.max_queue_size() as usize;
+
+    let mut queue_size = requested;
+    loop {
+        let (driver_size, init) = virtio_net_variant::<T>(queue_size);
+        if queue_size <= VIRTIO_NET_MIN_QUEUE_SIZE
+            || (queue_size <= device_max && driver_size <= VIRTIO_NET_MAX_DRIVER_SIZE)
+        {
+            if queue_size != requested {
+                kwarn!(
+                    "virtio_net: queue size {} not usable (device max {}, driver size {} bytes), fall back to {}",
+                    requested,
+                    device_max,
+                    virtio_net_variant::<T>(requested).0,
+                    queue_size
+                );
+            }
+            init(transport, dev_id);
+            return;
+        }
+        queue_size /= 2;
+    }
+}
+
+fn virtio_net_init<T: Transport + 'static, const QS: usize>(transport: T, dev_id: Arc<DeviceId>) {
+    let driver_net: Arc<SpinLock<VirtIONet<HalImpl, T, QS>>> = Arc::new(SpinLock::new(
+        match VirtIONet::<HalImpl, T, QS>::new(transport, VIRTIO_NET_RX_BUF_LEN) {
             Ok(net) => net,
-            Err(_) => {
-                kerror!("VirtIONet init failed");
+            Err(err) => {
+                kerror!("VirtIONet init failed (queue size {}): {:?}", QS, err);
                 return;
             }
-        };
-    let mac = smoltcp::wire::EthernetAddress::from_bytes(&driver_net.mac_address());
-    let driver: VirtioNICDriver<T> = VirtioNICDriver::new(driver_net);
+        },
+    ));
+    let mac = smoltcp::wire::EthernetAddress::from_bytes(&driver_net.lock().mac_address());
+    let driver: VirtioNICDriver<T, QS> = VirtioNICDriver::new(driver_net);
     let iface = VirtioInterface::new(driver, dev_id);
     let name = iface.name.clone();
     // 将网卡的接口信息注册到全局的网卡接口信息表中
@@ -267,13 +398,14 @@ pub fn virtio_net<T: Transport + 'static>(transport: T, dev_id: Arc<DeviceId>) {
         .register_device(iface.clone())
         .expect("Register virtio net failed");
     kinfo!(
-        "Virtio-net driver init successfully!\tNetDevID: [{}], MAC: [{}]",
+        "Virtio-net driver init successfully!\tNetDevID: [{}], MAC: [{}], queue size: {}",
         name,
-        mac
+        mac,
+        QS
     );
 }
 
-impl<T: Transport + 'static> Driver for VirtioInterface<T> {
+impl<T: Transport + 'static, const QS: usize> Driver for VirtioInterface<T, QS> {
     fn id_table(&self) -> Option<IdTable> {
         todo!()
     }
@@ -299,7 +431,7 @@ impl<T: Transport + 'static> Driver for VirtioInterface<T> {
     }
 }
 
-impl<T: Transport + 'static> NetDriver for VirtioInterface<T> {
+impl<T: Transport + 'static, const QS: usize> NetDriver for VirtioInterface<T, QS> {
     fn mac(&self) -> smoltcp::wire::EthernetAddress {
         let mac: [u8; 6] = self.driver.inner.lock().mac_address();
         return smoltcp::wire::EthernetAddress::from_bytes(&mac);
@@ -344,6 +476,18 @@ impl<T: Transport + 'static> NetDriver for VirtioInterface<T> {
         return Err(SystemError::EAGAIN_OR_EWOULDBLOCK);
     }
 
+    fn napi_poll(&self, sockets: &mut smoltcp::iface::SocketSet, budget: usize) -> usize {
+        let timestamp: smoltcp::time::Instant = Instant::now().into();
+        let mut device = NapiBudgetDevice::new(self.driver.force_get_mut(), budget);
+        self.iface.lock().poll(timestamp, &mut device, sockets);
+        return device.received();
+    }
+
+    #[inline]
+    fn napi(&self) -> &NapiStruct {
+        return &self.napi;
+    }
+
     #[inline(always)]
     fn inner_iface(&self) -> &SpinLock<smoltcp::iface::Interface> {
         return &self.iface;
@@ -353,7 +497,7 @@ impl<T: Transport + 'static> NetDriver for VirtioInterface<T> {
     // }
 }
 
-impl<T: Transport + 'static> KObject for VirtioInterface<T> {
+impl<T: Transport + 'static, const QS: usize> KObject for VirtioInterface<T, QS> {
     fn as_any_ref(&self) -> &dyn core::any::Any {
         self
     }
@@ -1,11 +1,7 @@
 use alloc::sync::Arc;
 use system_error::SystemError;
 
-use crate::{
-    arch::{sched::sched, MMArch},
-    mm::MemoryManagementArch,
-    smp::cpu::ProcessorId,
-};
+use crate::{arch::sched::sched, mm::page::tlb_shootdown_ack, smp::cpu::ProcessorId};
 
 use super::{
     irqdata::IrqHandlerData,
@@ -63,7 +59,7 @@ impl IrqHandler for FlushTLBIpiHandler {
         _static_data: Option<&dyn IrqHandlerData>,
         _dynamic_data: Option<Arc<dyn IrqHandlerData>>,
     ) -> Result<IrqReturn, SystemError> {
-        unsafe { MMArch::invalidate_all() };
+        tlb_shootdown_ack();
 
         Ok(IrqReturn::Handled)
     }
@@ -6,22 +6,29 @@ use core::{
     sync::atomic::{compiler_fence, AtomicI16, Ordering},
 };
 
-use alloc::{boxed::Box, sync::Arc, vec::Vec};
+use alloc::{boxed::Box, format, sync::Arc, vec::Vec};
 use num_traits::FromPrimitive;
 use system_error::SystemError;
+use unified_init::macros::unified_init;
 
 use crate::{
-    arch::CurrentIrqArch,
+    arch::{sched::sched, CurrentIrqArch},
     exception::InterruptArch,
-    kdebug, kinfo,
-    libs::rwlock::RwLock,
-    mm::percpu::{PerCpu, PerCpuVar},
-    process::ProcessManager,
+    include::bindings::bindings::smp_get_total_cpu,
+    init::initcall::INITCALL_CORE,
+    kdebug, kerror, kinfo,
+    libs::{cpumask::CpuMask, rwlock::RwLock, spinlock::SpinLock},
+    mm::percpu::{PerCpu, PerCpuCounter, PerCpuVar},
+    process::{
+        kthread::{KernelThreadClosure, KernelThreadMechanism},
+        ProcessControlBlock, ProcessFlags, ProcessManager,
+    },
+    sched::core::sched_setaffinity,
     smp::{core::smp_get_processor_id, cpu::ProcessorId},
     time::timer::clock,
 };
 
-const MAX_SOFTIRQ_NUM: u64 = 64;
+pub const MAX_SOFTIRQ_NUM: u64 = 64;
 const MAX_SOFTIRQ_RESTART: i32 = 20;
 
 static mut __CPU_PENDING: Option<Box<[VecStatus; PerCpu::MAX_CPU_NUM as usize]>> = None;
@@ -71,6 +78,19 @@ pub enum SoftirqNumber {
     /// 时钟软中断信号
     TIMER = 0,
     VideoRefresh = 1, //帧缓冲区刷新软中断
+    /// 网卡收包软中断（NAPI轮询）
+    NetRx = 2,
+}
+
+impl SoftirqNumber {
+    /// 软中断的名字（用于/proc/softirqs）
+    pub fn name(&self) -> &'static str {
+        match self {
+            SoftirqNumber::TIMER => "TIMER",
+            SoftirqNumber::VideoRefresh => "VIDEO_REFRESH",
+            SoftirqNumber::NetRx => "NET_RX",
+        }
+    }
 }
 
 impl From<u64> for SoftirqNumber {
@@ -84,6 +104,7 @@ bitflags! {
     pub struct VecStatus: u64 {
         const TIMER = 1 << 0;
         const VIDEO_REFRESH = 1 << 1;
+        const NET_RX = 1 << 2;
     }
 }
 
@@ -97,11 +118,30 @@ pub trait SoftirqVec: Send + Sync + Debug {
     fn run(&self);
 }
 
+/// 每个cpu上与软中断相关的数据
+#[derive(Debug)]
+struct SoftirqCpuData {
+    /// 这个cpu的ksoftirqd线程
+    ksoftirqd: SpinLock<Option<Arc<ProcessControlBlock>>>,
+}
+
+impl SoftirqCpuData {
+    fn new() -> Self {
+        return Self {
+            ksoftirqd: SpinLock::new(None),
+        };
+    }
+}
+
 #[derive(Debug)]
 pub struct Softirq {
     table: RwLock<[Option<Arc<dyn SoftirqVec>>; MAX_SOFTIRQ_NUM as usize]>,
     /// 软中断嵌套层数（per cpu）
     cpu_running_count: PerCpuVar<AtomicI16>,
+    /// 每个软中断在每个cpu上被执行的次数
+    counts: Vec<PerCpuCounter>,
+    /// 每个cpu的ksoftirqd线程
+    cpu_data: Vec<SoftirqCpuData>,
 }
 impl Softirq {
     /// 每个CPU最大嵌套的软中断数量
@@ -122,9 +162,18 @@ impl Softirq {
         percpu_count.resize_with(PerCpu::MAX_CPU_NUM as usize, || AtomicI16::new(0));
         let cpu_running_count = PerCpuVar::new(percpu_count).unwrap();
 
+        let counts = (0..MAX_SOFTIRQ_NUM)
+            .map(|_| PerCpuCounter::new().unwrap())
+            .collect();
+
+        let mut cpu_data = Vec::with_capacity(PerCpu::MAX_CPU_NUM as usize);
+        cpu_data.resize_with(PerCpu::MAX_CPU_NUM as usize, SoftirqCpuData::new);
+
         return Softirq {
             table: RwLock::new(data),
             cpu_running_count,
+            counts,
+            cpu_data,
         };
     }
 
@@ -181,8 +230,22 @@ impl Softirq {
         compiler_fence(Ordering::SeqCst);
     }
 
+    /// 在中断返回之前处理当前cpu上等待的软中断
+    ///
+    /// 如果当前cpu的ksoftirqd已经被唤醒，说明软中断的负载很重，交由ksoftirqd处理，
+    /// 避免被中断的进程长时间得不到运行
     #[inline(never)]
     pub fn do_softirq(&self) {
+        if self.ksoftirqd_running(smp_get_processor_id()) {
+            return;
+        }
+        self.__do_softirq();
+    }
+
+    /// 处理当前cpu上等待的软中断，调用时需要关中断
+    ///
+    /// 处理时间超过预算、或者重复处理的次数过多时，把剩余的软中断交给ksoftirqd
+    fn __do_softirq(&self) {
         if self.cpu_running_count().get().load(Ordering::SeqCst) >= Self::MAX_RUNNING_PER_CPU {
             // 当前CPU的软中断嵌套层数已经达到最大值，不再执行
             return;
@@ -216,6 +279,7 @@ impl Softirq {
 
                     let prev_count: usize = ProcessManager::current_pcb().preempt_count();
 
+                    self.counts[i as usize].this_cpu_inc();
                     softirq_func.as_ref().unwrap().run();
                     if unlikely(prev_count != ProcessManager::current_pcb().preempt_count()) {
                         kdebug!(
@@ -231,20 +295,45 @@ impl Softirq {
             unsafe { CurrentIrqArch::interrupt_disable() };
             max_restart -= 1;
             compiler_fence(Ordering::SeqCst);
-            if cpu_pending(cpu_id).is_empty() {
-                compiler_fence(Ordering::SeqCst);
+            if !cpu_pending(cpu_id).is_empty() {
                 if clock() < end && max_restart > 0 {
                     continue;
-                } else {
-                    break;
                 }
-            } else {
-                // TODO：当有softirqd时 唤醒它
-                break;
+                // 处理期间又产生了新的软中断，并且已经用完了预算，交给ksoftirqd处理
+                self.wakeup_ksoftirqd(cpu_id);
             }
+            break;
+        }
+    }
+
+    /// 指定cpu的ksoftirqd是否已经被唤醒
+    fn ksoftirqd_running(&self, cpu_id: ProcessorId) -> bool {
+        let ksoftirqd = self.cpu_data[cpu_id.data() as usize]
+            .ksoftirqd
+            .lock_irqsave();
+        return ksoftirqd.as_ref().map_or(false, |pcb| {
+            pcb.sched_info()
+                .inner_lock_read_irqsave()
+                .state()
+                .is_runnable()
+        });
+    }
+
+    fn wakeup_ksoftirqd(&self, cpu_id: ProcessorId) {
+        let ksoftirqd = self.cpu_data[cpu_id.data() as usize]
+            .ksoftirqd
+            .lock_irqsave()
+            .clone();
+        if let Some(pcb) = ksoftirqd {
+            ProcessManager::wakeup(&pcb).ok();
         }
     }
 
+    /// 获取软中断在指定cpu上被执行的次数
+    pub fn count(&self, cpu_id: ProcessorId, softirq_num: SoftirqNumber) -> u64 {
+        return self.counts[softirq_num as usize].read_cpu(cpu_id);
+    }
+
     pub fn raise_softirq(&self, softirq_num: SoftirqNumber) {
         let guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
         let processor_id = smp_get_processor_id();
@@ -289,3 +378,59 @@ impl<'a> Drop for RunningCountGuard<'a> {
 pub fn do_softirq() {
     softirq_vectors().do_softirq();
 }
+
+/// ksoftirqd线程：在进程上下文中处理中断返回时来不及处理的软中断
+///
+/// 与普通进程一样参与调度，软中断负载很重时，不会使其它进程饿死
+fn ksoftirqd_thread(cpu: usize) -> i32 {
+    let current_pcb = ProcessManager::current_pcb();
+    let cpu_id = ProcessorId::new(cpu as u32);
+    loop {
+        if KernelThreadMechanism::should_stop(&current_pcb) {
+            break;
+        }
+
+        let irq_guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
+        if cpu_pending(cpu_id).is_empty() {
+            ProcessManager::mark_sleep(true).ok();
+            drop(irq_guard);
+            sched();
+            continue;
+        }
+        softirq_vectors().__do_softirq();
+        drop(irq_guard);
+
+        if current_pcb.flags().contains(ProcessFlags::NEED_SCHEDULE) {
+            sched();
+        }
+    }
+    return 0;
+}
+
+/// 为每个cpu创建ksoftirqd线程，并把它固定在对应的cpu上
+#[unified_init(INITCALL_CORE)]
+fn ksoftirqd_init() -> Result<(), SystemError> {
+    let cpu_num = unsafe { smp_get_total_cpu() };
+    for cpu in 0..cpu_num {
+        let closure = KernelThreadClosure::StaticUsizeClosure((
+            &(ksoftirqd_thread as fn(usize) -> i32),
+            cpu as usize,
+        ));
+        let pcb = KernelThreadMechanism::create(closure, format!("ksoftirqd/{}", cpu))
+            .ok_or(SystemError::ENOMEM)?;
+
+        let mut mask = CpuMask::new();
+        mask.set(ProcessorId::new(cpu), true);
+        sched_setaffinity(&pcb, &mask).unwrap_or_else(|e| {
+            kerror!("Failed to bind ksoftirqd/{} to its cpu: {:?}", cpu, e);
+        });
+
+        softirq_vectors().cpu_data[cpu as usize]
+            .ksoftirqd
+            .lock_irqsave()
+            .replace(pcb.clone());
+        ProcessManager::wakeup(&pcb).ok();
+    }
+    kinfo!("ksoftirqd initialized.");
+    return Ok(());
+}
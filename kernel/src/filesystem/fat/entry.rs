@@ -3,7 +3,7 @@ use core::{cmp::min, intrinsics::unlikely};
 use system_error::SystemError;
 
 use crate::{
-    driver::base::block::{block_device::LBA_SIZE, SeekFrom},
+    driver::base::block::{block_device::LBA_SIZE, request_queue::BlkPlug, SeekFrom},
     kwarn,
     libs::vec_cursor::VecCursor,
 };
@@ -105,9 +105,13 @@ impl FATFile {
         let mut in_cluster_offset: u64 = offset % fs.bytes_per_cluster();
         let to_read_size: usize = min(buf.len(), bytes_remain as usize);
 
-        let mut start = 0;
         let mut read_ok = 0;
 
+        // 文件在磁盘上连续的簇会在请求队列中被合并成一个请求
+        let disk = fs.partition.disk();
+        let mut plug = BlkPlug::new(disk.as_ref());
+        let mut remain: &mut [u8] = buf;
+
         loop {
             // 当前簇已经读取完，尝试读取下一个簇
             if in_cluster_offset >= fs.bytes_per_cluster() {
@@ -124,26 +128,24 @@ impl FATFile {
                 to_read_size - read_ok,
                 min(
                     (fs.bytes_per_cluster() - in_cluster_offset) as usize,
-                    buf.len() - read_ok,
+                    remain.len(),
                 ),
             );
 
             //  从磁盘上读取数据
             let offset = fs.cluster_bytes_offset(current_cluster) + in_cluster_offset;
-            let r = fs.partition.disk().read_at_bytes(
-                offset as usize,
-                end_len,
-                &mut buf[start..start + end_len],
-            )?;
+            let (buf_slice, rest) = core::mem::take(&mut remain).split_at_mut(end_len);
+            remain = rest;
+            plug.read_bytes(offset as usize, end_len, buf_slice)?;
 
             // 更新偏移量计数信息
-            read_ok += r;
-            start += r;
-            in_cluster_offset += r as u64;
+            read_ok += end_len;
+            in_cluster_offset += end_len as u64;
             if read_ok == to_read_size {
                 break;
             }
         }
+        plug.finish()?;
         // todo: 更新时间信息
         return Ok(read_ok);
     }
@@ -176,9 +178,12 @@ impl FATFile {
 
         let mut in_cluster_bytes_offset: u64 = offset % fs.bytes_per_cluster();
 
-        let mut start: usize = 0;
         let mut write_ok: usize = 0;
 
+        let disk = fs.partition.disk();
+        let mut plug = BlkPlug::new(disk.as_ref());
+        let mut remain: &[u8] = buf;
+
         // 循环写入数据
         loop {
             if in_cluster_bytes_offset >= fs.bytes_per_cluster() {
@@ -198,21 +203,19 @@ impl FATFile {
             // 计算本次写入位置在磁盘上的偏移量
             let offset = fs.cluster_bytes_offset(current_cluster) + in_cluster_bytes_offset;
             // 写入磁盘
-            let w: usize = fs.partition.disk().write_at_bytes(
-                offset as usize,
-                end_len,
-                &buf[start..start + end_len],
-            )?;
+            let (buf_slice, rest) = remain.split_at(end_len);
+            remain = rest;
+            plug.write_bytes(offset as usize, end_len, buf_slice)?;
 
             // 更新偏移量数据
-            write_ok += w;
-            start += w;
-            in_cluster_bytes_offset += w as u64;
+            write_ok += end_len;
+            in_cluster_bytes_offset += end_len as u64;
 
             if write_ok == buf.len() {
                 break;
             }
         }
+        plug.finish()?;
         // todo: 更新时间信息
         return Ok(write_ok);
     }
@@ -3,6 +3,7 @@ use core::{any::Any, fmt::Debug};
 use system_error::SystemError;
 
 use alloc::{
+    borrow::Cow,
     collections::BTreeMap,
     string::String,
     sync::{Arc, Weak},
@@ -17,6 +18,7 @@ use crate::{
     filesystem::vfs::{
         core::generate_inode_id,
         file::{FileMode, FilePrivateData},
+        page_cache::{PageCache, PageCacheBackend},
         syscall::ModeType,
         FileSystem, FileType, IndexNode, InodeId, Metadata,
     },
@@ -25,6 +27,7 @@ use crate::{
         spinlock::{SpinLock, SpinLockGuard},
         vec_cursor::VecCursor,
     },
+    mm::VirtAddr,
     time::TimeSpec,
 };
 
@@ -109,6 +112,9 @@ pub struct FATInode {
 
     /// 若该节点是特殊文件节点，该字段则为真正的文件节点
     special_node: Option<SpecialNodeData>,
+
+    /// 文件的页缓存（只有普通文件才有）
+    page_cache: Option<Arc<PageCache>>,
 }
 
 impl FATInode {
@@ -203,10 +209,16 @@ impl LockedFATInode {
                 raw_dev: DeviceNumber::default(),
             },
             special_node: None,
+            page_cache: None,
         })));
 
         inode.0.lock().self_ref = Arc::downgrade(&inode);
 
+        if file_type == FileType::File {
+            let owner: Weak<dyn IndexNode> = Arc::downgrade(&inode) as Weak<LockedFATInode>;
+            inode.0.lock().page_cache = Some(PageCache::new(owner));
+        }
+
         inode.0.lock().update_metadata();
 
         return inode;
@@ -251,6 +263,15 @@ impl FileSystem for FATFileSystem {
     fn name(&self) -> &str {
         "fat"
     }
+
+    fn dentry_cacheable(&self) -> bool {
+        return true;
+    }
+
+    /// FAT的文件名大小写不敏感，查找时统一转换为大写（见`FATInode::find`）
+    fn dentry_name<'a>(&self, name: &'a str) -> Cow<'a, str> {
+        return Cow::Owned(name.to_uppercase());
+    }
 }
 
 impl FATFileSystem {
@@ -327,6 +348,7 @@ impl FATFileSystem {
                 raw_dev: DeviceNumber::default(),
             },
             special_node: None,
+            page_cache: None,
         })));
 
         let result: Arc<FATFileSystem> = Arc::new(FATFileSystem {
@@ -1365,22 +1387,57 @@ impl FATFsInfo {
     }
 }
 
+/// FAT文件的页缓存后端：页缓存未命中、写回脏页时，直接读写文件的簇
+struct FATPageCacheBackend<'a> {
+    file: &'a mut FATFile,
+    fs: &'a Arc<FATFileSystem>,
+}
+
+impl PageCacheBackend for FATPageCacheBackend<'_> {
+    fn read_pages(&mut self, offset: usize, buf: &mut [u8]) -> Result<usize, SystemError> {
+        return self.file.read(self.fs, buf, offset as u64);
+    }
+
+    fn write_pages(&mut self, offset: usize, buf: &[u8]) -> Result<usize, SystemError> {
+        return self.file.write(self.fs, buf, offset as u64);
+    }
+}
+
 impl IndexNode for LockedFATInode {
     fn read_at(
         &self,
         offset: usize,
         len: usize,
         buf: &mut [u8],
-        _data: &mut FilePrivateData,
+        data: &mut FilePrivateData,
     ) -> Result<usize, SystemError> {
+        // 持有inode的自旋锁时不能访问用户内存：缺页处理可能要等待其他CPU，而它们可能正在等待这把锁。
+        // 因此用户缓冲区先经过内核缓冲区中转
+        if VirtAddr::new(buf.as_ptr() as usize).check_user() {
+            let mut kbuf: Vec<u8> = vec![0; len];
+            let r = self.read_at(offset, len, &mut kbuf, data)?;
+            buf[..r].copy_from_slice(&kbuf[..r]);
+            return Ok(r);
+        }
+
         let mut guard: SpinLockGuard<FATInode> = self.0.lock();
-        match &guard.inode_type {
+        let fs: &Arc<FATFileSystem> = &guard.fs.upgrade().unwrap();
+        let page_cache = guard.page_cache.clone();
+
+        match &mut guard.inode_type {
             FATDirEntry::File(f) | FATDirEntry::VolId(f) => {
-                let r = f.read(
-                    &guard.fs.upgrade().unwrap(),
-                    &mut buf[0..len],
-                    offset as u64,
-                );
+                let r = match page_cache {
+                    Some(cache) => {
+                        let size = f.size() as usize;
+                        cache.read(
+                            offset,
+                            &mut buf[0..len],
+                            size,
+                            &mut FATPageCacheBackend { file: f, fs },
+                        )
+                    }
+                    None => f.read(fs, &mut buf[0..len], offset as u64),
+                };
                 guard.update_metadata();
                 return r;
             }
@@ -1399,14 +1456,39 @@ impl IndexNode for LockedFATInode {
         offset: usize,
         len: usize,
         buf: &[u8],
-        _data: &mut FilePrivateData,
+        data: &mut FilePrivateData,
     ) -> Result<usize, SystemError> {
+        // 与read_at相同，不在持有inode的锁时访问用户内存
+        if VirtAddr::new(buf.as_ptr() as usize).check_user() {
+            let kbuf: Vec<u8> = buf[0..len].to_vec();
+            return self.write_at(offset, len, &kbuf, data);
+        }
+
         let mut guard: SpinLockGuard<FATInode> = self.0.lock();
         let fs: &Arc<FATFileSystem> = &guard.fs.upgrade().unwrap();
+        let page_cache = guard.page_cache.clone();
 
         match &mut guard.inode_type {
             FATDirEntry::File(f) | FATDirEntry::VolId(f) => {
-                let r = f.write(fs, &buf[0..len], offset as u64);
+                let size = f.size() as usize;
+                let r = match page_cache {
+                    // 不改变文件大小的写入，只写到页缓存中
+                    Some(cache) if offset + len <= size => cache.write(
+                        offset,
+                        &buf[0..len],
+                        size,
+                        &mut FATPageCacheBackend { file: f, fs },
+                    ),
+                    // 需要扩展文件的写入，直接写到磁盘上（需要分配簇），并更新页缓存
+                    Some(cache) => {
+                        let r = f.write(fs, &buf[0..len], offset as u64);
+                        if r.is_ok() {
+                            cache.update(offset, &buf[0..len]);
+                        }
+                        r
+                    }
+                    None => f.write(fs, &buf[0..len], offset as u64),
+                };
                 guard.update_metadata();
                 return r;
             }
@@ -1469,6 +1551,7 @@ impl IndexNode for LockedFATInode {
         let mut guard: SpinLockGuard<FATInode> = self.0.lock();
         let fs: &Arc<FATFileSystem> = &guard.fs.upgrade().unwrap();
         let old_size = guard.metadata.size as usize;
+        let page_cache = guard.page_cache.clone();
 
         match &mut guard.inode_type {
             FATDirEntry::File(file) | FATDirEntry::VolId(file) => {
@@ -1491,6 +1574,9 @@ impl IndexNode for LockedFATInode {
                         offset += write_size;
                     }
                 } else {
+                    if let Some(cache) = page_cache {
+                        cache.truncate(len);
+                    }
                     file.truncate(fs, len as u64)?;
                 }
                 guard.update_metadata();
@@ -1504,6 +1590,23 @@ impl IndexNode for LockedFATInode {
         }
     }
 
+    fn sync(&self) -> Result<(), SystemError> {
+        let mut guard: SpinLockGuard<FATInode> = self.0.lock();
+        let fs: &Arc<FATFileSystem> = &guard.fs.upgrade().unwrap();
+        let page_cache = match guard.page_cache.clone() {
+            Some(cache) => cache,
+            None => return Ok(()),
+        };
+
+        match &mut guard.inode_type {
+            FATDirEntry::File(f) | FATDirEntry::VolId(f) => {
+                let size = f.size() as usize;
+                return page_cache.sync(size, &mut FATPageCacheBackend { file: f, fs });
+            }
+            _ => return Ok(()),
+        }
+    }
+
     fn truncate(&self, len: usize) -> Result<(), SystemError> {
         let guard: SpinLockGuard<FATInode> = self.0.lock();
         let old_size = guard.metadata.size as usize;
@@ -1603,6 +1706,12 @@ impl IndexNode for LockedFATInode {
 
         // 再从磁盘删除
         let r = dir.remove(guard.fs.upgrade().unwrap().clone(), name, true);
+        // 文件的簇已经被释放，丢弃页缓存中的页面，避免脏页被写回到已经释放的簇中
+        if r.is_ok() {
+            if let Some(cache) = &target_guard.page_cache {
+                cache.truncate(0);
+            }
+        }
         drop(target_guard);
         return r;
     }
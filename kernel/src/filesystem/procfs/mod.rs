@@ -8,22 +8,27 @@ use alloc::{
     sync::{Arc, Weak},
     vec::Vec,
 };
+use num_traits::FromPrimitive;
 use system_error::SystemError;
 
 use crate::{
     arch::mm::LockedFrameAllocator,
     driver::base::device::device_number::DeviceNumber,
+    exception::softirq::{softirq_vectors, SoftirqNumber, MAX_SOFTIRQ_NUM},
     filesystem::vfs::{
         core::{generate_inode_id, ROOT_INODE},
         FileType,
     },
+    include::bindings::bindings::smp_get_total_cpu,
     kerror, kinfo,
     libs::{
         once::Once,
-        spinlock::{SpinLock, SpinLockGuard},
+        spinlock::{lock_classes, SpinLock, SpinLockGuard},
     },
     mm::allocator::page_frame::FrameAllocator,
     process::{Pid, ProcessManager},
+    sched::stat::{sched_stat_show, sched_trace_show, task_sched_stat_show},
+    smp::cpu::ProcessorId,
     time::TimeSpec,
 };
 
@@ -48,6 +53,16 @@ pub enum ProcFileType {
     ProcMeminfo = 1,
     /// kmsg
     ProcKmsg = 2,
+    /// 每个cpu上各个软中断被执行的次数
+    ProcSoftirqs = 3,
+    /// 自旋锁的竞争情况
+    ProcLockStat = 4,
+    /// 每个cpu的调度统计信息以及延迟直方图
+    ProcSchedStat = 5,
+    /// 最近的调度事件
+    ProcSchedTrace = 6,
+    /// 进程的调度统计信息
+    ProcPidSchedStat = 7,
     //todo: 其他文件类型
     ///默认文件类型
     Default,
@@ -59,6 +74,11 @@ impl From<u8> for ProcFileType {
             0 => ProcFileType::ProcStatus,
             1 => ProcFileType::ProcMeminfo,
             2 => ProcFileType::ProcKmsg,
+            3 => ProcFileType::ProcSoftirqs,
+            4 => ProcFileType::ProcLockStat,
+            5 => ProcFileType::ProcSchedStat,
+            6 => ProcFileType::ProcSchedTrace,
+            7 => ProcFileType::ProcPidSchedStat,
             _ => ProcFileType::Default,
         }
     }
@@ -243,6 +263,118 @@ impl ProcFSInode {
         return Ok((data.len() * size_of::<u8>()) as i64);
     }
 
+    /// 打开 softirqs 文件
+    fn open_softirqs(&self, pdata: &mut ProcfsFilePrivateData) -> Result<i64, SystemError> {
+        let cpu_num = unsafe { smp_get_total_cpu() };
+        let data: &mut Vec<u8> = &mut pdata.data;
+
+        let mut header = format!("{:>16}", "");
+        for cpu in 0..cpu_num {
+            header.push_str(&format!("{:>11}", format!("CPU{}", cpu)));
+        }
+        header.push('\n');
+        data.append(&mut header.as_bytes().to_owned());
+
+        for nr in 0..MAX_SOFTIRQ_NUM {
+            let softirq_num = match SoftirqNumber::from_u64(nr) {
+                Some(softirq_num) => softirq_num,
+                None => continue,
+            };
+            let mut line = format!("{:>15}:", softirq_num.name());
+            for cpu in 0..cpu_num {
+                let count = softirq_vectors().count(ProcessorId::new(cpu), softirq_num);
+                line.push_str(&format!("{:>11}", count));
+            }
+            line.push('\n');
+            data.append(&mut line.as_bytes().to_owned());
+        }
+
+        // 去除多余的\0
+        self.trim_string(data);
+
+        return Ok((data.len() * size_of::<u8>()) as i64);
+    }
+
+    /// 打开 lock_stat 文件
+    fn open_lock_stat(&self, pdata: &mut ProcfsFilePrivateData) -> Result<i64, SystemError> {
+        let data: &mut Vec<u8> = &mut pdata.data;
+        data.append(
+            &mut format!(
+                "{:<20}{:>16}{:>16}{:>20}{:>16}{:>16}\n",
+                "class", "acquisitions", "contentions", "spins", "max_hold_ns", "avg_hold_ns"
+            )
+            .as_bytes()
+            .to_owned(),
+        );
+        for class in lock_classes() {
+            let acquisitions = class.acquisitions();
+            let avg_hold_ns = if acquisitions > 0 {
+                class.total_hold_ns() / acquisitions
+            } else {
+                0
+            };
+            data.append(
+                &mut format!(
+                    "{:<20}{:>16}{:>16}{:>20}{:>16}{:>16}\n",
+                    class.name(),
+                    acquisitions,
+                    class.contentions(),
+                    class.spins(),
+                    class.max_hold_ns(),
+                    avg_hold_ns
+                )
+                .as_bytes()
+                .to_owned(),
+            );
+        }
+
+        // 去除多余的\0
+        self.trim_string(data);
+
+        return Ok((data.len() * size_of::<u8>()) as i64);
+    }
+
+    /// 打开 schedstat 文件
+    fn open_sched_stat(&self, pdata: &mut ProcfsFilePrivateData) -> Result<i64, SystemError> {
+        let data: &mut Vec<u8> = &mut pdata.data;
+        data.append(&mut sched_stat_show().as_bytes().to_owned());
+
+        // 去除多余的\0
+        self.trim_string(data);
+
+        return Ok((data.len() * size_of::<u8>()) as i64);
+    }
+
+    /// 打开 sched_trace 文件
+    fn open_sched_trace(&self, pdata: &mut ProcfsFilePrivateData) -> Result<i64, SystemError> {
+        let data: &mut Vec<u8> = &mut pdata.data;
+        data.append(&mut sched_trace_show().as_bytes().to_owned());
+
+        // 去除多余的\0
+        self.trim_string(data);
+
+        return Ok((data.len() * size_of::<u8>()) as i64);
+    }
+
+    /// 打开进程的 schedstat 文件
+    fn open_pid_sched_stat(&self, pdata: &mut ProcfsFilePrivateData) -> Result<i64, SystemError> {
+        let pid = self.fdata.pid;
+        let pcb = ProcessManager::find(pid).ok_or_else(|| {
+            kerror!(
+                "ProcFS: Cannot find pcb for pid {:?} when opening its 'schedstat' file.",
+                pid
+            );
+            SystemError::ESRCH
+        })?;
+        let data: &mut Vec<u8> = &mut pdata.data;
+        data.append(&mut task_sched_stat_show(&pcb).as_bytes().to_owned());
+
+        // 去除多余的\0
+        self.trim_string(data);
+
+        return Ok((data.len() * size_of::<u8>()) as i64);
+    }
+
     /// proc文件系统读取函数
     fn proc_read(
         &self,
@@ -359,6 +491,74 @@ impl ProcFS {
             panic!("create ksmg error");
         }
 
+        // 创建softirqs文件
+        let binding = inode.create(
+            "softirqs",
+            FileType::File,
+            ModeType::from_bits_truncate(0o444),
+        );
+        if let Ok(softirqs) = binding {
+            let softirqs_file = softirqs
+                .as_any_ref()
+                .downcast_ref::<LockedProcFSInode>()
+                .unwrap();
+            softirqs_file.0.lock().fdata.pid = Pid::new(0);
+            softirqs_file.0.lock().fdata.ftype = ProcFileType::ProcSoftirqs;
+        } else {
+            panic!("create softirqs error");
+        }
+
+        // 创建lock_stat文件
+        let binding = inode.create(
+            "lock_stat",
+            FileType::File,
+            ModeType::from_bits_truncate(0o444),
+        );
+        if let Ok(lock_stat) = binding {
+            let lock_stat_file = lock_stat
+                .as_any_ref()
+                .downcast_ref::<LockedProcFSInode>()
+                .unwrap();
+            lock_stat_file.0.lock().fdata.pid = Pid::new(0);
+            lock_stat_file.0.lock().fdata.ftype = ProcFileType::ProcLockStat;
+        } else {
+            panic!("create lock_stat error");
+        }
+
+        // 创建schedstat文件
+        let binding = inode.create(
+            "schedstat",
+            FileType::File,
+            ModeType::from_bits_truncate(0o444),
+        );
+        if let Ok(sched_stat) = binding {
+            let sched_stat_file = sched_stat
+                .as_any_ref()
+                .downcast_ref::<LockedProcFSInode>()
+                .unwrap();
+            sched_stat_file.0.lock().fdata.pid = Pid::new(0);
+            sched_stat_file.0.lock().fdata.ftype = ProcFileType::ProcSchedStat;
+        } else {
+            panic!("create schedstat error");
+        }
+
+        // 创建sched_trace文件
+        let binding = inode.create(
+            "sched_trace",
+            FileType::File,
+            ModeType::from_bits_truncate(0o444),
+        );
+        if let Ok(sched_trace) = binding {
+            let sched_trace_file = sched_trace
+                .as_any_ref()
+                .downcast_ref::<LockedProcFSInode>()
+                .unwrap();
+            sched_trace_file.0.lock().fdata.pid = Pid::new(0);
+            sched_trace_file.0.lock().fdata.ftype = ProcFileType::ProcSchedTrace;
+        } else {
+            panic!("create sched_trace error");
+        }
+
         return result;
     }
 
@@ -387,6 +587,19 @@ impl ProcFS {
         status_file.0.lock().fdata.pid = pid;
         status_file.0.lock().fdata.ftype = ProcFileType::ProcStatus;
 
+        // schedstat文件
+        let binding: Arc<dyn IndexNode> = pid_dir.create(
+            "schedstat",
+            FileType::File,
+            ModeType::from_bits_truncate(0o444),
+        )?;
+        let sched_stat_file: &LockedProcFSInode = binding
+            .as_any_ref()
+            .downcast_ref::<LockedProcFSInode>()
+            .unwrap();
+        sched_stat_file.0.lock().fdata.pid = pid;
+        sched_stat_file.0.lock().fdata.ftype = ProcFileType::ProcPidSchedStat;
+
         //todo: 创建其他文件
 
         return Ok(());
@@ -401,6 +614,7 @@ impl ProcFS {
         let pid_dir: Arc<dyn IndexNode> = proc.find(&pid.to_string())?;
         // 删除进程文件夹下文件
         pid_dir.unlink("status")?;
+        pid_dir.unlink("schedstat")?;
 
         // 查看进程文件是否还存在
         // let pf= pid_dir.find("status").expect("Cannot find status");
@@ -426,6 +640,11 @@ impl IndexNode for LockedProcFSInode {
         let file_size = match inode.fdata.ftype {
             ProcFileType::ProcStatus => inode.open_status(&mut private_data)?,
             ProcFileType::ProcMeminfo => inode.open_meminfo(&mut private_data)?,
+            ProcFileType::ProcSoftirqs => inode.open_softirqs(&mut private_data)?,
+            ProcFileType::ProcLockStat => inode.open_lock_stat(&mut private_data)?,
+            ProcFileType::ProcSchedStat => inode.open_sched_stat(&mut private_data)?,
+            ProcFileType::ProcSchedTrace => inode.open_sched_trace(&mut private_data)?,
+            ProcFileType::ProcPidSchedStat => inode.open_pid_sched_stat(&mut private_data)?,
             _ => {
                 todo!()
             }
@@ -479,6 +698,13 @@ impl IndexNode for LockedProcFSInode {
         match inode.fdata.ftype {
             ProcFileType::ProcStatus => return inode.proc_read(offset, len, buf, private_data),
             ProcFileType::ProcMeminfo => return inode.proc_read(offset, len, buf, private_data),
+            ProcFileType::ProcSoftirqs => return inode.proc_read(offset, len, buf, private_data),
+            ProcFileType::ProcLockStat => return inode.proc_read(offset, len, buf, private_data),
+            ProcFileType::ProcSchedStat => return inode.proc_read(offset, len, buf, private_data),
+            ProcFileType::ProcSchedTrace => return inode.proc_read(offset, len, buf, private_data),
+            ProcFileType::ProcPidSchedStat => {
+                return inode.proc_read(offset, len, buf, private_data)
+            }
             ProcFileType::ProcKmsg => (),
             ProcFileType::Default => (),
         };
@@ -80,6 +80,10 @@ impl FileSystem for RamFS {
     fn name(&self) -> &str {
         "ramfs"
     }
+
+    fn dentry_cacheable(&self) -> bool {
+        return true;
+    }
 }
 
 impl RamFS {
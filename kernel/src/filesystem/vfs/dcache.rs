@@ -0,0 +1,264 @@
+//! 目录项缓存（dentry cache）
+//!
+//! 缓存“(父目录, 文件名) -> 子inode”的查找结果，使得路径查找在命中缓存时，
+//! 每一级只需要一次哈希表查找，而不需要调用`IndexNode::find`和`IndexNode::metadata`。
+//!
+//! - 父目录由`DirKey`（所在的MountFS的编号 + inode号）标识
+//! - 查找失败（ENOENT）的结果也会被缓存（负缓存）
+//! - 缓存项的数量超过上限时，按照LRU的顺序淘汰
+//!
+//! 只有在MountFS中进行的查找才会被缓存，并且所在的文件系统需要通过`FileSystem::dentry_cacheable`声明：
+//! 目录项只会通过VFS被创建、删除。MountFSInode在创建、删除、重命名目录项时使对应的缓存项失效。
+//! 缓存项的文件名经过`FileSystem::dentry_name`转换，大小写不敏感的文件系统中同一个目录项只有一个缓存项。
+
+use core::hash::{BuildHasher, Hash, Hasher};
+
+use alloc::{
+    collections::BTreeMap,
+    string::{String, ToString},
+    sync::Arc,
+};
+use hashbrown::{hash_map::RawEntryMut, HashMap};
+use system_error::SystemError;
+
+use crate::libs::spinlock::SpinLock;
+
+use super::{mount::MountFSInode, FileType, IndexNode, InodeId};
+
+/// 目录项缓存最多缓存的目录项数量
+const DCACHE_MAX_ENTRIES: usize = 8192;
+
+lazy_static! {
+    static ref DCACHE: SpinLock<DentryCache> = SpinLock::new(DentryCache::new());
+}
+
+/// 目录在目录项缓存中的标识
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct DirKey {
+    /// 目录所在的MountFS的编号
+    mount_id: usize,
+    /// 目录的inode号
+    inode_id: InodeId,
+}
+
+impl DirKey {
+    pub fn new(mount_id: usize, inode_id: InodeId) -> Self {
+        Self { mount_id, inode_id }
+    }
+
+    /// 获取inode在目录项缓存中的标识
+    ///
+    /// ## 返回值
+    ///
+    /// 如果inode不在MountFS中，或者它所在的文件系统不支持目录项缓存，返回None
+    pub fn of(inode: &Arc<dyn IndexNode>, inode_id: InodeId) -> Option<Self> {
+        return inode
+            .downcast_ref::<MountFSInode>()
+            .and_then(|i| i.dir_key(inode_id));
+    }
+}
+
+/// 一次查找的结果
+#[derive(Debug, Clone)]
+pub struct Dentry {
+    pub inode: Arc<dyn IndexNode>,
+    pub file_type: FileType,
+    /// 如果inode是一个目录，那么这是它在目录项缓存中的标识
+    pub key: Option<DirKey>,
+}
+
+#[derive(Debug, PartialEq, Eq, Hash)]
+struct DentryKey {
+    dir: DirKey,
+    name: String,
+}
+
+#[derive(Debug)]
+struct DentryEntry {
+    /// None表示这是一个负缓存项
+    dentry: Option<Dentry>,
+    /// 最近一次被访问的时间戳（LRU）
+    stamp: u64,
+}
+
+#[derive(Debug)]
+struct DentryCache {
+    entries: HashMap<DentryKey, DentryEntry>,
+    /// 时间戳 -> 缓存项，时间戳最小的缓存项最先被淘汰
+    lru: BTreeMap<u64, DentryKey>,
+    next_stamp: u64,
+    /// 每次有缓存项失效，该值加1。
+    /// 用于防止在查找期间目录项被删除时，把已经过时的查找结果插入到缓存中
+    generation: u64,
+}
+
+impl DentryCache {
+    fn new() -> Self {
+        Self {
+            entries: HashMap::new(),
+            lru: BTreeMap::new(),
+            next_stamp: 0,
+            generation: 0,
+        }
+    }
+
+    fn hash(&self, dir: DirKey, name: &str) -> u64 {
+        // 与DentryKey的Hash实现保持一致（String和str的哈希值相同）
+        let mut hasher = self.entries.hasher().build_hasher();
+        dir.hash(&mut hasher);
+        name.hash(&mut hasher);
+        return hasher.finish();
+    }
+
+    /// 查找缓存项
+    ///
+    /// ## 返回值
+    ///
+    /// - `None` - 缓存未命中
+    /// - `Some(None)` - 命中负缓存项
+    /// - `Some(Some(dentry))` - 命中
+    fn get(&mut self, dir: DirKey, name: &str) -> Option<Option<Dentry>> {
+        let hash = self.hash(dir, name);
+        let stamp = self.next_stamp;
+        let entry = self
+            .entries
+            .raw_entry_mut()
+            .from_hash(hash, |k| k.dir == dir && k.name == name);
+        if let RawEntryMut::Occupied(mut e) = entry {
+            let old_stamp = core::mem::replace(&mut e.get_mut().stamp, stamp);
+            let dentry = e.get().dentry.clone();
+            self.next_stamp += 1;
+            let key = self.lru.remove(&old_stamp).unwrap();
+            self.lru.insert(stamp, key);
+            return Some(dentry);
+        }
+        return None;
+    }
+
+    fn insert(&mut self, dir: DirKey, name: &str, dentry: Option<Dentry>) {
+        let hash = self.hash(dir, name);
+        let stamp = self.next_stamp;
+        self.next_stamp += 1;
+
+        let entry = self
+            .entries
+            .raw_entry_mut()
+            .from_hash(hash, |k| k.dir == dir && k.name == name);
+        match entry {
+            RawEntryMut::Occupied(mut e) => {
+                let old_stamp = core::mem::replace(&mut e.get_mut().stamp, stamp);
+                e.get_mut().dentry = dentry;
+                let key = self.lru.remove(&old_stamp).unwrap();
+                self.lru.insert(stamp, key);
+            }
+            RawEntryMut::Vacant(e) => {
+                let key = DentryKey {
+                    dir,
+                    name: name.to_string(),
+                };
+                self.lru.insert(
+                    stamp,
+                    DentryKey {
+                        dir,
+                        name: key.name.clone(),
+                    },
+                );
+                e.insert_hashed_nocheck(hash, key, DentryEntry { dentry, stamp });
+            }
+        }
+
+        while self.entries.len() > DCACHE_MAX_ENTRIES {
+            let (_, key) = self.lru.pop_first().unwrap();
+            self.entries.remove(&key);
+        }
+    }
+
+    fn remove(&mut self, dir: DirKey, name: &str) {
+        let hash = self.hash(dir, name);
+        let entry = self
+            .entries
+            .raw_entry_mut()
+            .from_hash(hash, |k| k.dir == dir && k.name == name);
+        if let RawEntryMut::Occupied(e) = entry {
+            let (_, removed) = e.remove_entry();
+            self.lru.remove(&removed.stamp);
+        }
+        self.generation += 1;
+    }
+
+    fn clear(&mut self) {
+        self.entries.clear();
+        self.lru.clear();
+        self.generation += 1;
+    }
+}
+
+/// 在目录中查找一个目录项，优先使用目录项缓存
+///
+/// ## 参数
+///
+/// - `parent` - 要在其中进行查找的目录
+/// - `parent_key` - 目录在目录项缓存中的标识（为None则不使用缓存）
+/// - `name` - 要查找的文件名
+pub fn dcache_find(
+    parent: &Arc<dyn IndexNode>,
+    parent_key: Option<DirKey>,
+    name: &str,
+) -> Result<Dentry, SystemError> {
+    let dir = match parent_key {
+        Some(dir) if name != "." && name != ".." => dir,
+        _ => return do_find(parent, name),
+    };
+    let fs = parent.fs();
+    let key_name = fs.dentry_name(name);
+
+    let generation = {
+        let mut cache = DCACHE.lock();
+        match cache.get(dir, &key_name) {
+            Some(Some(dentry)) => return Ok(dentry),
+            Some(None) => return Err(SystemError::ENOENT),
+            None => cache.generation,
+        }
+    };
+
+    let r = do_find(parent, name);
+    let dentry = match &r {
+        Ok(dentry) => Some(dentry.clone()),
+        Err(SystemError::ENOENT) => None,
+        Err(_) => return r,
+    };
+
+    let mut cache = DCACHE.lock();
+    // 查找期间有目录项失效，结果可能已经过时，不缓存
+    if cache.generation == generation {
+        cache.insert(dir, &key_name, dentry);
+    }
+    return r;
+}
+
+fn do_find(parent: &Arc<dyn IndexNode>, name: &str) -> Result<Dentry, SystemError> {
+    let inode = parent.find(name)?;
+    let metadata = inode.metadata()?;
+    let key = if metadata.file_type == FileType::Dir {
+        DirKey::of(&inode, metadata.inode_id)
+    } else {
+        None
+    };
+    return Ok(Dentry {
+        inode,
+        file_type: metadata.file_type,
+        key,
+    });
+}
+
+/// 目录中的一个目录项被创建、删除或者重命名时，使对应的缓存项失效
+///
+/// `name`需要经过`FileSystem::dentry_name`转换
+pub fn dcache_invalidate(dir: DirKey, name: &str) {
+    DCACHE.lock().remove(dir, name);
+}
+
+/// 清空目录项缓存（挂载、卸载文件系统时，路径查找的结果可能发生变化）
+pub fn dcache_invalidate_all() {
+    DCACHE.lock().clear();
+}
@@ -1,13 +1,15 @@
 pub mod core;
+pub mod dcache;
 pub mod fcntl;
 pub mod file;
 pub mod mount;
 pub mod open;
+pub mod page_cache;
 pub mod syscall;
 mod utils;
 
 use ::core::{any::Any, fmt::Debug, sync::atomic::AtomicUsize};
-use alloc::{string::String, sync::Arc, vec::Vec};
+use alloc::{borrow::Cow, string::String, sync::Arc, vec::Vec};
 use system_error::SystemError;
 
 use crate::{
@@ -19,7 +21,13 @@ use crate::{
     time::TimeSpec,
 };
 
-use self::{core::generate_inode_id, file::FileMode, syscall::ModeType};
+use self::{
+    core::generate_inode_id,
+    dcache::{dcache_find, DirKey},
+    file::FileMode,
+    syscall::ModeType,
+    utils::PathComponents,
+};
 pub use self::{core::ROOT_INODE, file::FilePrivateData, mount::MountFS};
 
 /// vfs容许的最大的路径名称长度
@@ -381,6 +389,14 @@ pub trait IndexNode: Any + Sync + Send + Debug {
         return Err(SystemError::EOPNOTSUPP_OR_ENOTSUP);
     }
 
+    /// @brief 卸载以当前Inode为根目录的文件系统
+    /// 请注意！该函数只能被MountFS实现，其他文件系统不应实现这个函数
+    ///
+    /// @return 被卸载的文件系统
+    fn umount(&self) -> Result<Arc<MountFS>, SystemError> {
+        return Err(SystemError::EOPNOTSUPP_OR_ENOTSUP);
+    }
+
     /// @brief 截断当前inode到指定的长度。如果当前文件长度小于len,则不操作。
     ///
     /// @param len 要被截断到的目标长度
@@ -452,60 +468,46 @@ impl dyn IndexNode {
 
         // 处理绝对路径
         // result: 上一个被找到的inode
-        // rest_path: 还没有查找的路径
-        let (mut result, mut rest_path) = if let Some(rest) = path.strip_prefix('/') {
-            (ROOT_INODE().clone(), String::from(rest))
+        let mut result = if path.starts_with('/') {
+            ROOT_INODE()
         } else {
             // 是相对路径
-            (self.find(".")?, String::from(path))
+            self.find(".")?
         };
+        // result在目录项缓存中的标识，以及它的类型
+        let mut result_key = DirKey::of(&result, result.metadata()?.inode_id);
+        let mut result_type = FileType::Dir;
 
         // 逐级查找文件
-        while !rest_path.is_empty() {
+        let mut components = PathComponents::new(path);
+        while let Some(name) = components.next() {
             // 当前这一级不是文件夹
-            if result.metadata()?.file_type != FileType::Dir {
+            if result_type != FileType::Dir {
                 return Err(SystemError::ENOTDIR);
             }
 
-            let name;
-
-            // 寻找“/”
-            match rest_path.find('/') {
-                Some(pos) => {
-                    // 找到了，设置下一个要查找的名字
-                    name = String::from(&rest_path[0..pos]);
-                    // 剩余的路径字符串
-                    rest_path = String::from(&rest_path[pos + 1..]);
-                }
-                None => {
-                    name = rest_path;
-                    rest_path = String::new();
-                }
-            }
-
-            // 遇到连续多个"/"的情况
-            if name.is_empty() {
-                continue;
-            }
-
-            let inode = result.find(&name)?;
+            let dentry = dcache_find(&result, result_key, name)?;
 
             // 处理符号链接的问题
-            if inode.metadata()?.file_type == FileType::SymLink && max_follow_times > 0 {
+            if dentry.file_type == FileType::SymLink && max_follow_times > 0 {
                 let mut content = [0u8; 256];
                 // 读取符号链接
-                let len = inode.read_at(0, 256, &mut content, &mut FilePrivateData::Unused)?;
+                let len = dentry
+                    .inode
+                    .read_at(0, 256, &mut content, &mut FilePrivateData::Unused)?;
 
                 // 将读到的数据转换为utf8字符串（先转为str，再转为String）
                 let link_path = String::from(
                     ::core::str::from_utf8(&content[..len]).map_err(|_| SystemError::ENOTDIR)?,
                 );
 
-                let new_path = link_path + "/" + &rest_path;
+                let new_path = link_path + "/" + components.rest();
                 // 继续查找符号链接
                 return result.lookup_follow_symlink(&new_path, max_follow_times - 1);
             } else {
-                result = inode;
+                result = dentry.inode;
+                result_key = dentry.key;
+                result_type = dentry.file_type;
             }
         }
 
@@ -597,6 +599,21 @@ pub trait FileSystem: Any + Sync + Send + Debug {
     fn as_any_ref(&self) -> &dyn Any;
 
     fn name(&self) -> &str;
+
+    /// @brief 路径查找的结果能否被目录项缓存所缓存
+    ///
+    /// 如果文件系统的目录项可能不经过VFS被创建、删除（例如procfs、devfs），则不能被缓存
+    fn dentry_cacheable(&self) -> bool {
+        return false;
+    }
+
+    /// @brief 文件名在目录项缓存中的形式
+    ///
+    /// 文件名大小写不敏感的文件系统需要返回统一大小写之后的文件名，
+    /// 使得同一个目录项的不同写法在缓存中对应同一个缓存项
+    fn dentry_name<'a>(&self, name: &'a str) -> Cow<'a, str> {
+        return Cow::Borrowed(name);
+    }
 }
 
 impl DowncastArc for dyn FileSystem {
@@ -1,9 +1,10 @@
 use core::{
     any::Any,
-    sync::atomic::{compiler_fence, Ordering},
+    sync::atomic::{compiler_fence, AtomicUsize, Ordering},
 };
 
 use alloc::{
+    borrow::Cow,
     collections::BTreeMap,
     sync::{Arc, Weak},
 };
@@ -12,9 +13,16 @@ use system_error::SystemError;
 use crate::{driver::base::device::device_number::DeviceNumber, libs::spinlock::SpinLock};
 
 use super::{
-    file::FileMode, syscall::ModeType, FilePrivateData, FileSystem, FileType, IndexNode, InodeId,
+    dcache::{dcache_invalidate, dcache_invalidate_all, DirKey},
+    file::FileMode,
+    page_cache::page_cache_sync_all,
+    syscall::ModeType,
+    FilePrivateData, FileSystem, FileType, IndexNode, InodeId,
 };
 
+/// 下一个MountFS的编号
+static NEXT_MOUNT_ID: AtomicUsize = AtomicUsize::new(0);
+
 /// @brief 挂载文件系统
 /// 挂载文件系统的时候，套了MountFS这一层，以实现文件系统的递归挂载
 #[derive(Debug)]
@@ -27,6 +35,10 @@ pub struct MountFS {
     self_mountpoint: Option<Arc<MountFSInode>>,
     /// 指向当前MountFS的弱引用
     self_ref: Weak<MountFS>,
+    /// MountFS的编号，用于在目录项缓存中标识目录
+    mount_id: usize,
+    /// 内部的文件系统是否支持目录项缓存
+    dentry_cacheable: bool,
 }
 
 /// @brief MountFS的Index Node 注意，这个IndexNode只是一个中间层。它的目的是将具体文件系统的Inode与挂载机制连接在一起。
@@ -45,11 +57,14 @@ impl MountFS {
         inner_fs: Arc<dyn FileSystem>,
         self_mountpoint: Option<Arc<MountFSInode>>,
     ) -> Arc<Self> {
+        let dentry_cacheable = inner_fs.dentry_cacheable();
         return MountFS {
             inner_filesystem: inner_fs,
             mountpoints: SpinLock::new(BTreeMap::new()),
             self_mountpoint: self_mountpoint,
             self_ref: Weak::default(),
+            mount_id: NEXT_MOUNT_ID.fetch_add(1, Ordering::Relaxed),
+            dentry_cacheable,
         }
         .wrap();
     }
@@ -109,6 +124,29 @@ impl MountFSInode {
         }
     }
 
+    /// @brief 获取当前inode（inode号为inode_id）在目录项缓存中的标识
+    ///
+    /// @return 如果当前inode所在的文件系统不支持目录项缓存，返回None
+    pub(super) fn dir_key(&self, inode_id: InodeId) -> Option<DirKey> {
+        if !self.mount_fs.dentry_cacheable {
+            return None;
+        }
+        return Some(DirKey::new(self.mount_fs.mount_id, inode_id));
+    }
+
+    /// @brief 当前目录下名为name的目录项被创建、删除或者重命名后，使目录项缓存中对应的缓存项失效
+    fn invalidate_dentry(&self, name: &str) {
+        if !self.mount_fs.dentry_cacheable {
+            return;
+        }
+        if let Ok(metadata) = self.inner_inode.metadata() {
+            dcache_invalidate(
+                DirKey::new(self.mount_fs.mount_id, metadata.inode_id),
+                &self.mount_fs.inner_filesystem.dentry_name(name),
+            );
+        }
+    }
+
     /// @brief 判断当前inode是否为它所在的文件系统的root inode
     fn is_mountpoint_root(&self) -> Result<bool, SystemError> {
         return Ok(self.inner_inode.fs().root_inode().metadata()?.inode_id
@@ -147,10 +185,12 @@ impl IndexNode for MountFSInode {
         mode: ModeType,
         data: usize,
     ) -> Result<Arc<dyn IndexNode>, SystemError> {
+        let inner_inode = self
+            .inner_inode
+            .create_with_data(name, file_type, mode, data);
+        self.invalidate_dentry(name);
         return Ok(MountFSInode {
-            inner_inode: self
-                .inner_inode
-                .create_with_data(name, file_type, mode, data)?,
+            inner_inode: inner_inode?,
             mount_fs: self.mount_fs.clone(),
             self_ref: Weak::default(),
         }
@@ -206,6 +246,10 @@ impl IndexNode for MountFSInode {
         return self.inner_inode.resize(len);
     }
 
+    fn sync(&self) -> Result<(), SystemError> {
+        return self.inner_inode.sync();
+    }
+
     #[inline]
     fn create(
         &self,
@@ -213,8 +257,10 @@ impl IndexNode for MountFSInode {
         file_type: FileType,
         mode: ModeType,
     ) -> Result<Arc<dyn IndexNode>, SystemError> {
+        let inner_inode = self.inner_inode.create(name, file_type, mode);
+        self.invalidate_dentry(name);
         return Ok(MountFSInode {
-            inner_inode: self.inner_inode.create(name, file_type, mode)?,
+            inner_inode: inner_inode?,
             mount_fs: self.mount_fs.clone(),
             self_ref: Weak::default(),
         }
@@ -222,7 +268,9 @@ impl IndexNode for MountFSInode {
     }
 
     fn link(&self, name: &str, other: &Arc<dyn IndexNode>) -> Result<(), SystemError> {
-        return self.inner_inode.link(name, other);
+        let r = self.inner_inode.link(name, other);
+        self.invalidate_dentry(name);
+        return r;
     }
 
     /// @brief 在挂载文件系统中删除文件/文件夹
@@ -235,7 +283,9 @@ impl IndexNode for MountFSInode {
             return Err(SystemError::EBUSY);
         }
         // 调用内层的inode的方法来删除这个inode
-        return self.inner_inode.unlink(name);
+        let r = self.inner_inode.unlink(name);
+        self.invalidate_dentry(name);
+        return r;
     }
 
     #[inline]
@@ -248,6 +298,7 @@ impl IndexNode for MountFSInode {
         }
         // 调用内层的rmdir的方法来删除这个inode
         let r = self.inner_inode.rmdir(name);
+        self.invalidate_dentry(name);
 
         return r;
     }
@@ -259,7 +310,12 @@ impl IndexNode for MountFSInode {
         target: &Arc<dyn IndexNode>,
         new_name: &str,
     ) -> Result<(), SystemError> {
-        return self.inner_inode.move_to(old_name, target, new_name);
+        let r = self.inner_inode.move_to(old_name, target, new_name);
+        self.invalidate_dentry(old_name);
+        if let Some(target) = target.downcast_ref::<MountFSInode>() {
+            target.invalidate_dentry(new_name);
+        }
+        return r;
     }
 
     fn find(&self, name: &str) -> Result<Arc<dyn IndexNode>, SystemError> {
@@ -347,9 +403,35 @@ impl IndexNode for MountFSInode {
             .mountpoints
             .lock()
             .insert(metadata.inode_id, new_mount_fs.clone());
+        // 挂载点下的路径查找结果发生了变化
+        dcache_invalidate_all();
         return Ok(new_mount_fs);
     }
 
+    fn umount(&self) -> Result<Arc<MountFS>, SystemError> {
+        // 只有被挂载的文件系统的根目录才能被卸载，rootfs不能被卸载
+        if !self.is_mountpoint_root()? {
+            return Err(SystemError::EINVAL);
+        }
+        let mountpoint = self
+            .mount_fs
+            .self_mountpoint
+            .as_ref()
+            .ok_or(SystemError::EBUSY)?;
+        let inode_id = mountpoint.inner_inode.metadata()?.inode_id;
+        // 卸载之后，文件系统的inode会随着最后一个引用被释放，页缓存中的脏页必须先写回
+        page_cache_sync_all()?;
+        let removed = mountpoint
+            .mount_fs
+            .mountpoints
+            .lock()
+            .remove(&inode_id)
+            .ok_or(SystemError::EINVAL)?;
+        // 丢弃被卸载的文件系统的所有缓存项（缓存项持有inode的引用），以及经过挂载点的查找结果
+        dcache_invalidate_all();
+        return Ok(removed);
+    }
+
     #[inline]
     fn mknod(
         &self,
@@ -357,8 +439,10 @@ impl IndexNode for MountFSInode {
         mode: ModeType,
         dev_t: DeviceNumber,
     ) -> Result<Arc<dyn IndexNode>, SystemError> {
+        let inner_inode = self.inner_inode.mknod(filename, mode, dev_t);
+        self.invalidate_dentry(filename);
         return Ok(MountFSInode {
-            inner_inode: self.inner_inode.mknod(filename, mode, dev_t)?,
+            inner_inode: inner_inode?,
             mount_fs: self.mount_fs.clone(),
             self_ref: Weak::default(),
         }
@@ -398,4 +482,12 @@ impl FileSystem for MountFS {
     fn name(&self) -> &str {
         "mountfs"
     }
+
+    fn dentry_cacheable(&self) -> bool {
+        return self.dentry_cacheable;
+    }
+
+    fn dentry_name<'a>(&self, name: &'a str) -> Cow<'a, str> {
+        return self.inner_filesystem.dentry_name(name);
+    }
 }
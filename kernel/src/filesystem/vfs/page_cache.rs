@@ -0,0 +1,635 @@
+//! 文件的页缓存
+//!
+//! 每个普通文件的inode可以拥有一个`PageCache`，以文件内的页号为索引，缓存文件内容所在的物理页帧。
+//! 文件系统的`read_at`/`write_at`先访问页缓存，只有在缓存未命中时，才通过`PageCacheBackend`访问磁盘。
+//!
+//! - 读：未命中的连续页面会被合并为一次磁盘读取（同时进行预读）
+//! - 写：不改变文件大小的写入只修改缓存中的页面并标记为脏页（写回）。脏页在`fsync`/`sync`时、
+//!   一个文件的脏页数量超过阈值时、以及由后台写回线程周期性地写回磁盘
+//! - 内存压力：页缓存占用的页帧总数超过上限时，按照二次机会（clock）算法回收干净的页面；
+//!   干净的页面不够回收时，唤醒后台写回线程，让脏页尽快变得可以回收
+
+use core::{
+    cmp::min,
+    sync::atomic::{AtomicBool, AtomicUsize, Ordering},
+};
+
+use alloc::{
+    collections::BTreeMap,
+    string::ToString,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use system_error::SystemError;
+use unified_init::macros::unified_init;
+
+use crate::{
+    arch::{mm::LockedFrameAllocator, MMArch},
+    init::initcall::INITCALL_FS,
+    kerror, kwarn,
+    libs::spinlock::SpinLock,
+    mm::{
+        allocator::page_frame::{
+            allocate_page_frames, deallocate_page_frames, FrameAllocator, PageFrameCount,
+            PhysPageFrame,
+        },
+        page_meta::{page_meta, PageMetaFlags},
+        MemoryManagementArch, PhysAddr,
+    },
+    process::{
+        kthread::{KernelThreadClosure, KernelThreadMechanism},
+        ProcessControlBlock, ProcessManager,
+    },
+    time::timer::schedule_timeout,
+};
+
+use super::IndexNode;
+
+/// 每次缓存未命中时，最多连续读取的页数
+const PAGE_CACHE_READAHEAD_PAGES: usize = 32;
+/// 单个文件的脏页数量超过该值时，在写入路径上同步写回
+const PAGE_CACHE_DIRTY_LIMIT: usize = 256;
+/// 页缓存最多占用物理内存的 1/PAGE_CACHE_MAX_RATIO
+const PAGE_CACHE_MAX_RATIO: usize = 4;
+/// 写回时，一次磁盘写入最多包含的连续脏页数
+const PAGE_CACHE_WRITEBACK_BATCH: usize = 32;
+/// 后台写回线程的写回周期（jiffies，单位：微秒）
+const PAGE_CACHE_WRITEBACK_INTERVAL: i64 = 5 * 1000 * 1000;
+
+/// 所有页缓存占用的页帧总数
+static PAGE_CACHE_PAGES: AtomicUsize = AtomicUsize::new(0);
+/// 页缓存占用的页帧数的上限（0表示尚未计算）
+static PAGE_CACHE_LIMIT: AtomicUsize = AtomicUsize::new(0);
+/// 后台写回线程
+static WRITEBACK_THREAD: SpinLock<Option<Arc<ProcessControlBlock>>> = SpinLock::new(None);
+/// 后台写回线程被提前唤醒（内存回收时干净的页面不够）
+static WRITEBACK_PENDING: AtomicBool = AtomicBool::new(false);
+
+lazy_static! {
+    /// 所有的页缓存，用于内存回收和sync
+    static ref PAGE_CACHES: SpinLock<Vec<Weak<PageCache>>> = SpinLock::new(Vec::new());
+}
+
+/// 页缓存访问磁盘的接口，由具体的文件系统实现
+pub trait PageCacheBackend {
+    /// 从文件的`offset`处读取数据到`buf`，返回读取的字节数
+    fn read_pages(&mut self, offset: usize, buf: &mut [u8]) -> Result<usize, SystemError>;
+    /// 把`buf`写入到文件的`offset`处，返回写入的字节数
+    fn write_pages(&mut self, offset: usize, buf: &[u8]) -> Result<usize, SystemError>;
+}
+
+#[derive(Debug)]
+pub struct PageCache {
+    inner: SpinLock<InnerPageCache>,
+    /// 页缓存所属的inode，用于sync时写回脏页
+    owner: Weak<dyn IndexNode>,
+}
+
+#[derive(Debug)]
+struct InnerPageCache {
+    /// 文件页号 -> 缓存页面所在的物理页帧
+    pages: BTreeMap<usize, PhysAddr>,
+    /// 脏页数量
+    dirty: usize,
+    /// clock算法的指针（文件页号）
+    clock_hand: usize,
+}
+
+impl PageCache {
+    pub fn new(owner: Weak<dyn IndexNode>) -> Arc<Self> {
+        let r = Arc::new(Self {
+            inner: SpinLock::new(InnerPageCache {
+                pages: BTreeMap::new(),
+                dirty: 0,
+                clock_hand: 0,
+            }),
+            owner,
+        });
+        let mut caches = PAGE_CACHES.lock_irqsave();
+        caches.retain(|c| c.strong_count() > 0);
+        caches.push(Arc::downgrade(&r));
+        return r;
+    }
+
+    /// 通过页缓存读取文件
+    ///
+    /// ## 参数
+    ///
+    /// - `offset` - 文件内的偏移量
+    /// - `buf` - 读出缓冲区
+    /// - `file_size` - 文件的大小
+    /// - `backend` - 缓存未命中时，用于读取磁盘的接口
+    ///
+    /// ## 返回值
+    ///
+    /// 成功读取的字节数
+    pub fn read(
+        &self,
+        offset: usize,
+        buf: &mut [u8],
+        file_size: usize,
+        backend: &mut dyn PageCacheBackend,
+    ) -> Result<usize, SystemError> {
+        if offset >= file_size {
+            return Ok(0);
+        }
+        let len = min(buf.len(), file_size - offset);
+        let end = offset + len;
+
+        let mut inner = self.inner.lock();
+        let mut pos = offset;
+        while pos < end {
+            let index = pos / MMArch::PAGE_SIZE;
+            let page_offset = pos % MMArch::PAGE_SIZE;
+            let copy_len = min(MMArch::PAGE_SIZE - page_offset, end - pos);
+
+            let paddr = match inner.pages.get(&index) {
+                Some(paddr) => *paddr,
+                None => {
+                    // 预读：一次读取从当前页开始的一段连续页面（不超过文件末尾）
+                    let last_in_file = (file_size - 1) / MMArch::PAGE_SIZE;
+                    let count = min(PAGE_CACHE_READAHEAD_PAGES, last_in_file + 1 - index);
+                    inner.fill(index, count, file_size, backend)?;
+                    *inner.pages.get(&index).unwrap()
+                }
+            };
+
+            unsafe {
+                let src = MMArch::phys_2_virt(paddr).unwrap().data() + page_offset;
+                let dst = &mut buf[pos - offset..pos - offset + copy_len];
+                dst.copy_from_slice(core::slice::from_raw_parts(src as *const u8, copy_len));
+            }
+            mark_referenced(paddr);
+            pos += copy_len;
+        }
+        drop(inner);
+
+        page_cache_balance();
+        return Ok(len);
+    }
+
+    /// 通过页缓存写入文件（写回）
+    ///
+    /// 调用者需要保证`offset + buf.len() <= file_size`，也就是说，这次写入不会改变文件的大小
+    pub fn write(
+        &self,
+        offset: usize,
+        buf: &[u8],
+        file_size: usize,
+        backend: &mut dyn PageCacheBackend,
+    ) -> Result<usize, SystemError> {
+        assert!(offset + buf.len() <= file_size);
+        let end = offset + buf.len();
+
+        let mut inner = self.inner.lock();
+        let mut pos = offset;
+        while pos < end {
+            let index = pos / MMArch::PAGE_SIZE;
+            let page_offset = pos % MMArch::PAGE_SIZE;
+            let copy_len = min(MMArch::PAGE_SIZE - page_offset, end - pos);
+
+            let paddr = match inner.pages.get(&index) {
+                Some(paddr) => *paddr,
+                None if copy_len == MMArch::PAGE_SIZE => inner.insert_zeroed(index)?,
+                // 部分覆盖的页面，需要先从磁盘读出原来的内容
+                None => {
+                    inner.fill(index, 1, file_size, backend)?;
+                    *inner.pages.get(&index).unwrap()
+                }
+            };
+
+            unsafe {
+                let dst = MMArch::phys_2_virt(paddr).unwrap().data() + page_offset;
+                core::slice::from_raw_parts_mut(dst as *mut u8, copy_len)
+                    .copy_from_slice(&buf[pos - offset..pos - offset + copy_len]);
+            }
+            mark_referenced(paddr);
+            inner.mark_dirty(paddr);
+            pos += copy_len;
+        }
+
+        let too_dirty = inner.dirty > PAGE_CACHE_DIRTY_LIMIT;
+        drop(inner);
+
+        if too_dirty {
+            self.writeback(file_size, backend)?;
+        }
+        page_cache_balance();
+        return Ok(buf.len());
+    }
+
+    /// 数据已经直接写入磁盘后，更新缓存中对应的页面（不会缓存新的页面）
+    pub fn update(&self, offset: usize, buf: &[u8]) {
+        let inner = self.inner.lock();
+        let end = offset + buf.len();
+        let mut pos = offset;
+        while pos < end {
+            let index = pos / MMArch::PAGE_SIZE;
+            let page_offset = pos % MMArch::PAGE_SIZE;
+            let copy_len = min(MMArch::PAGE_SIZE - page_offset, end - pos);
+            if let Some(paddr) = inner.pages.get(&index) {
+                unsafe {
+                    let dst = MMArch::phys_2_virt(*paddr).unwrap().data() + page_offset;
+                    core::slice::from_raw_parts_mut(dst as *mut u8, copy_len)
+                        .copy_from_slice(&buf[pos - offset..pos - offset + copy_len]);
+                }
+            }
+            pos += copy_len;
+        }
+    }
+
+    /// 把所有脏页写回磁盘
+    pub fn sync(
+        &self,
+        file_size: usize,
+        backend: &mut dyn PageCacheBackend,
+    ) -> Result<(), SystemError> {
+        return self.writeback(file_size, backend);
+    }
+
+    /// 把所有脏页写回磁盘。连续的脏页会被合并为一次写入
+    ///
+    /// 每次在锁内取出一段连续的脏页（复制内容并清除脏标志），放开页缓存的锁之后再写磁盘，
+    /// 写回期间再次被写入的页面会重新成为脏页。写磁盘失败时，这一段页面重新被标记为脏页。
+    ///
+    /// 调用者需要保证同一个文件的写回不会并发执行（例如在inode的锁内调用），
+    /// 否则较早取出的旧数据可能在较新的数据之后才写到磁盘上
+    fn writeback(
+        &self,
+        file_size: usize,
+        backend: &mut dyn PageCacheBackend,
+    ) -> Result<(), SystemError> {
+        let mut next = 0;
+        loop {
+            let (start, pages, buf) = match self.inner.lock().take_dirty_run(next, file_size) {
+                Some(run) => run,
+                None => return Ok(()),
+            };
+            next = start + pages.len();
+            if buf.is_empty() {
+                continue;
+            }
+
+            let mut written = 0;
+            while written < buf.len() {
+                match backend.write_pages(start * MMArch::PAGE_SIZE + written, &buf[written..]) {
+                    Ok(n) if n > 0 => written += n,
+                    r => {
+                        self.inner.lock().redirty(&pages);
+                        return Err(r.err().unwrap_or(SystemError::EIO));
+                    }
+                }
+            }
+        }
+    }
+
+    /// 文件被截断为`len`字节：丢弃之后的页面，并把最后一个页面中超出文件末尾的部分清零
+    pub fn truncate(&self, len: usize) {
+        let mut inner = self.inner.lock();
+        let first_removed = (len + MMArch::PAGE_SIZE - 1) / MMArch::PAGE_SIZE;
+        let removed: Vec<usize> = inner
+            .pages
+            .range(first_removed..)
+            .map(|(k, _)| *k)
+            .collect();
+        for index in removed {
+            inner.remove(index);
+        }
+
+        if len % MMArch::PAGE_SIZE != 0 {
+            if let Some(paddr) = inner.pages.get(&(len / MMArch::PAGE_SIZE)) {
+                unsafe {
+                    let vaddr = MMArch::phys_2_virt(*paddr).unwrap() + len % MMArch::PAGE_SIZE;
+                    MMArch::write_bytes(vaddr, 0, MMArch::PAGE_SIZE - len % MMArch::PAGE_SIZE);
+                }
+            }
+        }
+    }
+
+    /// 回收最多`nr`个干净的页面，返回实际回收的页面数
+    ///
+    /// 如果页缓存正在被其他人使用，则不回收
+    fn shrink(&self, nr: usize) -> usize {
+        let mut inner = match self.inner.try_lock() {
+            Ok(guard) => guard,
+            Err(_) => return 0,
+        };
+        return inner.shrink(nr);
+    }
+}
+
+impl Drop for PageCache {
+    fn drop(&mut self) {
+        let mut inner = self.inner.lock();
+        // inode已经被释放，没有办法再写回磁盘。
+        // 文件系统需要在释放inode之前写回（sync、卸载、后台写回），或者丢弃已删除文件的页面（truncate）
+        if inner.dirty > 0 {
+            kwarn!(
+                "page cache: {} dirty pages are discarded with their inode",
+                inner.dirty
+            );
+        }
+        let indexes: Vec<usize> = inner.pages.keys().copied().collect();
+        for index in indexes {
+            inner.remove(index);
+        }
+    }
+}
+
+impl InnerPageCache {
+    /// 分配一个清零的页面，并插入到缓存中
+    fn insert_zeroed(&mut self, index: usize) -> Result<PhysAddr, SystemError> {
+        let (paddr, _) = match unsafe { allocate_page_frames(PageFrameCount::new(1)) } {
+            Some(r) => r,
+            None => {
+                // 内存不足时，先回收其他文件的页缓存，再重试
+                page_cache_shrink_all(PAGE_CACHE_READAHEAD_PAGES);
+                unsafe { allocate_page_frames(PageFrameCount::new(1)) }
+                    .ok_or(SystemError::ENOMEM)?
+            }
+        };
+        unsafe { MMArch::write_bytes(MMArch::phys_2_virt(paddr).unwrap(), 0, MMArch::PAGE_SIZE) };
+        if let Some(meta) = page_meta(paddr) {
+            meta.set_flags(PageMetaFlags::PG_PAGECACHE | PageMetaFlags::PG_UPTODATE);
+        }
+        self.pages.insert(index, paddr);
+        PAGE_CACHE_PAGES.fetch_add(1, Ordering::Relaxed);
+        return Ok(paddr);
+    }
+
+    /// 从磁盘读取从`index`开始的、最多`count`个连续的未缓存页面
+    fn fill(
+        &mut self,
+        index: usize,
+        count: usize,
+        file_size: usize,
+        backend: &mut dyn PageCacheBackend,
+    ) -> Result<(), SystemError> {
+        // 只读取连续的、尚未缓存的页面
+        let mut count = count.max(1);
+        if let Some((next_cached, _)) = self.pages.range(index..).next() {
+            count = min(count, next_cached - index);
+        }
+
+        let offset = index * MMArch::PAGE_SIZE;
+        let len = min(count * MMArch::PAGE_SIZE, file_size.saturating_sub(offset));
+        let mut buf = vec![0u8; len];
+        let mut read = 0;
+        while read < len {
+            let r = backend.read_pages(offset + read, &mut buf[read..])?;
+            if r == 0 {
+                break;
+            }
+            read += r;
+        }
+
+        for i in 0..count {
+            let paddr = self.insert_zeroed(index + i)?;
+            let start = i * MMArch::PAGE_SIZE;
+            if start < read {
+                let copy_len = min(MMArch::PAGE_SIZE, read - start);
+                unsafe {
+                    let dst = MMArch::phys_2_virt(paddr).unwrap().data();
+                    core::slice::from_raw_parts_mut(dst as *mut u8, copy_len)
+                        .copy_from_slice(&buf[start..start + copy_len]);
+                }
+            }
+        }
+        return Ok(());
+    }
+
+    fn mark_dirty(&mut self, paddr: PhysAddr) {
+        if let Some(meta) = page_meta(paddr) {
+            if !meta
+                .set_flags(PageMetaFlags::PG_DIRTY)
+                .contains(PageMetaFlags::PG_DIRTY)
+            {
+                self.dirty += 1;
+            }
+        }
+    }
+
+    /// 从文件页号`from`开始，取出一段连续的脏页（最多`PAGE_CACHE_WRITEBACK_BATCH`页）
+    ///
+    /// 页面的内容被复制出来（不超过文件末尾），并且清除脏标志
+    ///
+    /// ## 返回值
+    ///
+    /// (第一个页面的文件页号, 取出的页面, 要写入磁盘的数据)；没有脏页时返回None
+    fn take_dirty_run(
+        &mut self,
+        from: usize,
+        file_size: usize,
+    ) -> Option<(usize, Vec<(usize, PhysAddr)>, Vec<u8>)> {
+        if self.dirty == 0 {
+            return None;
+        }
+
+        let mut pages: Vec<(usize, PhysAddr)> = Vec::new();
+        for (index, paddr) in self.pages.range(from..) {
+            if !is_dirty(*paddr) {
+                if pages.is_empty() {
+                    continue;
+                }
+                break;
+            }
+            if let Some((last, _)) = pages.last() {
+                if *index != last + 1 {
+                    break;
+                }
+            }
+            pages.push((*index, *paddr));
+            if pages.len() >= PAGE_CACHE_WRITEBACK_BATCH {
+                break;
+            }
+        }
+        let start = pages.first()?.0;
+
+        let offset = start * MMArch::PAGE_SIZE;
+        let len = min(
+            pages.len() * MMArch::PAGE_SIZE,
+            file_size.saturating_sub(offset),
+        );
+        let mut buf = Vec::with_capacity(len);
+        for (_, paddr) in pages.iter() {
+            let copy_len = min(MMArch::PAGE_SIZE, len - buf.len());
+            let src = unsafe { MMArch::phys_2_virt(*paddr).unwrap().data() };
+            buf.extend_from_slice(unsafe {
+                core::slice::from_raw_parts(src as *const u8, copy_len)
+            });
+        }
+
+        for (_, paddr) in pages.iter() {
+            page_meta(*paddr)
+                .unwrap()
+                .clear_flags(PageMetaFlags::PG_DIRTY);
+            self.dirty -= 1;
+        }
+        return Some((start, pages, buf));
+    }
+
+    /// 写回失败，把仍然在缓存中的页面重新标记为脏页
+    fn redirty(&mut self, pages: &[(usize, PhysAddr)]) {
+        for (index, paddr) in pages {
+            if self.pages.get(index) == Some(paddr) {
+                self.mark_dirty(*paddr);
+            }
+        }
+    }
+
+    /// 从缓存中删除一个页面，并释放它占用的页帧
+    fn remove(&mut self, index: usize) {
+        if let Some(paddr) = self.pages.remove(&index) {
+            if is_dirty(paddr) {
+                self.dirty -= 1;
+            }
+            unsafe { deallocate_page_frames(PhysPageFrame::new(paddr), PageFrameCount::new(1)) };
+            PAGE_CACHE_PAGES.fetch_sub(1, Ordering::Relaxed);
+        }
+    }
+
+    /// 使用clock算法回收最多`nr`个干净的页面
+    fn shrink(&mut self, nr: usize) -> usize {
+        let mut freed = 0;
+        // 每个页面最多被扫描两次（第一次清除访问标志，第二次回收）
+        let mut budget = self.pages.len() * 2;
+        while freed < nr && budget > 0 && !self.pages.is_empty() {
+            let (index, paddr) = match self.pages.range(self.clock_hand..).next() {
+                Some((k, v)) => (*k, *v),
+                None => {
+                    self.clock_hand = 0;
+                    continue;
+                }
+            };
+            self.clock_hand = index + 1;
+            budget -= 1;
+
+            let meta = match page_meta(paddr) {
+                Some(meta) => meta,
+                None => continue,
+            };
+            if meta.flags().contains(PageMetaFlags::PG_DIRTY) {
+                continue;
+            }
+            if meta
+                .clear_flags(PageMetaFlags::PG_REFERENCED)
+                .contains(PageMetaFlags::PG_REFERENCED)
+            {
+                continue;
+            }
+            self.remove(index);
+            freed += 1;
+        }
+        return freed;
+    }
+}
+
+#[inline]
+fn is_dirty(paddr: PhysAddr) -> bool {
+    page_meta(paddr)
+        .map(|m| m.flags().contains(PageMetaFlags::PG_DIRTY))
+        .unwrap_or(false)
+}
+
+#[inline]
+fn mark_referenced(paddr: PhysAddr) {
+    if let Some(meta) = page_meta(paddr) {
+        meta.set_flags(PageMetaFlags::PG_REFERENCED);
+    }
+}
+
+/// 获取页缓存占用页帧数的上限
+fn page_cache_limit() -> usize {
+    let limit = PAGE_CACHE_LIMIT.load(Ordering::Relaxed);
+    if limit != 0 {
+        return limit;
+    }
+    let total = unsafe { LockedFrameAllocator.usage() }.total().data();
+    let limit = (total / PAGE_CACHE_MAX_RATIO).max(1);
+    PAGE_CACHE_LIMIT.store(limit, Ordering::Relaxed);
+    return limit;
+}
+
+/// 如果页缓存占用的页帧超过了上限，则回收干净的页面
+fn page_cache_balance() {
+    let used = PAGE_CACHE_PAGES.load(Ordering::Relaxed);
+    let limit = page_cache_limit();
+    if used > limit {
+        page_cache_shrink_all(used - limit + PAGE_CACHE_READAHEAD_PAGES);
+    }
+}
+
+/// 从所有文件的页缓存中，回收最多`nr`个干净的页面
+///
+/// ## 返回值
+///
+/// 实际回收的页面数
+pub fn page_cache_shrink_all(nr: usize) -> usize {
+    let caches: Vec<Arc<PageCache>> = PAGE_CACHES
+        .lock_irqsave()
+        .iter()
+        .filter_map(|c| c.upgrade())
+        .collect();
+
+    let mut freed = 0;
+    for cache in caches {
+        if freed >= nr {
+            break;
+        }
+        freed += cache.shrink(nr - freed);
+    }
+
+    // 这里可能持有其他页缓存或者inode的锁，不能直接写磁盘，交给后台写回线程
+    if freed < nr {
+        page_cache_wakeup_writeback();
+    }
+    return freed;
+}
+
+/// 唤醒后台写回线程，立即写回所有的脏页
+pub fn page_cache_wakeup_writeback() {
+    WRITEBACK_PENDING.store(true, Ordering::SeqCst);
+    if let Some(pcb) = WRITEBACK_THREAD.lock_irqsave().clone() {
+        ProcessManager::wakeup(&pcb).ok();
+    }
+}
+
+/// 把所有文件的脏页写回磁盘（sync系统调用）
+pub fn page_cache_sync_all() -> Result<(), SystemError> {
+    let owners: Vec<Arc<dyn IndexNode>> = PAGE_CACHES
+        .lock_irqsave()
+        .iter()
+        .filter_map(|c| c.upgrade())
+        .filter_map(|c| c.owner.upgrade())
+        .collect();
+
+    for inode in owners {
+        inode.sync()?;
+    }
+    return Ok(());
+}
+
+/// 后台写回线程：周期性地把所有文件的脏页写回磁盘，内存紧张时被提前唤醒
+fn page_cache_writeback_thread() -> i32 {
+    loop {
+        if !WRITEBACK_PENDING.swap(false, Ordering::SeqCst) {
+            schedule_timeout(PAGE_CACHE_WRITEBACK_INTERVAL).ok();
+            WRITEBACK_PENDING.store(false, Ordering::SeqCst);
+        }
+        if let Err(e) = page_cache_sync_all() {
+            kerror!("page cache: background writeback failed: {:?}", e);
+        }
+    }
+}
+
+#[unified_init(INITCALL_FS)]
+fn page_cache_writeback_init() -> Result<(), SystemError> {
+    let closure = KernelThreadClosure::StaticEmptyClosure((
+        &(page_cache_writeback_thread as fn() -> i32),
+        (),
+    ));
+    let pcb = KernelThreadMechanism::create_and_run(closure, "kwritebackd".to_string())
+        .ok_or(SystemError::ENOMEM)?;
+    WRITEBACK_THREAD.lock_irqsave().replace(pcb);
+    return Ok(());
+}
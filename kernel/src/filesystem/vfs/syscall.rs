@@ -24,6 +24,7 @@ use super::{
     fcntl::{AtFlags, FcntlCommand, FD_CLOEXEC},
     file::{File, FileMode},
     open::{do_faccessat, do_fchmodat, do_sys_open},
+    page_cache::page_cache_sync_all,
     utils::{rsplit_path, user_path_at},
     Dirent, FileType, IndexNode, FSMAKER, MAX_PATHLEN, ROOT_INODE, VFS_MAX_FOLLOW_SYMLINK_TIMES,
 };
@@ -851,6 +852,27 @@ impl Syscall {
         return Err(SystemError::EBADF);
     }
 
+    /// 把文件在页缓存中的脏页写回磁盘
+    pub fn fsync(fd: i32) -> Result<usize, SystemError> {
+        let binding = ProcessManager::current_pcb().fd_table();
+        let fd_table_guard = binding.read();
+        let file = fd_table_guard
+            .get_file_by_fd(fd)
+            .ok_or(SystemError::EBADF)?;
+        // drop guard 以避免无法调度的问题
+        drop(fd_table_guard);
+
+        let inode = file.lock_no_preempt().inode();
+        inode.sync()?;
+        return Ok(0);
+    }
+
+    /// 把所有文件在页缓存中的脏页写回磁盘
+    pub fn sync() -> Result<usize, SystemError> {
+        page_cache_sync_all()?;
+        return Ok(0);
+    }
+
     fn do_fstat(fd: i32) -> Result<PosixKstat, SystemError> {
         let binding = ProcessManager::current_pcb().fd_table();
         let fd_table_guard = binding.read();
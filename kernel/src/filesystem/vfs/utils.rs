@@ -28,6 +28,48 @@ pub fn rsplit_path(path: &str) -> (&str, Option<&str>) {
     return (comp, rest_opt);
 }
 
+/// 路径的各级文件名的迭代器（不会分配内存）
+///
+/// 连续的多个“/”会被视为一个。举例：对于 /123//456/789/ ，依次返回123、456、789
+#[derive(Debug, Clone)]
+pub struct PathComponents<'a> {
+    rest: &'a str,
+}
+
+impl<'a> PathComponents<'a> {
+    pub fn new(path: &'a str) -> Self {
+        Self { rest: path }
+    }
+
+    /// 还没有被迭代的路径
+    pub fn rest(&self) -> &'a str {
+        self.rest
+    }
+}
+
+impl<'a> Iterator for PathComponents<'a> {
+    type Item = &'a str;
+
+    fn next(&mut self) -> Option<&'a str> {
+        let path = self.rest.trim_start_matches('/');
+        if path.is_empty() {
+            self.rest = path;
+            return None;
+        }
+
+        match path.find('/') {
+            Some(pos) => {
+                self.rest = &path[pos + 1..];
+                return Some(&path[..pos]);
+            }
+            None => {
+                self.rest = "";
+                return Some(path);
+            }
+        }
+    }
+}
+
 /// 根据dirfd和path，计算接下来开始lookup的inode和剩余的path
 ///
 /// ## 返回值
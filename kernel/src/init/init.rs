@@ -17,7 +17,7 @@ use crate::{
     },
     mm::init::mm_init,
     process::{kthread::kthread_init, process_init, ProcessManager},
-    sched::{core::sched_init, SchedArch},
+    sched::{core::sched_init, stat::sched_stat_init, SchedArch},
     smp::{early_smp_init, SMPArch},
     syscall::Syscall,
     time::{
@@ -78,6 +78,7 @@ fn do_start_kernel() {
     // SMP初始化有可能会开中断，所以这里再次检查中断是否关闭
     assert_eq!(CurrentIrqArch::is_irq_enabled(), false);
     Futex::init();
+    sched_stat_init();
 
     setup_arch_post().expect("setup_arch_post failed");
 
@@ -61,11 +61,69 @@ impl CpuMask {
         self.bmp.is_empty()
     }
 
+    /// 把所有cpu设置为value
+    pub fn set_all(&mut self, value: bool) {
+        self.bmp.set_all(value);
+    }
+
+    /// 从用户态的cpu位图构造CpuMask（第i个字节的第j位对应第i*8+j个cpu）
+    ///
+    /// 超出`PerCpu::MAX_CPU_NUM`的部分会被忽略
+    pub fn from_bytes(bytes: &[u8]) -> Self {
+        let mut mask = Self::new();
+        for (i, byte) in bytes.iter().enumerate() {
+            for bit in 0..8 {
+                let cpu = (i * 8 + bit) as u32;
+                if cpu >= PerCpu::MAX_CPU_NUM {
+                    return mask;
+                }
+                if byte & (1 << bit) != 0 {
+                    mask.set(ProcessorId::new(cpu), true);
+                }
+            }
+        }
+        return mask;
+    }
+
+    /// 把CpuMask转换为用户态的cpu位图，写入到buf中
+    ///
+    /// ## 返回值
+    ///
+    /// 写入的字节数
+    pub fn to_bytes(&self, buf: &mut [u8]) -> usize {
+        let len = core::cmp::min(buf.len(), Self::bytes_len());
+        buf[..len].fill(0);
+        for cpu in self.iter_cpu() {
+            let index = cpu.data() as usize / 8;
+            if index >= len {
+                break;
+            }
+            buf[index] |= 1 << (cpu.data() % 8);
+        }
+        return len;
+    }
+
+    /// CpuMask转换为位图之后的字节数
+    pub const fn bytes_len() -> usize {
+        (PerCpu::MAX_CPU_NUM as usize + 7) / 8
+    }
+
+    /// 求两个CpuMask的交集
+    pub fn and(&self, other: &CpuMask) -> CpuMask {
+        let mut result = CpuMask::new();
+        for cpu in self.iter_cpu() {
+            if other.get(cpu).unwrap_or(false) {
+                result.set(cpu, true);
+            }
+        }
+        return result;
+    }
+
     /// 迭代所有被置位的cpu
     pub fn iter_cpu(&self) -> CpuMaskIter {
         CpuMaskIter {
             mask: self,
-            index: ProcessorId::new(0),
+            index: None,
             set: true,
         }
     }
@@ -74,7 +132,7 @@ impl CpuMask {
     pub fn iter_zero_cpu(&self) -> CpuMaskIter {
         CpuMaskIter {
             mask: self,
-            index: ProcessorId::new(0),
+            index: None,
             set: false,
         }
     }
@@ -82,7 +140,8 @@ impl CpuMask {
 
 pub struct CpuMaskIter<'a> {
     mask: &'a CpuMask,
-    index: ProcessorId,
+    /// 上一次返回的cpu，None表示还没有开始迭代
+    index: Option<ProcessorId>,
     set: bool,
 }
 
@@ -90,20 +149,14 @@ impl<'a> Iterator for CpuMaskIter<'a> {
     type Item = ProcessorId;
 
     fn next(&mut self) -> Option<ProcessorId> {
-        if self.index.data() == 0 {
-            if self.set {
-                self.index = self.mask.first()?;
-            } else {
-                self.index = self.mask.first_zero()?;
-            }
-        }
-
-        if self.set {
-            self.index = self.mask.next_index(self.index)?;
-        } else {
-            self.index = self.mask.next_zero_index(self.index)?;
-        }
-        Some(self.index)
+        let next = match (self.index, self.set) {
+            (None, true) => self.mask.first(),
+            (None, false) => self.mask.first_zero(),
+            (Some(index), true) => self.mask.next_index(index),
+            (Some(index), false) => self.mask.next_zero_index(index),
+        }?;
+        self.index = Some(next);
+        Some(next)
     }
 }
 
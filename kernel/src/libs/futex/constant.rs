@@ -45,10 +45,18 @@ bitflags! {
     }
 }
 
-#[allow(dead_code)]
+impl FutexArg {
+    /// 该命令的第4个参数是否为超时时间（其他命令用它传递val2）
+    pub fn has_timeout(&self) -> bool {
+        return *self == Self::FUTEX_WAIT
+            || *self == Self::FUTEX_LOCK_PI
+            || *self == Self::FUTEX_LOCK_PI2
+            || *self == Self::FUTEX_WAIT_BITSET
+            || *self == Self::FUTEX_WAIT_REQUEUE_PI;
+    }
+}
+
 pub const FUTEX_WAITERS: u32 = 0x80000000;
-#[allow(dead_code)]
 pub const FUTEX_OWNER_DIED: u32 = 0x40000000;
-#[allow(dead_code)]
 pub const FUTEX_TID_MASK: u32 = 0x3fffffff;
 pub const FUTEX_BITSET_MATCH_ANY: u32 = 0xffffffff;
@@ -1,142 +1,229 @@
 use alloc::{
     collections::LinkedList,
     sync::{Arc, Weak},
+    vec::Vec,
 };
 use core::hash::{Hash, Hasher};
-use core::{intrinsics::likely, sync::atomic::AtomicU64};
-use hashbrown::HashMap;
+use core::sync::atomic::{AtomicU32, AtomicUsize, Ordering};
 use system_error::SystemError;
 
 use crate::{
     arch::{sched::sched, CurrentIrqArch, MMArch},
     exception::InterruptArch,
-    libs::spinlock::{SpinLock, SpinLockGuard},
+    include::bindings::bindings::smp_get_total_cpu,
+    kinfo,
+    libs::spinlock::{LockClass, SpinLock, SpinLockGuard},
     mm::{ucontext::AddressSpace, MemoryManagementArch, VirtAddr},
-    process::{ProcessControlBlock, ProcessManager},
-    syscall::user_access::UserBufferReader,
-    time::{
-        timer::{next_n_us_timer_jiffies, Timer, WakeUpHelper},
-        TimeSpec,
-    },
+    process::{Pid, ProcessControlBlock, ProcessManager},
+    sched::SchedPriority,
+    syscall::user_access::{UserBufferReader, UserBufferWriter},
+    time::{hrtimer::HrTimer, timer::WakeUpHelper},
 };
 
 use super::constant::*;
 
 static mut FUTEX_DATA: Option<FutexData> = None;
+static FUTEX_BUCKET_LOCK_CLASS: LockClass = LockClass::new("futex_bucket");
 
+/// 每个cpu对应的futex哈希桶的数量
+const FUTEX_BUCKETS_PER_CPU: usize = 256;
+
+/// 全局的futex哈希表
+///
+/// 桶的数量是固定的2的幂，每个桶有自己的锁和等待队列。不同的futex按照地址被散列到不同的桶中，
+/// 因此对不同futex的操作通常不会争用同一把锁。
 pub struct FutexData {
-    data: SpinLock<HashMap<FutexKey, FutexHashBucket>>,
+    buckets: Vec<SpinLock<FutexHashBucket>>,
+    /// 哈希值右移的位数，使得结果落在[0, buckets.len())中
+    shift: u32,
 }
 
 impl FutexData {
-    pub fn futex_map() -> SpinLockGuard<'static, HashMap<FutexKey, FutexHashBucket>> {
-        unsafe { FUTEX_DATA.as_ref().unwrap().data.lock() }
+    #[inline]
+    fn get() -> &'static FutexData {
+        unsafe { FUTEX_DATA.as_ref().unwrap() }
     }
 
-    pub fn try_remove(key: &FutexKey) -> Option<FutexHashBucket> {
-        unsafe {
-            let mut guard = FUTEX_DATA.as_ref().unwrap().data.lock();
-            if let Some(futex) = guard.get(key) {
-                if futex.chain.is_empty() {
-                    return guard.remove(key);
-                }
-            }
+    /// 获取key所在的桶的下标
+    #[inline]
+    fn bucket_index(key: &FutexKey) -> usize {
+        let data = Self::get();
+        return (key.hash_value() >> data.shift) as usize;
+    }
+
+    #[inline]
+    fn bucket(index: usize) -> &'static SpinLock<FutexHashBucket> {
+        return &Self::get().buckets[index];
+    }
+
+    /// 锁住两个桶。总是先锁下标较小的桶，避免死锁
+    ///
+    /// ## 返回值
+    ///
+    /// (index1对应的桶, index2对应的桶)。两个下标相同时，第二个值为None
+    fn lock_two(
+        index1: usize,
+        index2: usize,
+    ) -> (
+        SpinLockGuard<'static, FutexHashBucket>,
+        Option<SpinLockGuard<'static, FutexHashBucket>>,
+    ) {
+        if index1 == index2 {
+            return (Self::bucket(index1).lock(), None);
+        }
+        if index1 < index2 {
+            let guard1 = Self::bucket(index1).lock();
+            let guard2 = Self::bucket(index2).lock();
+            return (guard1, Some(guard2));
         }
-        None
+        let guard2 = Self::bucket(index2).lock();
+        let guard1 = Self::bucket(index1).lock();
+        return (guard1, Some(guard2));
     }
 }
 
 pub struct Futex;
 
-// 对于同一个futex的进程或线程将会在这个bucket等待
+/// 桶的等待队列中的一项
+#[derive(Debug)]
+struct FutexWaiter {
+    /// 所等待的futex。被requeue到其他futex上时会改变
+    key: FutexKey,
+    obj: Arc<FutexObj>,
+}
+
+/// 散列到同一个桶的futex上等待的进程或线程，都在这个bucket等待
+#[derive(Debug)]
 pub struct FutexHashBucket {
-    // 该futex维护的等待队列
-    chain: LinkedList<Arc<FutexObj>>,
+    // 该桶维护的等待队列，按照加入的先后顺序排列
+    chain: LinkedList<FutexWaiter>,
 }
 
 impl FutexHashBucket {
-    /// ## 判断是否在bucket里
-    pub fn contains(&self, futex_q: &FutexObj) -> bool {
-        self.chain
-            .iter()
-            .filter(|x| futex_q.pcb.ptr_eq(&x.pcb) && x.key == futex_q.key)
-            .count()
-            != 0
+    const fn new() -> Self {
+        Self {
+            chain: LinkedList::new(),
+        }
     }
 
-    /// 让futex_q在该bucket上挂起
+    /// 将futex_q加入等待队列，并且把当前进程标记为睡眠
     ///
     /// 进入该函数前，需要关中断
     #[inline(always)]
-    pub fn sleep_no_sched(&mut self, futex_q: Arc<FutexObj>) -> Result<(), SystemError> {
+    fn sleep_no_sched(&mut self, key: FutexKey, futex_q: Arc<FutexObj>) -> Result<(), SystemError> {
         assert!(CurrentIrqArch::is_irq_enabled() == false);
-        self.chain.push_back(futex_q);
+        self.chain.push_back(FutexWaiter { key, obj: futex_q });
 
-        ProcessManager::mark_sleep(true)?;
+        if let Err(e) = ProcessManager::mark_sleep(true) {
+            self.chain.pop_back();
+            return Err(e);
+        }
 
         Ok(())
     }
 
-    /// ## 唤醒队列中的最多nr_wake个进程
+    /// ## 唤醒在key上等待、并且bitset有交集的最多nr_wake个进程
     ///
     /// return: 唤醒的进程数
-    #[inline(always)]
-    pub fn wake_up(
-        &mut self,
-        key: FutexKey,
-        bitset: Option<u32>,
-        nr_wake: u32,
-    ) -> Result<usize, SystemError> {
+    fn wake_up(&mut self, key: &FutexKey, bitset: u32, nr_wake: u32) -> usize {
         let mut count = 0;
-        let mut pop_count = 0;
-        while let Some(futex_q) = self.chain.pop_front() {
-            if futex_q.key == key {
-                // TODO: 考虑优先级继承的机制
-
-                if let Some(bitset) = bitset {
-                    if futex_q.bitset != bitset {
-                        self.chain.push_back(futex_q);
-                        continue;
-                    }
+        let woken: Vec<FutexWaiter> = self
+            .chain
+            .extract_if(|w| {
+                // PI futex的等待者只能由FUTEX_UNLOCK_PI唤醒
+                if count >= nr_wake || w.key != *key || w.obj.pi || w.obj.bitset & bitset == 0 {
+                    return false;
                 }
+                count += 1;
+                return true;
+            })
+            .collect();
 
-                // 唤醒
-                if futex_q.pcb.upgrade().is_some() {
-                    self.remove(futex_q.clone());
-                    ProcessManager::wakeup(&futex_q.pcb.upgrade().unwrap())?;
-                }
+        for w in woken.iter() {
+            if let Some(pcb) = w.obj.pcb.upgrade() {
+                ProcessManager::wakeup(&pcb).ok();
+            }
+        }
+        return woken.len();
+    }
 
-                // 判断唤醒数
-                count += 1;
-                if count >= nr_wake {
-                    break;
+    /// 从等待队列中取出在key上等待的最多nr个非PI等待者
+    fn take(&mut self, key: &FutexKey, nr: u32) -> Vec<FutexWaiter> {
+        let mut count = 0;
+        return self
+            .chain
+            .extract_if(|w| {
+                if count >= nr || w.key != *key || w.obj.pi {
+                    return false;
                 }
-            } else {
-                self.chain.push_back(futex_q);
+                count += 1;
+                return true;
+            })
+            .collect();
+    }
+
+    /// 在key上等待的、优先级最高的PI等待者。优先级相同时，先等待的优先
+    ///
+    /// ## 返回值
+    ///
+    /// (等待者, 除了它之外是否还有其他PI等待者)
+    fn top_pi_waiter(&self, key: &FutexKey) -> Option<(Arc<FutexObj>, bool)> {
+        let mut top: Option<&Arc<FutexObj>> = None;
+        let mut count = 0;
+        for w in self.chain.iter() {
+            if !w.obj.pi || w.key != *key || w.obj.pcb.upgrade().is_none() {
+                continue;
             }
-            // 判断是否循环完队列了
-            pop_count += 1;
-            if pop_count >= self.chain.len() {
-                break;
+            count += 1;
+            if top.map_or(true, |t| w.obj.priority < t.priority) {
+                top = Some(&w.obj);
             }
         }
-        Ok(count as usize)
+        return top.map(|t| (t.clone(), count > 1));
+    }
+
+    /// 是否有PI等待者在key上等待
+    fn has_pi_waiters(&self, key: &FutexKey) -> bool {
+        return self.chain.iter().any(|w| w.obj.pi && w.key == *key);
     }
 
     /// 将FutexObj从bucket中删除
-    pub fn remove(&mut self, futex: Arc<FutexObj>) {
-        self.chain
-            .extract_if(|x| Arc::ptr_eq(x, &futex))
-            .for_each(drop);
+    ///
+    /// ## 返回值
+    ///
+    /// FutexObj是否在bucket中
+    fn remove(&mut self, futex: &Arc<FutexObj>) -> bool {
+        return self
+            .chain
+            .extract_if(|w| Arc::ptr_eq(&w.obj, futex))
+            .count()
+            != 0;
     }
 }
 
+/// 一个等待者
 #[derive(Debug)]
 pub struct FutexObj {
     pcb: Weak<ProcessControlBlock>,
-    key: FutexKey,
     bitset: u32,
-    // TODO: 优先级继承
+    /// 是否在等待PI futex（FUTEX_LOCK_PI）
+    pi: bool,
+    /// 等待者的调度优先级。释放PI futex时，锁会被交给优先级最高的等待者
+    priority: SchedPriority,
+    /// 等待者当前所在的桶的下标，只能在持有该桶的锁时修改
+    bucket: AtomicUsize,
+}
+
+impl FutexObj {
+    fn new(pcb: &Arc<ProcessControlBlock>, bitset: u32, pi: bool, bucket: usize) -> Arc<Self> {
+        return Arc::new(Self {
+            pcb: Arc::downgrade(pcb),
+            bitset,
+            pi,
+            priority: pcb.sched_info().priority(),
+            bucket: AtomicUsize::new(bucket),
+        });
+    }
 }
 
 pub enum FutexAccess {
@@ -160,6 +247,24 @@ pub struct FutexKey {
     key: InnerFutexKey,
 }
 
+impl FutexKey {
+    /// 计算key的64位哈希值，高位用于选择哈希桶
+    fn hash_value(&self) -> u64 {
+        const GOLDEN_RATIO_64: u64 = 0x61C8_8646_80B5_83EB;
+        let (space, address) = match &self.key {
+            InnerFutexKey::Shared(k) => (k.i_seq, k.page_offset),
+            InnerFutexKey::Private(k) => (
+                k.address_space
+                    .as_ref()
+                    .map_or(0, |w| w.as_ptr() as *const u8 as u64),
+                k.address,
+            ),
+        };
+        let v = (address + self.offset as u64) ^ space.rotate_left(32);
+        return v.wrapping_mul(GOLDEN_RATIO_64);
+    }
+}
+
 /// 不同进程间通过文件共享futex变量，表明该变量在文件中的位置
 #[derive(Hash, PartialEq, Eq, Clone, Debug)]
 pub struct SharedKey {
@@ -201,20 +306,37 @@ impl PartialEq for PrivateKey {
 
 impl Futex {
     /// ### 初始化FUTEX_DATA
+    ///
+    /// 哈希桶的数量为 每个cpu 256 个，向上取整到2的幂
     pub fn init() {
+        let cpus = (unsafe { smp_get_total_cpu() } as usize).max(1);
+        let nr_buckets = (FUTEX_BUCKETS_PER_CPU * cpus).next_power_of_two();
+
+        let mut buckets = Vec::with_capacity(nr_buckets);
+        buckets.resize_with(nr_buckets, || {
+            SpinLock::new_with_class(FutexHashBucket::new(), &FUTEX_BUCKET_LOCK_CLASS)
+        });
+
         unsafe {
             FUTEX_DATA = Some(FutexData {
-                data: SpinLock::new(HashMap::new()),
+                buckets,
+                shift: 64 - nr_buckets.trailing_zeros(),
             })
         };
+        kinfo!("Futex hash table initialized with {} buckets", nr_buckets);
     }
 
     /// ### 让当前进程在指定futex上等待直到futex_wake显式唤醒
+    ///
+    /// ## 参数
+    ///
+    /// - `deadline` - 超时的时刻（单位：纳秒，参见`ktime_get_ns()`），None表示永不超时
+    /// - `bitset` - 只有bitset与之有交集的FUTEX_WAKE_BITSET才能唤醒该进程
     pub fn futex_wait(
         uaddr: VirtAddr,
         flags: FutexFlag,
         val: u32,
-        abs_time: Option<TimeSpec>,
+        deadline: Option<u64>,
         bitset: u32,
     ) -> Result<usize, SystemError> {
         if bitset == 0 {
@@ -227,123 +349,81 @@ impl Futex {
             flags.contains(FutexFlag::FLAGS_SHARED),
             FutexAccess::FutexRead,
         )?;
+        let index = FutexData::bucket_index(&key);
 
-        let mut futex_map_guard = FutexData::futex_map();
-        let bucket = futex_map_guard.get_mut(&key);
-        let bucket_mut = match bucket {
-            Some(bucket) => bucket,
-            None => {
-                let bucket = FutexHashBucket {
-                    chain: LinkedList::new(),
-                };
-                futex_map_guard.insert(key.clone(), bucket);
-                futex_map_guard.get_mut(&key).unwrap()
-            }
-        };
+        // 先读取一次，使得持有桶的锁时读取用户空间不会产生缺页
+        Self::get_futex_value(uaddr)?;
 
-        // 使用UserBuffer读取futex
-        let user_reader =
-            UserBufferReader::new(uaddr.as_ptr::<u32>(), core::mem::size_of::<u32>(), true)?;
+        let pcb = ProcessManager::current_pcb();
+        let futex_q = FutexObj::new(&pcb, bitset, false, index);
+        // 创建超时计时器任务
+        let timer = deadline.map(|expires| HrTimer::new(WakeUpHelper::new(pcb.clone()), expires));
 
-        // 从用户空间读取到futex的val
-        let mut uval = 0;
+        let mut bucket = FutexData::bucket(index).lock();
 
-        // 读取
-        // 这里只尝试一种方式去读取用户空间，与linux不太一致
-        // 对于linux，如果bucket被锁住时读取失败，将会将bucket解锁后重新读取
-        user_reader.copy_one_from_user::<u32>(&mut uval, 0)?;
+        // 在持有桶的锁时读取futex的值，保证不会错过在此之后的futex_wake
+        let uval = Self::get_futex_value(uaddr)?;
 
         // 不满足wait条件，返回错误
         if uval != val {
             return Err(SystemError::EAGAIN_OR_EWOULDBLOCK);
         }
 
-        let pcb = ProcessManager::current_pcb();
-        // 创建超时计时器任务
-        let mut timer = None;
-        if !abs_time.is_none() {
-            let time = abs_time.unwrap();
-
-            let wakeup_helper = WakeUpHelper::new(pcb.clone());
-
-            let sec = time.tv_sec;
-            let nsec = time.tv_nsec;
-            let jiffies = next_n_us_timer_jiffies((nsec / 1000 + sec * 1_000_000) as u64);
-
-            let wake_up = Timer::new(wakeup_helper, jiffies);
-
-            wake_up.activate();
-            timer = Some(wake_up);
-        }
-
-        let futex_q = Arc::new(FutexObj {
-            pcb: Arc::downgrade(&pcb),
-            key: key.clone(),
-            bitset,
-        });
         let irq_guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
         // 满足条件则将当前进程在该bucket上挂起
-        bucket_mut.sleep_no_sched(futex_q.clone()).map_err(|e| {
+        bucket.sleep_no_sched(key, futex_q.clone()).map_err(|e| {
             kwarn!("error:{e:?}");
             e
         })?;
-        drop(futex_map_guard);
+        if let Some(timer) = timer.as_ref() {
+            timer.start();
+        }
+        drop(bucket);
         drop(irq_guard);
         sched();
 
         // 被唤醒后的检查
-        let mut futex_map_guard = FutexData::futex_map();
-        let bucket = futex_map_guard.get_mut(&key);
-        let bucket_mut = match bucket {
-            // 如果该pcb不在链表里面了或者该链表已经被释放，就证明是正常的Wake操作
-            Some(bucket_mut) => {
-                if !bucket_mut.contains(&futex_q) {
-                    // 取消定时器任务
-                    if timer.is_some() {
-                        timer.unwrap().cancel();
-                    }
-                    return Ok(0);
-                }
-                // 非正常唤醒，返回交给下层
-                bucket_mut
-            }
-            None => {
-                // 取消定时器任务
-                if timer.is_some() {
-                    timer.unwrap().cancel();
-                }
-                return Ok(0);
-            }
-        };
-
-        // 如果是超时唤醒，则返回错误
-        if timer.is_some() {
-            if timer.clone().unwrap().timeout() {
-                bucket_mut.remove(futex_q);
+        if let Some(timer) = timer.as_ref() {
+            timer.cancel();
+        }
 
-                return Err(SystemError::ETIMEDOUT);
-            }
+        // 如果已经不在等待队列中，就证明是正常的Wake操作
+        if !Self::unqueue(&futex_q) {
+            return Ok(0);
         }
 
-        // TODO: 如果没有挂起的信号，则重新判断是否满足wait要求，重新进入wait
+        // 如果是超时唤醒，则返回错误
+        if timer.map_or(false, |timer| timer.timeout()) {
+            return Err(SystemError::ETIMEDOUT);
+        }
 
-        // 经过前面的几个判断，到这里之后，
-        // 当前进程被唤醒大概率是其他进程更改了uval,需要重新去判断当前进程是否满足wait
+        // 被信号唤醒，需要处理信号然后重启futex系统调用
+        if pcb.sig_info_irqsave().sig_pending().has_pending() {
+            return Err(SystemError::ERESTARTSYS);
+        }
 
-        // 到这里之后，前面的唤醒条件都不满足，则是被信号唤醒
-        // 需要处理信号然后重启futex系统调用
+        // 虚假唤醒，由用户态重新判断是否需要等待
+        Ok(0)
+    }
 
-        // 取消定时器任务
-        if timer.is_some() {
-            let timer = timer.unwrap();
-            if !timer.timeout() {
-                timer.cancel();
+    /// 把等待者从它所在的桶中移除
+    ///
+    /// ## 返回值
+    ///
+    /// 等待者是否仍在队列中（false表示它已经被唤醒或者获得了PI futex）
+    fn unqueue(futex_q: &Arc<FutexObj>) -> bool {
+        loop {
+            let index = futex_q.bucket.load(Ordering::SeqCst);
+            let mut bucket = FutexData::bucket(index).lock();
+            if futex_q.bucket.load(Ordering::SeqCst) != index {
+                // 加锁期间被requeue到了其他桶
+                continue;
             }
+            return bucket.remove(futex_q);
         }
-        Ok(0)
     }
 
-    // ### 唤醒指定futex上挂起的最多nr_wake个进程
+    // ### 唤醒指定futex上挂起的、bitset与之有交集的最多nr_wake个进程
     pub fn futex_wake(
         uaddr: VirtAddr,
         flags: FutexFlag,
@@ -360,24 +440,18 @@ impl Futex {
             flags.contains(FutexFlag::FLAGS_SHARED),
             FutexAccess::FutexRead,
         )?;
-        let mut binding = FutexData::futex_map();
-        let bucket_mut = binding.get_mut(&key).ok_or(SystemError::EINVAL)?;
 
-        // 确保后面的唤醒操作是有意义的
-        if bucket_mut.chain.is_empty() {
-            return Ok(0);
-        }
+        let mut bucket = FutexData::bucket(FutexData::bucket_index(&key)).lock();
         // 从队列中唤醒
-        let count = bucket_mut.wake_up(key.clone(), Some(bitset), nr_wake)?;
-
-        drop(binding);
-
-        FutexData::try_remove(&key);
-
+        let count = bucket.wake_up(&key, bitset, nr_wake);
         Ok(count)
     }
 
     /// ### 唤醒制定uaddr1上的最多nr_wake个进程，然后将uaddr1最多nr_requeue个进程移动到uaddr2绑定的futex上
+    ///
+    /// ## 返回值
+    ///
+    /// 被唤醒以及被移动的进程数之和
     pub fn futex_requeue(
         uaddr1: VirtAddr,
         flags: FutexFlag,
@@ -408,47 +482,35 @@ impl Futex {
             }
         })?;
 
-        if requeue_pi && key1 == key2 {
-            return Err(SystemError::EINVAL);
+        if cmpval.is_some() {
+            Self::get_futex_value(uaddr1)?;
         }
 
-        if likely(!cmpval.is_none()) {
-            let uval_reader =
-                UserBufferReader::new(uaddr1.as_ptr::<u32>(), core::mem::size_of::<u32>(), true)?;
-            let curval = uval_reader.read_one_from_user::<u32>(0)?;
+        let index1 = FutexData::bucket_index(&key1);
+        let index2 = FutexData::bucket_index(&key2);
+        let (mut bucket1, mut bucket2) = FutexData::lock_two(index1, index2);
 
+        if let Some(cmpval) = cmpval {
             // 判断是否满足条件
-            if *curval != cmpval.unwrap() {
+            if Self::get_futex_value(uaddr1)? != cmpval {
                 return Err(SystemError::EAGAIN_OR_EWOULDBLOCK);
             }
         }
 
-        let mut futex_data_guard = FutexData::futex_map();
-        if !requeue_pi {
-            // 唤醒nr_wake个进程
-            let bucket_1_mut = futex_data_guard.get_mut(&key1).ok_or(SystemError::EINVAL)?;
-            let ret = bucket_1_mut.wake_up(key1.clone(), None, nr_wake as u32)?;
-            // 将bucket1中最多nr_requeue个任务转移到bucket2
-            for _ in 0..nr_requeue {
-                let bucket_1_mut = futex_data_guard.get_mut(&key1).ok_or(SystemError::EINVAL)?;
-                let futex_q = bucket_1_mut.chain.pop_front();
-                match futex_q {
-                    Some(futex_q) => {
-                        let bucket_2_mut =
-                            futex_data_guard.get_mut(&key2).ok_or(SystemError::EINVAL)?;
-                        bucket_2_mut.chain.push_back(futex_q);
-                    }
-                    None => {
-                        break;
-                    }
-                }
-            }
-
-            return Ok(ret);
-        } else {
-            // 暂时不支持优先级继承
-            todo!()
+        // 唤醒nr_wake个进程
+        let woken = bucket1.wake_up(&key1, FUTEX_BITSET_MATCH_ANY, nr_wake as u32);
+
+        // 将key1上最多nr_requeue个任务转移到key2
+        let moved = bucket1.take(&key1, nr_requeue as u32);
+        let requeued = moved.len();
+        let target = bucket2.as_mut().unwrap_or(&mut bucket1);
+        for mut w in moved {
+            w.key = key2.clone();
+            w.obj.bucket.store(index2, Ordering::SeqCst);
+            target.chain.push_back(w);
         }
+
+        return Ok(woken + requeued);
     }
 
     /// ### 唤醒futex上的进程的同时进行一些操作
@@ -471,28 +533,171 @@ impl Futex {
             FutexAccess::FutexWrite,
         )?;
 
-        let mut futex_data_guard = FutexData::futex_map();
-        let bucket1 = futex_data_guard.get_mut(&key1).ok_or(SystemError::EINVAL)?;
+        // 确保uaddr2可写，使得持有桶的锁时修改它不会产生缺页
+        Self::fault_in_writeable(uaddr2)?;
+
+        let (mut bucket1, mut bucket2) = FutexData::lock_two(
+            FutexData::bucket_index(&key1),
+            FutexData::bucket_index(&key2),
+        );
         let mut wake_count = 0;
 
         // 唤醒uaddr1中的进程
-        wake_count += bucket1.wake_up(key1, None, nr_wake as u32)?;
-
-        match Self::futex_atomic_op_inuser(op as u32, uaddr2) {
-            Ok(ret) => {
-                // 操作成功则唤醒uaddr2中的进程
-                if ret {
-                    let bucket2 = futex_data_guard.get_mut(&key2).ok_or(SystemError::EINVAL)?;
-                    wake_count += bucket2.wake_up(key2, None, nr_wake2 as u32)?;
+        wake_count += bucket1.wake_up(&key1, FUTEX_BITSET_MATCH_ANY, nr_wake as u32);
+
+        // 操作成功则唤醒uaddr2中的进程
+        if Self::futex_atomic_op_inuser(op as u32, uaddr2)? {
+            let bucket2 = bucket2.as_mut().unwrap_or(&mut bucket1);
+            wake_count += bucket2.wake_up(&key2, FUTEX_BITSET_MATCH_ANY, nr_wake2 as u32);
+        }
+
+        Ok(wake_count)
+    }
+
+    /// ### 获取PI futex（FUTEX_LOCK_PI/FUTEX_TRYLOCK_PI）
+    ///
+    /// futex的值为持有者的tid，以及表示有进程在内核中等待的FUTEX_WAITERS位。
+    /// 锁被占用时，当前进程在内核中等待，直到持有者通过FUTEX_UNLOCK_PI把锁直接交给它。
+    ///
+    /// ## 参数
+    ///
+    /// - `deadline` - 超时的时刻（单位：纳秒，参见`ktime_get_ns()`），None表示永不超时
+    /// - `trylock` - 为true时，锁被占用则立即返回EAGAIN
+    pub fn futex_lock_pi(
+        uaddr: VirtAddr,
+        flags: FutexFlag,
+        deadline: Option<u64>,
+        trylock: bool,
+    ) -> Result<usize, SystemError> {
+        let key = Self::get_futex_key(
+            uaddr,
+            flags.contains(FutexFlag::FLAGS_SHARED),
+            FutexAccess::FutexWrite,
+        )?;
+        let index = FutexData::bucket_index(&key);
+
+        let pcb = ProcessManager::current_pcb();
+        let tid = pcb.pid().data() as u32;
+        let futex_q = FutexObj::new(&pcb, FUTEX_BITSET_MATCH_ANY, true, index);
+        let timer = deadline.map(|expires| HrTimer::new(WakeUpHelper::new(pcb.clone()), expires));
+        let mut timer_started = false;
+
+        loop {
+            Self::fault_in_writeable(uaddr)?;
+            let mut bucket = FutexData::bucket(index).lock();
+            let uval = Self::get_futex_value(uaddr)?;
+            let owner = uval & FUTEX_TID_MASK;
+
+            if owner == tid {
+                return Err(SystemError::EDEADLK_OR_EDEADLOCK);
+            }
+
+            if owner == 0 {
+                // 锁是空闲的（或者持有者已经退出），直接获取它
+                let mut newval = tid | (uval & FUTEX_OWNER_DIED);
+                if bucket.has_pi_waiters(&key) {
+                    newval |= FUTEX_WAITERS;
+                }
+                if Self::cmpxchg_futex_value(uaddr, uval, newval)? != uval {
+                    continue;
+                }
+                if let Some(timer) = timer.as_ref() {
+                    timer.cancel();
+                }
+                return Ok(0);
+            }
+
+            if trylock {
+                return Err(SystemError::EAGAIN_OR_EWOULDBLOCK);
+            }
+
+            if ProcessManager::find(Pid::new(owner as usize)).is_none() {
+                return Err(SystemError::ESRCH);
+            }
+
+            // 告诉持有者，释放锁时需要进入内核
+            if uval & FUTEX_WAITERS == 0
+                && Self::cmpxchg_futex_value(uaddr, uval, uval | FUTEX_WAITERS)? != uval
+            {
+                continue;
+            }
+
+            let irq_guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
+            bucket.sleep_no_sched(key.clone(), futex_q.clone())?;
+            if let Some(timer) = timer.as_ref() {
+                if !timer_started {
+                    timer.start();
+                    timer_started = true;
+                }
+            }
+            drop(bucket);
+            drop(irq_guard);
+            sched();
+
+            if !Self::unqueue(&futex_q) {
+                // 持有者已经把锁交给了当前进程
+                if let Some(timer) = timer.as_ref() {
+                    timer.cancel();
                 }
+                return Ok(0);
+            }
+
+            if timer.as_ref().map_or(false, |timer| timer.timeout()) {
+                return Err(SystemError::ETIMEDOUT);
             }
-            Err(e) => {
-                // TODO:retry?
-                return Err(e);
+
+            if pcb.sig_info_irqsave().sig_pending().has_pending() {
+                if let Some(timer) = timer.as_ref() {
+                    timer.cancel();
+                }
+                return Err(SystemError::ERESTARTSYS);
             }
+            // 虚假唤醒，重新尝试获取锁
         }
+    }
 
-        Ok(wake_count)
+    /// ### 释放PI futex（FUTEX_UNLOCK_PI）
+    ///
+    /// 如果有进程在等待，则把锁直接交给优先级最高的等待者并唤醒它，否则把futex的值清零
+    pub fn futex_unlock_pi(uaddr: VirtAddr, flags: FutexFlag) -> Result<usize, SystemError> {
+        let key = Self::get_futex_key(
+            uaddr,
+            flags.contains(FutexFlag::FLAGS_SHARED),
+            FutexAccess::FutexWrite,
+        )?;
+        let index = FutexData::bucket_index(&key);
+        let tid = ProcessManager::current_pcb().pid().data() as u32;
+
+        loop {
+            Self::fault_in_writeable(uaddr)?;
+            let mut bucket = FutexData::bucket(index).lock();
+            let uval = Self::get_futex_value(uaddr)?;
+            if uval & FUTEX_TID_MASK != tid {
+                return Err(SystemError::EPERM);
+            }
+
+            let top = bucket.top_pi_waiter(&key);
+            let newval = match top.as_ref() {
+                Some((waiter, has_more)) => {
+                    let next_tid = waiter.pcb.upgrade().map_or(0, |p| p.pid().data() as u32);
+                    next_tid | if *has_more { FUTEX_WAITERS } else { 0 }
+                }
+                None => 0,
+            };
+
+            // 用户态可能同时修改了futex的值（例如设置FUTEX_WAITERS），需要重试
+            if Self::cmpxchg_futex_value(uaddr, uval, newval)? != uval {
+                continue;
+            }
+
+            if let Some((waiter, _)) = top {
+                bucket.remove(&waiter);
+                if let Some(pcb) = waiter.pcb.upgrade() {
+                    ProcessManager::wakeup(&pcb).ok();
+                }
+            }
+            return Ok(0);
+        }
     }
 
     fn get_futex_key(
@@ -512,22 +717,13 @@ impl Futex {
         // 目前address指向所在页面的起始地址
         address -= offset;
 
-        // 若不是进程间共享的futex，则返回Private
-        if !fshared {
-            return Ok(FutexKey {
-                ptr: 0,
-                word: 0,
-                offset: offset as u32,
-                key: InnerFutexKey::Private(PrivateKey {
-                    address: address as u64,
-                    address_space: None,
-                }),
-            });
-        }
-
-        // 获取到地址所在地址空间
+        // 获取到地址所在地址空间。
+        // 私有的futex只能被同一个地址空间中的线程访问，不同进程中相同地址上的futex互不相干
         let address_space = AddressSpace::current()?;
+
         // TODO： 判断是否为匿名映射，是匿名映射才返回PrivateKey
+        // 未实现共享内存机制,共享内存部分应该通过inode构建SharedKey
+        let _ = fshared;
         return Ok(FutexKey {
             ptr: 0,
             word: 0,
@@ -537,9 +733,33 @@ impl Futex {
                 address_space: Some(Arc::downgrade(&address_space)),
             }),
         });
+    }
 
-        // 未实现共享内存机制,贡献内存部分应该通过inode构建SharedKey
-        // todo!("Shared memory not implemented");
+    /// 读取用户空间中futex的值
+    fn get_futex_value(uaddr: VirtAddr) -> Result<u32, SystemError> {
+        let reader =
+            UserBufferReader::new(uaddr.as_ptr::<u32>(), core::mem::size_of::<u32>(), true)?;
+        return Ok(*reader.read_one_from_user::<u32>(0)?);
+    }
+
+    /// 原子地比较并交换用户空间中futex的值
+    ///
+    /// ## 返回值
+    ///
+    /// 交换之前的值。与`old`不相等时表示交换失败
+    fn cmpxchg_futex_value(uaddr: VirtAddr, old: u32, new: u32) -> Result<u32, SystemError> {
+        UserBufferWriter::new(uaddr.as_ptr::<u32>(), core::mem::size_of::<u32>(), true)?;
+        let atomic = unsafe { &*(uaddr.data() as *const AtomicU32) };
+        match atomic.compare_exchange(old, new, Ordering::SeqCst, Ordering::SeqCst) {
+            Ok(v) | Err(v) => return Ok(v),
+        }
+    }
+
+    /// 确保futex所在的页面可写（例如提前完成写时复制），使得之后持有桶的锁时修改它不会产生缺页
+    fn fault_in_writeable(uaddr: VirtAddr) -> Result<(), SystemError> {
+        // 带lock前缀的cmpxchg无论是否成功都会进行写访问
+        Self::cmpxchg_futex_value(uaddr, 0, 0)?;
+        return Ok(());
     }
 
     pub fn futex_atomic_op_inuser(encoded_op: u32, uaddr: VirtAddr) -> Result<bool, SystemError> {
@@ -565,9 +785,9 @@ impl Futex {
 
                 oparg &= 31;
             }
+            oparg = 1 << oparg;
         }
 
-        // TODO: 这个汇编似乎是有问题的，目前不好测试
         let old_val = Self::arch_futex_atomic_op_inuser(op, oparg, uaddr)?;
 
         match cmp {
@@ -597,46 +817,26 @@ impl Futex {
 
     /// ### 对futex进行操作
     ///
-    /// 进入该方法会关闭中断保证修改的原子性，所以进入该方法前应确保中断锁已释放
+    /// 使用原子指令修改用户空间中的值，其他cpu上的用户态线程同时修改它也不会丢失更新
     ///
     /// ### return uaddr原来的值
-    #[allow(unused_assignments)]
     pub fn arch_futex_atomic_op_inuser(
         op: FutexOP,
         oparg: u32,
         uaddr: VirtAddr,
     ) -> Result<u32, SystemError> {
-        let guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
-
-        let reader =
-            UserBufferReader::new(uaddr.as_ptr::<u32>(), core::mem::size_of::<u32>(), true)?;
-
-        let oldval = reader.read_one_from_user::<u32>(0)?;
-
-        let atomic_addr = AtomicU64::new(uaddr.data() as u64);
-        // 这个指针是指向指针的指针
-        let ptr = atomic_addr.as_ptr();
-        match op {
-            FutexOP::FUTEX_OP_SET => unsafe {
-                *((*ptr) as *mut u32) = oparg;
-            },
-            FutexOP::FUTEX_OP_ADD => unsafe {
-                *((*ptr) as *mut u32) += oparg;
-            },
-            FutexOP::FUTEX_OP_OR => unsafe {
-                *((*ptr) as *mut u32) |= oparg;
-            },
-            FutexOP::FUTEX_OP_ANDN => unsafe {
-                *((*ptr) as *mut u32) &= oparg;
-            },
-            FutexOP::FUTEX_OP_XOR => unsafe {
-                *((*ptr) as *mut u32) ^= oparg;
-            },
+        UserBufferWriter::new(uaddr.as_ptr::<u32>(), core::mem::size_of::<u32>(), true)?;
+        let atomic = unsafe { &*(uaddr.data() as *const AtomicU32) };
+
+        let oldval = match op {
+            FutexOP::FUTEX_OP_SET => atomic.swap(oparg, Ordering::SeqCst),
+            FutexOP::FUTEX_OP_ADD => atomic.fetch_add(oparg, Ordering::SeqCst),
+            FutexOP::FUTEX_OP_OR => atomic.fetch_or(oparg, Ordering::SeqCst),
+            FutexOP::FUTEX_OP_ANDN => atomic.fetch_and(!oparg, Ordering::SeqCst),
+            FutexOP::FUTEX_OP_XOR => atomic.fetch_xor(oparg, Ordering::SeqCst),
             _ => return Err(SystemError::ENOSYS),
-        }
-
-        drop(guard);
+        };
 
-        Ok(*oldval)
+        Ok(oldval)
     }
 }
@@ -1,6 +1,10 @@
 use system_error::SystemError;
 
-use crate::{mm::VirtAddr, syscall::Syscall, time::TimeSpec};
+use crate::{
+    mm::VirtAddr,
+    syscall::Syscall,
+    time::{hrtimer::ktime_get_ns, timekeeping::getnstimeofday, TimeSpec, NSEC_PER_SEC},
+};
 
 use super::{constant::*, futex::Futex};
 
@@ -33,12 +37,18 @@ impl Syscall {
             }
         }
 
+        // FUTEX_WAIT的超时时间是相对时间，其余命令的超时时间是绝对时间
+        let deadline = match timeout {
+            Some(ts) => Some(Self::futex_deadline(&ts, cmd != FutexArg::FUTEX_WAIT)?),
+            None => None,
+        };
+
         match cmd {
             FutexArg::FUTEX_WAIT => {
-                return Futex::futex_wait(uaddr, flags, val, timeout, FUTEX_BITSET_MATCH_ANY);
+                return Futex::futex_wait(uaddr, flags, val, deadline, FUTEX_BITSET_MATCH_ANY);
             }
             FutexArg::FUTEX_WAIT_BITSET => {
-                return Futex::futex_wait(uaddr, flags, val, timeout, val3);
+                return Futex::futex_wait(uaddr, flags, val, deadline, val3);
             }
             FutexArg::FUTEX_WAKE => {
                 return Futex::futex_wake(uaddr, flags, val, FUTEX_BITSET_MATCH_ANY);
@@ -78,27 +88,44 @@ impl Syscall {
                     val3 as i32,
                 );
             }
-            FutexArg::FUTEX_LOCK_PI => {
-                todo!()
-            }
-            FutexArg::FUTEX_LOCK_PI2 => {
-                todo!()
+            FutexArg::FUTEX_LOCK_PI | FutexArg::FUTEX_LOCK_PI2 => {
+                return Futex::futex_lock_pi(uaddr, flags, deadline, false);
             }
             FutexArg::FUTEX_UNLOCK_PI => {
-                todo!()
+                return Futex::futex_unlock_pi(uaddr, flags);
             }
             FutexArg::FUTEX_TRYLOCK_PI => {
-                todo!()
-            }
-            FutexArg::FUTEX_WAIT_REQUEUE_PI => {
-                todo!()
+                return Futex::futex_lock_pi(uaddr, flags, None, true);
             }
-            FutexArg::FUTEX_CMP_REQUEUE_PI => {
-                todo!()
+            FutexArg::FUTEX_WAIT_REQUEUE_PI | FutexArg::FUTEX_CMP_REQUEUE_PI => {
+                // TODO: 支持在普通futex与PI futex之间requeue
+                return Err(SystemError::ENOSYS);
             }
             _ => {
                 return Err(SystemError::ENOSYS);
             }
         }
     }
+
+    /// 把用户传入的超时时间转换为`ktime_get_ns()`时间基准下的到期时刻（单位：纳秒）
+    ///
+    /// ## 参数
+    ///
+    /// - `absolute` - 为true时，超时时间是以CLOCK_REALTIME表示的绝对时间
+    fn futex_deadline(ts: &TimeSpec, absolute: bool) -> Result<u64, SystemError> {
+        if ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= NSEC_PER_SEC as i64 {
+            return Err(SystemError::EINVAL);
+        }
+        let mut ns = (ts.tv_sec as u64)
+            .saturating_mul(NSEC_PER_SEC as u64)
+            .saturating_add(ts.tv_nsec as u64);
+
+        if absolute {
+            // 目前所有时钟都以墙上时间为准，先换算成距离现在的时长
+            let now = getnstimeofday();
+            let now_ns = now.tv_sec as u64 * NSEC_PER_SEC as u64 + now.tv_nsec as u64;
+            ns = ns.saturating_sub(now_ns);
+        }
+        return Ok(ktime_get_ns().saturating_add(ns));
+    }
 }
@@ -4,18 +4,30 @@ use core::hint::spin_loop;
 use core::mem::ManuallyDrop;
 use core::ops::{Deref, DerefMut};
 
-use core::sync::atomic::{AtomicBool, Ordering};
+use core::ptr::null_mut;
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU32, AtomicU64, Ordering};
 
-use crate::arch::CurrentIrqArch;
+use crate::arch::{CurrentIrqArch, CurrentTimeArch};
 use crate::exception::{InterruptArch, IrqFlagsGuard};
 use crate::process::ProcessManager;
+use crate::time::TimeArch;
 use system_error::SystemError;
 
 /// 实现了守卫的SpinLock, 能够支持内部可变性
 ///
+/// 使用排队自旋锁（ticket lock）实现：加锁者按照取号的先后顺序获得锁，保证公平性；
+/// 等待期间只读取`owner`，不会反复写同一个缓存行。
+///
+/// 与MCS锁不同，ticket lock的解锁操作不依赖加锁者的队列节点，因此锁可以在
+/// 另一个上下文中被释放（参见`SpinLockGuard::leak()`和`force_unlock()`）。
 #[derive(Debug)]
 pub struct SpinLock<T> {
-    lock: AtomicBool,
+    /// 下一个要发放的号码
+    next: AtomicU32,
+    /// 当前持有锁的号码
+    owner: AtomicU32,
+    /// 锁的类别，不为None时统计锁的竞争情况
+    class: Option<&'static LockClass>,
     /// 自旋锁保护的数据
     data: UnsafeCell<T>,
 }
@@ -29,6 +41,8 @@ pub struct SpinLockGuard<'a, T: 'a> {
     data: *mut T,
     irq_flag: Option<IrqFlagsGuard>,
     flags: SpinLockGuardFlags,
+    /// 获得锁的时刻（单位：时钟周期），只有统计竞争情况的锁会记录
+    acquired_at: usize,
 }
 
 impl<'a, T: 'a> SpinLockGuard<'a, T> {
@@ -62,40 +76,92 @@ unsafe impl<T> Sync for SpinLock<T> where T: Send {}
 impl<T> SpinLock<T> {
     pub const fn new(value: T) -> Self {
         return Self {
-            lock: AtomicBool::new(false),
+            next: AtomicU32::new(0),
+            owner: AtomicU32::new(0),
+            class: None,
+            data: UnsafeCell::new(value),
+        };
+    }
+
+    /// 创建一个统计竞争情况的自旋锁
+    ///
+    /// ## 参数
+    ///
+    /// - `value` - 自旋锁保护的数据
+    /// - `class` - 锁的类别，同一类别的锁共享统计信息（参见/proc/lock_stat）
+    pub const fn new_with_class(value: T, class: &'static LockClass) -> Self {
+        return Self {
+            next: AtomicU32::new(0),
+            owner: AtomicU32::new(0),
+            class: Some(class),
             data: UnsafeCell::new(value),
         };
     }
 
     #[inline(always)]
     pub fn lock(&self) -> SpinLockGuard<T> {
-        loop {
-            let res = self.try_lock();
-            if res.is_ok() {
-                return res.unwrap();
-            }
-            spin_loop();
-        }
+        ProcessManager::preempt_disable();
+        self.inner_lock();
+        return self.new_guard(None, SpinLockGuardFlags::empty());
     }
 
     /// 加锁，但是不更改preempt count
     #[inline(always)]
     pub fn lock_no_preempt(&self) -> SpinLockGuard<T> {
-        loop {
-            if let Ok(guard) = self.try_lock_no_preempt() {
-                return guard;
-            }
-            spin_loop();
-        }
+        self.inner_lock();
+        return self.new_guard(None, SpinLockGuardFlags::NO_PREEMPT);
     }
 
     pub fn lock_irqsave(&self) -> SpinLockGuard<T> {
-        loop {
-            if let Ok(guard) = self.try_lock_irqsave() {
-                return guard;
-            }
+        let irq_guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
+        ProcessManager::preempt_disable();
+        self.inner_lock();
+        return self.new_guard(Some(irq_guard), SpinLockGuardFlags::empty());
+    }
+
+    #[inline(always)]
+    fn inner_lock(&self) {
+        if self.inner_try_lock() {
+            return;
+        }
+        self.inner_lock_slow();
+    }
+
+    /// 取号并等待轮到自己
+    ///
+    /// 排队期间不改变中断状态：`lock()`排队时仍然可以响应中断（例如TLB shootdown和唤醒的IPI）。
+    /// 会在中断上下文中获取的锁，必须使用`lock_irqsave()`，否则中断处理函数会排在被它打断的加锁者后面
+    #[inline(never)]
+    fn inner_lock_slow(&self) {
+        let ticket = self.next.fetch_add(1, Ordering::Relaxed);
+        let mut spins: u64 = 0;
+        while self.owner.load(Ordering::Acquire) != ticket {
+            spins += 1;
             spin_loop();
         }
+        if let Some(class) = self.class {
+            class.record_acquire(spins);
+        }
+    }
+
+    #[inline(always)]
+    fn new_guard(
+        &self,
+        irq_flag: Option<IrqFlagsGuard>,
+        flags: SpinLockGuardFlags,
+    ) -> SpinLockGuard<T> {
+        let acquired_at = if self.class.is_some() {
+            CurrentTimeArch::get_cycles()
+        } else {
+            0
+        };
+        return SpinLockGuard {
+            lock: self,
+            data: unsafe { &mut *self.data.get() },
+            irq_flag,
+            flags,
+            acquired_at,
+        };
     }
 
     pub fn try_lock(&self) -> Result<SpinLockGuard<T>, SystemError> {
@@ -103,12 +169,7 @@ impl<T> SpinLock<T> {
         ProcessManager::preempt_disable();
 
         if self.inner_try_lock() {
-            return Ok(SpinLockGuard {
-                lock: self,
-                data: unsafe { &mut *self.data.get() },
-                irq_flag: None,
-                flags: SpinLockGuardFlags::empty(),
-            });
+            return Ok(self.new_guard(None, SpinLockGuardFlags::empty()));
         }
 
         // 如果加锁失败恢复自旋锁持有计数
@@ -117,11 +178,27 @@ impl<T> SpinLock<T> {
         return Err(SystemError::EAGAIN_OR_EWOULDBLOCK);
     }
 
+    /// 只有在没有人持有锁、也没有人排队时才取号（test-and-test-and-set）
     fn inner_try_lock(&self) -> bool {
+        // Acquire：与上一个持有者解锁时的Release配对
+        let owner = self.owner.load(Ordering::Acquire);
+        if self.next.load(Ordering::Relaxed) != owner {
+            return false;
+        }
         let res = self
-            .lock
-            .compare_exchange(false, true, Ordering::SeqCst, Ordering::SeqCst)
+            .next
+            .compare_exchange(
+                owner,
+                owner.wrapping_add(1),
+                Ordering::Acquire,
+                Ordering::Relaxed,
+            )
             .is_ok();
+        if res {
+            if let Some(class) = self.class {
+                class.record_acquire(0);
+            }
+        }
         return res;
     }
 
@@ -129,12 +206,7 @@ impl<T> SpinLock<T> {
         let irq_guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
         ProcessManager::preempt_disable();
         if self.inner_try_lock() {
-            return Ok(SpinLockGuard {
-                lock: self,
-                data: unsafe { &mut *self.data.get() },
-                irq_flag: Some(irq_guard),
-                flags: SpinLockGuardFlags::empty(),
-            });
+            return Ok(self.new_guard(Some(irq_guard), SpinLockGuardFlags::empty()));
         }
         ProcessManager::preempt_enable();
         drop(irq_guard);
@@ -143,12 +215,7 @@ impl<T> SpinLock<T> {
 
     pub fn try_lock_no_preempt(&self) -> Result<SpinLockGuard<T>, SystemError> {
         if self.inner_try_lock() {
-            return Ok(SpinLockGuard {
-                lock: self,
-                data: unsafe { &mut *self.data.get() },
-                irq_flag: None,
-                flags: SpinLockGuardFlags::NO_PREEMPT,
-            });
+            return Ok(self.new_guard(None, SpinLockGuardFlags::NO_PREEMPT));
         }
         return Err(SystemError::EAGAIN_OR_EWOULDBLOCK);
     }
@@ -160,11 +227,11 @@ impl<T> SpinLock<T> {
     /// 由于这样做可能导致preempt count不正确，因此必须小心的手动维护好preempt count。
     /// 如非必要，请不要使用这个函数。
     pub unsafe fn force_unlock(&self) {
-        self.lock.store(false, Ordering::SeqCst);
+        self.owner.fetch_add(1, Ordering::Release);
     }
 
     fn unlock(&self) {
-        self.lock.store(false, Ordering::SeqCst);
+        self.owner.fetch_add(1, Ordering::Release);
         ProcessManager::preempt_enable();
     }
 }
@@ -188,6 +255,9 @@ impl<T> DerefMut for SpinLockGuard<'_, T> {
 /// @brief 为SpinLockGuard实现Drop方法，那么，一旦守卫的生命周期结束，就会自动释放自旋锁，避免了忘记放锁的情况
 impl<T> Drop for SpinLockGuard<'_, T> {
     fn drop(&mut self) {
+        if let Some(class) = self.lock.class {
+            class.record_release(CurrentTimeArch::get_cycles().wrapping_sub(self.acquired_at));
+        }
         if self.flags.contains(SpinLockGuardFlags::NO_PREEMPT) {
             self.unlock_no_preempt();
         } else {
@@ -204,3 +274,115 @@ bitflags! {
         const NO_PREEMPT = (1<<0);
     }
 }
+
+/// 自旋锁的类别
+///
+/// 同一类别的锁（例如每个cpu的时间轮的锁）共享竞争统计信息。
+/// 类别在第一次加锁时被加入全局链表，之后可以通过/proc/lock_stat读取。
+#[derive(Debug)]
+pub struct LockClass {
+    name: &'static str,
+    /// 加锁次数
+    acquisitions: AtomicU64,
+    /// 需要等待的加锁次数
+    contentions: AtomicU64,
+    /// 等待期间的自旋次数
+    spins: AtomicU64,
+    /// 最长的持有时间（单位：时钟周期）
+    max_hold_cycles: AtomicU64,
+    /// 总的持有时间（单位：时钟周期）
+    total_hold_cycles: AtomicU64,
+    registered: AtomicBool,
+    next: AtomicPtr<LockClass>,
+}
+
+/// 已经注册的锁类别组成的链表
+static LOCK_CLASSES: AtomicPtr<LockClass> = AtomicPtr::new(null_mut());
+
+impl LockClass {
+    pub const fn new(name: &'static str) -> Self {
+        return Self {
+            name,
+            acquisitions: AtomicU64::new(0),
+            contentions: AtomicU64::new(0),
+            spins: AtomicU64::new(0),
+            max_hold_cycles: AtomicU64::new(0),
+            total_hold_cycles: AtomicU64::new(0),
+            registered: AtomicBool::new(false),
+            next: AtomicPtr::new(null_mut()),
+        };
+    }
+
+    fn record_acquire(&'static self, spins: u64) {
+        if !self.registered.load(Ordering::Relaxed) {
+            self.register();
+        }
+        self.acquisitions.fetch_add(1, Ordering::Relaxed);
+        if spins > 0 {
+            self.contentions.fetch_add(1, Ordering::Relaxed);
+            self.spins.fetch_add(spins, Ordering::Relaxed);
+        }
+    }
+
+    fn record_release(&self, hold_cycles: usize) {
+        let hold_cycles = hold_cycles as u64;
+        self.total_hold_cycles
+            .fetch_add(hold_cycles, Ordering::Relaxed);
+        self.max_hold_cycles
+            .fetch_max(hold_cycles, Ordering::Relaxed);
+    }
+
+    fn register(&'static self) {
+        if self.registered.swap(true, Ordering::AcqRel) {
+            return;
+        }
+        let this = self as *const LockClass as *mut LockClass;
+        let mut head = LOCK_CLASSES.load(Ordering::Acquire);
+        loop {
+            self.next.store(head, Ordering::Relaxed);
+            match LOCK_CLASSES.compare_exchange(head, this, Ordering::AcqRel, Ordering::Acquire) {
+                Ok(_) => return,
+                Err(h) => head = h,
+            }
+        }
+    }
+
+    pub fn name(&self) -> &'static str {
+        self.name
+    }
+
+    pub fn acquisitions(&self) -> u64 {
+        self.acquisitions.load(Ordering::Relaxed)
+    }
+
+    pub fn contentions(&self) -> u64 {
+        self.contentions.load(Ordering::Relaxed)
+    }
+
+    pub fn spins(&self) -> u64 {
+        self.spins.load(Ordering::Relaxed)
+    }
+
+    /// 最长的持有时间（单位：纳秒）
+    pub fn max_hold_ns(&self) -> u64 {
+        CurrentTimeArch::cycles2ns(self.max_hold_cycles.load(Ordering::Relaxed) as usize) as u64
+    }
+
+    /// 总的持有时间（单位：纳秒）
+    pub fn total_hold_ns(&self) -> u64 {
+        CurrentTimeArch::cycles2ns(self.total_hold_cycles.load(Ordering::Relaxed) as usize) as u64
+    }
+}
+
+/// 遍历所有已经注册的锁类别
+pub fn lock_classes() -> impl Iterator<Item = &'static LockClass> {
+    let mut cur = LOCK_CLASSES.load(Ordering::Acquire);
+    return core::iter::from_fn(move || {
+        if cur.is_null() {
+            return None;
+        }
+        let class = unsafe { &*cur };
+        cur = class.next.load(Ordering::Acquire);
+        return Some(class);
+    });
+}
@@ -13,7 +13,10 @@ use core::{
     ptr::NonNull,
 };
 
-use super::page_frame::{FrameAllocator, PageFrameCount};
+use super::{
+    page_frame::{FrameAllocator, PageFrameCount},
+    slab::SlabAllocator,
+};
 
 /// 类kmalloc的分配器应当实现的trait
 pub trait LocalAlloc {
@@ -57,8 +60,13 @@ impl KernelAllocator {
 }
 
 /// 为内核分配器实现LocalAlloc的trait
+///
+/// 小对象由slab分配，只有大于slab最大对象大小的请求才会直接从buddy分配整页
 impl LocalAlloc for KernelAllocator {
     unsafe fn local_alloc(&self, layout: Layout) -> *mut u8 {
+        if SlabAllocator::class_index(&layout).is_some() {
+            return SlabAllocator::allocate(layout);
+        }
         return self
             .alloc_in_buddy(layout)
             .map(|x| x.as_mut_ptr() as *mut u8)
@@ -66,6 +74,13 @@ impl LocalAlloc for KernelAllocator {
     }
 
     unsafe fn local_alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        if SlabAllocator::class_index(&layout).is_some() {
+            let ptr = SlabAllocator::allocate(layout);
+            if !ptr.is_null() {
+                core::ptr::write_bytes(ptr, 0, layout.size());
+            }
+            return ptr;
+        }
         return self
             .alloc_in_buddy(layout)
             .map(|x| {
@@ -77,26 +92,40 @@ impl LocalAlloc for KernelAllocator {
     }
 
     unsafe fn local_dealloc(&self, ptr: *mut u8, layout: Layout) {
+        if SlabAllocator::class_index(&layout).is_some() {
+            SlabAllocator::deallocate(ptr, layout);
+            return;
+        }
         self.free_in_buddy(ptr, layout);
     }
 }
 
+impl KernelAllocator {
+    /// 获取分配请求对应的日志来源
+    #[inline]
+    fn log_source(layout: &Layout) -> klog_types::LogSource {
+        if SlabAllocator::class_index(layout).is_some() {
+            klog_types::LogSource::Slab
+        } else {
+            klog_types::LogSource::Buddy
+        }
+    }
+}
+
 /// 为内核slab分配器实现GlobalAlloc特性
 unsafe impl GlobalAlloc for KernelAllocator {
     unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-        let r = self.local_alloc_zeroed(layout);
+        let r = self.local_alloc(layout);
         mm_debug_log(
             klog_types::AllocatorLogType::Alloc(AllocLogItem::new(
                 layout.clone(),
                 Some(r as usize),
                 None,
             )),
-            klog_types::LogSource::Buddy,
+            Self::log_source(&layout),
         );
 
         return r;
-
-        // self.local_alloc_zeroed(layout, 0)
     }
 
     unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
@@ -108,7 +137,7 @@ unsafe impl GlobalAlloc for KernelAllocator {
                 Some(r as usize),
                 None,
             )),
-            klog_types::LogSource::Buddy,
+            Self::log_source(&layout),
         );
 
         return r;
@@ -121,7 +150,7 @@ unsafe impl GlobalAlloc for KernelAllocator {
                 Some(ptr as usize),
                 None,
             )),
-            klog_types::LogSource::Buddy,
+            Self::log_source(&layout),
         );
 
         self.local_dealloc(ptr, layout);
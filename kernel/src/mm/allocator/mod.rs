@@ -2,4 +2,5 @@ pub mod buddy;
 pub mod bump;
 pub mod kernel_allocator;
 pub mod page_frame;
+pub mod per_cpu_pages;
 pub mod slab;
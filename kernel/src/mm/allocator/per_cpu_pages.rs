@@ -0,0 +1,308 @@
+//! 每个CPU的页帧缓存
+//!
+//! 在全局的buddy分配器前面，为每个CPU维护若干个小阶数（order <= PCP_MAX_ORDER）的空闲块链表。
+//! 大部分的页帧分配/释放只需要访问本CPU的链表，只有在链表为空、或者超过高水位线时，
+//! 才会批量地与buddy交换页帧，从而避免所有CPU都争用buddy的那一把锁。
+//!
+//! 空闲块链表是侵入式的：每个空闲块的第一个字存放下一个空闲块的物理地址，不需要额外的内存。
+//!
+//! 水位线可以通过启动参数调整（以order 0的页帧数量为单位，更高阶的链表按比例缩小）：
+//!
+//! - `pcp_high=<n>`：链表中最多缓存的块数，超过则释放到buddy
+//! - `pcp_low=<n>`：超过高水位线时，链表会被释放到剩余该数量
+//! - `pcp_batch=<n>`：链表为空时，一次从buddy中取出的块数
+
+use core::cmp::{max, min};
+
+use alloc::vec::Vec;
+
+use crate::{
+    arch::MMArch,
+    init::boot_params,
+    kinfo,
+    libs::spinlock::SpinLock,
+    mm::{
+        percpu::{PerCpu, PerCpuVar},
+        MemoryManagementArch, PhysAddr,
+    },
+    smp::cpu::ProcessorId,
+};
+
+use super::page_frame::{FrameAllocator, PageFrameCount, PageFrameUsage};
+
+/// 每个CPU缓存的最大阶数（包含）。阶数为k的块包含 1<<k 个页帧
+const PCP_MAX_ORDER: usize = 3;
+
+static mut PER_CPU_PAGES: Option<PerCpuVar<SpinLock<PerCpuPages>>> = None;
+static mut PCP_WATERMARK: PcpWatermark = PcpWatermark::DEFAULT;
+
+/// 每CPU页帧缓存的水位线
+#[derive(Debug, Clone, Copy)]
+struct PcpWatermark {
+    low: usize,
+    high: usize,
+    batch: usize,
+}
+
+impl PcpWatermark {
+    const DEFAULT: Self = Self {
+        low: 128,
+        high: 192,
+        batch: 32,
+    };
+
+    /// 从启动参数中解析水位线，没有指定的项使用默认值
+    fn from_cmdline(cmdline: &str) -> Self {
+        let mut wm = Self::DEFAULT;
+        for arg in cmdline.split(|c: char| c.is_whitespace() || c == '\0') {
+            let (key, value) = match arg.split_once('=') {
+                Some(kv) => kv,
+                None => continue,
+            };
+            let value = match value.parse::<usize>() {
+                Ok(v) => v,
+                Err(_) => continue,
+            };
+            match key {
+                "pcp_high" => wm.high = value,
+                "pcp_low" => wm.low = value,
+                "pcp_batch" => wm.batch = value,
+                _ => {}
+            }
+        }
+
+        // 保证 1 <= batch <= high, low < high
+        wm.high = max(wm.high, 1);
+        wm.batch = min(max(wm.batch, 1), wm.high);
+        if wm.low >= wm.high {
+            wm.low = wm.high - wm.batch;
+        }
+        return wm;
+    }
+
+    /// 获取指定阶数的链表的水位线
+    #[inline]
+    fn for_order(&self, order: usize) -> Self {
+        Self {
+            low: self.low >> order,
+            high: max(self.high >> order, 1),
+            batch: max(self.batch >> order, 1),
+        }
+    }
+}
+
+/// 一个CPU的页帧缓存
+#[derive(Debug)]
+struct PerCpuPages {
+    lists: [PcpList; PCP_MAX_ORDER + 1],
+}
+
+impl PerCpuPages {
+    const fn new() -> Self {
+        Self {
+            lists: [
+                PcpList::new(),
+                PcpList::new(),
+                PcpList::new(),
+                PcpList::new(),
+            ],
+        }
+    }
+
+    /// 缓存的页帧总数
+    fn cached_pages(&self) -> usize {
+        self.lists
+            .iter()
+            .enumerate()
+            .map(|(order, list)| list.count << order)
+            .sum()
+    }
+}
+
+/// 某个阶数的空闲块链表
+#[derive(Debug)]
+struct PcpList {
+    head: PhysAddr,
+    count: usize,
+}
+
+impl PcpList {
+    const fn new() -> Self {
+        Self {
+            head: PhysAddr::new(0),
+            count: 0,
+        }
+    }
+
+    unsafe fn push(&mut self, paddr: PhysAddr) {
+        MMArch::write(MMArch::phys_2_virt(paddr).unwrap(), self.head);
+        self.head = paddr;
+        self.count += 1;
+    }
+
+    unsafe fn pop(&mut self) -> Option<PhysAddr> {
+        if self.count == 0 {
+            return None;
+        }
+        let paddr = self.head;
+        self.head = MMArch::read(MMArch::phys_2_virt(paddr).unwrap());
+        self.count -= 1;
+        return Some(paddr);
+    }
+}
+
+/// 初始化每CPU页帧缓存
+///
+/// 必须在buddy分配器初始化之后调用。在此之前，所有的分配请求都会直接交给buddy处理。
+pub fn per_cpu_pages_init() {
+    let wm = PcpWatermark::from_cmdline(boot_params().read().boot_cmdline_str());
+
+    let mut data = Vec::with_capacity(PerCpu::MAX_CPU_NUM as usize);
+    for _ in 0..PerCpu::MAX_CPU_NUM {
+        data.push(SpinLock::new(PerCpuPages::new()));
+    }
+
+    unsafe {
+        PCP_WATERMARK = wm;
+        PER_CPU_PAGES = Some(PerCpuVar::new(data).unwrap());
+    }
+    kinfo!("Per-cpu page cache initialized, watermark: {:?}", wm);
+}
+
+#[inline]
+fn per_cpu_pages() -> Option<&'static PerCpuVar<SpinLock<PerCpuPages>>> {
+    unsafe { PER_CPU_PAGES.as_ref() }
+}
+
+/// 获取count对应的、可以被每CPU缓存的阶数
+#[inline]
+fn pcp_order(count: PageFrameCount) -> Option<usize> {
+    let order = count.data().trailing_zeros() as usize;
+    if order <= PCP_MAX_ORDER && count.data().is_power_of_two() {
+        return Some(order);
+    }
+    return None;
+}
+
+/// 分配页帧。小阶数的请求优先从当前CPU的缓存中分配
+///
+/// ## 参数
+///
+/// - `buddy` - 全局的buddy分配器
+/// - `count` - 要分配的页帧数量
+pub unsafe fn pcp_allocate<A: FrameAllocator>(
+    buddy: &SpinLock<Option<A>>,
+    count: PageFrameCount,
+) -> Option<(PhysAddr, PageFrameCount)> {
+    if let (Some(order), Some(pcp)) = (pcp_order(count), per_cpu_pages()) {
+        let mut guard = pcp.get().lock_irqsave();
+        let list = &mut guard.lists[order];
+        if list.count == 0 {
+            // 批量地从buddy取出空闲块
+            let wm = PCP_WATERMARK.for_order(order);
+            if let Some(ref mut allocator) = *buddy.lock_irqsave() {
+                for _ in 0..wm.batch {
+                    match allocator.allocate(count) {
+                        Some((paddr, _)) => list.push(paddr),
+                        None => break,
+                    }
+                }
+            }
+        }
+
+        if let Some(paddr) = list.pop() {
+            return Some((paddr, count));
+        }
+    }
+
+    let r = buddy
+        .lock_irqsave()
+        .as_mut()
+        .and_then(|a| a.allocate(count));
+    if r.is_none() && per_cpu_pages().is_some() {
+        // 内存不足时，把所有CPU缓存的页帧都还给buddy，然后重试
+        pcp_drain_all(buddy);
+        return buddy
+            .lock_irqsave()
+            .as_mut()
+            .and_then(|a| a.allocate(count));
+    }
+    return r;
+}
+
+/// 释放页帧。小阶数的块会先放入当前CPU的缓存
+///
+/// ## 参数
+///
+/// - `buddy` - 全局的buddy分配器
+/// - `address` - 要释放的块的起始物理地址
+/// - `count` - 块的页帧数量（必须是2的幂）
+pub unsafe fn pcp_free<A: FrameAllocator>(
+    buddy: &SpinLock<Option<A>>,
+    address: PhysAddr,
+    count: PageFrameCount,
+) {
+    if let (Some(order), Some(pcp)) = (pcp_order(count), per_cpu_pages()) {
+        let mut guard = pcp.get().lock_irqsave();
+        let list = &mut guard.lists[order];
+        list.push(address);
+
+        let wm = PCP_WATERMARK.for_order(order);
+        if list.count > wm.high {
+            // 超过高水位线，批量地归还给buddy
+            if let Some(ref mut allocator) = *buddy.lock_irqsave() {
+                while list.count > wm.low {
+                    let paddr = list.pop().unwrap();
+                    allocator.free(paddr, count);
+                }
+            }
+        }
+        return;
+    }
+
+    if let Some(ref mut allocator) = *buddy.lock_irqsave() {
+        allocator.free(address, count);
+    }
+}
+
+/// 获取页帧使用情况。每CPU缓存中的页帧也被视为空闲页帧
+pub unsafe fn pcp_usage<A: FrameAllocator>(buddy: &SpinLock<Option<A>>) -> Option<PageFrameUsage> {
+    // 注意加锁顺序：先每CPU缓存，后buddy
+    let mut cached = 0;
+    if let Some(pcp) = per_cpu_pages() {
+        for cpu in 0..PerCpu::MAX_CPU_NUM {
+            cached += pcp
+                .force_get(ProcessorId::new(cpu))
+                .lock_irqsave()
+                .cached_pages();
+        }
+    }
+
+    let usage = buddy.lock_irqsave().as_ref().map(|a| a.usage())?;
+    return Some(PageFrameUsage::new(
+        usage.used() - PageFrameCount::new(cached),
+        usage.total(),
+    ));
+}
+
+/// 把所有CPU缓存的页帧都归还给buddy
+pub unsafe fn pcp_drain_all<A: FrameAllocator>(buddy: &SpinLock<Option<A>>) {
+    let pcp = match per_cpu_pages() {
+        Some(pcp) => pcp,
+        None => return,
+    };
+
+    for cpu in 0..PerCpu::MAX_CPU_NUM {
+        let mut guard = pcp.force_get(ProcessorId::new(cpu)).lock_irqsave();
+        let mut buddy_guard = buddy.lock_irqsave();
+        let allocator = match buddy_guard.as_mut() {
+            Some(a) => a,
+            None => return,
+        };
+        for (order, list) in guard.lists.iter_mut().enumerate() {
+            while let Some(paddr) = list.pop() {
+                allocator.free(paddr, PageFrameCount::new(1 << order));
+            }
+        }
+    }
+}
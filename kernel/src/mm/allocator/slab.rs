@@ -1,123 +1,323 @@
-//! 当前slab分配器暂时不使用，等待后续完善后合并主线
-#![allow(dead_code)]
+//! 内核的slab分配器
+//!
+//! 按照2的幂把小对象划分为若干个大小类（8B ~ 2KB），每个大小类维护partial/full/free三个slab链表。
+//! slab本身从buddy分配器申请，且按照slab的大小对齐，因此释放对象时，可以直接通过地址找到它所在的slab。
+//!
+//! 大于2KB（或者对齐要求大于2KB）的分配请求，不经过slab，直接交给buddy分配器处理。
 
-use core::alloc::Layout;
+use core::{alloc::Layout, cmp::max, intrinsics::unlikely, mem::size_of, ptr::null_mut};
 
-// 定义Slab，用来存放空闲块
-pub struct Slab {
-    block_size: usize,
-    free_block_list: FreeBlockList,
+use crate::{
+    arch::{mm::LockedFrameAllocator, MMArch},
+    libs::spinlock::SpinLock,
+    mm::{
+        page_meta::{page_meta, PageMetaFlags},
+        MemoryManagementArch, VirtAddr,
+    },
+};
+
+use super::page_frame::{FrameAllocator, PageFrameCount};
+
+/// 最小的对象大小为 1<<3 = 8 字节
+const SLAB_MIN_OBJ_SHIFT: usize = 3;
+/// 最大的对象大小为 1<<11 = 2KB
+const SLAB_MAX_OBJ_SHIFT: usize = 11;
+/// 大小类的数量
+const SLAB_CLASS_NUM: usize = SLAB_MAX_OBJ_SHIFT - SLAB_MIN_OBJ_SHIFT + 1;
+/// 对象大小大于等于 1<<9 的大小类，每个slab占用4页，以减少slab头部造成的浪费
+const SLAB_LARGE_OBJ_SHIFT: usize = 9;
+/// 每个大小类最多缓存的空闲slab数量，超出的部分会归还给buddy
+const SLAB_MAX_FREE_SLABS: usize = 2;
+
+/// slab能够处理的最大对象大小
+pub const SLAB_MAX_OBJ_SIZE: usize = 1 << SLAB_MAX_OBJ_SHIFT;
+
+/// 全局的slab分配器
+static SLAB_CACHES: [SpinLock<SlabCache>; SLAB_CLASS_NUM] = [
+    SpinLock::new(SlabCache::new(3)),
+    SpinLock::new(SlabCache::new(4)),
+    SpinLock::new(SlabCache::new(5)),
+    SpinLock::new(SlabCache::new(6)),
+    SpinLock::new(SlabCache::new(7)),
+    SpinLock::new(SlabCache::new(8)),
+    SpinLock::new(SlabCache::new(9)),
+    SpinLock::new(SlabCache::new(10)),
+    SpinLock::new(SlabCache::new(11)),
+];
+
+pub struct SlabAllocator;
+
+impl SlabAllocator {
+    /// 获取layout对应的大小类的下标
+    ///
+    /// ## 返回值
+    ///
+    /// - `Some(index)` - 该layout可以由slab分配
+    /// - `None` - 该layout太大，应当由buddy分配
+    #[inline]
+    pub fn class_index(layout: &Layout) -> Option<usize> {
+        let size = max(layout.size(), layout.align());
+        if unlikely(size > SLAB_MAX_OBJ_SIZE) {
+            return None;
+        }
+        let size = max(size, 1 << SLAB_MIN_OBJ_SHIFT).next_power_of_two();
+        return Some(size.trailing_zeros() as usize - SLAB_MIN_OBJ_SHIFT);
+    }
+
+    /// 从slab中分配一个对象
+    ///
+    /// ## 返回值
+    ///
+    /// 分配得到的对象的地址，如果layout不能由slab处理，或者内存不足，则返回空指针
+    pub unsafe fn allocate(layout: Layout) -> *mut u8 {
+        if let Some(index) = Self::class_index(&layout) {
+            return SLAB_CACHES[index].lock_irqsave().allocate();
+        }
+        return null_mut();
+    }
+
+    /// 把对象归还给slab
+    ///
+    /// ## 参数
+    ///
+    /// - `ptr` - 对象的地址
+    /// - `layout` - 分配该对象时使用的layout
+    pub unsafe fn deallocate(ptr: *mut u8, layout: Layout) {
+        let index = Self::class_index(&layout).expect("slab: deallocate a non-slab layout");
+        SLAB_CACHES[index].lock_irqsave().deallocate(ptr);
+    }
 }
 
-impl Slab {
-    /// @brief: 初始化一个slab
-    /// @param {usize} start_addr
-    /// @param {usize} slab_size
-    /// @param {usize} block_size
-    pub unsafe fn new(start_addr: usize, slab_size: usize, block_size: usize) -> Slab {
-        let blocks_num = slab_size / block_size;
-        return Slab {
-            block_size: block_size,
-            free_block_list: FreeBlockList::new(start_addr, block_size, blocks_num),
+/// 某个大小类的slab缓存
+#[derive(Debug)]
+struct SlabCache {
+    /// 对象的大小（字节）
+    obj_size: usize,
+    /// 每个slab占用的页数（必须是2的幂）
+    slab_pages: usize,
+    /// 有部分空闲对象的slab
+    partial: SlabList,
+    /// 所有对象都已分配的slab
+    full: SlabList,
+    /// 所有对象都空闲的slab
+    free: SlabList,
+}
+
+/// SlabCache中的裸指针只在持有锁的情况下被访问
+unsafe impl Send for SlabCache {}
+
+impl SlabCache {
+    const fn new(obj_shift: usize) -> Self {
+        let slab_pages = if obj_shift >= SLAB_LARGE_OBJ_SHIFT {
+            4
+        } else {
+            1
+        };
+        return Self {
+            obj_size: 1 << obj_shift,
+            slab_pages,
+            partial: SlabList::new(),
+            full: SlabList::new(),
+            free: SlabList::new(),
         };
     }
 
-    /// @brief: 获取slab中可用的block数
-    pub fn used_blocks(&self) -> usize {
-        return self.free_block_list.len();
+    #[inline]
+    fn slab_bytes(&self) -> usize {
+        self.slab_pages * MMArch::PAGE_SIZE
     }
 
-    /// @brief: 扩大free_block_list
-    /// @param {*} mut
-    /// @param {usize} start_addr
-    /// @param {usize} slab_size
-    pub fn grow(&mut self, start_addr: usize, slab_size: usize) {
-        let num_of_blocks = slab_size / self.block_size;
-        let mut block_list =
-            unsafe { FreeBlockList::new(start_addr, self.block_size, num_of_blocks) };
-        // 将新链表接到原链表的后面
-        while let Some(block) = block_list.pop() {
-            self.free_block_list.push(block);
+    /// 第一个对象相对于slab起始地址的偏移量（跳过slab头部，并按照对象大小对齐）
+    #[inline]
+    fn obj_offset(&self) -> usize {
+        (size_of::<SlabHeader>() + self.obj_size - 1) & !(self.obj_size - 1)
+    }
+
+    unsafe fn allocate(&mut self) -> *mut u8 {
+        let slab = if let Some(slab) = self.partial.first() {
+            slab
+        } else {
+            let slab = match self.free.pop() {
+                Some(slab) => slab,
+                None => match self.grow() {
+                    Some(slab) => slab,
+                    None => return null_mut(),
+                },
+            };
+            self.partial.push(slab);
+            slab
+        };
+
+        let header = &mut *slab;
+        let obj = header.free_list;
+        assert!(!obj.is_null(), "slab: partial slab has no free object");
+        header.free_list = (*obj).next;
+        header.inuse += 1;
+
+        if header.inuse == header.total {
+            self.partial.remove(slab);
+            self.full.push(slab);
         }
+        return obj as *mut u8;
     }
-    /// @brief: 从slab中分配一个block
-    /// @return 分配的内存地址
-    pub fn allocate(&mut self, _layout: Layout) -> Option<*mut u8> {
-        match self.free_block_list.pop() {
-            Some(block) => return Some(block.addr() as *mut u8),
-            None => return None,
+
+    unsafe fn deallocate(&mut self, ptr: *mut u8) {
+        let slab = (ptr as usize & !(self.slab_bytes() - 1)) as *mut SlabHeader;
+        let header = &mut *slab;
+        assert!(
+            header.inuse > 0 && header.obj_size == self.obj_size,
+            "slab: invalid free, ptr={:p}, obj_size={}",
+            ptr,
+            self.obj_size
+        );
+        let was_full = header.inuse == header.total;
+
+        let obj = ptr as *mut FreeObject;
+        (*obj).next = header.free_list;
+        header.free_list = obj;
+        header.inuse -= 1;
+
+        if was_full {
+            self.full.remove(slab);
+            if header.inuse == 0 {
+                self.release(slab);
+            } else {
+                self.partial.push(slab);
+            }
+        } else if header.inuse == 0 {
+            self.partial.remove(slab);
+            self.release(slab);
         }
     }
-    /// @brief: 将block归还给slab
-    pub fn free(&mut self, ptr: *mut u8) {
-        let ptr = ptr as *mut FreeBlock;
-        unsafe {
-            self.free_block_list.push(&mut *ptr);
+
+    /// 从buddy申请一个新的slab，并初始化其空闲对象链表
+    unsafe fn grow(&mut self) -> Option<*mut SlabHeader> {
+        let (paddr, count) = LockedFrameAllocator.allocate(PageFrameCount::new(self.slab_pages))?;
+        let vaddr = MMArch::phys_2_virt(paddr)?;
+        assert!(
+            vaddr.check_aligned(self.slab_bytes()),
+            "slab: buddy returned an unaligned block"
+        );
+        assert!(count.data() == self.slab_pages);
+        if let Some(meta) = page_meta(paddr) {
+            meta.set_flags(PageMetaFlags::PG_SLAB);
         }
+
+        let base = vaddr.data();
+        let offset = self.obj_offset();
+        let total = (self.slab_bytes() - offset) / self.obj_size;
+
+        // 从后往前串起空闲链表，使得分配时地址是递增的
+        let mut free_list: *mut FreeObject = null_mut();
+        for i in (0..total).rev() {
+            let obj = (base + offset + i * self.obj_size) as *mut FreeObject;
+            (*obj).next = free_list;
+            free_list = obj;
+        }
+
+        let slab = base as *mut SlabHeader;
+        slab.write(SlabHeader {
+            prev: null_mut(),
+            next: null_mut(),
+            free_list,
+            obj_size: self.obj_size,
+            inuse: 0,
+            total,
+        });
+        return Some(slab);
     }
+
+    /// 处理一个已经完全空闲的slab：缓存起来，或者归还给buddy
+    unsafe fn release(&mut self, slab: *mut SlabHeader) {
+        if self.free.len() < SLAB_MAX_FREE_SLABS {
+            self.free.push(slab);
+            return;
+        }
+
+        let paddr = MMArch::virt_2_phys(VirtAddr::new(slab as usize)).unwrap();
+        LockedFrameAllocator.free(paddr, PageFrameCount::new(self.slab_pages));
+    }
+}
+
+/// slab的头部，存放在slab的起始位置
+#[derive(Debug)]
+#[repr(C)]
+struct SlabHeader {
+    prev: *mut SlabHeader,
+    next: *mut SlabHeader,
+    /// 空闲对象链表
+    free_list: *mut FreeObject,
+    /// 对象大小，用于检测错误的释放
+    obj_size: usize,
+    /// 已分配的对象数
+    inuse: usize,
+    /// 该slab中对象的总数
+    total: usize,
 }
-/// slab中的空闲块
-struct FreeBlockList {
+
+/// 空闲对象，复用对象本身的空间来存放链表指针
+struct FreeObject {
+    next: *mut FreeObject,
+}
+
+/// slab的侵入式双向链表
+#[derive(Debug)]
+struct SlabList {
+    head: *mut SlabHeader,
     len: usize,
-    head: Option<&'static mut FreeBlock>,
 }
 
-impl FreeBlockList {
-    unsafe fn new(start_addr: usize, block_size: usize, num_of_blocks: usize) -> FreeBlockList {
-        let mut new_list = FreeBlockList::new_empty();
-        for i in (0..num_of_blocks).rev() {
-            // 从后往前分配，避免内存碎片
-            let new_block = (start_addr + i * block_size) as *mut FreeBlock;
-            new_list.push(&mut *new_block);
+impl SlabList {
+    const fn new() -> Self {
+        Self {
+            head: null_mut(),
+            len: 0,
         }
-        return new_list;
-    }
-
-    fn new_empty() -> FreeBlockList {
-        return FreeBlockList { len: 0, head: None };
     }
 
+    #[inline]
     fn len(&self) -> usize {
-        return self.len;
+        self.len
     }
 
-    /// @brief: 将空闲块从链表中弹出
-    fn pop(&mut self) -> Option<&'static mut FreeBlock> {
-        // 从链表中弹出一个空闲块
-        let block = self.head.take().map(|node| {
-            self.head = node.next.take();
-            self.len -= 1;
-            node
-        });
-        return block;
+    #[inline]
+    fn first(&self) -> Option<*mut SlabHeader> {
+        if self.head.is_null() {
+            None
+        } else {
+            Some(self.head)
+        }
     }
 
-    /// @brief: 将空闲块压入链表
-    fn push(&mut self, free_block: &'static mut FreeBlock) {
-        free_block.next = self.head.take();
+    unsafe fn push(&mut self, slab: *mut SlabHeader) {
+        (*slab).prev = null_mut();
+        (*slab).next = self.head;
+        if !self.head.is_null() {
+            (*self.head).prev = slab;
+        }
+        self.head = slab;
         self.len += 1;
-        self.head = Some(free_block);
     }
 
-    fn is_empty(&self) -> bool {
-        return self.head.is_none();
+    unsafe fn pop(&mut self) -> Option<*mut SlabHeader> {
+        let slab = self.first()?;
+        self.remove(slab);
+        return Some(slab);
     }
-}
 
-impl Drop for FreeBlockList {
-    fn drop(&mut self) {
-        while let Some(_) = self.pop() {}
-    }
-}
-
-struct FreeBlock {
-    next: Option<&'static mut FreeBlock>,
-}
-
-impl FreeBlock {
-    /// @brief: 获取FreeBlock的地址
-    /// @return {*}
-    fn addr(&self) -> usize {
-        return self as *const _ as usize;
+    unsafe fn remove(&mut self, slab: *mut SlabHeader) {
+        let prev = (*slab).prev;
+        let next = (*slab).next;
+        if prev.is_null() {
+            self.head = next;
+        } else {
+            (*prev).next = next;
+        }
+        if !next.is_null() {
+            (*next).prev = prev;
+        }
+        (*slab).prev = null_mut();
+        (*slab).next = null_mut();
+        self.len -= 1;
     }
 }
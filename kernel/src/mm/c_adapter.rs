@@ -1,8 +1,7 @@
 //! 这是暴露给C的接口，用于在C语言中使用Rust的内存分配器。
 
-use core::intrinsics::unlikely;
+use core::{alloc::Layout, intrinsics::unlikely};
 
-use alloc::vec::Vec;
 use hashbrown::HashMap;
 use system_error::SystemError;
 
@@ -14,13 +13,20 @@ use crate::{
 };
 
 use super::{
-    allocator::page_frame::PageFrameCount, kernel_mapper::KernelMapper, mmio_buddy::mmio_pool,
-    no_init::pseudo_map_phys, page::PageFlags, MemoryManagementArch, PhysAddr, VirtAddr,
+    allocator::{
+        kernel_allocator::{KernelAllocator, LocalAlloc},
+        page_frame::PageFrameCount,
+    },
+    kernel_mapper::KernelMapper,
+    mmio_buddy::mmio_pool,
+    no_init::pseudo_map_phys,
+    page::PageFlags,
+    MemoryManagementArch, PhysAddr, VirtAddr,
 };
 
 lazy_static! {
     // 用于记录内核分配给C的空间信息
-    static ref C_ALLOCATION_MAP: SpinLock<HashMap<VirtAddr, (VirtAddr, usize, usize)>> = SpinLock::new(HashMap::new());
+    static ref C_ALLOCATION_MAP: SpinLock<HashMap<VirtAddr, Layout>> = SpinLock::new(HashMap::new());
 }
 
 /// [EXTERN TO C] Use pseudo mapper to map physical memory to virtual memory.
@@ -75,38 +81,45 @@ pub unsafe extern "C" fn kmalloc(size: usize, _gfp: gfp_t) -> usize {
     return do_kmalloc(size, true);
 }
 
-fn do_kmalloc(size: usize, _zero: bool) -> usize {
-    let space: Vec<u8> = vec![0u8; size];
-
-    assert!(space.len() == size);
-    let (ptr, len, cap) = space.into_raw_parts();
-    if !ptr.is_null() {
-        let vaddr = VirtAddr::new(ptr as usize);
-        let len = len as usize;
-        let cap = cap as usize;
-        let mut guard = C_ALLOCATION_MAP.lock();
-        if unlikely(guard.contains_key(&vaddr)) {
-            drop(guard);
-            unsafe {
-                drop(Vec::from_raw_parts(vaddr.data() as *mut u8, len, cap));
-            }
-            panic!(
-                "do_kmalloc: vaddr {:?} already exists in C Allocation Map, query size: {size}, zero: {_zero}",
-                vaddr
-            );
+/// C语言分配的内存按照8字节对齐，小对象由slab分配
+const KMALLOC_ALIGN: usize = 8;
+
+fn do_kmalloc(size: usize, zero: bool) -> usize {
+    let layout = match Layout::from_size_align(core::cmp::max(size, 1), KMALLOC_ALIGN) {
+        Ok(layout) => layout,
+        Err(_) => return SystemError::EINVAL.to_posix_errno() as i64 as usize,
+    };
+
+    let ptr = unsafe {
+        if zero {
+            KernelAllocator.local_alloc_zeroed(layout)
+        } else {
+            KernelAllocator.local_alloc(layout)
         }
-        // 插入到C Allocation Map中
-        guard.insert(vaddr, (vaddr, len, cap));
-        return vaddr.data();
-    } else {
+    };
+    if ptr.is_null() {
         return SystemError::ENOMEM.to_posix_errno() as i64 as usize;
     }
+
+    let vaddr = VirtAddr::new(ptr as usize);
+    let mut guard = C_ALLOCATION_MAP.lock_irqsave();
+    if unlikely(guard.contains_key(&vaddr)) {
+        drop(guard);
+        unsafe { KernelAllocator.local_dealloc(ptr, layout) };
+        panic!(
+            "do_kmalloc: vaddr {:?} already exists in C Allocation Map, query size: {size}, zero: {zero}",
+            vaddr
+        );
+    }
+    // 插入到C Allocation Map中
+    guard.insert(vaddr, layout);
+    return vaddr.data();
 }
 
 #[no_mangle]
 pub unsafe extern "C" fn kfree(vaddr: usize) -> usize {
     let vaddr = VirtAddr::new(vaddr);
-    let mut guard = C_ALLOCATION_MAP.lock();
+    let mut guard = C_ALLOCATION_MAP.lock_irqsave();
     let p = guard.remove(&vaddr);
     drop(guard);
 
@@ -114,8 +127,8 @@ pub unsafe extern "C" fn kfree(vaddr: usize) -> usize {
         kerror!("kfree: vaddr {:?} not found in C Allocation Map", vaddr);
         return SystemError::EINVAL.to_posix_errno() as i64 as usize;
     }
-    let (vaddr, len, cap) = p.unwrap();
-    drop(Vec::from_raw_parts(vaddr.data() as *mut u8, len, cap));
+    let layout = p.unwrap();
+    KernelAllocator.local_dealloc(vaddr.data() as *mut u8, layout);
     return 0;
 }
 
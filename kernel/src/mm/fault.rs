@@ -0,0 +1,213 @@
+//! 用户空间缺页异常的处理
+//!
+//! 匿名映射在创建VMA时不再分配物理页，而是在第一次访问时，由缺页异常按需分配并清零。
+//! fork时父子进程共享的可写私有页面被设置为只读，在发生写访问时，由缺页异常复制出私有的副本（写时复制）。
+//! 体系结构相关的缺页异常入口只需要解析出访问的类型，然后调用`PageFaultHandler::handle_user_fault`。
+
+use core::intrinsics::unlikely;
+
+use alloc::sync::Arc;
+use system_error::SystemError;
+
+use crate::arch::{mm::PageMapper, MMArch};
+
+use super::{
+    allocator::page_frame::{allocate_page_frames, PageFrameCount},
+    page::{Flusher, PageFlags, PageFlushAll, StaleFrames},
+    page_meta::{page_meta, PageMetaFlags},
+    page_ref::page_ref_count_mapped,
+    ucontext::{AddressSpace, InnerAddressSpace, LockedVMA},
+    MemoryManagementArch, PhysAddr, VirtAddr, VmFlags,
+};
+
+bitflags! {
+    /// 缺页异常的访问类型
+    pub struct FaultFlags: u32 {
+        /// 写访问
+        const FAULT_FLAG_WRITE = 1 << 0;
+        /// 异常发生在用户态
+        const FAULT_FLAG_USER = 1 << 1;
+        /// 取指令导致的异常
+        const FAULT_FLAG_INSTRUCTION = 1 << 2;
+        /// 页面存在，但是访问权限不足
+        const FAULT_FLAG_PRESENT = 1 << 3;
+    }
+}
+
+pub struct PageFaultHandler;
+
+impl PageFaultHandler {
+    /// 处理当前进程的用户地址空间内的缺页异常
+    ///
+    /// ## 参数
+    ///
+    /// - `address` - 触发异常的虚拟地址
+    /// - `flags` - 访问类型
+    ///
+    /// ## 返回值
+    ///
+    /// - `Ok(())` - 异常已经被处理，可以重新执行触发异常的指令
+    /// - `Err(SystemError::EFAULT)` - 地址不在任何一个VMA内，或者访问权限不足
+    ///
+    /// ## 注意
+    ///
+    /// 缺页处理只获取地址空间的读锁：同一个VMA内的缺页由VMA的锁串行化，对页表的修改由页表锁保护，
+    /// 因此同一个进程的多个线程可以同时处理不同VMA内的缺页。只有改变VMA布局的操作（mmap、munmap、fork等）才获取写锁。
+    pub fn handle_user_fault(address: VirtAddr, flags: FaultFlags) -> Result<(), SystemError> {
+        if unlikely(!address.check_user()) {
+            return Err(SystemError::EFAULT);
+        }
+
+        let address_space = AddressSpace::current()?;
+        let mut stale = StaleFrames::new();
+        let guard = address_space.read();
+        let r = match guard.mappings.contains(address) {
+            Some(vma) => {
+                Self::handle_mm_fault(&address_space, &guard, &vma, address, flags, &mut stale)
+            }
+            None => Err(SystemError::EFAULT),
+        };
+        drop(guard);
+        // 地址空间、VMA和页表的锁都已经释放，此时才能等待其他CPU刷新TLB
+        stale.finish();
+        return r;
+    }
+
+    /// 处理某个VMA内的缺页异常
+    ///
+    /// ## 参数
+    ///
+    /// - `address_space` - VMA所在的地址空间
+    /// - `inner` - 通过读锁获得的地址空间
+    /// - `vma` - 触发异常的地址所在的VMA
+    /// - `address` - 触发异常的虚拟地址
+    /// - `flags` - 访问类型
+    /// - `stale` - 收集被替换下来的物理页，由调用者在释放所有锁之后释放
+    fn handle_mm_fault(
+        address_space: &AddressSpace,
+        inner: &InnerAddressSpace,
+        vma: &Arc<LockedVMA>,
+        address: VirtAddr,
+        flags: FaultFlags,
+        stale: &mut StaleFrames,
+    ) -> Result<(), SystemError> {
+        let guard = vma.lock();
+        if !Self::access_permitted(*guard.vm_flags(), flags) {
+            return Err(SystemError::EFAULT);
+        }
+
+        let (_page_table_guard, mut mapper) = address_space.lock_page_table(inner);
+        let mapper = &mut mapper;
+        let page_addr = VirtAddr::new(address.data() & !MMArch::PAGE_OFFSET_MASK);
+        match mapper.translate(page_addr) {
+            Some((paddr, page_flags)) => {
+                // 页面已经存在（可能是其他CPU上的线程已经处理了这个异常，或者TLB中的表项过时了）
+                if Self::page_flags_permitted(page_flags, flags) {
+                    unsafe { MMArch::invalidate_page(page_addr) };
+                    return Ok(());
+                }
+
+                // VMA可写，但页表项只读：这是一个写时复制的页面
+                if flags.contains(FaultFlags::FAULT_FLAG_WRITE) && !page_flags.has_write() {
+                    return Self::do_wp_page(page_addr, paddr, guard.flags(), mapper, stale);
+                }
+                return Err(SystemError::EFAULT);
+            }
+            None => {
+                return Self::do_anonymous_page(page_addr, guard.flags(), mapper);
+            }
+        }
+    }
+
+    /// 为匿名映射分配一个清零的物理页，并映射到指定的虚拟地址
+    fn do_anonymous_page(
+        page_addr: VirtAddr,
+        page_flags: PageFlags<MMArch>,
+        mapper: &mut PageMapper,
+    ) -> Result<(), SystemError> {
+        let flush = unsafe { mapper.map(page_addr, page_flags) }.ok_or(SystemError::ENOMEM)?;
+
+        let paddr = mapper.translate(page_addr).unwrap().0;
+        unsafe {
+            let vaddr = MMArch::phys_2_virt(paddr).unwrap();
+            MMArch::write_bytes(vaddr, 0, MMArch::PAGE_SIZE);
+        }
+        if let Some(meta) = page_meta(paddr) {
+            meta.set_flags(PageMetaFlags::PG_ANON);
+        }
+
+        let mut flusher: PageFlushAll<MMArch> = PageFlushAll::new();
+        flusher.consume(flush);
+        return Ok(());
+    }
+
+    /// 处理对写时复制页面的写访问
+    ///
+    /// 如果物理页只被当前页表引用（不计固定持有的引用），则直接恢复写权限，否则复制出一个新的物理页。
+    /// 旧物理页被放入`stale`，等所有CPU都刷新了TLB之后才减少它的引用计数
+    fn do_wp_page(
+        page_addr: VirtAddr,
+        old_paddr: PhysAddr,
+        page_flags: PageFlags<MMArch>,
+        mapper: &mut PageMapper,
+        stale: &mut StaleFrames,
+    ) -> Result<(), SystemError> {
+        if page_ref_count_mapped(old_paddr) == 1 {
+            // 其他CPU上最多只缓存了只读的表项，它们写入时会再次触发缺页异常并刷新，因此只需要刷新当前CPU
+            let mut flusher: PageFlushAll<MMArch> = PageFlushAll::new();
+            let flush = unsafe { mapper.remap(page_addr, page_flags) }.unwrap();
+            flusher.consume(flush);
+            return Ok(());
+        }
+
+        let (new_paddr, _) =
+            unsafe { allocate_page_frames(PageFrameCount::new(1)) }.ok_or(SystemError::ENOMEM)?;
+        unsafe {
+            let src = MMArch::phys_2_virt(old_paddr).unwrap();
+            let dst = MMArch::phys_2_virt(new_paddr).unwrap();
+            (dst.data() as *mut u8)
+                .copy_from_nonoverlapping(src.data() as *const u8, MMArch::PAGE_SIZE);
+        }
+
+        let mut flusher: PageFlushAll<MMArch> = PageFlushAll::new();
+        unsafe {
+            let (_, _, flush) = mapper.unmap_phys(page_addr, false).unwrap();
+            flusher.consume(flush);
+            let flush = mapper
+                .map_phys(page_addr, new_paddr, page_flags)
+                .expect("Failed to map the copied page");
+            flusher.consume(flush);
+        }
+        if let Some(meta) = page_meta(new_paddr) {
+            meta.set_flags(PageMetaFlags::PG_ANON);
+        }
+        // 同一地址空间的其他线程可能还在其他CPU上通过过时的表项访问旧物理页，必须等它们都刷新之后才能释放它
+        stale.push(old_paddr);
+        return Ok(());
+    }
+
+    /// 判断VMA是否允许本次访问
+    fn access_permitted(vm_flags: VmFlags, flags: FaultFlags) -> bool {
+        if flags.contains(FaultFlags::FAULT_FLAG_WRITE) {
+            return vm_flags.contains(VmFlags::VM_WRITE);
+        }
+        if flags.contains(FaultFlags::FAULT_FLAG_INSTRUCTION) {
+            return vm_flags.contains(VmFlags::VM_EXEC);
+        }
+        return vm_flags.intersects(VmFlags::VM_READ | VmFlags::VM_WRITE | VmFlags::VM_EXEC);
+    }
+
+    /// 判断已经存在的页表项是否允许本次访问
+    fn page_flags_permitted(page_flags: PageFlags<MMArch>, flags: FaultFlags) -> bool {
+        if flags.contains(FaultFlags::FAULT_FLAG_WRITE) && !page_flags.has_write() {
+            return false;
+        }
+        if flags.contains(FaultFlags::FAULT_FLAG_INSTRUCTION) && !page_flags.has_execute() {
+            return false;
+        }
+        if flags.contains(FaultFlags::FAULT_FLAG_USER) && !page_flags.has_user() {
+            return false;
+        }
+        return true;
+    }
+}
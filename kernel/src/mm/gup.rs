@@ -0,0 +1,142 @@
+//! 固定用户页（相当于Linux的`pin_user_pages`）
+//!
+//! 驱动需要让设备直接通过DMA访问用户缓冲区时，先把缓冲区所在的物理页固定下来：
+//! - 尚未分配的页面通过缺页处理提前分配
+//! - 设备要写入的写时复制页面会被提前复制，保证DMA不会写到与其他进程共享的物理页
+//! - 增加物理页的引用计数，使得在I/O期间，即使用户解除了映射，物理页也不会被释放
+//! - 增加物理页的固定计数：写时复制不把固定持有的引用当作共享，fork时固定的页面直接复制给子进程，
+//!   因此在I/O期间，父进程写入固定的页面不会把它换成新的物理页
+//!
+//! 固定的物理页在`PinnedUserPages`被drop时解除固定。
+
+use alloc::vec::Vec;
+use system_error::SystemError;
+
+use crate::arch::MMArch;
+
+use super::{
+    allocator::page_frame::{deallocate_page_frames, PageFrameCount, PhysPageFrame},
+    fault::{FaultFlags, PageFaultHandler},
+    page_meta::page_meta,
+    page_ref::page_ref_dec,
+    ucontext::AddressSpace,
+    MemoryManagementArch, PhysAddr, VirtAddr,
+};
+
+/// 当前进程的一段被固定的用户缓冲区
+#[derive(Debug)]
+pub struct PinnedUserPages {
+    /// 缓冲区经过的每一个物理页
+    pages: Vec<PhysAddr>,
+    /// 缓冲区在第一个页内的偏移量
+    offset: usize,
+    /// 缓冲区的长度
+    len: usize,
+}
+
+impl PinnedUserPages {
+    /// 固定当前进程的用户缓冲区[vaddr, vaddr+len)
+    ///
+    /// ## 参数
+    ///
+    /// - `vaddr` - 缓冲区的起始虚拟地址
+    /// - `len` - 缓冲区的长度
+    /// - `write` - 缓冲区是否会被写入（例如从设备读取数据）
+    ///
+    /// ## 返回值
+    ///
+    /// - `Err(SystemError::EFAULT)` - 缓冲区不是合法的用户内存、访问权限不足，或者映射的是设备内存
+    pub fn pin(vaddr: VirtAddr, len: usize, write: bool) -> Result<Self, SystemError> {
+        let end = vaddr.data().checked_add(len).ok_or(SystemError::EFAULT)?;
+        if !vaddr.check_user() || (len > 0 && !VirtAddr::new(end - 1).check_user()) {
+            return Err(SystemError::EFAULT);
+        }
+
+        let mut result = Self {
+            pages: Vec::new(),
+            offset: vaddr.data() & MMArch::PAGE_OFFSET_MASK,
+            len,
+        };
+        if len == 0 {
+            return Ok(result);
+        }
+
+        let address_space = AddressSpace::current()?;
+        let mut fault_flags = FaultFlags::FAULT_FLAG_USER;
+        if write {
+            fault_flags |= FaultFlags::FAULT_FLAG_WRITE;
+        }
+
+        let mut page = vaddr.data() & !MMArch::PAGE_OFFSET_MASK;
+        while page < end {
+            loop {
+                let guard = address_space.read();
+                let (page_table_guard, mapper) = address_space.lock_page_table(&guard);
+                if let Some((paddr, flags)) = mapper.translate(VirtAddr::new(page)) {
+                    // 设备内存等不由页帧分配器管理的物理页没有引用计数，不能被固定
+                    let meta = match page_meta(paddr) {
+                        Some(meta) if meta.refcount() != 0 => meta,
+                        _ => return Err(SystemError::EFAULT),
+                    };
+                    if !write || flags.has_write() {
+                        meta.ref_inc();
+                        meta.pin_inc();
+                        result.pages.push(paddr);
+                        break;
+                    }
+                }
+                drop(page_table_guard);
+                drop(guard);
+                // 页面不存在或者是写时复制页面，由缺页处理分配或者复制
+                PageFaultHandler::handle_user_fault(VirtAddr::new(page), fault_flags)?;
+            }
+            page += MMArch::PAGE_SIZE;
+        }
+        return Ok(result);
+    }
+
+    /// 把缓冲区划分为物理地址连续的区间
+    ///
+    /// ## 参数
+    ///
+    /// - `max_seg_len` - 每个区间的最大长度
+    ///
+    /// ## 返回值
+    ///
+    /// (物理地址, 长度)的数组，按照在缓冲区内的顺序排列
+    pub fn segments(&self, max_seg_len: usize) -> Vec<(PhysAddr, usize)> {
+        let mut segs: Vec<(PhysAddr, usize)> = Vec::new();
+        let mut remain = self.len;
+        for (i, paddr) in self.pages.iter().enumerate() {
+            let offset = if i == 0 { self.offset } else { 0 };
+            let seg_len = core::cmp::min(MMArch::PAGE_SIZE - offset, remain);
+            let seg_start = *paddr + offset;
+            remain -= seg_len;
+
+            if let Some(last) = segs.last_mut() {
+                if last.0 + last.1 == seg_start && last.1 + seg_len <= max_seg_len {
+                    last.1 += seg_len;
+                    continue;
+                }
+            }
+            segs.push((seg_start, seg_len));
+        }
+        return segs;
+    }
+}
+
+impl Drop for PinnedUserPages {
+    fn drop(&mut self) {
+        for paddr in self.pages.iter() {
+            if let Some(meta) = page_meta(*paddr) {
+                meta.pin_dec();
+            }
+            // 固定期间，用户可能已经解除了映射
+            if page_ref_dec(*paddr) == 0 {
+                unsafe {
+                    deallocate_page_frames(PhysPageFrame::new(*paddr), PageFrameCount::new(1))
+                };
+            }
+        }
+    }
+}
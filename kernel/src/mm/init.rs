@@ -1,8 +1,14 @@
 use core::{fmt::Write, sync::atomic::Ordering};
 
 use crate::{
-    arch::MMArch, driver::serial::serial8250::send_to_default_serial8250_port,
-    filesystem::procfs::kmsg::kmsg_init, libs::printk::PrintkWriter, mm::mmio_buddy::mmio_init,
+    arch::MMArch,
+    driver::serial::serial8250::send_to_default_serial8250_port,
+    filesystem::procfs::kmsg::kmsg_init,
+    libs::printk::PrintkWriter,
+    mm::{
+        allocator::per_cpu_pages::per_cpu_pages_init, mmio_buddy::mmio_init,
+        page_meta::page_meta_init, percpu::PerCpu,
+    },
 };
 
 use super::MemoryManagementArch;
@@ -40,6 +46,15 @@ pub unsafe fn mm_init() {
 
     MMArch::init();
 
+    // 初始化页帧元数据数组
+    page_meta_init();
+
+    // 分配每个CPU的数据区，此后才能创建PerCpu变量
+    PerCpu::init();
+
+    // 在buddy前面启用每CPU页帧缓存
+    per_cpu_pages_init();
+
     // enable mmio
     mmio_init();
     // enable KMSG
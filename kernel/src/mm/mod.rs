@@ -22,12 +22,16 @@ use self::{
 pub mod allocator;
 pub mod c_adapter;
 pub mod early_ioremap;
+pub mod fault;
+pub mod gup;
 pub mod init;
 pub mod kernel_mapper;
 pub mod memblock;
 pub mod mmio_buddy;
 pub mod no_init;
 pub mod page;
+pub mod page_meta;
+pub mod page_ref;
 pub mod percpu;
 pub mod syscall;
 pub mod ucontext;
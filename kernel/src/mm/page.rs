@@ -3,18 +3,29 @@ use core::{
     marker::PhantomData,
     mem,
     ops::Add,
-    sync::atomic::{compiler_fence, Ordering},
+    sync::atomic::{compiler_fence, AtomicUsize, Ordering},
 };
 
+use alloc::vec::Vec;
+
 use crate::{
     arch::{interrupt::ipi::send_ipi, MMArch},
     exception::ipi::{IpiKind, IpiTarget},
     kerror, kwarn,
+    libs::spinlock::SpinLock,
+    process::ProcessManager,
+    smp::core::smp_get_processor_id,
 };
 
 use super::{
-    allocator::page_frame::FrameAllocator, syscall::ProtFlags, MemoryManagementArch, PageTableKind,
-    PhysAddr, VirtAddr,
+    allocator::page_frame::{
+        deallocate_page_frames, FrameAllocator, PageFrameCount, PhysPageFrame,
+    },
+    page_meta::page_meta,
+    page_ref::page_ref_dec,
+    percpu::PerCpu,
+    syscall::ProtFlags,
+    MemoryManagementArch, PageTableKind, PhysAddr, VirtAddr,
 };
 
 #[derive(Debug)]
@@ -532,6 +543,22 @@ impl<Arch: MemoryManagementArch, F: FrameAllocator> PageMapper<Arch, F> {
         };
     }
 
+    /// 创建一个操作同一个页表的页面映射器
+    ///
+    /// ## Safety
+    ///
+    /// 调用者需要保证通过不同的映射器对页表的修改是互斥的
+    pub unsafe fn alias(&self) -> Self
+    where
+        F: Clone,
+    {
+        return Self::new(
+            self.table_kind,
+            self.table_paddr,
+            self.frame_allocator.clone(),
+        );
+    }
+
     /// 创建页表，并为这个页表创建页面映射器
     pub unsafe fn create(table_kind: PageTableKind, mut allocator: F) -> Option<Self> {
         let table_paddr = allocator.allocate_one()?;
@@ -632,6 +659,13 @@ impl<Arch: MemoryManagementArch, F: FrameAllocator> PageMapper<Arch, F> {
 
                 table.set_entry(i, entry);
                 compiler_fence(Ordering::SeqCst);
+
+                // 记录用户页表对物理页的映射
+                if flags.has_user() {
+                    if let Some(meta) = page_meta(phys) {
+                        meta.map_inc();
+                    }
+                }
                 return Some(PageFlush::new(virt));
             } else {
                 let next_table = table.next_level_table(i);
@@ -691,6 +725,10 @@ impl<Arch: MemoryManagementArch, F: FrameAllocator> PageMapper<Arch, F> {
         return self
             .visit(virt, |p1, i| {
                 let mut entry = p1.entry(i)?;
+                // 页面尚未映射（例如尚未发生缺页的匿名页），不能给它设置标志位
+                if !entry.present() {
+                    return None;
+                }
                 entry.set_flags(flags);
                 p1.set_entry(i, entry);
                 Some(PageFlush::new(virt))
@@ -753,8 +791,14 @@ impl<Arch: MemoryManagementArch, F: FrameAllocator> PageMapper<Arch, F> {
         }
 
         let mut table = self.table();
-        return unmap_phys_inner(virt, &mut table, unmap_parents, self.allocator_mut())
-            .map(|(paddr, flags)| (paddr, flags, PageFlush::<Arch>::new(virt)));
+        let (paddr, flags) =
+            unmap_phys_inner(virt, &mut table, unmap_parents, self.allocator_mut())?;
+        if flags.has_user() {
+            if let Some(meta) = page_meta(paddr) {
+                meta.map_dec();
+            }
+        }
+        return Some((paddr, flags, PageFlush::<Arch>::new(virt)));
     }
 
     /// 在页表中，访问虚拟地址对应的页表项，并调用传入的函数F
@@ -958,6 +1002,139 @@ impl Drop for InactiveFlusher {
     }
 }
 
+/// 最近一次发起的TLB shootdown的序号
+static TLB_SHOOTDOWN_SEQ: AtomicUsize = AtomicUsize::new(0);
+
+/// 每个CPU已经完成的TLB shootdown的序号
+///
+/// 尚未上线的CPU为`usize::MAX`，发起者不需要等待它们（它们的TLB中没有任何用户地址空间的表项）
+static TLB_SHOOTDOWN_DONE: [AtomicUsize; PerCpu::MAX_CPU_NUM as usize] =
+    [const { AtomicUsize::new(usize::MAX) }; PerCpu::MAX_CPU_NUM as usize];
+
+/// 把当前CPU加入TLB shootdown的等待范围
+///
+/// 必须在当前CPU能够接收刷新TLB的IPI之后调用
+pub fn tlb_shootdown_cpu_online() {
+    let cpu = smp_get_processor_id().data() as usize;
+    TLB_SHOOTDOWN_DONE[cpu].store(TLB_SHOOTDOWN_SEQ.load(Ordering::SeqCst), Ordering::SeqCst);
+}
+
+/// 刷新当前CPU的TLB，并应答已经发起的TLB shootdown
+///
+/// 由刷新TLB的IPI的处理函数调用
+pub fn tlb_shootdown_ack() {
+    let cpu = smp_get_processor_id().data() as usize;
+    // 先读取序号再刷新，保证应答的序号不会超过本次刷新实际覆盖的请求
+    let seq = TLB_SHOOTDOWN_SEQ.load(Ordering::SeqCst);
+    unsafe { MMArch::invalidate_all() };
+    if TLB_SHOOTDOWN_DONE[cpu].load(Ordering::SeqCst) != usize::MAX {
+        TLB_SHOOTDOWN_DONE[cpu].fetch_max(seq, Ordering::SeqCst);
+    }
+}
+
+/// 刷新所有CPU的TLB，并等待其他CPU刷新完成
+///
+/// 与`InactiveFlusher`不同，本函数返回时，其他CPU上不会再有过时的表项，
+/// 因此可以在它之后释放被解除映射的物理页。
+///
+/// 当前CPU可能是在关中断的情况下调用本函数的，收不到其他发起者的IPI，
+/// 因此在等待期间，会主动应答其他CPU发起的shootdown，避免两个发起者互相等待。
+///
+/// 注意：等待期间，其他CPU必须能够响应中断，而它们可能正在关中断自旋等待某把锁，
+/// 因此不能在持有自旋锁的时候调用本函数。需要在持有锁时释放物理页的路径，请使用`StaleFrames`。
+pub fn tlb_shootdown() {
+    let this_cpu = smp_get_processor_id().data() as usize;
+    let seq = TLB_SHOOTDOWN_SEQ.fetch_add(1, Ordering::SeqCst) + 1;
+    tlb_shootdown_ack();
+
+    let others_online = TLB_SHOOTDOWN_DONE
+        .iter()
+        .enumerate()
+        .any(|(cpu, done)| cpu != this_cpu && done.load(Ordering::SeqCst) != usize::MAX);
+    if !others_online {
+        return;
+    }
+
+    send_ipi(IpiKind::FlushTLB, IpiTarget::Other);
+    for (cpu, done) in TLB_SHOOTDOWN_DONE.iter().enumerate() {
+        if cpu == this_cpu {
+            continue;
+        }
+        while done.load(Ordering::SeqCst) < seq {
+            if TLB_SHOOTDOWN_DONE[this_cpu].load(Ordering::SeqCst)
+                < TLB_SHOOTDOWN_SEQ.load(Ordering::SeqCst)
+            {
+                tlb_shootdown_ack();
+            }
+            core::hint::spin_loop();
+        }
+    }
+}
+
+/// 因为上下文不允许等待TLB shootdown而被推迟释放的物理页，由下一次`StaleFrames::finish`释放
+static DEFERRED_STALE_FRAMES: SpinLock<Vec<PhysAddr>> = SpinLock::new(Vec::new());
+
+/// 已经从页表中移除、但其他CPU的TLB中可能还缓存着对应表项的物理页（相当于Linux的mmu_gather）
+///
+/// `tlb_shootdown`需要等待其他CPU应答，不能在持有自旋锁的时候进行。因此缺页处理等路径先把
+/// 被替换下来的物理页收集起来，释放所有的锁之后再调用`finish`：等所有CPU都刷新了TLB，
+/// 才减少物理页的引用计数（必要时释放它）。
+#[derive(Debug)]
+pub struct StaleFrames {
+    frames: Vec<PhysAddr>,
+}
+
+impl StaleFrames {
+    pub fn new() -> Self {
+        return Self { frames: Vec::new() };
+    }
+
+    /// 记录一个已经从页表中移除的物理页，页表项持有的引用转交给`StaleFrames`
+    pub fn push(&mut self, paddr: PhysAddr) {
+        self.frames.push(paddr);
+    }
+
+    /// 刷新所有CPU的TLB，然后释放收集到的物理页
+    ///
+    /// 如果调用时仍然持有自旋锁，则只向其他CPU发出刷新请求，物理页推迟到下一次`finish`时释放
+    pub fn finish(mut self) {
+        self.release();
+    }
+
+    fn release(&mut self) {
+        if self.frames.is_empty() {
+            return;
+        }
+
+        if ProcessManager::current_pcb().preempt_count() != 0 {
+            unsafe { MMArch::invalidate_all() };
+            send_ipi(IpiKind::FlushTLB, IpiTarget::Other);
+            DEFERRED_STALE_FRAMES
+                .lock_irqsave()
+                .append(&mut self.frames);
+            return;
+        }
+
+        let mut frames = mem::take(&mut self.frames);
+        frames.append(&mut DEFERRED_STALE_FRAMES.lock_irqsave());
+        tlb_shootdown();
+        for paddr in frames {
+            // 在等待期间，其他的页表可能已经解除了对这个物理页的引用
+            if page_ref_dec(paddr) == 0 {
+                unsafe {
+                    deallocate_page_frames(PhysPageFrame::new(paddr), PageFrameCount::new(1))
+                };
+            }
+        }
+    }
+}
+
+impl Drop for StaleFrames {
+    fn drop(&mut self) {
+        self.release();
+    }
+}
+
 /// # 把一个地址向下对齐到页大小
 pub fn round_down_to_page_size(addr: usize) -> usize {
     addr & !(MMArch::PAGE_SIZE - 1)
@@ -0,0 +1,201 @@
+//! 物理页帧的元数据（相当于Linux的`struct page`）
+//!
+//! 为每个物理页帧维护一个16字节的`PageMeta`，按照页帧号（PFN）存放在一个连续的数组中。
+//! 数组的大小由memblock中最高的物理地址决定，占用的内存为物理内存的 16/4096 ≈ 0.4%。
+//!
+//! - `refcount`：页帧的引用计数。页帧被分配出去时为1，归还给页帧分配器时为0
+//! - `mapcount`：页帧被多少个用户页表项映射，由`PageMapper`维护
+//! - `flags`：页帧的状态标志，参见`PageMetaFlags`
+//! - `pincount`：页帧被`PinnedUserPages`固定的次数。每次固定同时也持有一个引用计数
+
+use core::sync::atomic::{AtomicU32, Ordering};
+
+use crate::{arch::MMArch, kinfo};
+
+use super::{
+    allocator::page_frame::{allocate_page_frames, PageFrameCount},
+    memblock::mem_block_manager,
+    MemoryManagementArch, PhysAddr,
+};
+
+bitflags! {
+    /// 物理页帧的状态标志
+    pub struct PageMetaFlags: u32 {
+        /// 页帧被锁定，正在进行I/O
+        const PG_LOCKED = 1 << 0;
+        /// 页帧的内容与后备存储不一致
+        const PG_DIRTY = 1 << 1;
+        /// 页帧的内容是有效的
+        const PG_UPTODATE = 1 << 2;
+        /// 页帧位于LRU链表中
+        const PG_LRU = 1 << 3;
+        /// 匿名页
+        const PG_ANON = 1 << 4;
+        /// 页帧被slab分配器使用
+        const PG_SLAB = 1 << 5;
+        /// 页帧属于某个文件的页缓存
+        const PG_PAGECACHE = 1 << 6;
+        /// 页帧最近被访问过（用于页缓存回收的二次机会算法）
+        const PG_REFERENCED = 1 << 7;
+    }
+}
+
+/// 物理页帧的元数据
+#[derive(Debug)]
+#[repr(C, align(16))]
+pub struct PageMeta {
+    refcount: AtomicU32,
+    mapcount: AtomicU32,
+    flags: AtomicU32,
+    pincount: AtomicU32,
+}
+
+impl PageMeta {
+    /// 获取引用计数
+    #[inline(always)]
+    pub fn refcount(&self) -> u32 {
+        self.refcount.load(Ordering::Acquire)
+    }
+
+    /// 增加引用计数，返回增加后的值
+    #[inline(always)]
+    pub fn ref_inc(&self) -> u32 {
+        self.refcount.fetch_add(1, Ordering::AcqRel) + 1
+    }
+
+    /// 减少引用计数，返回减少后的值。返回0时，调用者需要释放页帧
+    ///
+    /// 没有被计数的页帧（例如在元数据初始化之前分配的页帧），引用计数保持为0
+    #[inline(always)]
+    pub fn ref_dec(&self) -> u32 {
+        let old = self
+            .refcount
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |x| x.checked_sub(1))
+            .unwrap_or(0);
+        old.saturating_sub(1)
+    }
+
+    /// 获取映射计数
+    #[inline(always)]
+    pub fn mapcount(&self) -> u32 {
+        self.mapcount.load(Ordering::Acquire)
+    }
+
+    #[inline(always)]
+    pub fn map_inc(&self) -> u32 {
+        self.mapcount.fetch_add(1, Ordering::AcqRel) + 1
+    }
+
+    #[inline(always)]
+    pub fn map_dec(&self) -> u32 {
+        self.mapcount
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |x| x.checked_sub(1))
+            .unwrap_or(0)
+            .saturating_sub(1)
+    }
+
+    #[inline(always)]
+    pub fn flags(&self) -> PageMetaFlags {
+        PageMetaFlags::from_bits_truncate(self.flags.load(Ordering::Acquire))
+    }
+
+    /// 设置标志位，返回设置前的标志
+    #[inline(always)]
+    pub fn set_flags(&self, flags: PageMetaFlags) -> PageMetaFlags {
+        PageMetaFlags::from_bits_truncate(self.flags.fetch_or(flags.bits(), Ordering::AcqRel))
+    }
+
+    /// 清除标志位，返回清除前的标志
+    #[inline(always)]
+    pub fn clear_flags(&self, flags: PageMetaFlags) -> PageMetaFlags {
+        PageMetaFlags::from_bits_truncate(self.flags.fetch_and(!flags.bits(), Ordering::AcqRel))
+    }
+
+    /// 获取固定计数
+    #[inline(always)]
+    pub fn pincount(&self) -> u32 {
+        self.pincount.load(Ordering::Acquire)
+    }
+
+    #[inline(always)]
+    pub fn pin_inc(&self) -> u32 {
+        self.pincount.fetch_add(1, Ordering::AcqRel) + 1
+    }
+
+    #[inline(always)]
+    pub fn pin_dec(&self) -> u32 {
+        self.pincount
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |x| x.checked_sub(1))
+            .unwrap_or(0)
+            .saturating_sub(1)
+    }
+
+    /// 页帧被分配出去时，重置元数据
+    #[inline(always)]
+    fn reset(&self, refcount: u32) {
+        self.refcount.store(refcount, Ordering::Relaxed);
+        self.mapcount.store(0, Ordering::Relaxed);
+        self.flags.store(0, Ordering::Relaxed);
+        self.pincount.store(0, Ordering::Relaxed);
+    }
+}
+
+/// 所有物理页帧的元数据，下标为页帧号
+static mut PAGE_META: &'static [PageMeta] = &[];
+
+/// 初始化页帧元数据数组
+///
+/// 必须在页帧分配器初始化之后调用。在此之前分配的页帧，元数据全部为0
+pub fn page_meta_init() {
+    let max_paddr = mem_block_manager()
+        .to_iter()
+        .map(|area| area.base.data() + area.size)
+        .max()
+        .unwrap_or(0);
+    let max_pfn = max_paddr >> MMArch::PAGE_SHIFT;
+    let bytes = max_pfn * core::mem::size_of::<PageMeta>();
+    let pages = (bytes + MMArch::PAGE_SIZE - 1) >> MMArch::PAGE_SHIFT;
+
+    let (paddr, count) = unsafe { allocate_page_frames(PageFrameCount::new(pages)) }
+        .expect("Failed to allocate page meta array");
+    unsafe {
+        let vaddr = MMArch::phys_2_virt(paddr).unwrap();
+        MMArch::write_bytes(vaddr, 0, count.bytes());
+        PAGE_META = core::slice::from_raw_parts(vaddr.data() as *const PageMeta, max_pfn);
+    }
+    kinfo!(
+        "Page meta initialized: {} frames, {} KB",
+        max_pfn,
+        count.bytes() / 1024
+    );
+}
+
+/// 获取物理页帧的元数据
+///
+/// ## 返回值
+///
+/// 如果元数据数组尚未初始化，或者物理地址超出了物理内存的范围，返回None
+#[inline(always)]
+pub fn page_meta(paddr: PhysAddr) -> Option<&'static PageMeta> {
+    unsafe { PAGE_META.get(paddr.data() >> MMArch::PAGE_SHIFT) }
+}
+
+/// 页帧分配器分配出页帧后调用：引用计数置为1，其余元数据清零
+pub fn page_meta_on_allocate(paddr: PhysAddr, count: PageFrameCount) {
+    let start = paddr.data() >> MMArch::PAGE_SHIFT;
+    if let Some(metas) = unsafe { PAGE_META.get(start..start + count.data()) } {
+        for meta in metas {
+            meta.reset(1);
+        }
+    }
+}
+
+/// 页帧被归还给页帧分配器时调用
+pub fn page_meta_on_free(paddr: PhysAddr, count: PageFrameCount) {
+    let start = paddr.data() >> MMArch::PAGE_SHIFT;
+    if let Some(metas) = unsafe { PAGE_META.get(start..start + count.data()) } {
+        for meta in metas {
+            meta.reset(0);
+        }
+    }
+}
@@ -0,0 +1,42 @@
+//! 用户物理页的引用计数
+//!
+//! fork时父子进程以只读的方式共享同一个物理页（写时复制），因此在解除映射时，
+//! 只有当物理页不再被任何页表引用时，才能把它归还给页帧分配器。
+//!
+//! 引用计数存放在物理页的元数据（`PageMeta`）中：页帧被分配出来时引用计数为1，
+//! 之后每多一个页表共享这个页帧，引用计数加1。
+//!
+//! 被`PinnedUserPages`固定的页帧，每次固定也持有一个引用计数，同时增加固定计数。
+//! 写时复制只关心页帧是否被其他页表共享，因此使用去掉固定部分的`page_ref_count_mapped`。
+
+use super::{page_meta::page_meta, PhysAddr};
+
+/// 获取物理页的引用计数（物理页必须已经被映射）
+pub fn page_ref_count(paddr: PhysAddr) -> usize {
+    return page_meta(paddr).map(|m| m.refcount() as usize).unwrap_or(1);
+}
+
+/// 获取物理页被页表引用的次数，即引用计数中不属于固定的部分（物理页必须已经被映射）
+pub fn page_ref_count_mapped(paddr: PhysAddr) -> usize {
+    return page_meta(paddr)
+        .map(|m| m.refcount().saturating_sub(m.pincount()) as usize)
+        .unwrap_or(1);
+}
+
+/// 获取物理页被固定的次数
+pub fn page_pin_count(paddr: PhysAddr) -> usize {
+    return page_meta(paddr).map(|m| m.pincount() as usize).unwrap_or(0);
+}
+
+/// 增加物理页的引用计数，返回增加后的引用计数
+pub fn page_ref_inc(paddr: PhysAddr) -> usize {
+    let meta = page_meta(paddr).expect("page_ref_inc: no page meta for the frame");
+    return meta.ref_inc() as usize;
+}
+
+/// 减少物理页的引用计数，返回减少后的引用计数
+///
+/// 如果返回0，说明物理页已经不再被引用，调用者需要释放它
+pub fn page_ref_dec(paddr: PhysAddr) -> usize {
+    return page_meta(paddr).map(|m| m.ref_dec() as usize).unwrap_or(0);
+}
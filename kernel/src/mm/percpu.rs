@@ -1,37 +1,192 @@
-use core::sync::atomic::AtomicU32;
+//! 每个CPU的数据区
+//!
+//! 内核在初始化内存管理时，为每个CPU分配一块按页对齐的数据区（大小为`PerCpu::AREA_SIZE`）。
+//! 每个PerCpu变量在所有CPU的数据区中占用相同的偏移量，因此访问当前CPU的变量时，
+//! 只需要“当前CPU数据区的起始地址 + 偏移量”：
+//!
+//! - x86_64上，内核态的gs寄存器指向当前CPU的数据区，`PerCpuCounter`的读取和累加各只需要一条指令
+//! - riscv64上，通过tp寄存器指向的LocalContext获取当前CPU的id，再查表得到数据区的起始地址
+//!
+//! 不同CPU的数据区位于不同的页中，因此不同CPU的同一个变量之间不会发生伪共享。
+//! `PerCpuVar`在数据区内按照缓存行对齐，使得同一个CPU上的不同变量也不会共享缓存行
+//! （例如其他CPU访问本CPU的某个带锁的变量时，不会影响本CPU访问相邻的变量）。
+
+use core::{
+    alloc::Layout,
+    marker::PhantomData,
+    sync::atomic::{AtomicU32, AtomicU64, Ordering},
+};
 
 use alloc::vec::Vec;
 
 use crate::{
-    include::bindings::bindings::smp_get_total_cpu,
-    libs::lazy_init::Lazy,
+    arch::{CurrentPerCpuArch, MMArch},
+    kinfo,
+    libs::{lazy_init::Lazy, spinlock::SpinLock},
+    mm::{MemoryManagementArch, VirtAddr},
     smp::{core::smp_get_processor_id, cpu::ProcessorId},
 };
 
-/// 系统中的CPU数量
+/// 已经分配了数据区的CPU数量，为0表示`PerCpu::init()`尚未被调用
 ///
-/// todo: 待smp模块重构后，从smp模块获取CPU数量。
-/// 目前由于smp模块初始化时机较晚，导致大部分内核模块无法在早期初始化PerCpu变量。
-const CPU_NUM: AtomicU32 = AtomicU32::new(PerCpu::MAX_CPU_NUM);
+/// 由于smp模块初始化时机较晚，初始化数据区的时候还不知道实际的CPU数量，
+/// 因此会为`PerCpu::MAX_CPU_NUM`个CPU都分配数据区。
+static CPU_NUM: AtomicU32 = AtomicU32::new(0);
+
+/// 每个CPU的数据区的起始地址
+static mut PERCPU_AREAS: [usize; PerCpu::MAX_CPU_NUM as usize] = [0; PerCpu::MAX_CPU_NUM as usize];
+
+/// 数据区中空闲的偏移量区间
+static PERCPU_FREE_LIST: SpinLock<PerCpuFreeList> = SpinLock::new(PerCpuFreeList::new());
+
+/// 缓存行的大小
+const CACHE_LINE_SIZE: usize = 64;
+
+/// 架构相关的PerCpu接口
+pub trait PerCpuArch {
+    /// 每个CPU的数据区的开头，保留给架构相关代码使用的字节数
+    const HEADER_SIZE: usize;
+
+    /// 初始化指定CPU的数据区的头部
+    ///
+    /// 在`PerCpu::init()`中，对每个CPU调用一次
+    unsafe fn init_area(cpu: ProcessorId, base: VirtAddr);
+
+    /// 让当前CPU开始使用自己的数据区
+    unsafe fn setup_this_cpu(cpu: ProcessorId, base: VirtAddr);
+
+    /// 获取当前CPU的数据区的起始地址
+    fn this_cpu_base() -> VirtAddr;
+
+    /// 读取当前CPU的数据区中，偏移量为`offset`的u64
+    unsafe fn this_cpu_read_u64(offset: usize) -> u64;
+
+    /// 给当前CPU的数据区中，偏移量为`offset`的u64加上`val`
+    ///
+    /// 该操作不能被本CPU上的中断打断，但是不保证对其他CPU是原子的
+    unsafe fn this_cpu_add_u64(offset: usize, val: u64);
+}
 
 #[derive(Debug)]
 pub struct PerCpu;
 
 impl PerCpu {
     pub const MAX_CPU_NUM: u32 = 128;
+    /// 每个CPU的数据区的大小
+    pub const AREA_SIZE: usize = 4 * MMArch::PAGE_SIZE;
+
     /// # 初始化PerCpu
     ///
-    /// 该函数应该在内核初始化时调用一次。
+    /// 为每个CPU分配数据区，并让当前CPU（BSP）开始使用自己的数据区。
     ///
-    /// 该函数会调用`smp_get_total_cpu()`获取CPU数量，然后将其存储在`CPU_NUM`中。
-    #[allow(dead_code)]
+    /// 该函数应该在内核堆初始化之后、第一个PerCpu变量被创建之前调用一次。
+    /// AP启动时，需要调用`CurrentPerCpuArch::setup_this_cpu()`使用自己的数据区。
     pub fn init() {
-        if CPU_NUM.load(core::sync::atomic::Ordering::SeqCst) != 0 {
+        if CPU_NUM.load(Ordering::SeqCst) != 0 {
             panic!("PerCpu::init() called twice");
         }
-        let cpus = unsafe { smp_get_total_cpu() };
-        assert!(cpus > 0, "PerCpu::init(): smp_get_total_cpu() returned 0");
-        CPU_NUM.store(cpus, core::sync::atomic::Ordering::SeqCst);
+
+        let layout = Layout::from_size_align(Self::AREA_SIZE, MMArch::PAGE_SIZE).unwrap();
+        for i in 0..Self::MAX_CPU_NUM {
+            let base = unsafe { alloc::alloc::alloc_zeroed(layout) } as usize;
+            assert!(base != 0, "PerCpu::init(): failed to allocate per-cpu area");
+            unsafe {
+                PERCPU_AREAS[i as usize] = base;
+                CurrentPerCpuArch::init_area(ProcessorId::new(i), VirtAddr::new(base));
+            }
+        }
+
+        PERCPU_FREE_LIST
+            .lock_irqsave()
+            .free(CurrentPerCpuArch::HEADER_SIZE, Self::AREA_SIZE);
+        CPU_NUM.store(Self::MAX_CPU_NUM, Ordering::SeqCst);
+
+        let cpu = smp_get_processor_id();
+        unsafe { CurrentPerCpuArch::setup_this_cpu(cpu, Self::area_base(cpu)) };
+        kinfo!(
+            "Per-cpu areas initialized: {} cpus, {} bytes each",
+            Self::MAX_CPU_NUM,
+            Self::AREA_SIZE
+        );
+    }
+
+    /// 已经分配了数据区的CPU数量
+    #[inline]
+    pub fn cpu_num() -> u32 {
+        return CPU_NUM.load(Ordering::Relaxed);
+    }
+
+    /// 获取指定CPU的数据区的起始地址
+    #[inline]
+    pub fn area_base(cpu: ProcessorId) -> VirtAddr {
+        return VirtAddr::new(unsafe { PERCPU_AREAS[cpu.data() as usize] });
+    }
+
+    /// 在所有CPU的数据区中分配一段空间
+    ///
+    /// ## 返回值
+    ///
+    /// 分配到的偏移量。数据区空间不足时，返回None
+    fn alloc_offset(size: usize, align: usize) -> Option<usize> {
+        if Self::cpu_num() == 0 {
+            panic!("PerCpu::init() not called");
+        }
+        return PERCPU_FREE_LIST.lock_irqsave().alloc(size.max(1), align);
+    }
+
+    fn free_offset(offset: usize, size: usize) {
+        PERCPU_FREE_LIST
+            .lock_irqsave()
+            .free(offset, offset + size.max(1));
+    }
+}
+
+/// 数据区中空闲的偏移量区间，按照起始偏移量排序
+#[derive(Debug)]
+struct PerCpuFreeList {
+    /// (起始偏移量, 结束偏移量)
+    ranges: Vec<(usize, usize)>,
+}
+
+impl PerCpuFreeList {
+    const fn new() -> Self {
+        Self { ranges: Vec::new() }
+    }
+
+    /// 首次适应地分配一段空间
+    fn alloc(&mut self, size: usize, align: usize) -> Option<usize> {
+        for i in 0..self.ranges.len() {
+            let (start, end) = self.ranges[i];
+            let offset = (start + align - 1) & !(align - 1);
+            if offset + size > end {
+                continue;
+            }
+
+            self.ranges.remove(i);
+            if offset + size < end {
+                self.ranges.insert(i, (offset + size, end));
+            }
+            if start < offset {
+                self.ranges.insert(i, (start, offset));
+            }
+            return Some(offset);
+        }
+        return None;
+    }
+
+    /// 释放[start, end)，并与相邻的空闲区间合并
+    fn free(&mut self, start: usize, end: usize) {
+        let i = self.ranges.partition_point(|r| r.0 < start);
+        self.ranges.insert(i, (start, end));
+
+        if i + 1 < self.ranges.len() && self.ranges[i].1 == self.ranges[i + 1].0 {
+            self.ranges[i].1 = self.ranges[i + 1].1;
+            self.ranges.remove(i + 1);
+        }
+        if i > 0 && self.ranges[i - 1].1 == self.ranges[i].0 {
+            self.ranges[i - 1].1 = self.ranges[i].1;
+            self.ranges.remove(i);
+        }
     }
 }
 
@@ -39,6 +194,8 @@ impl PerCpu {
 ///
 /// 该结构体的每个实例都是线程安全的，因为每个CPU都有自己的变量。
 ///
+/// 变量的数据存放在每个CPU的数据区中，并且按照缓存行对齐。
+///
 /// 一种简单的使用方法是：使用该结构体提供的`define_lazy`方法定义一个全局变量，
 /// 然后在内核初始化时调用`init`、`new`方法去初始化它。
 ///
@@ -47,7 +204,9 @@ impl PerCpu {
 #[derive(Debug)]
 #[allow(dead_code)]
 pub struct PerCpuVar<T> {
-    inner: Vec<T>,
+    /// 变量在每个CPU的数据区中的偏移量
+    offset: usize,
+    _marker: PhantomData<T>,
 }
 
 #[allow(dead_code)]
@@ -57,17 +216,41 @@ impl<T> PerCpuVar<T> {
     /// ## 参数
     ///
     /// - `data` - 每个CPU的数据的初始值。 传入的Vec的长度必须等于CPU的数量，否则返回None。
+    ///
+    /// ## 返回值
+    ///
+    /// 数据区的剩余空间不足时，返回None
     pub fn new(data: Vec<T>) -> Option<Self> {
-        let cpu_num = CPU_NUM.load(core::sync::atomic::Ordering::SeqCst);
+        let cpu_num = PerCpu::cpu_num();
         if cpu_num == 0 {
             panic!("PerCpu::init() not called");
         }
 
-        if data.len() != cpu_num.try_into().unwrap() {
+        if data.len() != cpu_num as usize {
             return None;
         }
 
-        return Some(Self { inner: data });
+        let align = core::mem::align_of::<T>().max(CACHE_LINE_SIZE);
+        if align > MMArch::PAGE_SIZE {
+            return None;
+        }
+        let offset = PerCpu::alloc_offset(Self::padded_size(), align)?;
+
+        for (cpu, value) in data.into_iter().enumerate() {
+            let base = PerCpu::area_base(ProcessorId::new(cpu as u32));
+            unsafe { ((base.data() + offset) as *mut T).write(value) };
+        }
+
+        return Some(Self {
+            offset,
+            _marker: PhantomData,
+        });
+    }
+
+    /// 变量在数据区中占用的大小：填充到缓存行的整数倍，避免与其他变量共享缓存行
+    const fn padded_size() -> usize {
+        let size = core::mem::size_of::<T>();
+        return (size + CACHE_LINE_SIZE - 1) & !(CACHE_LINE_SIZE - 1);
     }
 
     /// 定义一个Lazy的PerCpu变量，稍后再初始化
@@ -75,25 +258,112 @@ impl<T> PerCpuVar<T> {
         Lazy::<Self>::new()
     }
 
+    #[inline]
     pub fn get(&self) -> &T {
-        let cpu_id = smp_get_processor_id();
-        &self.inner[cpu_id.data() as usize]
+        let base = CurrentPerCpuArch::this_cpu_base();
+        unsafe { &*((base.data() + self.offset) as *const T) }
     }
 
+    #[inline]
     pub fn get_mut(&mut self) -> &mut T {
-        let cpu_id = smp_get_processor_id();
-        &mut self.inner[cpu_id.data() as usize]
+        let base = CurrentPerCpuArch::this_cpu_base();
+        unsafe { &mut *((base.data() + self.offset) as *mut T) }
     }
 
     pub unsafe fn force_get(&self, cpu_id: ProcessorId) -> &T {
-        &self.inner[cpu_id.data() as usize]
+        let base = PerCpu::area_base(cpu_id);
+        &*((base.data() + self.offset) as *const T)
     }
 
     pub unsafe fn force_get_mut(&mut self, cpu_id: ProcessorId) -> &mut T {
-        &mut self.inner[cpu_id.data() as usize]
+        let base = PerCpu::area_base(cpu_id);
+        &mut *((base.data() + self.offset) as *mut T)
+    }
+}
+
+impl<T> Drop for PerCpuVar<T> {
+    fn drop(&mut self) {
+        for cpu in 0..PerCpu::cpu_num() {
+            let base = PerCpu::area_base(ProcessorId::new(cpu));
+            unsafe { core::ptr::drop_in_place((base.data() + self.offset) as *mut T) };
+        }
+        PerCpu::free_offset(self.offset, Self::padded_size());
     }
 }
 
 /// PerCpu变量是线程安全的，因为每个CPU都有自己的变量。
 unsafe impl<T> Sync for PerCpuVar<T> {}
 unsafe impl<T> Send for PerCpuVar<T> {}
+
+/// 每个CPU一个的u64计数器
+///
+/// 当前CPU上的累加和读取不需要加锁，也不需要带lock前缀的原子指令：
+/// 在x86_64上，它们各自被编译为一条基于gs的指令，不会被中断打断，也不会在执行过程中被迁移到其他CPU。
+///
+/// 与`PerCpuVar`不同，计数器在数据区中只按照8字节对齐：同一个CPU的多个计数器只会被这个CPU修改，
+/// 把它们紧凑地放在一起反而能减少缓存行的占用。
+#[derive(Debug)]
+pub struct PerCpuCounter {
+    offset: usize,
+}
+
+impl PerCpuCounter {
+    /// 创建一个计数器，每个CPU上的初始值都为0
+    ///
+    /// ## 返回值
+    ///
+    /// 数据区的剩余空间不足时，返回None
+    pub fn new() -> Option<Self> {
+        let offset = PerCpu::alloc_offset(
+            core::mem::size_of::<AtomicU64>(),
+            core::mem::align_of::<AtomicU64>(),
+        )?;
+        let r = Self { offset };
+        for cpu in 0..PerCpu::cpu_num() {
+            r.counter(ProcessorId::new(cpu)).store(0, Ordering::Relaxed);
+        }
+        return Some(r);
+    }
+
+    #[inline]
+    fn counter(&self, cpu: ProcessorId) -> &AtomicU64 {
+        let base = PerCpu::area_base(cpu);
+        unsafe { &*((base.data() + self.offset) as *const AtomicU64) }
+    }
+
+    /// 给当前CPU的计数器加上`val`
+    #[inline(always)]
+    pub fn this_cpu_add(&self, val: u64) {
+        unsafe { CurrentPerCpuArch::this_cpu_add_u64(self.offset, val) };
+    }
+
+    /// 当前CPU的计数器加一
+    #[inline(always)]
+    pub fn this_cpu_inc(&self) {
+        self.this_cpu_add(1);
+    }
+
+    /// 读取当前CPU的计数器
+    #[inline(always)]
+    pub fn this_cpu_read(&self) -> u64 {
+        return unsafe { CurrentPerCpuArch::this_cpu_read_u64(self.offset) };
+    }
+
+    /// 读取指定CPU的计数器
+    pub fn read_cpu(&self, cpu: ProcessorId) -> u64 {
+        return self.counter(cpu).load(Ordering::Relaxed);
+    }
+
+    /// 所有CPU的计数器之和
+    pub fn sum(&self) -> u64 {
+        return (0..PerCpu::cpu_num())
+            .map(|cpu| self.read_cpu(ProcessorId::new(cpu)))
+            .sum();
+    }
+}
+
+impl Drop for PerCpuCounter {
+    fn drop(&mut self) {
+        PerCpu::free_offset(self.offset, core::mem::size_of::<AtomicU64>());
+    }
+}
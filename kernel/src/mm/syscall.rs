@@ -236,12 +236,14 @@ impl Syscall {
             return Err(SystemError::EOPNOTSUPP_OR_ENOTSUP);
         }
         let current_address_space = AddressSpace::current()?;
+        // 除非指定了MAP_POPULATE，否则物理页在第一次访问时才分配
         let start_page = current_address_space.write().map_anonymous(
             start_vaddr,
             len,
             prot_flags,
             map_flags,
             true,
+            map_flags.contains(MapFlags::MAP_POPULATE),
         )?;
         return Ok(start_page.virt_address().data());
     }
@@ -25,16 +25,18 @@ use crate::{
         spinlock::{SpinLock, SpinLockGuard},
     },
     process::ProcessManager,
-    syscall::user_access::{UserBufferReader, UserBufferWriter},
 };
 
 use super::{
     allocator::page_frame::{
-        deallocate_page_frames, PageFrameCount, PhysPageFrame, VirtPageFrame, VirtPageFrameIter,
+        allocate_page_frames, deallocate_page_frames, PageFrameCount, PhysPageFrame, VirtPageFrame,
+        VirtPageFrameIter,
     },
-    page::{Flusher, InactiveFlusher, PageFlags, PageFlushAll},
+    page::{Flusher, InactiveFlusher, PageFlags, PageFlush, PageFlushAll},
+    page_meta::{page_meta, PageMetaFlags},
+    page_ref::{page_pin_count, page_ref_count_mapped, page_ref_dec, page_ref_inc},
     syscall::{MapFlags, MremapFlags, ProtFlags},
-    MemoryManagementArch, PageTableKind, VirtAddr, VirtRegion, VmFlags,
+    MemoryManagementArch, PageTableKind, PhysAddr, VirtAddr, VirtRegion, VmFlags,
 };
 
 /// MMAP_MIN_ADDR的默认值
@@ -53,6 +55,8 @@ pub const DEFAULT_MMAP_MIN_ADDR: usize = 65536;
 #[derive(Debug)]
 pub struct AddressSpace {
     inner: RwLock<InnerAddressSpace>,
+    /// 只持有读锁时修改页表所需的锁，参见`lock_page_table`
+    page_table_lock: SpinLock<()>,
 }
 
 impl AddressSpace {
@@ -60,10 +64,28 @@ impl AddressSpace {
         let inner = InnerAddressSpace::new(create_stack)?;
         let result = Self {
             inner: RwLock::new(inner),
+            page_table_lock: SpinLock::new(()),
         };
         return Ok(Arc::new(result));
     }
 
+    /// 在只持有地址空间读锁的情况下修改页表（例如缺页处理）
+    ///
+    /// 持有写锁的路径独占整个地址空间，不需要这把锁。持有读锁的路径可能并发地修改页表
+    /// （不同的VMA可能共享同一个中间级页表），因此必须在返回的守卫被释放之前使用映射器。
+    ///
+    /// ## 参数
+    ///
+    /// - `inner` - 通过读锁获得的地址空间
+    pub fn lock_page_table<'a>(
+        &'a self,
+        inner: &InnerAddressSpace,
+    ) -> (SpinLockGuard<'a, ()>, PageMapper) {
+        let guard = self.page_table_lock.lock();
+        let mapper = unsafe { inner.user_mapper.utable.alias() };
+        return (guard, mapper);
+    }
+
     /// 从pcb中获取当前进程的地址空间结构体的Arc指针
     pub fn current() -> Result<Arc<AddressSpace>, SystemError> {
         let vm = ProcessManager::current_pcb()
@@ -150,6 +172,11 @@ impl InnerAddressSpace {
     /// # Returns
     ///
     /// 返回克隆后的，新的地址空间的Arc指针
+    ///
+    /// # 注意
+    ///
+    /// 写时复制会撤销父进程页表项的写权限，本函数只刷新当前CPU的TLB。同一地址空间的其他线程可能正在其他CPU上运行，
+    /// 调用者必须在释放地址空间的锁之后、让子进程运行之前，调用`tlb_shootdown`
     #[inline(never)]
     pub fn try_clone(&mut self) -> Result<Arc<AddressSpace>, SystemError> {
         let irq_guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
@@ -162,6 +189,8 @@ impl InnerAddressSpace {
         }
         let _current_stack_size = self.user_stack.as_ref().unwrap().stack_size();
 
+        let mut flusher: PageFlushAll<MMArch> = PageFlushAll::new();
+
         let current_mapper = &mut self.user_mapper.utable;
 
         // 拷贝空洞
@@ -171,58 +200,60 @@ impl InnerAddressSpace {
             // TODO: 增加对VMA是否为文件映射的判断，如果是的话，就跳过
 
             let vma_guard: SpinLockGuard<'_, VMA> = vma.lock();
-            let old_flags = vma_guard.flags();
-            let tmp_flags: PageFlags<MMArch> = PageFlags::new().set_write(true);
-
-            // 分配内存页并创建新的VMA
-            let new_vma = VMA::zeroed(
-                VirtPageFrame::new(vma_guard.region.start()),
-                PageFrameCount::new(vma_guard.region.size() / MMArch::PAGE_SIZE),
-                vma_guard.vm_flags().clone(),
-                tmp_flags,
-                &mut new_guard.user_mapper.utable,
-                (),
-            )?;
-            new_guard.mappings.vmas.insert(new_vma.clone());
+            let flags = vma_guard.flags();
+            let vm_flags = *vma_guard.vm_flags();
+
+            // 可写的私有映射采用写时复制：父子进程以只读的方式共享物理页，直到有一方写入
+            let cow =
+                vm_flags.contains(VmFlags::VM_WRITE) && !vm_flags.contains(VmFlags::VM_SHARED);
+            let shared_flags = if cow { flags.set_write(false) } else { flags };
+
+            // 创建新的VMA。尚未映射的页面在子进程中同样按需分配
+            let new_vma = LockedVMA::new(VMA::new(vma_guard.region, vm_flags, flags, true));
+            new_guard.mappings.vmas.insert(new_vma);
             // kdebug!("new vma: {:x?}", new_vma);
-            let mut new_vma_guard = new_vma.lock();
-            for page in new_vma_guard.pages().map(|p| p.virt_address()) {
+            let new_mapper = &mut new_guard.user_mapper.utable;
+            for page in vma_guard.pages().map(|p| p.virt_address()) {
                 // kdebug!("page: {:x?}", page);
-                let current_frame = unsafe {
-                    MMArch::phys_2_virt(
-                        current_mapper
-                            .translate(page)
-                            .expect("VMA page not mapped")
-                            .0,
-                    )
-                }
-                .expect("Phys2Virt: vaddr overflow.")
-                .data() as *mut u8;
-
-                let new_frame = unsafe {
-                    MMArch::phys_2_virt(
-                        new_guard
-                            .user_mapper
-                            .utable
-                            .translate(page)
-                            .expect("VMA page not mapped")
-                            .0,
-                    )
+                let paddr = match current_mapper.translate(page) {
+                    Some((paddr, _)) => paddr,
+                    None => continue,
+                };
+
+                if cow && page_pin_count(paddr) != 0 {
+                    // 被固定的页面可能正在进行DMA，父进程必须继续使用原来的物理页，因此直接复制给子进程
+                    let (new_paddr, _) = unsafe { allocate_page_frames(PageFrameCount::new(1)) }
+                        .ok_or(SystemError::ENOMEM)?;
+                    unsafe {
+                        let src = MMArch::phys_2_virt(paddr).unwrap();
+                        let dst = MMArch::phys_2_virt(new_paddr).unwrap();
+                        (dst.data() as *mut u8)
+                            .copy_from_nonoverlapping(src.data() as *const u8, MMArch::PAGE_SIZE);
+                    }
+                    let flush = unsafe { new_mapper.map_phys(page, new_paddr, flags) }
+                        .ok_or(SystemError::ENOMEM)?;
+                    unsafe { flush.ignore() };
+                    if let Some(meta) = page_meta(new_paddr) {
+                        meta.set_flags(PageMetaFlags::PG_ANON);
+                    }
+                    continue;
                 }
-                .expect("Phys2Virt: vaddr overflow.")
-                .data() as *mut u8;
 
-                unsafe {
-                    // 拷贝数据
-                    new_frame.copy_from_nonoverlapping(current_frame, MMArch::PAGE_SIZE);
+                if cow {
+                    let flush = unsafe { current_mapper.remap(page, shared_flags) }.unwrap();
+                    flusher.consume(flush);
                 }
+
+                let flush = unsafe { new_mapper.map_phys(page, paddr, shared_flags) }
+                    .ok_or(SystemError::ENOMEM)?;
+                // 新的地址空间不是当前的地址空间，不需要刷新TLB
+                unsafe { flush.ignore() };
+                page_ref_inc(paddr);
             }
             drop(vma_guard);
-
-            new_vma_guard.remap(old_flags, &mut new_guard.user_mapper.utable, ())?;
-            drop(new_vma_guard);
         }
         drop(new_guard);
+        flusher.flush();
         drop(irq_guard);
         return Ok(new_addr_space);
     }
@@ -242,6 +273,10 @@ impl InnerAddressSpace {
     /// - `prot_flags`：保护标志
     /// - `map_flags`：映射标志
     /// - `round_to_min`：是否将`start_vaddr`对齐到`mmap_min`，如果为`true`，则当`start_vaddr`不为0时，会对齐到`mmap_min`，否则仅向下对齐到页边界
+    /// - `allocate_at_once`：是否立即分配物理页。如果为`false`，则只创建VMA，物理页在第一次访问时由缺页异常分配
+    ///
+    /// 请注意，如果内核需要在持有地址空间的锁的情况下访问这段内存（例如加载ELF文件），必须立即分配物理页，
+    /// 否则缺页异常处理程序会因为无法获取地址空间的锁而死锁。
     ///
     /// ## 返回
     ///
@@ -253,6 +288,7 @@ impl InnerAddressSpace {
         prot_flags: ProtFlags,
         map_flags: MapFlags,
         round_to_min: bool,
+        allocate_at_once: bool,
     ) -> Result<VirtPageFrame, SystemError> {
         // 用于对齐hint的函数
         let round_hint_to_min = |hint: VirtAddr| {
@@ -287,7 +323,16 @@ impl InnerAddressSpace {
             prot_flags,
             map_flags,
             move |page, count, flags, mapper, flusher| {
-                Ok(VMA::zeroed(page, count, vm_flags, flags, mapper, flusher)?)
+                if allocate_at_once {
+                    VMA::zeroed(page, count, vm_flags, flags, mapper, flusher)
+                } else {
+                    Ok(LockedVMA::new(VMA::new(
+                        VirtRegion::new(page.virt_address(), count.bytes()),
+                        vm_flags,
+                        flags,
+                        true,
+                    )))
+                }
             },
         )?;
 
@@ -422,20 +467,35 @@ impl InnerAddressSpace {
             self.munmap(start_page, page_count)?;
         }
 
-        // 获取映射后的新内存页面
-        let new_page = self.map_anonymous(new_vaddr, new_len, prot_flags, map_flags, true)?;
+        // 获取映射后的新内存页面（按需分配）
+        let new_page =
+            self.map_anonymous(new_vaddr, new_len, prot_flags, map_flags, true, false)?;
         let new_page_vaddr = new_page.virt_address();
 
-        // 拷贝旧内存区域内容到新内存区域
-        let old_buffer_reader =
-            UserBufferReader::new(old_vaddr.data() as *const u8, old_len, true)?;
-        let old_buf: &[u8] = old_buffer_reader.read_from_user(0)?;
-        let mut new_buffer_writer =
-            UserBufferWriter::new(new_page_vaddr.data() as *mut u8, new_len, true)?;
-        let new_buf: &mut [u8] = new_buffer_writer.buffer(0)?;
-        let len = old_buf.len().min(new_buf.len());
-        for i in 0..len {
-            new_buf[i] = old_buf[i];
+        // 拷贝旧内存区域内容到新内存区域。
+        // 由于当前持有地址空间的锁，这里不能通过用户地址访问内存（可能触发缺页异常），
+        // 而是直接通过物理地址拷贝已经映射了的页面
+        let flags = self
+            .mappings
+            .contains(new_page_vaddr)
+            .ok_or(SystemError::EFAULT)?
+            .lock()
+            .flags();
+        let mut flusher: PageFlushAll<MMArch> = PageFlushAll::new();
+        let page_count = PageFrameCount::from_bytes(page_align_up(old_len.min(new_len))).unwrap();
+        for i in 0..page_count.data() {
+            let offset = i * MMArch::PAGE_SIZE;
+            if let Some((paddr, _)) = self.user_mapper.utable.translate(old_vaddr + offset) {
+                let flush = unsafe {
+                    copy_frame_to(
+                        &mut self.user_mapper.utable,
+                        new_page_vaddr + offset,
+                        paddr,
+                        flags,
+                    )?
+                };
+                flusher.consume(flush);
+            }
         }
 
         return Ok(new_page_vaddr);
@@ -598,7 +658,7 @@ impl InnerAddressSpace {
             let len = new_brk - self.brk;
             let prot_flags = ProtFlags::PROT_READ | ProtFlags::PROT_WRITE | ProtFlags::PROT_EXEC;
             let map_flags = MapFlags::MAP_PRIVATE | MapFlags::MAP_ANONYMOUS | MapFlags::MAP_FIXED;
-            self.map_anonymous(old_brk, len, prot_flags, map_flags, true)?;
+            self.map_anonymous(old_brk, len, prot_flags, map_flags, true, false)?;
 
             self.brk = new_brk;
             return Ok(old_brk);
@@ -634,6 +694,45 @@ impl InnerAddressSpace {
     }
 }
 
+/// 分配一个新的物理页，把`src`物理页的内容拷贝进去，并映射到`mapper`中的`dst`虚拟地址
+///
+/// ## 返回值
+///
+/// 返回新映射的页表项的刷新器
+unsafe fn copy_frame_to(
+    mapper: &mut PageMapper,
+    dst: VirtAddr,
+    src: PhysAddr,
+    flags: PageFlags<MMArch>,
+) -> Result<PageFlush<MMArch>, SystemError> {
+    let flush = mapper.map(dst, flags).ok_or(SystemError::ENOMEM)?;
+    let new_paddr = mapper.translate(dst).unwrap().0;
+
+    let src = MMArch::phys_2_virt(src).expect("Phys2Virt: vaddr overflow.");
+    let dst = MMArch::phys_2_virt(new_paddr).expect("Phys2Virt: vaddr overflow.");
+    (dst.data() as *mut u8).copy_from_nonoverlapping(src.data() as *const u8, MMArch::PAGE_SIZE);
+    return Ok(flush);
+}
+
+/// 修改一个页面的标志位。与其他页表共享的页面（写时复制）保持只读
+///
+/// ## 返回值
+///
+/// 如果页面没有被映射，返回None
+unsafe fn remap_page(
+    mapper: &mut PageMapper,
+    virt: VirtAddr,
+    flags: PageFlags<MMArch>,
+) -> Option<PageFlush<MMArch>> {
+    let (paddr, _) = mapper.translate(virt)?;
+    let flags = if flags.has_write() && page_ref_count_mapped(paddr) > 1 {
+        flags.set_write(false)
+    } else {
+        flags
+    };
+    return mapper.remap(virt, flags);
+}
+
 impl Drop for InnerAddressSpace {
     fn drop(&mut self) {
         unsafe {
@@ -691,7 +790,6 @@ impl UserMappings {
     /// 判断当前进程的VMA内，是否有包含指定的虚拟地址的VMA。
     ///
     /// 如果有，返回包含指定虚拟地址的VMA的Arc指针，否则返回None。
-    #[allow(dead_code)]
     pub fn contains(&self, vaddr: VirtAddr) -> Option<Arc<LockedVMA>> {
         for v in self.vmas.iter() {
             let guard = v.lock();
@@ -917,14 +1015,10 @@ impl LockedVMA {
         let mut guard = self.lock();
         assert!(guard.mapped);
         for page in guard.region.pages() {
-            // 暂时要求所有的页帧都已经映射到页表
-            // TODO: 引入Lazy Mapping, 通过缺页中断来映射页帧，这里就不必要求所有的页帧都已经映射到页表了
-            let r = unsafe {
-                mapper
-                    .remap(page.virt_address(), flags)
-                    .expect("Failed to remap, beacuse of some page is not mapped")
-            };
-            flusher.consume(r);
+            // 尚未发生缺页的页面没有映射到页表，跳过即可。它们在缺页时会使用新的标志位
+            if let Some(r) = unsafe { remap_page(mapper, page.virt_address(), flags) } {
+                flusher.consume(r);
+            }
         }
         guard.flags = flags;
         return Ok(());
@@ -936,18 +1030,22 @@ impl LockedVMA {
         let mut guard = self.lock();
         assert!(guard.mapped);
         for page in guard.region.pages() {
-            let (paddr, _, flush) = unsafe { mapper.unmap_phys(page.virt_address(), true) }
-                .expect("Failed to unmap, beacuse of some page is not mapped");
+            // 尚未发生缺页的页面没有映射到页表，也就没有需要释放的物理页
+            let (paddr, _, flush) = match unsafe { mapper.unmap_phys(page.virt_address(), true) } {
+                Some(r) => r,
+                None => continue,
+            };
 
             // todo: 获取物理页的anon_vma的守卫
 
             // todo: 从anon_vma中删除当前VMA
 
-            // todo: 如果物理页的anon_vma链表长度为0，则释放物理页.
-
-            // 目前由于还没有实现共享页，所以直接释放物理页也没问题。
-            // 但是在实现共享页之后，就不能直接释放物理页了，需要在anon_vma链表长度为0的时候才能释放物理页
-            unsafe { deallocate_page_frames(PhysPageFrame::new(paddr), PageFrameCount::new(1)) };
+            // 物理页可能与其他进程共享（写时复制），只有在不再被任何页表引用时才释放
+            if page_ref_dec(paddr) == 0 {
+                unsafe {
+                    deallocate_page_frames(PhysPageFrame::new(paddr), PageFrameCount::new(1))
+                };
+            }
 
             flusher.consume(flush);
         }
@@ -1123,16 +1221,10 @@ impl VMA {
         assert!(self.mapped);
         for page in self.region.pages() {
             // kdebug!("remap page {:?}", page.virt_address());
-            // 暂时要求所有的页帧都已经映射到页表
-            // TODO: 引入Lazy Mapping, 通过缺页中断来映射页帧，这里就不必要求所有的页帧都已经映射到页表了
-            let r = unsafe {
-                mapper
-                    .remap(page.virt_address(), flags)
-                    .expect("Failed to remap, beacuse of some page is not mapped")
-            };
-            // kdebug!("consume page {:?}", page.virt_address());
-            flusher.consume(r);
-            // kdebug!("remap page {:?} done", page.virt_address());
+            // 尚未发生缺页的页面没有映射到页表，跳过即可
+            if let Some(r) = unsafe { remap_page(mapper, page.virt_address(), flags) } {
+                flusher.consume(r);
+            }
         }
         self.flags = flags;
         return Ok(());
@@ -1348,6 +1440,7 @@ impl UserStack {
             prot_flags,
             map_flags,
             false,
+            false,
         )?;
         // test_buddy();
         // 设置保护页只读
@@ -1399,6 +1492,7 @@ impl UserStack {
             prot_flags,
             map_flags,
             false,
+            false,
         )?;
 
         return Ok(());
@@ -1433,6 +1527,7 @@ impl UserStack {
             prot_flags,
             map_flags,
             false,
+            false,
         )?;
 
         return Ok(());
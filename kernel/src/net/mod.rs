@@ -9,6 +9,7 @@ use crate::{driver::net::NetDriver, libs::rwlock::RwLock};
 use smoltcp::wire::IpEndpoint;
 
 pub mod event_poll;
+pub mod napi;
 pub mod net_core;
 pub mod socket;
 pub mod syscall;
@@ -0,0 +1,294 @@
+//! 网卡收包的NAPI机制
+//!
+//! 网卡中断只做三件事：关闭网卡的收包中断、把网卡挂到当前cpu的轮询队列上、触发NET_RX软中断。
+//! 真正的收包与协议栈处理在软中断上下文中进行，每个网卡每轮最多处理`NAPI_POLL_WEIGHT`个数据包：
+//! - 收包队列被取空时，结束轮询并重新打开收包中断；
+//! - 预算用完时，网卡重新排到轮询队列末尾，等待下一轮软中断（负载过高时由ksoftirqd接手）。
+//!
+//! 参考：https://code.dragonos.org.cn/xref/linux-6.1.9/net/core/dev.c#6633
+
+use core::sync::atomic::{AtomicU64, AtomicU8, Ordering};
+
+use alloc::{
+    boxed::Box,
+    collections::VecDeque,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use smoltcp::{iface::SocketSet, phy};
+use system_error::SystemError;
+use unified_init::macros::unified_init;
+
+use crate::{
+    driver::net::NetDriver,
+    exception::softirq::{softirq_vectors, SoftirqNumber, SoftirqVec},
+    init::initcall::INITCALL_SUBSYS,
+    libs::spinlock::SpinLock,
+    mm::percpu::{PerCpu, PerCpuVar},
+    time::{
+        timer::{next_n_us_timer_jiffies, Timer, TimerFunction},
+        Instant,
+    },
+};
+
+use super::{
+    net_core::{collect_events, send_event},
+    socket::{
+        sockets::{tcp_listen_refill, tcp_listen_update},
+        SOCKET_SET,
+    },
+    NET_DRIVERS,
+};
+
+/// 每个网卡每轮轮询最多处理的数据包数量
+pub const NAPI_POLL_WEIGHT: usize = 64;
+/// 一次NET_RX软中断最多处理的数据包数量
+const NETDEV_BUDGET: usize = 300;
+
+/// 网卡已经被调度，在某个cpu的轮询队列上（或者正在被轮询）
+const NAPI_STATE_SCHED: u8 = 1 << 0;
+/// 网卡被调度期间又来了中断，结束轮询时需要再轮询一次
+const NAPI_STATE_MISSED: u8 = 1 << 1;
+
+static mut NAPI_POLL_LIST: Option<PerCpuVar<SpinLock<VecDeque<Arc<dyn NetDriver>>>>> = None;
+
+#[inline]
+fn napi_poll_list() -> &'static SpinLock<VecDeque<Arc<dyn NetDriver>>> {
+    unsafe { NAPI_POLL_LIST.as_ref().unwrap().get() }
+}
+
+/// 每个网卡的NAPI状态
+#[derive(Debug)]
+pub struct NapiStruct {
+    state: AtomicU8,
+    /// 协议栈下一次需要被轮询的时刻（jiffies），为0表示没有待触发的定时器
+    next_poll: AtomicU64,
+}
+
+impl NapiStruct {
+    pub const fn new() -> Self {
+        return Self {
+            state: AtomicU8::new(0),
+            next_poll: AtomicU64::new(0),
+        };
+    }
+
+    /// 尝试把网卡标记为已调度
+    ///
+    /// ## 返回值
+    ///
+    /// - `true` 调用者需要把网卡放到轮询队列上
+    /// - `false` 网卡已经被调度，本次中断被记录下来，由正在进行的轮询负责处理
+    fn schedule_prep(&self) -> bool {
+        let prev = self
+            .state
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |state| {
+                if state & NAPI_STATE_SCHED != 0 {
+                    Some(state | NAPI_STATE_MISSED)
+                } else {
+                    Some(state | NAPI_STATE_SCHED)
+                }
+            })
+            .unwrap();
+        return prev & NAPI_STATE_SCHED == 0;
+    }
+
+    /// 结束轮询
+    ///
+    /// ## 返回值
+    ///
+    /// - `true` 网卡已经退出调度状态，调用者应当重新打开收包中断
+    /// - `false` 轮询期间错过了中断，网卡仍然处于调度状态，需要再轮询一次
+    fn complete(&self) -> bool {
+        let prev = self
+            .state
+            .fetch_update(Ordering::AcqRel, Ordering::Acquire, |state| {
+                if state & NAPI_STATE_MISSED != 0 {
+                    Some(NAPI_STATE_SCHED)
+                } else {
+                    Some(0)
+                }
+            })
+            .unwrap();
+        return prev & NAPI_STATE_MISSED == 0;
+    }
+}
+
+/// 在网卡中断中调用，把网卡放到当前cpu的轮询队列上，并触发NET_RX软中断
+pub fn napi_schedule(iface: Arc<dyn NetDriver>) {
+    if !iface.napi().schedule_prep() {
+        return;
+    }
+    iface.set_rx_irq(false);
+    napi_poll_list().lock_irqsave().push_back(iface);
+    softirq_vectors().raise_softirq(SoftirqNumber::NetRx);
+}
+
+/// 调度所有的网卡（用于无法区分中断来源的共享中断处理函数）
+pub fn napi_schedule_all() {
+    let ifaces: Vec<Arc<dyn NetDriver>> = NET_DRIVERS.read_irqsave().values().cloned().collect();
+    for iface in ifaces {
+        napi_schedule(iface);
+    }
+}
+
+/// 对网卡的phy::Device的包装，收到`budget`个数据包之后就不再从网卡取包
+pub struct NapiBudgetDevice<'a, D: phy::Device> {
+    inner: &'a mut D,
+    budget: usize,
+    received: usize,
+}
+
+impl<'a, D: phy::Device> NapiBudgetDevice<'a, D> {
+    pub fn new(inner: &'a mut D, budget: usize) -> Self {
+        return Self {
+            inner,
+            budget,
+            received: 0,
+        };
+    }
+
+    /// 本轮已经从网卡取出的数据包数量
+    pub fn received(&self) -> usize {
+        return self.received;
+    }
+}
+
+impl<'a, D: phy::Device> phy::Device for NapiBudgetDevice<'a, D> {
+    type RxToken<'b>
+        = D::RxToken<'b>
+    where
+        Self: 'b;
+    type TxToken<'b>
+        = D::TxToken<'b>
+    where
+        Self: 'b;
+
+    fn receive(
+        &mut self,
+        timestamp: smoltcp::time::Instant,
+    ) -> Option<(Self::RxToken<'_>, Self::TxToken<'_>)> {
+        if self.received >= self.budget {
+            return None;
+        }
+        let tokens = self.inner.receive(timestamp)?;
+        self.received += 1;
+        return Some(tokens);
+    }
+
+    fn transmit(&mut self, timestamp: smoltcp::time::Instant) -> Option<Self::TxToken<'_>> {
+        return self.inner.transmit(timestamp);
+    }
+
+    fn capabilities(&self) -> phy::DeviceCapabilities {
+        return self.inner.capabilities();
+    }
+}
+
+/// 协议栈定时器（重传、延迟ACK等）到期时，调度一次网卡轮询
+#[derive(Debug)]
+struct NapiPollTimer {
+    iface: Weak<dyn NetDriver>,
+    expire: u64,
+}
+
+impl TimerFunction for NapiPollTimer {
+    fn run(&mut self) -> Result<(), SystemError> {
+        if let Some(iface) = self.iface.upgrade() {
+            iface
+                .napi()
+                .next_poll
+                .compare_exchange(self.expire, 0, Ordering::AcqRel, Ordering::Relaxed)
+                .ok();
+            napi_schedule(iface);
+        }
+        return Ok(());
+    }
+}
+
+/// 根据协议栈下一次需要被轮询的时间，为网卡设置定时器
+///
+/// 只有新的时刻早于已经设置的时刻时，才会新建定时器；过期的定时器到期后只会多触发一次轮询
+pub(super) fn napi_arm_timer(iface: &Arc<dyn NetDriver>, sockets: &SocketSet) {
+    let timestamp: smoltcp::time::Instant = Instant::now().into();
+    let delay = match iface.inner_iface().lock().poll_delay(timestamp, sockets) {
+        Some(delay) => delay,
+        None => return,
+    };
+    let expire = next_n_us_timer_jiffies(delay.total_micros().max(1));
+
+    let next_poll = &iface.napi().next_poll;
+    let prev = next_poll.load(Ordering::Acquire);
+    if prev != 0 && prev <= expire {
+        return;
+    }
+    if next_poll
+        .compare_exchange(prev, expire, Ordering::AcqRel, Ordering::Relaxed)
+        .is_err()
+    {
+        return;
+    }
+
+    let timer = Timer::new(
+        Box::new(NapiPollTimer {
+            iface: Arc::downgrade(iface),
+            expire,
+        }),
+        expire,
+    );
+    timer.activate();
+}
+
+/// NET_RX软中断
+#[derive(Debug)]
+struct NetRxSoftirq;
+
+impl SoftirqVec for NetRxSoftirq {
+    fn run(&self) {
+        let list = napi_poll_list();
+        let mut budget = NETDEV_BUDGET;
+
+        while budget > 0 {
+            let iface = match list.lock_irqsave().pop_front() {
+                Some(iface) => iface,
+                None => break,
+            };
+
+            let mut sockets = SOCKET_SET.lock_irqsave();
+            let work = iface.napi_poll(&mut sockets, NAPI_POLL_WEIGHT);
+            napi_arm_timer(&iface, &sockets);
+            let mut events = tcp_listen_update(&mut sockets);
+            events.extend(collect_events(&sockets));
+            drop(sockets);
+            send_event(events);
+            tcp_listen_refill();
+
+            // 至少消耗1个预算，避免不断错过中断的网卡让这个循环停不下来
+            budget = budget.saturating_sub(work.max(1));
+            if work < NAPI_POLL_WEIGHT && iface.napi().complete() {
+                // 收包队列已经取空，重新打开中断
+                iface.set_rx_irq(true);
+            } else {
+                list.lock_irqsave().push_back(iface);
+            }
+        }
+
+        if !list.lock_irqsave().is_empty() {
+            softirq_vectors().raise_softirq(SoftirqNumber::NetRx);
+        }
+    }
+}
+
+#[unified_init(INITCALL_SUBSYS)]
+fn napi_init() -> Result<(), SystemError> {
+    let mut data = Vec::with_capacity(PerCpu::MAX_CPU_NUM as usize);
+    for _ in 0..PerCpu::MAX_CPU_NUM {
+        data.push(SpinLock::new(VecDeque::new()));
+    }
+    unsafe {
+        NAPI_POLL_LIST = Some(PerCpuVar::new(data).ok_or(SystemError::ENOMEM)?);
+    }
+
+    softirq_vectors().register_softirq(SoftirqNumber::NetRx, Arc::new(NetRxSoftirq))?;
+    return Ok(());
+}
@@ -1,4 +1,4 @@
-use alloc::{boxed::Box, collections::BTreeMap, sync::Arc};
+use alloc::{collections::BTreeMap, sync::Arc, vec::Vec};
 use smoltcp::{socket::dhcpv4, wire};
 use system_error::SystemError;
 
@@ -6,37 +6,19 @@ use crate::{
     driver::net::NetDriver,
     kdebug, kinfo, kwarn,
     libs::rwlock::RwLockReadGuard,
-    net::{socket::SocketPollMethod, NET_DRIVERS},
-    time::timer::{next_n_ms_timer_jiffies, Timer, TimerFunction},
+    net::{napi::napi_arm_timer, socket::SocketPollMethod, NET_DRIVERS},
 };
 
 use super::{
     event_poll::{EPollEventType, EventPoll},
-    socket::{sockets::TcpSocket, HANDLE_MAP, SOCKET_SET},
+    socket::{
+        sockets::{tcp_listen_refill, tcp_listen_update, TcpSocket},
+        SocketHandleItem, HANDLE_MAP, SOCKET_SET,
+    },
 };
 
-/// The network poll function, which will be called by timer.
-///
-/// The main purpose of this function is to poll all network interfaces.
-#[derive(Debug)]
-struct NetWorkPollFunc;
-
-impl TimerFunction for NetWorkPollFunc {
-    fn run(&mut self) -> Result<(), SystemError> {
-        poll_ifaces_try_lock(10).ok();
-        let next_time = next_n_ms_timer_jiffies(10);
-        let timer = Timer::new(Box::new(NetWorkPollFunc), next_time);
-        timer.activate();
-        return Ok(());
-    }
-}
-
 pub fn net_init() -> Result<(), SystemError> {
     dhcp_query()?;
-    // Init poll timer function
-    // let next_time = next_n_ms_timer_jiffies(5);
-    // let timer = Timer::new(Box::new(NetWorkPollFunc), next_time);
-    // timer.activate();
     return Ok(());
 }
 
@@ -119,6 +101,9 @@ fn dhcp_query() -> Result<(), SystemError> {
     return Err(SystemError::ETIMEDOUT);
 }
 
+/// 在进程上下文中同步地轮询所有网卡，用于把socket上刚写入的数据立即发送出去。
+///
+/// 收包由网卡中断触发的NAPI软中断完成，读socket之前不需要调用这个函数
 pub fn poll_ifaces() {
     let guard: RwLockReadGuard<BTreeMap<usize, Arc<dyn NetDriver>>> = NET_DRIVERS.read_irqsave();
     if guard.len() == 0 {
@@ -128,87 +113,46 @@ pub fn poll_ifaces() {
     let mut sockets = SOCKET_SET.lock_irqsave();
     for (_, iface) in guard.iter() {
         iface.poll(&mut sockets).ok();
+        napi_arm_timer(iface, &sockets);
     }
-    let _ = send_event(&sockets);
+    let mut events = tcp_listen_update(&mut sockets);
+    events.extend(collect_events(&sockets));
+    drop(sockets);
+    drop(guard);
+    send_event(events);
+    tcp_listen_refill();
 }
 
-/// 对ifaces进行轮询，最多对SOCKET_SET尝试times次加锁。
+/// ### 收集轮询后各个socket上需要通知的事件
 ///
-/// @return 轮询成功，返回Ok(())
-/// @return 加锁超时，返回SystemError::EAGAIN_OR_EWOULDBLOCK
-/// @return 没有网卡，返回SystemError::ENODEV
-pub fn poll_ifaces_try_lock(times: u16) -> Result<(), SystemError> {
-    let mut i = 0;
-    while i < times {
-        let guard: RwLockReadGuard<BTreeMap<usize, Arc<dyn NetDriver>>> =
-            NET_DRIVERS.read_irqsave();
-        if guard.len() == 0 {
-            kwarn!("poll_ifaces: No net driver found!");
-            // 没有网卡，返回错误
-            return Err(SystemError::ENODEV);
-        }
-        let sockets = SOCKET_SET.try_lock_irqsave();
-        // 加锁失败，继续尝试
-        if sockets.is_err() {
-            i += 1;
-            continue;
-        }
-
-        let mut sockets = sockets.unwrap();
-        for (_, iface) in guard.iter() {
-            iface.poll(&mut sockets).ok();
-        }
-        send_event(&sockets)?;
-        return Ok(());
-    }
-
-    // 尝试次数用完，返回错误
-    return Err(SystemError::EAGAIN_OR_EWOULDBLOCK);
-}
-
-/// 对ifaces进行轮询，最多对SOCKET_SET尝试一次加锁。
-///
-/// @return 轮询成功，返回Ok(())
-/// @return 加锁超时，返回SystemError::EAGAIN_OR_EWOULDBLOCK
-/// @return 没有网卡，返回SystemError::ENODEV
-pub fn poll_ifaces_try_lock_onetime() -> Result<(), SystemError> {
-    let guard: RwLockReadGuard<BTreeMap<usize, Arc<dyn NetDriver>>> = NET_DRIVERS.read_irqsave();
-    if guard.len() == 0 {
-        kwarn!("poll_ifaces: No net driver found!");
-        // 没有网卡，返回错误
-        return Err(SystemError::ENODEV);
-    }
-    let mut sockets = SOCKET_SET.try_lock_irqsave()?;
-    for (_, iface) in guard.iter() {
-        iface.poll(&mut sockets).ok();
-    }
-    send_event(&sockets)?;
-    return Ok(());
-}
-
-/// ### 处理轮询后的事件
-fn send_event(sockets: &smoltcp::iface::SocketSet) -> Result<(), SystemError> {
+/// 调用者持有SOCKET_SET。这里只计算事件，唤醒等待者要在释放SOCKET_SET之后通过`send_event`进行。
+/// 只收集状态发生了变化、或者收到了新数据的socket
+pub(super) fn collect_events(
+    sockets: &smoltcp::iface::SocketSet,
+) -> Vec<(Arc<SocketHandleItem>, u64)> {
+    let mut result = Vec::new();
     for (handle, socket_type) in sockets.iter() {
-        let handle_guard = HANDLE_MAP.read_irqsave();
-        let item = handle_guard.get(&handle);
-        if item.is_none() {
-            continue;
+        let handle_item = match HANDLE_MAP.get(&handle) {
+            Some(item) => item,
+            None => continue,
+        };
+        // 监听socket的锚点只由tcp_listen_update唤醒
+        if let smoltcp::socket::Socket::Tcp(inner_socket) = socket_type {
+            if TcpSocket::is_listen_anchor(inner_socket) {
+                continue;
+            }
         }
 
-        let handle_item = item.unwrap();
-
         // 获取socket上的事件
         let mut events =
             SocketPollMethod::poll(socket_type, handle_item.shutdown_type()).bits() as u64;
 
         // 分发到相应类型socket处理
-        match socket_type {
+        let notify = match socket_type {
             smoltcp::socket::Socket::Raw(_) | smoltcp::socket::Socket::Udp(_) => {
-                handle_guard
-                    .get(&handle)
-                    .unwrap()
-                    .wait_queue
-                    .wakeup_any(events);
+                // 无法得知缓冲区中数据报的数量，只要可读就通知
+                let readable = events & EPollEventType::EPOLLIN.bits() as u64 != 0;
+                handle_item.update_notify_state(events, 0) || readable
             }
             smoltcp::socket::Socket::Icmp(_) => unimplemented!("Icmp socket hasn't unimplemented"),
             smoltcp::socket::Socket::Tcp(inner_socket) => {
@@ -218,27 +162,28 @@ fn send_event(sockets: &smoltcp::iface::SocketSet) -> Result<(), SystemError> {
                 if inner_socket.state() == smoltcp::socket::tcp::State::Established {
                     events |= TcpSocket::CAN_CONNECT;
                 }
-                handle_guard
-                    .get(&handle)
-                    .unwrap()
-                    .wait_queue
-                    .wakeup_any(events);
+                handle_item.update_notify_state(events, inner_socket.recv_queue())
             }
-            smoltcp::socket::Socket::Dhcpv4(_) => {}
+            smoltcp::socket::Socket::Dhcpv4(_) => false,
             smoltcp::socket::Socket::Dns(_) => unimplemented!("Dns socket hasn't unimplemented"),
+        };
+        if notify {
+            result.push((handle_item, events));
         }
-        drop(handle_guard);
-        let mut handle_guard = HANDLE_MAP.write_irqsave();
-        let handle_item = handle_guard.get_mut(&handle).unwrap();
+    }
+    return result;
+}
+
+/// ### 唤醒socket上的等待者，并通知epoll
+///
+/// 不能在持有SOCKET_SET的时候调用
+pub(super) fn send_event(events: Vec<(Arc<SocketHandleItem>, u64)>) {
+    for (handle_item, events) in events {
+        handle_item.wait_queue.wakeup_any(events);
         EventPoll::wakeup_epoll(
-            &mut handle_item.epitems,
+            &handle_item.epitems,
             EPollEventType::from_bits_truncate(events as u32),
-        )?;
-        // crate::kdebug!(
-        //     "{} send_event {:?}",
-        //     handle,
-        //     EPollEventType::from_bits_truncate(events as u32)
-        // );
+        )
+        .ok();
     }
-    Ok(())
 }
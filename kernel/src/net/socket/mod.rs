@@ -1,4 +1,9 @@
-use core::{any::Any, fmt::Debug, sync::atomic::AtomicUsize};
+use core::{
+    any::Any,
+    fmt::Debug,
+    hash::{BuildHasher, Hash, Hasher},
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+};
 
 use alloc::{
     boxed::Box,
@@ -7,7 +12,7 @@ use alloc::{
     sync::{Arc, Weak},
     vec::Vec,
 };
-use hashbrown::HashMap;
+use hashbrown::{hash_map::DefaultHashBuilder, HashMap};
 use smoltcp::{
     iface::{SocketHandle, SocketSet},
     socket::{self, tcp, udp},
@@ -15,14 +20,14 @@ use smoltcp::{
 use system_error::SystemError;
 
 use crate::{
-    arch::{rand::rand, sched::sched},
+    arch::rand::rand,
     filesystem::vfs::{
         file::FileMode, syscall::ModeType, FilePrivateData, FileSystem, FileType, IndexNode,
         Metadata,
     },
     libs::{
-        rwlock::{RwLock, RwLockReadGuard, RwLockWriteGuard},
-        spinlock::{SpinLock, SpinLockGuard},
+        rwlock::{RwLock, RwLockWriteGuard},
+        spinlock::{LockClass, SpinLock, SpinLockGuard},
         wait_queue::EventWaitQueue,
     },
 };
@@ -37,13 +42,16 @@ use super::{
 
 pub mod sockets;
 
+static SOCKET_SET_LOCK_CLASS: LockClass = LockClass::new("socket_set");
+
 lazy_static! {
     /// 所有socket的集合
-    /// TODO: 优化这里，自己实现SocketSet！！！现在这样的话，不管全局有多少个网卡，每个时间点都只会有1个进程能够访问socket
-    pub static ref SOCKET_SET: SpinLock<SocketSet<'static >> = SpinLock::new(SocketSet::new(vec![]));
-    /// SocketHandle表，每个SocketHandle对应一个SocketHandleItem，
-    /// 注意！：在网卡中断中需要拿到这张表的🔓，在获取读锁时应该确保关中断避免死锁
-    pub static ref HANDLE_MAP: RwLock<HashMap<SocketHandle, SocketHandleItem>> = RwLock::new(HashMap::new());
+    ///
+    /// smoltcp的`Interface::poll()`需要以可变引用的方式访问整个SocketSet，因此这把锁只用来保护协议栈状态，
+    /// 持有期间不做唤醒、epoll通知等操作。socket自己的等待队列、shutdown状态都在`HANDLE_MAP`中，不需要这把锁
+    pub static ref SOCKET_SET: SpinLock<SocketSet<'static >> = SpinLock::new_with_class(SocketSet::new(vec![]), &SOCKET_SET_LOCK_CLASS);
+    /// SocketHandle表，每个SocketHandle对应一个SocketHandleItem
+    pub static ref HANDLE_MAP: SocketHandleMap = SocketHandleMap::new();
     /// 端口管理器
     pub static ref PORT_MANAGER: PortManager = PortManager::new();
 }
@@ -234,10 +242,12 @@ pub trait Socket: Sync + Send + Debug + Any {
         todo!()
     }
 
+    /// @brief 在socket的最后一个文件描述符被关闭时调用，释放socket持有的资源
+    fn close(&mut self) {}
+
     fn add_epoll(&mut self, epitem: Arc<EPollItem>) -> Result<(), SystemError> {
         HANDLE_MAP
-            .write_irqsave()
-            .get_mut(&self.socket_handle())
+            .get(&self.socket_handle())
             .unwrap()
             .add_epoll(epitem);
         Ok(())
@@ -245,8 +255,7 @@ pub trait Socket: Sync + Send + Debug + Any {
 
     fn remove_epoll(&mut self, epoll: &Weak<SpinLock<EventPoll>>) -> Result<(), SystemError> {
         HANDLE_MAP
-            .write_irqsave()
-            .get_mut(&self.socket_handle())
+            .get(&self.socket_handle())
             .unwrap()
             .remove_epoll(epoll)?;
 
@@ -254,8 +263,7 @@ pub trait Socket: Sync + Send + Debug + Any {
     }
 
     fn clear_epoll(&mut self) -> Result<(), SystemError> {
-        let mut handle_map_guard = HANDLE_MAP.write_irqsave();
-        let handle_item = handle_map_guard.get_mut(&self.socket_handle()).unwrap();
+        let handle_item = HANDLE_MAP.get(&self.socket_handle()).unwrap();
 
         for epitem in handle_item.epitems.lock_irqsave().iter() {
             let epoll = epitem.epoll();
@@ -322,12 +330,10 @@ impl IndexNode for SocketInode {
                 PORT_MANAGER.unbind_port(socket.metadata().unwrap().socket_type, ip.port)?;
             }
 
+            socket.close();
             socket.clear_epoll()?;
 
-            HANDLE_MAP
-                .write_irqsave()
-                .remove(&socket.socket_handle())
-                .unwrap();
+            HANDLE_MAP.remove(&socket.socket_handle()).unwrap();
         }
         Ok(())
     }
@@ -395,6 +401,10 @@ pub struct SocketHandleItem {
     pub wait_queue: EventWaitQueue,
     /// epitems，考虑写在这是否是最优解？
     pub epitems: SpinLock<LinkedList<Arc<EPollItem>>>,
+    /// 上一次通知等待者时，socket上的事件
+    last_events: AtomicU64,
+    /// 上一次通知等待者时，接收缓冲区中的数据量
+    last_rx_queued: AtomicUsize,
 }
 
 impl SocketHandleItem {
@@ -404,6 +414,8 @@ impl SocketHandleItem {
             shutdown_type: RwLock::new(ShutdownType::empty()),
             wait_queue: EventWaitQueue::new(),
             epitems: SpinLock::new(LinkedList::new()),
+            last_events: AtomicU64::new(0),
+            last_rx_queued: AtomicUsize::new(0),
         }
     }
 
@@ -413,39 +425,56 @@ impl SocketHandleItem {
             shutdown_type: RwLock::new(ShutdownType::empty()),
             wait_queue: EventWaitQueue::new(),
             epitems: SpinLock::new(LinkedList::new()),
+            last_events: AtomicU64::new(0),
+            last_rx_queued: AtomicUsize::new(0),
         }
     }
 
     /// ### 在socket的等待队列上睡眠
+    ///
+    /// 调用者持着SOCKET_SET检查等待条件，当前进程先进入等待队列，再放开SOCKET_SET。
+    /// 网卡轮询在SOCKET_SET下记录socket的状态，因此它要么发生在检查之前，要么一定能唤醒当前进程
     pub fn sleep(
         socket_handle: SocketHandle,
         events: u64,
-        handle_map_guard: RwLockReadGuard<'_, HashMap<SocketHandle, SocketHandleItem>>,
+        socket_set_guard: SpinLockGuard<SocketSet<'static>>,
     ) {
-        unsafe {
-            handle_map_guard
-                .get(&socket_handle)
-                .unwrap()
-                .wait_queue
-                .sleep_without_schedule(events)
-        };
-        drop(handle_map_guard);
-        sched();
+        let handle_item = HANDLE_MAP.get(&socket_handle).unwrap();
+        handle_item
+            .wait_queue
+            .sleep_unlock_spinlock(events, socket_set_guard);
+    }
+
+    /// ### 记录等待者看到的接收缓冲区中的数据量
+    ///
+    /// 在持有SOCKET_SET、准备睡眠时调用。数据被读走之后，上一次记录的数据量可能比现在多，
+    /// 不更新的话，新到达的数据不会被当成“增长”，等待者就不会被唤醒
+    pub fn set_rx_queued(&self, rx_queued: usize) {
+        self.last_rx_queued.store(rx_queued, Ordering::Release);
+    }
+
+    /// ### 记录socket当前的事件与接收缓冲区中的数据量
+    ///
+    /// 返回与上一次记录相比，事件是否发生了变化、或者是否收到了新的数据
+    pub fn update_notify_state(&self, events: u64, rx_queued: usize) -> bool {
+        let events_changed = self.last_events.swap(events, Ordering::AcqRel) != events;
+        let rx_grown = self.last_rx_queued.swap(rx_queued, Ordering::AcqRel) < rx_queued;
+        return events_changed || rx_grown;
     }
 
     pub fn shutdown_type(&self) -> ShutdownType {
         self.shutdown_type.read().clone()
     }
 
-    pub fn shutdown_type_writer(&mut self) -> RwLockWriteGuard<ShutdownType> {
+    pub fn shutdown_type_writer(&self) -> RwLockWriteGuard<ShutdownType> {
         self.shutdown_type.write_irqsave()
     }
 
-    pub fn add_epoll(&mut self, epitem: Arc<EPollItem>) {
+    pub fn add_epoll(&self, epitem: Arc<EPollItem>) {
         self.epitems.lock_irqsave().push_back(epitem)
     }
 
-    pub fn remove_epoll(&mut self, epoll: &Weak<SpinLock<EventPoll>>) -> Result<(), SystemError> {
+    pub fn remove_epoll(&self, epoll: &Weak<SpinLock<EventPoll>>) -> Result<(), SystemError> {
         let is_remove = !self
             .epitems
             .lock_irqsave()
@@ -461,6 +490,59 @@ impl SocketHandleItem {
     }
 }
 
+/// SocketHandle表的分片数量
+const HANDLE_MAP_SHARDS: usize = 64;
+
+/// ### SocketHandle表
+///
+/// 按照SocketHandle的哈希值分成若干片，每片一把读写锁，不同socket的查表互不干扰。
+/// 表中保存的是`Arc<SocketHandleItem>`，分片的锁只在取出Arc的时候持有，
+/// 之后对等待队列、shutdown状态、epoll的操作都只用到socket自己的锁。
+///
+/// 注意！：NET_RX软中断中也会查这张表，因此分片的锁都需要关中断获取
+pub struct SocketHandleMap {
+    shards: Vec<RwLock<HashMap<SocketHandle, Arc<SocketHandleItem>>>>,
+    hash_builder: DefaultHashBuilder,
+}
+
+impl SocketHandleMap {
+    fn new() -> Self {
+        let shards = (0..HANDLE_MAP_SHARDS)
+            .map(|_| RwLock::new(HashMap::new()))
+            .collect();
+        return Self {
+            shards,
+            hash_builder: DefaultHashBuilder::default(),
+        };
+    }
+
+    #[inline]
+    fn shard(
+        &self,
+        handle: &SocketHandle,
+    ) -> &RwLock<HashMap<SocketHandle, Arc<SocketHandleItem>>> {
+        let mut hasher = self.hash_builder.build_hasher();
+        handle.hash(&mut hasher);
+        return &self.shards[hasher.finish() as usize % HANDLE_MAP_SHARDS];
+    }
+
+    pub fn get(&self, handle: &SocketHandle) -> Option<Arc<SocketHandleItem>> {
+        return self.shard(handle).read_irqsave().get(handle).cloned();
+    }
+
+    pub fn insert(
+        &self,
+        handle: SocketHandle,
+        item: Arc<SocketHandleItem>,
+    ) -> Option<Arc<SocketHandleItem>> {
+        return self.shard(&handle).write_irqsave().insert(handle, item);
+    }
+
+    pub fn remove(&self, handle: &SocketHandle) -> Option<Arc<SocketHandleItem>> {
+        return self.shard(handle).write_irqsave().remove(handle);
+    }
+}
+
 /// # TCP 和 UDP 的端口管理器。
 /// 如果 TCP/UDP 的 socket 绑定了某个端口，它会在对应的表中记录，以检测端口冲突。
 pub struct PortManager {
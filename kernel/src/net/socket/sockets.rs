@@ -1,6 +1,8 @@
-use alloc::{boxed::Box, sync::Arc, vec::Vec};
+use core::sync::atomic::{AtomicBool, Ordering};
+
+use alloc::{boxed::Box, collections::VecDeque, sync::Arc, vec::Vec};
 use smoltcp::{
-    iface::SocketHandle,
+    iface::{SocketHandle, SocketSet},
     socket::{raw, tcp, udp},
     wire,
 };
@@ -9,7 +11,7 @@ use system_error::SystemError;
 use crate::{
     driver::net::NetDriver,
     kerror, kwarn,
-    libs::{rwlock::RwLock, spinlock::SpinLock},
+    libs::spinlock::SpinLock,
     net::{
         event_poll::EPollEventType, net_core::poll_ifaces, Endpoint, Protocol, ShutdownType,
         NET_DRIVERS,
@@ -96,7 +98,6 @@ impl Socket for RawSocket {
     }
 
     fn read(&mut self, buf: &mut [u8]) -> (Result<usize, SystemError>, Endpoint) {
-        poll_ifaces();
         loop {
             // 如何优化这里？
             let mut socket_set_guard = SOCKET_SET.lock_irqsave();
@@ -120,11 +121,10 @@ impl Socket for RawSocket {
                     }
                 }
             }
-            drop(socket_set_guard);
             SocketHandleItem::sleep(
                 self.socket_handle(),
                 EPollEventType::EPOLLIN.bits() as u64,
-                HANDLE_MAP.read_irqsave(),
+                socket_set_guard,
             );
         }
     }
@@ -308,7 +308,6 @@ impl Socket for UdpSocket {
     fn read(&mut self, buf: &mut [u8]) -> (Result<usize, SystemError>, Endpoint) {
         loop {
             // kdebug!("Wait22 to Read");
-            poll_ifaces();
             let mut socket_set_guard = SOCKET_SET.lock_irqsave();
             let socket = socket_set_guard.get_mut::<udp::Socket>(self.handle.0);
 
@@ -324,11 +323,10 @@ impl Socket for UdpSocket {
                 // 如果socket没有连接，则忙等
                 // return (Err(SystemError::ENOTCONN), Endpoint::Ip(None));
             }
-            drop(socket_set_guard);
             SocketHandleItem::sleep(
                 self.socket_handle(),
                 EPollEventType::EPOLLIN.bits() as u64,
-                HANDLE_MAP.read_irqsave(),
+                socket_set_guard,
             );
         }
     }
@@ -397,17 +395,14 @@ impl Socket for UdpSocket {
     }
 
     fn poll(&self) -> EPollEventType {
+        let shutdown_type = HANDLE_MAP
+            .get(&self.socket_handle())
+            .unwrap()
+            .shutdown_type();
         let sockets = SOCKET_SET.lock_irqsave();
         let socket = sockets.get::<udp::Socket>(self.handle.0);
 
-        return SocketPollMethod::udp_poll(
-            socket,
-            HANDLE_MAP
-                .read_irqsave()
-                .get(&self.socket_handle())
-                .unwrap()
-                .shutdown_type(),
-        );
+        return SocketPollMethod::udp_poll(socket, shutdown_type);
     }
 
     fn connect(&mut self, endpoint: Endpoint) -> Result<(), SystemError> {
@@ -475,6 +470,8 @@ pub struct TcpSocket {
     handle: Arc<GlobalSocketHandle>,
     local_endpoint: Option<wire::IpEndpoint>, // save local endpoint for bind()
     is_listening: bool,
+    /// 监听队列，只有处于监听状态的socket才有
+    listen_queue: Option<Arc<TcpListenQueue>>,
     metadata: SocketMetadata,
 }
 
@@ -496,9 +493,7 @@ impl TcpSocket {
     ///
     /// @return 返回创建的tcp的socket
     pub fn new(options: SocketOptions) -> Self {
-        let rx_buffer = tcp::SocketBuffer::new(vec![0; Self::DEFAULT_RX_BUF_SIZE]);
-        let tx_buffer = tcp::SocketBuffer::new(vec![0; Self::DEFAULT_TX_BUF_SIZE]);
-        let socket = tcp::Socket::new(rx_buffer, tx_buffer);
+        let socket = Self::new_smoltcp_socket();
 
         // 把socket添加到socket集合中，并得到socket的句柄
         let handle: Arc<GlobalSocketHandle> =
@@ -516,11 +511,37 @@ impl TcpSocket {
             handle,
             local_endpoint: None,
             is_listening: false,
+            listen_queue: None,
             metadata,
         };
     }
+
+    /// 创建一个使用默认大小缓冲区的smoltcp tcp socket
+    fn new_smoltcp_socket() -> tcp::Socket<'static> {
+        let rx_buffer = tcp::SocketBuffer::new(vec![0; Self::DEFAULT_RX_BUF_SIZE]);
+        let tx_buffer = tcp::SocketBuffer::new(vec![0; Self::DEFAULT_TX_BUF_SIZE]);
+        return tcp::Socket::new(rx_buffer, tx_buffer);
+    }
+
+    /// 创建监听socket的锚点：一个不收发数据、缓冲区为空的smoltcp tcp socket
+    fn new_listen_anchor() -> tcp::Socket<'static> {
+        return tcp::Socket::new(
+            tcp::SocketBuffer::new(vec![]),
+            tcp::SocketBuffer::new(vec![]),
+        );
+    }
+
+    /// 判断一个smoltcp tcp socket是否是监听socket的锚点
+    ///
+    /// 锚点只在HANDLE_MAP和端口表中代表监听socket，它的事件由`tcp_listen_update`产生，
+    /// 不能按普通的tcp socket计算（发送缓冲区容量为0，会被当成缓冲区已满）
+    pub fn is_listen_anchor(socket: &tcp::Socket) -> bool {
+        return socket.state() == tcp::State::Closed
+            && socket.send_capacity() == 0
+            && socket.recv_capacity() == 0;
+    }
+
     fn do_listen(
-        &mut self,
         socket: &mut tcp::Socket,
         local_endpoint: wire::IpEndpoint,
     ) -> Result<(), SystemError> {
@@ -538,8 +559,6 @@ impl TcpSocket {
                 //     "Tcp Socket Listen on {local_endpoint}, open?:{}",
                 //     socket.is_open()
                 // );
-                self.is_listening = true;
-
                 Ok(())
             }
             Err(_) => Err(SystemError::EINVAL),
@@ -558,7 +577,6 @@ impl Socket for TcpSocket {
 
     fn read(&mut self, buf: &mut [u8]) -> (Result<usize, SystemError>, Endpoint) {
         if HANDLE_MAP
-            .read_irqsave()
             .get(&self.socket_handle())
             .unwrap()
             .shutdown_type()
@@ -569,7 +587,6 @@ impl Socket for TcpSocket {
         // kdebug!("tcp socket: read, buf len={}", buf.len());
 
         loop {
-            poll_ifaces();
             let mut socket_set_guard = SOCKET_SET.lock_irqsave();
             let socket = socket_set_guard.get_mut::<tcp::Socket>(self.handle.0);
 
@@ -604,8 +621,7 @@ impl Socket for TcpSocket {
                         tcp::RecvError::Finished => {
                             // 对端写端已关闭，我们应该关闭读端
                             HANDLE_MAP
-                                .write_irqsave()
-                                .get_mut(&self.socket_handle())
+                                .get(&self.socket_handle())
                                 .unwrap()
                                 .shutdown_type_writer()
                                 .insert(ShutdownType::RCV_SHUTDOWN);
@@ -616,18 +632,21 @@ impl Socket for TcpSocket {
             } else {
                 return (Err(SystemError::ENOTCONN), Endpoint::Ip(None));
             }
-            drop(socket_set_guard);
+            // 从这里开始，接收缓冲区的数据量增长就要唤醒当前进程
+            HANDLE_MAP
+                .get(&self.socket_handle())
+                .unwrap()
+                .set_rx_queued(socket.recv_queue());
             SocketHandleItem::sleep(
                 self.socket_handle(),
                 EPollEventType::EPOLLIN.bits() as u64,
-                HANDLE_MAP.read_irqsave(),
+                socket_set_guard,
             );
         }
     }
 
     fn write(&self, buf: &[u8], _to: Option<Endpoint>) -> Result<usize, SystemError> {
         if HANDLE_MAP
-            .read_irqsave()
             .get(&self.socket_handle())
             .unwrap()
             .shutdown_type()
@@ -660,17 +679,21 @@ impl Socket for TcpSocket {
     }
 
     fn poll(&self) -> EPollEventType {
+        if let Some(listen_queue) = &self.listen_queue {
+            if listen_queue.inner.lock_irqsave().accept_queue.is_empty() {
+                return EPollEventType::empty();
+            }
+            return EPollEventType::EPOLLIN | EPollEventType::EPOLLRDNORM;
+        }
+
+        let shutdown_type = HANDLE_MAP
+            .get(&self.socket_handle())
+            .unwrap()
+            .shutdown_type();
         let mut socket_set_guard = SOCKET_SET.lock_irqsave();
         let socket = socket_set_guard.get_mut::<tcp::Socket>(self.handle.0);
 
-        return SocketPollMethod::tcp_poll(
-            socket,
-            HANDLE_MAP
-                .read_irqsave()
-                .get(&self.socket_handle())
-                .unwrap()
-                .shutdown_type(),
-        );
+        return SocketPollMethod::tcp_poll(socket, shutdown_type);
     }
 
     fn connect(&mut self, endpoint: Endpoint) -> Result<(), SystemError> {
@@ -703,11 +726,10 @@ impl Socket for TcpSocket {
                                 return Ok(());
                             }
                             tcp::State::SynSent => {
-                                drop(sockets);
                                 SocketHandleItem::sleep(
                                     self.socket_handle(),
                                     Self::CAN_CONNECT,
-                                    HANDLE_MAP.read_irqsave(),
+                                    sockets,
                                 );
                             }
                             _ => {
@@ -731,8 +753,8 @@ impl Socket for TcpSocket {
 
     /// @brief tcp socket 监听 local_endpoint 端口
     ///
-    /// @param backlog 未处理的连接队列的最大长度. 由于smoltcp不支持backlog，所以这个参数目前无效
-    fn listen(&mut self, _backlog: usize) -> Result<(), SystemError> {
+    /// @param backlog 未处理的连接队列的最大长度，超过`SOMAXCONN`时按`SOMAXCONN`处理
+    fn listen(&mut self, backlog: usize) -> Result<(), SystemError> {
         if self.is_listening {
             return Ok(());
         }
@@ -740,13 +762,34 @@ impl Socket for TcpSocket {
         let local_endpoint = self.local_endpoint.ok_or(SystemError::EINVAL)?;
         let mut sockets = SOCKET_SET.lock_irqsave();
         let socket = sockets.get_mut::<tcp::Socket>(self.handle.0);
-
-        if socket.is_listening() {
-            // kdebug!("Tcp Socket is already listening on {local_endpoint}");
-            return Ok(());
+        if socket.is_open() {
+            return Err(SystemError::EINVAL);
         }
-        // kdebug!("Tcp Socket  before listen, open={}", socket.is_open());
-        return self.do_listen(socket, local_endpoint);
+        Self::do_listen(socket, local_endpoint)?;
+
+        // 原来的smoltcp socket成为监听队列中的第一个监听socket，
+        // 监听socket自己换成一个不收发数据的空socket，作为HANDLE_MAP和端口表中的句柄
+        let anchor = GlobalSocketHandle::new(sockets.add(Self::new_listen_anchor()));
+        let old_handle = ::core::mem::replace(&mut self.handle, anchor.clone());
+        let listen_queue = Arc::new(TcpListenQueue::new(
+            local_endpoint,
+            backlog,
+            anchor.0,
+            old_handle.clone(),
+        ));
+
+        // 持有SOCKET_SET，网卡轮询不会看到中间状态
+        let item = HANDLE_MAP.remove(&old_handle.0).unwrap();
+        HANDLE_MAP.insert(anchor.0, item);
+        drop(sockets);
+        PORT_MANAGER.unbind_port(self.metadata.socket_type, local_endpoint.port)?;
+        PORT_MANAGER.bind_port(self.metadata.socket_type, local_endpoint.port, anchor)?;
+
+        listen_queue.refill();
+        TCP_LISTENERS.lock_irqsave().push(listen_queue.clone());
+        self.listen_queue = Some(listen_queue);
+        self.is_listening = true;
+        return Ok(());
     }
 
     fn bind(&mut self, endpoint: Endpoint) -> Result<(), SystemError> {
@@ -767,94 +810,59 @@ impl Socket for TcpSocket {
 
     fn shutdown(&mut self, shutdown_type: super::ShutdownType) -> Result<(), SystemError> {
         // TODO：目前只是在表层判断，对端不知晓，后续需使用tcp实现
-        HANDLE_MAP
-            .write_irqsave()
-            .get_mut(&self.socket_handle())
+        *HANDLE_MAP
+            .get(&self.socket_handle())
             .unwrap()
-            .shutdown_type = RwLock::new(shutdown_type);
+            .shutdown_type_writer() = shutdown_type;
         return Ok(());
     }
 
     fn accept(&mut self) -> Result<(Box<dyn Socket>, Endpoint), SystemError> {
-        let endpoint = self.local_endpoint.ok_or(SystemError::EINVAL)?;
+        let listen_queue = self.listen_queue.clone().ok_or(SystemError::EINVAL)?;
         loop {
-            // kdebug!("tcp accept: poll_ifaces()");
-            poll_ifaces();
-
             let mut sockets = SOCKET_SET.lock_irqsave();
+            let handle = listen_queue.inner.lock_irqsave().accept_queue.pop_front();
+            let handle = match handle {
+                Some(handle) => handle,
+                None => {
+                    SocketHandleItem::sleep(self.socket_handle(), Self::CAN_ACCPET, sockets);
+                    continue;
+                }
+            };
 
-            let socket = sockets.get_mut::<tcp::Socket>(self.handle.0);
-
-            if socket.is_active() {
-                // kdebug!("tcp accept: socket.is_active()");
-                let remote_ep = socket.remote_endpoint().ok_or(SystemError::ENOTCONN)?;
-
-                let new_socket = {
-                    // Initialize the TCP socket's buffers.
-                    let rx_buffer = tcp::SocketBuffer::new(vec![0; Self::DEFAULT_RX_BUF_SIZE]);
-                    let tx_buffer = tcp::SocketBuffer::new(vec![0; Self::DEFAULT_TX_BUF_SIZE]);
-                    // The new TCP socket used for sending and receiving data.
-                    let mut tcp_socket = tcp::Socket::new(rx_buffer, tx_buffer);
-                    self.do_listen(&mut tcp_socket, endpoint)
-                        .expect("do_listen failed");
-
-                    // tcp_socket.listen(endpoint).unwrap();
-
-                    // 之所以把old_handle存入new_socket, 是因为当前时刻，smoltcp已经把old_handle对应的socket与远程的endpoint关联起来了
-                    // 因此需要再为当前的socket分配一个新的handle
-                    let new_handle = GlobalSocketHandle::new(sockets.add(tcp_socket));
-                    let old_handle = ::core::mem::replace(&mut self.handle, new_handle.clone());
-
-                    // 更新端口与 handle 的绑定
-                    if let Some(Endpoint::Ip(Some(ip))) = self.endpoint() {
-                        PORT_MANAGER.unbind_port(self.metadata.socket_type, ip.port)?;
-                        PORT_MANAGER.bind_port(
-                            self.metadata.socket_type,
-                            ip.port,
-                            new_handle.clone(),
-                        )?;
-                    }
-
-                    let metadata = SocketMetadata::new(
-                        SocketType::TcpSocket,
-                        Self::DEFAULT_TX_BUF_SIZE,
-                        Self::DEFAULT_RX_BUF_SIZE,
-                        Self::DEFAULT_METADATA_BUF_SIZE,
-                        self.metadata.options,
-                    );
-
-                    let new_socket = Box::new(TcpSocket {
-                        handle: old_handle.clone(),
-                        local_endpoint: self.local_endpoint,
-                        is_listening: false,
-                        metadata,
-                    });
-
-                    // 更新handle表
-                    let mut handle_guard = HANDLE_MAP.write_irqsave();
-                    // 先删除原来的
-                    let item = handle_guard.remove(&old_handle.0).unwrap();
-                    // 按照smoltcp行为，将新的handle绑定到原来的item
-                    handle_guard.insert(new_handle.0, item);
-                    let new_item = SocketHandleItem::from_socket(&new_socket);
-                    // 插入新的item
-                    handle_guard.insert(old_handle.0, new_item);
-
-                    new_socket
-                };
-                // kdebug!("tcp accept: new socket: {:?}", new_socket);
-                drop(sockets);
-                poll_ifaces();
-
-                return Ok((new_socket, Endpoint::Ip(Some(remote_ep))));
-            }
+            let remote_ep = sockets.get::<tcp::Socket>(handle.0).remote_endpoint();
             drop(sockets);
+            // 取走一个连接之后，监听队列可能又有了空位
+            listen_queue.refill();
 
-            SocketHandleItem::sleep(
-                self.socket_handle(),
-                Self::CAN_ACCPET,
-                HANDLE_MAP.read_irqsave(),
+            // 连接在accept之前就已经被对端重置了，丢弃它，继续等待下一个连接
+            let remote_ep = match remote_ep {
+                Some(ep) => ep,
+                None => continue,
+            };
+
+            let metadata = SocketMetadata::new(
+                SocketType::TcpSocket,
+                Self::DEFAULT_TX_BUF_SIZE,
+                Self::DEFAULT_RX_BUF_SIZE,
+                Self::DEFAULT_METADATA_BUF_SIZE,
+                self.metadata.options,
+            );
+            let new_socket = Box::new(TcpSocket {
+                handle,
+                local_endpoint: self.local_endpoint,
+                is_listening: false,
+                listen_queue: None,
+                metadata,
+            });
+            HANDLE_MAP.insert(
+                new_socket.socket_handle(),
+                Arc::new(SocketHandleItem::from_socket(&new_socket)),
             );
+            // kdebug!("tcp accept: new socket: {:?}", new_socket);
+            poll_ifaces();
+
+            return Ok((new_socket, Endpoint::Ip(Some(remote_ep))));
         }
     }
 
@@ -889,6 +897,193 @@ impl Socket for TcpSocket {
     fn socket_handle(&self) -> SocketHandle {
         self.handle.0
     }
+
+    fn close(&mut self) {
+        let listen_queue = match self.listen_queue.take() {
+            Some(listen_queue) => listen_queue,
+            None => return,
+        };
+        let mut listeners = TCP_LISTENERS.lock_irqsave();
+        listeners.retain(|x| !Arc::ptr_eq(x, &listen_queue));
+        drop(listeners);
+
+        // 重置还没有被accept的连接，否则对端会一直等待
+        let mut sockets = SOCKET_SET.lock_irqsave();
+        let inner = listen_queue.inner.lock_irqsave();
+        for handle in inner.pending.iter().chain(inner.accept_queue.iter()) {
+            sockets.get_mut::<tcp::Socket>(handle.0).abort();
+        }
+        drop(inner);
+        drop(sockets);
+        // 先把RST发出去，再随着监听队列一起释放这些socket
+        poll_ifaces();
+        drop(listen_queue);
+    }
+}
+
+/// 监听队列中同时处于LISTEN状态的smoltcp socket的最大数量
+///
+/// 每个监听socket只能接收一个SYN，因此预先准备backlog个监听socket，但是不超过这个上限：
+/// smoltcp中每个监听socket都带有完整的收发缓冲区（见`TcpSocket::new_smoltcp_socket`）。
+/// 用掉的监听socket在网卡轮询释放SOCKET_SET之后由`tcp_listen_refill`补充
+const TCP_MAX_SYN_BACKLOG: usize = 16;
+/// listen的backlog的上限
+const SOMAXCONN: usize = 4096;
+
+/// 所有处于监听状态的tcp socket的监听队列，网卡轮询之后由`tcp_listen_update`更新
+static TCP_LISTENERS: SpinLock<Vec<Arc<TcpListenQueue>>> = SpinLock::new(Vec::new());
+
+/// # tcp监听队列
+///
+/// - `pending`：处于LISTEN或SYN_RECEIVED状态的smoltcp socket，相当于半连接队列
+/// - `accept_queue`：已经完成三次握手、等待accept的连接
+///
+/// 两个队列中的socket总数不超过backlog
+#[derive(Debug)]
+pub struct TcpListenQueue {
+    local_endpoint: wire::IpEndpoint,
+    backlog: usize,
+    /// 监听socket在HANDLE_MAP中的句柄，用于唤醒在accept中等待的进程
+    listener: SocketHandle,
+    /// 网卡轮询用掉了监听socket，需要由`tcp_listen_refill`补充
+    need_refill: AtomicBool,
+    inner: SpinLock<TcpListenQueueInner>,
+}
+
+#[derive(Debug)]
+struct TcpListenQueueInner {
+    pending: Vec<Arc<GlobalSocketHandle>>,
+    accept_queue: VecDeque<Arc<GlobalSocketHandle>>,
+}
+
+impl TcpListenQueue {
+    fn new(
+        local_endpoint: wire::IpEndpoint,
+        backlog: usize,
+        listener: SocketHandle,
+        first: Arc<GlobalSocketHandle>,
+    ) -> Self {
+        let mut pending = Vec::new();
+        pending.push(first);
+        return Self {
+            local_endpoint,
+            backlog: backlog.clamp(1, SOMAXCONN),
+            listener,
+            need_refill: AtomicBool::new(false),
+            inner: SpinLock::new(TcpListenQueueInner {
+                pending,
+                accept_queue: VecDeque::new(),
+            }),
+        };
+    }
+
+    /// 把已经完成握手的连接移到accept队列，并让被重置的半连接重新开始监听
+    ///
+    /// 调用者持有SOCKET_SET，因此这里不分配新的socket，只标记需要补充。返回是否有新的连接进入了accept队列
+    fn update(&self, sockets: &mut SocketSet<'static>) -> bool {
+        let mut inner = self.inner.lock_irqsave();
+        let established: Vec<Arc<GlobalSocketHandle>> = inner
+            .pending
+            .extract_if(|handle| {
+                let state = sockets.get::<tcp::Socket>(handle.0).state();
+                !matches!(
+                    state,
+                    tcp::State::Listen | tcp::State::SynReceived | tcp::State::Closed
+                )
+            })
+            .collect();
+        let has_new = !established.is_empty();
+        inner.accept_queue.extend(established);
+        drop(inner);
+
+        if self.relisten(sockets) != 0 {
+            self.need_refill.store(true, Ordering::Release);
+        }
+        return has_new;
+    }
+
+    /// 让被对端重置的半连接重新开始监听
+    ///
+    /// 调用者持有SOCKET_SET。返回还需要补充的监听socket数量
+    fn relisten(&self, sockets: &mut SocketSet<'static>) -> usize {
+        let inner = self.inner.lock_irqsave();
+        let mut listening = 0;
+        for handle in inner.pending.iter() {
+            let socket = sockets.get_mut::<tcp::Socket>(handle.0);
+            if socket.state() == tcp::State::Closed {
+                TcpSocket::do_listen(socket, self.local_endpoint).ok();
+            }
+            if socket.state() == tcp::State::Listen {
+                listening += 1;
+            }
+        }
+
+        let room = self
+            .backlog
+            .saturating_sub(inner.pending.len() + inner.accept_queue.len());
+        return self
+            .backlog
+            .min(TCP_MAX_SYN_BACKLOG)
+            .saturating_sub(listening)
+            .min(room);
+    }
+
+    /// 补充监听socket，使得监听队列能够继续接收新的SYN
+    ///
+    /// 新socket的缓冲区很大，在SOCKET_SET之外分配，因此调用者不能持有SOCKET_SET
+    fn refill(&self) {
+        loop {
+            if self.relisten(&mut SOCKET_SET.lock_irqsave()) == 0 {
+                return;
+            }
+            let mut socket = TcpSocket::new_smoltcp_socket();
+            if TcpSocket::do_listen(&mut socket, self.local_endpoint).is_err() {
+                return;
+            }
+
+            let mut sockets = SOCKET_SET.lock_irqsave();
+            // 分配期间其他进程可能已经补充过了
+            if self.relisten(&mut sockets) == 0 {
+                return;
+            }
+            let handle = GlobalSocketHandle::new(sockets.add(socket));
+            self.inner.lock_irqsave().pending.push(handle);
+        }
+    }
+}
+
+/// ### 为在网卡轮询中用掉了监听socket的监听队列补充新的监听socket
+///
+/// 在网卡轮询释放SOCKET_SET之后调用，调用者不能持有SOCKET_SET
+pub fn tcp_listen_refill() {
+    // refill需要获取SOCKET_SET，而tcp_listen_update在持有SOCKET_SET时获取TCP_LISTENERS，
+    // 因此先释放TCP_LISTENERS
+    let listeners: Vec<Arc<TcpListenQueue>> = TCP_LISTENERS
+        .lock_irqsave()
+        .iter()
+        .filter(|x| x.need_refill.swap(false, Ordering::AcqRel))
+        .cloned()
+        .collect();
+    for listen_queue in listeners {
+        listen_queue.refill();
+    }
+}
+
+/// ### 网卡轮询之后，更新所有tcp监听队列
+///
+/// 调用者持有SOCKET_SET。返回需要唤醒的监听socket以及事件
+pub fn tcp_listen_update(sockets: &mut SocketSet<'static>) -> Vec<(Arc<SocketHandleItem>, u64)> {
+    let mut result = Vec::new();
+    for listen_queue in TCP_LISTENERS.lock_irqsave().iter() {
+        if !listen_queue.update(sockets) {
+            continue;
+        }
+        if let Some(item) = HANDLE_MAP.get(&listen_queue.listener) {
+            let events = EPollEventType::EPOLLIN | EPollEventType::EPOLLRDNORM;
+            result.push((item, events.bits() as u64 | TcpSocket::CAN_ACCPET));
+        }
+    }
+    return result;
 }
 
 /// # 表示 seqpacket socket
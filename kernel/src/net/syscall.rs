@@ -44,9 +44,7 @@ impl Syscall {
         let socket = new_socket(address_family, socket_type, protocol)?;
 
         let handle_item = SocketHandleItem::new(&socket);
-        HANDLE_MAP
-            .write_irqsave()
-            .insert(socket.socket_handle(), handle_item);
+        HANDLE_MAP.insert(socket.socket_handle(), Arc::new(handle_item));
 
         let socketinode: Arc<SocketInode> = SocketInode::new(socket);
         let f = File::new(socketinode, FileMode::O_RDWR)?;
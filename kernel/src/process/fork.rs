@@ -8,7 +8,7 @@ use crate::{
     filesystem::procfs::procfs_register_pid,
     ipc::signal::flush_signal_handlers,
     libs::rwlock::RwLock,
-    mm::VirtAddr,
+    mm::{page::tlb_shootdown, VirtAddr},
     process::ProcessFlags,
     syscall::user_access::UserBufferWriter,
 };
@@ -245,6 +245,8 @@ impl ProcessManager {
                 current_pcb.pid(), new_pcb.pid(), e
             )
         });
+        // 地址空间的锁已经释放：等待其他CPU丢弃父进程中被设为只读的页面的可写表项
+        tlb_shootdown();
         unsafe { new_pcb.basic_mut().set_user_vm(Some(new_address_space)) };
         return Ok(());
     }
@@ -362,6 +364,10 @@ impl ProcessManager {
         unsafe { pcb.arch_info().clone_from(&guard) };
         drop(guard);
 
+        // 子进程继承父进程的cpu亲和性
+        pcb.sched_info()
+            .set_cpus_allowed(current_pcb.sched_info().cpus_allowed());
+
         // 为内核线程设置WorkerPrivate
         if current_pcb.flags().contains(ProcessFlags::KTHREAD) {
             *pcb.worker_private() =
@@ -32,6 +32,7 @@ use crate::{
     libs::{
         align::AlignedBox,
         casting::DowncastArc,
+        cpumask::CpuMask,
         futex::{
             constant::{FutexFlag, FUTEX_BITSET_MATCH_ANY},
             futex::Futex,
@@ -46,6 +47,7 @@ use crate::{
     sched::{
         completion::Completion,
         core::{sched_enqueue, CPU_EXECUTING},
+        stat::{sched_stat_wakeup, TaskSchedStat},
         SchedPolicy, SchedPriority,
     },
     smp::{
@@ -53,6 +55,7 @@ use crate::{
         kick_cpu,
     },
     syscall::{user_access::clear_user, Syscall},
+    time::tick::tick_nohz_idle_exit,
 };
 
 use self::kthread::WorkerPrivate;
@@ -212,6 +215,7 @@ impl ProcessManager {
                 drop(writer);
 
                 sched_enqueue(pcb.clone(), true);
+                sched_stat_wakeup(pcb, &ProcessManager::current_pcb());
                 return Ok(());
             } else if state.is_exited() {
                 return Err(SystemError::EINVAL);
@@ -238,6 +242,7 @@ impl ProcessManager {
                 drop(writer);
 
                 sched_enqueue(pcb.clone(), true);
+                sched_stat_wakeup(pcb, &ProcessManager::current_pcb());
                 return Ok(());
             } else if state.is_runnable() {
                 return Ok(());
@@ -350,11 +355,12 @@ impl ProcessManager {
         }
 
         if let Some(addr) = thread.clear_child_tid {
+            // 先清零再唤醒，否则被唤醒的pthread_join()可能看到旧的tid而再次睡眠
+            unsafe { clear_user(addr, core::mem::size_of::<i32>()).expect("clear tid failed") };
             if Arc::strong_count(&pcb.basic().user_vm().expect("User VM Not found")) > 1 {
                 let _ =
                     Futex::futex_wake(addr, FutexFlag::FLAGS_MATCH_NONE, 1, FUTEX_BITSET_MATCH_ANY);
             }
-            unsafe { clear_user(addr, core::mem::size_of::<i32>()).expect("clear tid failed") };
         }
 
         // 如果是vfork出来的进程，则需要处理completion
@@ -413,6 +419,20 @@ impl ProcessManager {
         // 由于进程切换前使用了SpinLockGuard::leak()，所以这里需要手动释放锁
         prev_pcb.arch_info.force_unlock();
         next_pcb.arch_info.force_unlock();
+
+        // prev的上下文已经保存完毕，从现在开始，它可以在其它CPU上运行
+        prev_pcb.sched_info().set_executing(false);
+
+        // prev不允许在当前CPU上运行，但是在切换出去之前无法迁移，现在把它放到允许的CPU上
+        if prev_pcb.flags().contains(ProcessFlags::NEED_MIGRATE) {
+            prev_pcb.flags().remove(ProcessFlags::NEED_MIGRATE);
+            sched_enqueue(prev_pcb, true);
+        }
+
+        // idle进程在中断中被切换出去时，还没来得及恢复周期性的时钟中断
+        if prev_pcb.pid() == Pid(0) {
+            tick_nohz_idle_exit();
+        }
     }
 
     /// 如果目标进程正在目标CPU上运行，那么就让这个cpu陷入内核态
@@ -1022,6 +1042,18 @@ pub struct ProcessSchedulerInfo {
     /// 如果当前进程等待被迁移到另一个cpu核心上（也就是flags中的PF_NEED_MIGRATE被置位），
     /// 该字段存储要被迁移到的目标处理器核心号
     migrate_to: AtomicProcessorId,
+    /// 进程是否正在CPU上执行。
+    ///
+    /// 进程被切换到CPU上之前置位，在切换到下一个进程、并且上下文保存完毕之后才会被清除。
+    /// 置位期间，进程不能被迁移到其它CPU
+    executing: AtomicBool,
+    /// 进程是否在CFS的运行队列中。
+    ///
+    /// 进程在即将切换出去时被唤醒，会在它还在执行时就被加入运行队列，
+    /// 调度器据此避免把它重复加入队列
+    on_rq: AtomicBool,
+    /// 允许进程运行的cpu
+    cpus_allowed: RwLock<CpuMask>,
     inner_locked: RwLock<InnerSchedInfo>,
     /// 进程的调度优先级
     priority: SchedPriority,
@@ -1029,6 +1061,8 @@ pub struct ProcessSchedulerInfo {
     virtual_runtime: AtomicIsize,
     /// 由实时调度器管理的时间片
     rt_time_slice: AtomicIsize,
+    /// 调度统计信息
+    stat: TaskSchedStat,
 }
 
 #[derive(Debug)]
@@ -1057,9 +1091,14 @@ impl ProcessSchedulerInfo {
     #[inline(never)]
     pub fn new(on_cpu: Option<ProcessorId>) -> Self {
         let cpu_id = on_cpu.unwrap_or(ProcessorId::INVALID);
+        let mut cpus_allowed = CpuMask::new();
+        cpus_allowed.set_all(true);
         return Self {
             on_cpu: AtomicProcessorId::new(cpu_id),
             migrate_to: AtomicProcessorId::new(ProcessorId::INVALID),
+            executing: AtomicBool::new(false),
+            on_rq: AtomicBool::new(false),
+            cpus_allowed: RwLock::new(cpus_allowed),
             inner_locked: RwLock::new(InnerSchedInfo {
                 state: ProcessState::Blocked(false),
                 sched_policy: SchedPolicy::CFS,
@@ -1067,6 +1106,7 @@ impl ProcessSchedulerInfo {
             virtual_runtime: AtomicIsize::new(0),
             rt_time_slice: AtomicIsize::new(0),
             priority: SchedPriority::new(100).unwrap(),
+            stat: TaskSchedStat::new(),
         };
     }
 
@@ -1087,6 +1127,45 @@ impl ProcessSchedulerInfo {
         }
     }
 
+    #[inline]
+    pub fn is_executing(&self) -> bool {
+        return self.executing.load(Ordering::SeqCst);
+    }
+
+    #[inline]
+    pub fn set_executing(&self, executing: bool) {
+        self.executing.store(executing, Ordering::SeqCst);
+    }
+
+    #[inline]
+    pub fn on_rq(&self) -> bool {
+        return self.on_rq.load(Ordering::SeqCst);
+    }
+
+    /// 设置进程是否在CFS的运行队列中，返回原来的值
+    #[inline]
+    pub fn set_on_rq(&self, on_rq: bool) -> bool {
+        return self.on_rq.swap(on_rq, Ordering::SeqCst);
+    }
+
+    /// 获取允许进程运行的cpu
+    pub fn cpus_allowed(&self) -> CpuMask {
+        return self.cpus_allowed.read_irqsave().clone();
+    }
+
+    /// 设置允许进程运行的cpu。
+    ///
+    /// 请注意，本函数只修改掩码，不会迁移进程。要让进程立即离开不允许的cpu，请使用`sched_setaffinity`
+    pub fn set_cpus_allowed(&self, mask: CpuMask) {
+        *self.cpus_allowed.write_irqsave() = mask;
+    }
+
+    /// 进程是否允许在指定的cpu上运行
+    #[inline]
+    pub fn cpu_allowed(&self, cpu: ProcessorId) -> bool {
+        return self.cpus_allowed.read_irqsave().get(cpu).unwrap_or(false);
+    }
+
     pub fn migrate_to(&self) -> Option<ProcessorId> {
         let migrate_to = self.migrate_to.load(Ordering::SeqCst);
         if migrate_to == ProcessorId::INVALID {
@@ -1163,6 +1242,10 @@ impl ProcessSchedulerInfo {
         self.rt_time_slice.fetch_add(delta, Ordering::SeqCst);
     }
 
+    pub fn stat(&self) -> &TaskSchedStat {
+        return &self.stat;
+    }
+
     pub fn priority(&self) -> SchedPriority {
         return self.priority;
     }
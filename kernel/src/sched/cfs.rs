@@ -5,7 +5,7 @@ use alloc::{boxed::Box, sync::Arc, vec::Vec};
 use crate::{
     arch::CurrentIrqArch,
     exception::InterruptArch,
-    include::bindings::bindings::MAX_CPU_NUM,
+    include::bindings::bindings::{smp_get_total_cpu, MAX_CPU_NUM},
     kBUG,
     libs::{
         rbtree::RBTree,
@@ -15,10 +15,12 @@ use crate::{
         ProcessControlBlock, ProcessFlags, ProcessManager, ProcessSchedulerInfo, ProcessState,
     },
     smp::{core::smp_get_processor_id, cpu::ProcessorId},
+    time::timer::{clock, next_n_ms_timer_jiffies},
 };
 
 use super::{
     core::{sched_enqueue, Scheduler},
+    stat::sched_stat_migrate,
     SchedPriority,
 };
 
@@ -41,11 +43,18 @@ pub unsafe fn sched_cfs_init() {
     }
 }
 
+/// 两次周期性负载均衡之间的间隔（毫秒）
+const CFS_BALANCE_INTERVAL_MS: u64 = 4;
+/// 一次负载均衡最多迁移的进程数量
+const CFS_BALANCE_MAX_MIGRATE: usize = 8;
+
 /// @brief CFS队列（per-cpu的）
 #[derive(Debug)]
 struct CFSQueue {
     /// 当前cpu上执行的进程剩余的时间片
     cpu_exec_proc_jiffies: i64,
+    /// 下一次周期性负载均衡的时间（jiffies）
+    next_balance: u64,
     /// 自旋锁保护的队列
     locked_queue: SpinLock<RBTree<i64, Arc<ProcessControlBlock>>>,
     /// 当前核心的队列专属的IDLE进程的pcb
@@ -56,6 +65,7 @@ impl CFSQueue {
     pub fn new(idle_pcb: Arc<ProcessControlBlock>) -> CFSQueue {
         CFSQueue {
             cpu_exec_proc_jiffies: 0,
+            next_balance: 0,
             locked_queue: SpinLock::new(RBTree::new()),
             idle_pcb,
         }
@@ -69,6 +79,10 @@ impl CFSQueue {
         if pcb.pid().into() == 0 {
             return;
         }
+        // 进程已经在运行队列中，不重复加入
+        if pcb.sched_info().set_on_rq(true) {
+            return;
+        }
 
         queue.insert(pcb.sched_info().virtual_runtime() as i64, pcb.clone());
     }
@@ -80,6 +94,7 @@ impl CFSQueue {
         if !queue.is_empty() {
             // 队列不为空，返回下一个要执行的pcb
             res = queue.pop_first().unwrap().1;
+            res.sched_info().set_on_rq(false);
         } else {
             // 如果队列为空，则返回IDLE进程的pcb
             res = self.idle_pcb.clone();
@@ -87,6 +102,32 @@ impl CFSQueue {
         return res;
     }
 
+    /// @brief 将pcb从调度队列中移除
+    ///
+    /// @return 进程是否在这个队列中
+    pub fn remove(&mut self, pcb: &Arc<ProcessControlBlock>) -> bool {
+        let mut queue = self.locked_queue.lock_irqsave();
+
+        // 队列的键是进程入队时的虚拟运行时间，可能与现在的值不同，因此需要遍历查找
+        let key = match queue.iter().find(|(_, p)| Arc::ptr_eq(p, pcb)) {
+            Some((key, _)) => *key,
+            None => return false,
+        };
+        // 虚拟运行时间相同的进程可能有多个
+        let mut others = Vec::new();
+        while let Some(p) = queue.remove(&key) {
+            if Arc::ptr_eq(&p, pcb) {
+                break;
+            }
+            others.push(p);
+        }
+        for p in others {
+            queue.insert(key, p);
+        }
+        pcb.sched_info().set_on_rq(false);
+        return true;
+    }
+
     /// @brief 获取cfs队列的最小运行时间
     ///
     /// @return Option<i64> 如果队列不为空，那么返回队列中，最小的虚拟运行时间；否则返回None
@@ -192,6 +233,109 @@ impl SchedulerCFS {
         cpu_queue.enqueue(pcb);
     }
 
+    /// 负载均衡：从负载最重的cpu的运行队列中，把一部分进程拉到当前cpu的运行队列中
+    ///
+    /// 由当前cpu在调度时调用：周期性地调用，或者在当前cpu即将空闲时调用。
+    /// 迁移时同时持有两个队列的锁（按照cpu号从小到大的顺序加锁，避免死锁），
+    /// 进程先从源队列中移除，再加入目标队列，因此不会同时出现在两个队列中。
+    /// 正在某个cpu上执行的进程，以及不允许在当前cpu上运行的进程不会被迁移。
+    ///
+    /// 请注意，进入该函数之前，需要关中断
+    ///
+    /// ## 参数
+    ///
+    /// - `this_cpu` - 当前cpu
+    /// - `idle` - 当前cpu是否即将空闲
+    ///
+    /// ## 返回值
+    ///
+    /// 迁移的进程数量
+    pub fn load_balance(&mut self, this_cpu: ProcessorId, idle: bool) -> usize {
+        let cpu_num = unsafe { smp_get_total_cpu() };
+        let this_idx = this_cpu.data() as usize;
+
+        // 找到等待运行的进程最多的cpu
+        let mut busiest: Option<(usize, usize)> = None;
+        for cpu in 0..cpu_num as usize {
+            if cpu == this_idx {
+                continue;
+            }
+            let len = self.cpu_queue[cpu].locked_queue.lock_irqsave().len();
+            if busiest.map_or(true, |(_, max)| len > max) {
+                busiest = Some((cpu, len));
+            }
+        }
+        let (src_idx, _) = match busiest {
+            Some(b) => b,
+            None => return 0,
+        };
+
+        // 按照cpu号从小到大的顺序加锁
+        let (mut src_queue, mut dst_queue) = if src_idx < this_idx {
+            let src = self.cpu_queue[src_idx].locked_queue.lock_irqsave();
+            let dst = self.cpu_queue[this_idx].locked_queue.lock_irqsave();
+            (src, dst)
+        } else {
+            let dst = self.cpu_queue[this_idx].locked_queue.lock_irqsave();
+            let src = self.cpu_queue[src_idx].locked_queue.lock_irqsave();
+            (src, dst)
+        };
+
+        // 加锁之前读取的长度可能已经过时，重新计算要迁移的数量
+        let src_len = src_queue.len();
+        let dst_len = dst_queue.len();
+        let mut nr_migrate = src_len.saturating_sub(dst_len) / 2;
+        if nr_migrate == 0 && idle && src_len > 0 && dst_len == 0 {
+            // 当前cpu即将空闲，而对方还有进程在等待，那么至少迁移一个
+            nr_migrate = 1;
+        }
+        nr_migrate = core::cmp::min(nr_migrate, CFS_BALANCE_MAX_MIGRATE);
+        if nr_migrate == 0 {
+            return 0;
+        }
+
+        // 迁移到当前cpu上的进程，虚拟运行时间从当前cpu的队列的最小值开始
+        let base_vruntime = CFSQueue::min_vruntime(&dst_queue)
+            .unwrap_or(ProcessManager::current_pcb().sched_info().virtual_runtime() as i64);
+
+        // 优先迁移虚拟运行时间最大的进程，它们最晚才会被调度，缓存也最冷
+        let mut skipped = Vec::new();
+        let mut migrated = 0;
+        while migrated < nr_migrate {
+            let (vruntime, pcb) = match src_queue.pop_last() {
+                Some(p) => p,
+                None => break,
+            };
+            if pcb.sched_info().is_executing() || !pcb.sched_info().cpu_allowed(this_cpu) {
+                skipped.push((vruntime, pcb));
+                continue;
+            }
+            sched_stat_migrate(&pcb);
+            pcb.sched_info().set_on_cpu(Some(this_cpu));
+            pcb.sched_info().set_virtual_runtime(base_vruntime as isize);
+            dst_queue.insert(base_vruntime, pcb);
+            migrated += 1;
+        }
+        for (vruntime, pcb) in skipped {
+            src_queue.insert(vruntime, pcb);
+        }
+
+        return migrated;
+    }
+
+    /// 把进程从它所在的cpu的运行队列中移除
+    ///
+    /// ## 返回值
+    ///
+    /// 进程是否在运行队列中
+    pub fn remove(&mut self, pcb: &Arc<ProcessControlBlock>) -> bool {
+        let cpu_id = match pcb.sched_info().on_cpu() {
+            Some(cpu_id) => cpu_id,
+            None => return false,
+        };
+        return self.cpu_queue[cpu_id.data() as usize].remove(pcb);
+    }
+
     /// @brief 设置cpu的队列的IDLE进程的pcb
     #[allow(dead_code)]
     pub fn set_cpu_idle(&mut self, cpu_id: usize, pcb: Arc<ProcessControlBlock>) {
@@ -217,14 +361,33 @@ impl Scheduler for SchedulerCFS {
             .flags()
             .remove(ProcessFlags::NEED_SCHEDULE);
 
-        let current_cpu_id = smp_get_processor_id().data() as usize;
+        let current_cpu = smp_get_processor_id();
+        let current_cpu_id = current_cpu.data() as usize;
+
+        // 周期性地进行负载均衡；当前cpu即将空闲时，立即尝试从其它cpu拉取进程
+        let current_pcb = ProcessManager::current_pcb();
+        let going_idle = self.get_cfs_queue_len(current_cpu) == 0
+            && (Arc::ptr_eq(&current_pcb, &self.cpu_queue[current_cpu_id].idle_pcb)
+                || current_pcb.sched_info().inner_lock_read_irqsave().state()
+                    != ProcessState::Runnable);
+        if going_idle || clock() >= self.cpu_queue[current_cpu_id].next_balance {
+            self.cpu_queue[current_cpu_id].next_balance =
+                next_n_ms_timer_jiffies(CFS_BALANCE_INTERVAL_MS);
+            self.load_balance(current_cpu, going_idle);
+        }
 
         let current_cpu_queue: &mut CFSQueue = self.cpu_queue[current_cpu_id];
 
         let proc: Arc<ProcessControlBlock> = current_cpu_queue.dequeue();
 
+        // 当前进程在即将睡眠时被唤醒，因此又出现在了当前cpu的队列中，直接继续运行
+        if Arc::ptr_eq(&proc, &current_pcb) {
+            return None;
+        }
+
         compiler_fence(core::sync::atomic::Ordering::SeqCst);
         // 如果当前不是running态，或者当前进程的虚拟运行时间大于等于下一个进程的，那就需要切换。
+        // IDLE进程停止时钟中断期间虚拟运行时间不再增加，因此队列中有进程时总是切换
         let state = ProcessManager::current_pcb()
             .sched_info()
             .inner_lock_read_irqsave()
@@ -232,9 +395,12 @@ impl Scheduler for SchedulerCFS {
         if (state != ProcessState::Runnable)
             || (ProcessManager::current_pcb().sched_info().virtual_runtime()
                 >= proc.sched_info().virtual_runtime())
+            || !current_pcb.sched_info().cpu_allowed(current_cpu)
+            || Arc::ptr_eq(&current_pcb, &current_cpu_queue.idle_pcb)
         {
             compiler_fence(core::sync::atomic::Ordering::SeqCst);
-            // 本次切换由于时间片到期引发，则再次加入就绪队列，否则交由其它功能模块进行管理
+            // 本次切换由于时间片到期引发，则再次加入就绪队列，否则交由其它功能模块进行管理。
+            // 当前进程在即将睡眠时被唤醒的话，已经在队列中了，enqueue不会重复加入
             if state == ProcessState::Runnable {
                 sched_enqueue(ProcessManager::current_pcb(), false);
                 compiler_fence(core::sync::atomic::Ordering::SeqCst);
@@ -255,6 +421,10 @@ impl Scheduler for SchedulerCFS {
         } else {
             // 不进行切换
 
+            // 当前进程在执行期间被唤醒而加入了队列，继续运行的话要把它从队列中移除
+            if current_pcb.sched_info().on_rq() {
+                current_cpu_queue.remove(&current_pcb);
+            }
             // 设置进程可以执行的时间
             compiler_fence(core::sync::atomic::Ordering::SeqCst);
             if current_cpu_queue.cpu_exec_proc_jiffies <= 0 {
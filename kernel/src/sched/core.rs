@@ -5,14 +5,21 @@ use core::{
 
 use alloc::{sync::Arc, vec::Vec};
 
+use system_error::SystemError;
+
 use crate::{
+    arch::CurrentIrqArch,
+    exception::InterruptArch,
+    include::bindings::bindings::smp_get_total_cpu,
     kinfo,
+    libs::cpumask::CpuMask,
     mm::percpu::PerCpu,
     process::{AtomicPid, Pid, ProcessControlBlock, ProcessFlags, ProcessManager, ProcessState},
-    smp::{core::smp_get_processor_id, cpu::ProcessorId},
+    smp::{core::smp_get_processor_id, cpu::ProcessorId, kick_cpu},
 };
 
 use super::rt::{sched_rt_init, SchedulerRT, __get_rt_scheduler};
+use super::stat::{sched_stat_enqueue, sched_stat_migrate};
 use super::{
     cfs::{sched_cfs_init, SchedulerCFS, __get_cfs_scheduler},
     SchedPolicy,
@@ -50,7 +57,6 @@ impl CpuExecuting {
 
 // 获取某个cpu的负载情况，返回当前负载，cpu_id 是获取负载的cpu的id
 // TODO:将获取负载情况调整为最近一段时间运行进程的数量
-#[allow(dead_code)]
 pub fn get_cpu_loads(cpu_id: ProcessorId) -> u32 {
     let cfs_scheduler = __get_cfs_scheduler();
     let rt_scheduler = __get_rt_scheduler();
@@ -58,41 +64,105 @@ pub fn get_cpu_loads(cpu_id: ProcessorId) -> u32 {
     let len_rt = rt_scheduler.rt_queue_len(cpu_id);
     // let load_rt = rt_scheduler.get_load_list_len(cpu_id);
     // kdebug!("this cpu_id {} is load rt {}", cpu_id, load_rt);
+    // 正在执行的进程不在运行队列中，也要计入负载（IDLE进程除外）
+    let running = (CPU_EXECUTING.get(cpu_id) != Pid::new(0)) as usize;
 
-    return (len_rt + len_cfs) as u32;
+    return (len_rt + len_cfs + running) as u32;
 }
-// 负载均衡
-pub fn loads_balance(pcb: Arc<ProcessControlBlock>) {
-    // FIXME: 由于目前负载均衡是直接添加到目标CPU的队列中，导致会由于时序问题导致进程在两个CPU上都存在。
-    // 在调度子系统重写/改进之前，暂时只设置进程在0号CPU上运行
-    // 由于调度器问题，暂时不进行负载均衡，见issue: https://github.com/DragonOS-Community/DragonOS/issues/571
-    let min_loads_cpu_id = ProcessorId::new(0);
-
-    // 获取总的CPU数量
-    // let cpu_num = unsafe { smp_get_total_cpu() };
-    // 获取当前负载最小的CPU的id
-    // let mut min_loads = get_cpu_loads(smp_get_processor_id());
-    // for cpu_id in 0..cpu_num {
-    //     let cpu_id = ProcessorId::new(cpu_id);
-    //     let tmp_cpu_loads = get_cpu_loads(cpu_id);
-    //     if min_loads - tmp_cpu_loads > 0 {
-    //         min_loads_cpu_id = cpu_id;
-    //         min_loads = tmp_cpu_loads;
-    //     }
-    // }
-
-    let pcb_cpu = pcb.sched_info().on_cpu();
-    // 将当前pcb迁移到负载最小的CPU
-    // 如果当前pcb的PF_NEED_MIGRATE已经置位，则不进行迁移操作
-    if pcb_cpu.is_none()
-        || (min_loads_cpu_id != pcb_cpu.unwrap()
-            && !pcb.flags().contains(ProcessFlags::NEED_MIGRATE))
-    {
-        pcb.flags().insert(ProcessFlags::NEED_MIGRATE);
-        pcb.sched_info().set_migrate_to(Some(min_loads_cpu_id));
-        // kdebug!("set migrating, pcb:{:?}", pcb);
+
+/// 为被唤醒（或者新创建）的进程选择要加入的运行队列
+///
+/// - 如果进程仍然在某个CPU上执行（例如进程刚刚标记为睡眠，还没有被切换出去，就被唤醒了），
+///   那么它只能留在原来的CPU上，否则它会同时在两个CPU上运行
+/// - 否则在进程允许运行的CPU中，选择负载最小的。负载相同时优先选择进程上次运行的CPU，以利用缓存
+///
+/// 对于已经在运行队列中的进程，由负载均衡器（`SchedulerCFS::load_balance`）负责迁移
+pub fn select_task_rq(pcb: &Arc<ProcessControlBlock>) -> ProcessorId {
+    let prev_cpu = pcb.sched_info().on_cpu();
+    if let Some(prev_cpu) = prev_cpu {
+        if pcb.sched_info().is_executing() {
+            return prev_cpu;
+        }
     }
+
+    let cpu_num = unsafe { smp_get_total_cpu() };
+    let allowed = pcb.sched_info().cpus_allowed();
+    let mut target =
+        prev_cpu.filter(|cpu| cpu.data() < cpu_num && allowed.get(*cpu).unwrap_or(false));
+    let mut min_loads = target.map(get_cpu_loads).unwrap_or(u32::MAX);
+    for cpu_id in allowed.iter_cpu() {
+        if min_loads == 0 || cpu_id.data() >= cpu_num {
+            break;
+        }
+        if Some(cpu_id) == target {
+            continue;
+        }
+        let loads = get_cpu_loads(cpu_id);
+        if loads < min_loads {
+            target = Some(cpu_id);
+            min_loads = loads;
+        }
+    }
+
+    // 允许运行的CPU都不在线（sched_setaffinity会拒绝这样的掩码），只能留在原来的CPU上
+    return target.unwrap_or(prev_cpu.unwrap_or(smp_get_processor_id()));
 }
+
+/// 设置进程的cpu亲和性，并且让进程离开不再允许运行的cpu
+///
+/// ## 参数
+///
+/// - `pcb` - 要设置的进程
+/// - `mask` - 允许进程运行的cpu
+///
+/// ## 返回值
+///
+/// - `Err(SystemError::EINVAL)` - mask中没有在线的cpu
+pub fn sched_setaffinity(
+    pcb: &Arc<ProcessControlBlock>,
+    mask: &CpuMask,
+) -> Result<(), SystemError> {
+    let mut online = CpuMask::new();
+    for cpu in 0..unsafe { smp_get_total_cpu() } {
+        online.set(ProcessorId::new(cpu), true);
+    }
+    let mask = mask.and(&online);
+    if mask.is_empty() {
+        return Err(SystemError::EINVAL);
+    }
+    pcb.sched_info().set_cpus_allowed(mask);
+
+    let on_cpu = match pcb.sched_info().on_cpu() {
+        Some(cpu) => cpu,
+        None => return Ok(()),
+    };
+    if pcb.sched_info().cpu_allowed(on_cpu) {
+        return Ok(());
+    }
+
+    if pcb.sched_info().is_executing() {
+        // 让进程尽快被调度，在它被切换出去之后，由switch_finish_hook迁移
+        pcb.flags().insert(ProcessFlags::NEED_SCHEDULE);
+        if on_cpu != smp_get_processor_id() {
+            ProcessManager::kick(pcb);
+        }
+        return Ok(());
+    }
+
+    // 进程在不允许的cpu的运行队列中等待，把它转移到允许的cpu上
+    let irq_guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
+    let removed = match pcb.sched_info().inner_lock_read_irqsave().policy() {
+        SchedPolicy::CFS => __get_cfs_scheduler().remove(pcb),
+        SchedPolicy::FIFO | SchedPolicy::RR => __get_rt_scheduler().remove(pcb),
+    };
+    if removed {
+        sched_enqueue(pcb.clone(), true);
+    }
+    drop(irq_guard);
+
+    return Ok(());
+}
+
 /// @brief 具体的调度器应当实现的trait
 pub trait Scheduler {
     /// @brief 使用该调度器发起调度的时候，要调用的函数
@@ -139,19 +209,11 @@ pub fn do_sched() -> Option<Arc<ProcessControlBlock>> {
     let rt_scheduler: &mut SchedulerRT = __get_rt_scheduler();
     compiler_fence(core::sync::atomic::Ordering::SeqCst);
 
-    let next: Arc<ProcessControlBlock>;
-    match rt_scheduler.pick_next_task_rt(smp_get_processor_id()) {
-        Some(p) => {
-            next = p;
-            // 将pick的进程放回原处
-            rt_scheduler.enqueue_front(next);
-
-            return rt_scheduler.sched();
-        }
-        None => {
-            return cfs_scheduler.sched();
-        }
+    // 有实时进程等待时（必要时先从其他cpu拉取），由RT调度器决定是否切换
+    if rt_scheduler.balance(smp_get_processor_id()) {
+        return rt_scheduler.sched();
     }
+    return cfs_scheduler.sched();
 }
 
 /// @brief 将进程加入调度队列
@@ -165,19 +227,33 @@ pub fn sched_enqueue(pcb: Arc<ProcessControlBlock>, mut reset_time: bool) {
     }
     let cfs_scheduler = __get_cfs_scheduler();
     let rt_scheduler = __get_rt_scheduler();
-    // 除了IDLE以外的进程，都进行负载均衡
+    // 被唤醒的进程重新选择运行队列（IDLE进程固定在自己的CPU上）。
+    // 时间片耗尽而重新入队的进程留在当前CPU上，由负载均衡器决定是否迁移，
+    // 除非进程不再允许在当前CPU上运行
     if pcb.pid().into() > 0 {
-        loads_balance(pcb.clone());
-    }
-
-    if pcb.flags().contains(ProcessFlags::NEED_MIGRATE) {
-        // kdebug!("migrating pcb:{:?}", pcb);
-        pcb.flags().remove(ProcessFlags::NEED_MIGRATE);
-        pcb.sched_info().set_on_cpu(pcb.sched_info().migrate_to());
-        reset_time = true;
+        let misplaced = pcb
+            .sched_info()
+            .on_cpu()
+            .map_or(true, |cpu| !pcb.sched_info().cpu_allowed(cpu));
+        if misplaced && pcb.sched_info().is_executing() {
+            // 进程还在不允许的CPU上执行，等它被切换出去之后，由switch_finish_hook迁移
+            pcb.flags().insert(ProcessFlags::NEED_MIGRATE);
+            return;
+        }
+        if reset_time || misplaced {
+            let target = select_task_rq(&pcb);
+            if pcb.sched_info().on_cpu() != Some(target) {
+                if pcb.sched_info().on_cpu().is_some() {
+                    sched_stat_migrate(&pcb);
+                }
+                pcb.sched_info().set_on_cpu(Some(target));
+                reset_time = true;
+            }
+        }
     }
 
     assert!(pcb.sched_info().on_cpu().is_some());
+    sched_stat_enqueue(&pcb);
 
     match pcb.sched_info().inner_lock_read_irqsave().policy() {
         SchedPolicy::CFS => {
@@ -189,6 +265,18 @@ pub fn sched_enqueue(pcb: Arc<ProcessControlBlock>, mut reset_time: bool) {
         }
         SchedPolicy::FIFO | SchedPolicy::RR => rt_scheduler.enqueue(pcb.clone()),
     }
+
+    // 目标CPU正在执行IDLE进程，它可能已经停止了时钟中断，需要通知它立即进行调度
+    let target = pcb.sched_info().on_cpu().unwrap();
+    if pcb.pid().into() > 0 && CPU_EXECUTING.get(target) == Pid::new(0) {
+        if target == smp_get_processor_id() {
+            ProcessManager::current_pcb()
+                .flags()
+                .insert(ProcessFlags::NEED_SCHEDULE);
+        } else {
+            kick_cpu(target).ok();
+        }
+    }
 }
 
 /// 初始化进程调度器模块
@@ -2,6 +2,7 @@ pub mod cfs;
 pub mod completion;
 pub mod core;
 pub mod rt;
+pub mod stat;
 pub mod syscall;
 
 /// 调度策略
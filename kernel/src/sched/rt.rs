@@ -1,21 +1,28 @@
-use core::sync::atomic::compiler_fence;
+use core::sync::atomic::{compiler_fence, AtomicUsize, Ordering};
 
 use alloc::{boxed::Box, collections::LinkedList, sync::Arc, vec::Vec};
+use bitmap::{traits::BitMapOps, StaticBitmap};
 
 use crate::{
-    arch::cpu::current_cpu_id,
-    include::bindings::bindings::MAX_CPU_NUM,
+    arch::{cpu::current_cpu_id, CurrentIrqArch},
+    exception::InterruptArch,
+    include::bindings::bindings::{smp_get_total_cpu, MAX_CPU_NUM},
     kBUG, kdebug,
     libs::spinlock::SpinLock,
-    process::{ProcessControlBlock, ProcessFlags, ProcessManager},
-    smp::cpu::ProcessorId,
+    process::{ProcessControlBlock, ProcessFlags, ProcessManager, ProcessState},
+    smp::{cpu::ProcessorId, kick_cpu},
 };
 
 use super::{
+    cfs::__get_cfs_scheduler,
     core::{sched_enqueue, Scheduler},
+    stat::sched_stat_migrate,
     SchedPolicy,
 };
 
+/// 实时进程的优先级数量，优先级的数值越小，优先级越高
+const MAX_RT_PRIO: usize = 100;
+
 /// 声明全局的rt调度器实例
 pub static mut RT_SCHEDULER_PTR: Option<Box<SchedulerRT>> = None;
 
@@ -35,135 +42,371 @@ pub unsafe fn sched_rt_init() {
         panic!("Try to init RT Scheduler twice.");
     }
 }
-/// @brief RT队列（per-cpu的）
+
+/// 进程在RT队列中的优先级（0为最高）
+#[inline]
+fn rt_prio(pcb: &Arc<ProcessControlBlock>) -> usize {
+    return (pcb.sched_info().priority().data() as usize).min(MAX_RT_PRIO - 1);
+}
+
+/// 进程是否使用实时调度策略（IDLE进程除外）
+#[inline]
+fn is_rt_task(pcb: &Arc<ProcessControlBlock>) -> bool {
+    if pcb.pid().into() == 0 {
+        return false;
+    }
+    return matches!(
+        pcb.sched_info().inner_lock_read_irqsave().policy(),
+        SchedPolicy::FIFO | SchedPolicy::RR
+    );
+}
+
+/// 受锁保护的RT队列
 #[derive(Debug)]
-struct RTQueue {
-    /// 加锁保护的存储进程的双向队列
-    locked_queue: SpinLock<LinkedList<Arc<ProcessControlBlock>>>,
+struct RTQueueInner {
+    /// 每个优先级一个先进先出的队列
+    queues: Vec<LinkedList<Arc<ProcessControlBlock>>>,
+    /// 第i位为1表示优先级为i的队列非空，用于O(1)地找到最高的优先级
+    bitmap: StaticBitmap<MAX_RT_PRIO>,
+    /// 队列中的进程总数
+    nr_running: usize,
 }
 
-impl RTQueue {
-    pub fn new() -> RTQueue {
-        RTQueue {
-            locked_queue: SpinLock::new(LinkedList::new()),
-        }
+impl RTQueueInner {
+    fn new() -> Self {
+        let mut queues = Vec::with_capacity(MAX_RT_PRIO);
+        queues.resize_with(MAX_RT_PRIO, LinkedList::new);
+        return Self {
+            queues,
+            bitmap: StaticBitmap::new(),
+            nr_running: 0,
+        };
     }
-    /// @brief 将pcb加入队列
-    pub fn enqueue(&mut self, pcb: Arc<ProcessControlBlock>) {
-        let mut queue = self.locked_queue.lock_irqsave();
 
-        // 如果进程是IDLE进程，那么就不加入队列
-        if pcb.pid().into() == 0 {
-            return;
-        }
-        queue.push_back(pcb);
+    /// 队列中最高的优先级
+    #[inline]
+    fn highest_prio(&self) -> Option<usize> {
+        return self.bitmap.first_index();
     }
 
-    /// @brief 将pcb从调度队列头部取出,若队列为空，则返回None
-    pub fn dequeue(&mut self) -> Option<Arc<ProcessControlBlock>> {
-        let res: Option<Arc<ProcessControlBlock>>;
-        let mut queue = self.locked_queue.lock_irqsave();
-        if queue.len() > 0 {
-            // 队列不为空，返回下一个要执行的pcb
-            res = Some(queue.pop_front().unwrap());
+    fn push(&mut self, pcb: Arc<ProcessControlBlock>, front: bool) {
+        let prio = rt_prio(&pcb);
+        if front {
+            self.queues[prio].push_front(pcb);
         } else {
-            // 如果队列为空，则返回None
-            res = None;
+            self.queues[prio].push_back(pcb);
         }
-        return res;
+        self.bitmap.set(prio, true);
+        self.nr_running += 1;
     }
-    pub fn enqueue_front(&mut self, pcb: Arc<ProcessControlBlock>) {
-        let mut queue = self.locked_queue.lock_irqsave();
 
-        // 如果进程是IDLE进程，那么就不加入队列
-        if pcb.pid().into() == 0 {
-            return;
+    fn pop(&mut self, prio: usize) -> Option<Arc<ProcessControlBlock>> {
+        let pcb = self.queues[prio].pop_front()?;
+        self.dec(prio);
+        return Some(pcb);
+    }
+
+    /// 从队列中移除进程之后更新统计信息
+    fn dec(&mut self, prio: usize) {
+        if self.queues[prio].is_empty() {
+            self.bitmap.set(prio, false);
         }
-        queue.push_front(pcb);
+        self.nr_running -= 1;
     }
 
-    #[allow(dead_code)]
-    pub fn get_rt_queue_size(&mut self) -> usize {
-        let queue = self.locked_queue.lock_irqsave();
-        return queue.len();
+    /// 取出优先级为prio的队列中，第一个可以迁移到cpu上的进程
+    fn take_migratable(
+        &mut self,
+        prio: usize,
+        cpu: ProcessorId,
+    ) -> Option<Arc<ProcessControlBlock>> {
+        let pcb = self.queues[prio]
+            .extract_if(|p| !p.sched_info().is_executing() && p.sched_info().cpu_allowed(cpu))
+            .next()?;
+        self.dec(prio);
+        return Some(pcb);
+    }
+}
+
+/// @brief RT队列（per-cpu的）
+///
+/// 每个优先级一个链表，再用位图记录哪些优先级有进程在等待，
+/// 因此无论队列中有多少进程，挑选下一个进程的时间都是固定的
+#[derive(Debug)]
+struct RTQueue {
+    locked_queue: SpinLock<RTQueueInner>,
+    /// 该cpu上正在执行的进程的RT优先级，非实时进程为MAX_RT_PRIO
+    curr_prio: AtomicUsize,
+}
+
+impl RTQueue {
+    pub fn new() -> RTQueue {
+        RTQueue {
+            locked_queue: SpinLock::new(RTQueueInner::new()),
+            curr_prio: AtomicUsize::new(MAX_RT_PRIO),
+        }
     }
 }
 
 /// @brief RT调度器类
 pub struct SchedulerRT {
-    cpu_queue: Vec<Vec<&'static mut RTQueue>>,
-    load_list: Vec<&'static mut LinkedList<u64>>,
+    cpu_queue: Vec<RTQueue>,
+    /// 队列中有进程在等待的cpu的数量，为0时不需要从其他cpu拉取进程
+    rt_overload: AtomicUsize,
 }
 
 impl SchedulerRT {
     const RR_TIMESLICE: isize = 100;
-    const MAX_RT_PRIO: isize = 100;
 
     pub fn new() -> SchedulerRT {
-        // 暂时手动指定核心数目
-        // todo: 从cpu模块来获取核心的数目
-        let mut result = SchedulerRT {
-            cpu_queue: Default::default(),
-            load_list: Default::default(),
+        let mut cpu_queue = Vec::with_capacity(MAX_CPU_NUM as usize);
+        for _ in 0..MAX_CPU_NUM {
+            cpu_queue.push(RTQueue::new());
+        }
+        return SchedulerRT {
+            cpu_queue,
+            rt_overload: AtomicUsize::new(0),
         };
+    }
 
-        // 为每个cpu核心创建队列
-        for cpu_id in 0..MAX_CPU_NUM {
-            result.cpu_queue.push(Vec::new());
-            // 每个CPU有MAX_RT_PRIO个优先级队列
-            for _ in 0..SchedulerRT::MAX_RT_PRIO {
-                result.cpu_queue[cpu_id as usize].push(Box::leak(Box::new(RTQueue::new())));
+    /// 把进程加入cpu的队列，如果它的优先级高于该cpu上正在执行的进程，则通知该cpu进行调度
+    fn enqueue_on(&mut self, cpu_id: ProcessorId, pcb: Arc<ProcessControlBlock>, front: bool) {
+        // 如果进程是IDLE进程，那么就不加入队列
+        if pcb.pid().into() == 0 {
+            return;
+        }
+        let prio = rt_prio(&pcb);
+        let rq = &self.cpu_queue[cpu_id.data() as usize];
+        let mut queue = rq.locked_queue.lock_irqsave();
+        if queue.nr_running == 0 {
+            self.rt_overload.fetch_add(1, Ordering::SeqCst);
+        }
+        queue.push(pcb, front);
+        drop(queue);
+
+        if prio < rq.curr_prio.load(Ordering::SeqCst) {
+            if cpu_id == current_cpu_id() {
+                ProcessManager::current_pcb()
+                    .flags()
+                    .insert(ProcessFlags::NEED_SCHEDULE);
+            } else {
+                kick_cpu(cpu_id).ok();
             }
         }
-        // 为每个cpu核心创建负载统计队列
-        for _ in 0..MAX_CPU_NUM {
-            result
-                .load_list
-                .push(Box::leak(Box::new(LinkedList::new())));
+    }
+
+    /// 取出cpu的队列中优先级最高的进程
+    fn dequeue_on(&mut self, cpu_id: ProcessorId) -> Option<Arc<ProcessControlBlock>> {
+        let mut queue = self.cpu_queue[cpu_id.data() as usize]
+            .locked_queue
+            .lock_irqsave();
+        let prio = queue.highest_prio()?;
+        let pcb = queue.pop(prio);
+        if queue.nr_running == 0 {
+            self.rt_overload.fetch_sub(1, Ordering::SeqCst);
         }
-        return result;
+        return pcb;
     }
 
     /// @brief 挑选下一个可执行的rt进程
     pub fn pick_next_task_rt(&mut self, cpu_id: ProcessorId) -> Option<Arc<ProcessControlBlock>> {
-        // 循环查找，直到找到
-        // 这里应该是优先级数量，而不是CPU数量，需要修改
-        for i in 0..SchedulerRT::MAX_RT_PRIO {
-            let cpu_queue_i: &mut RTQueue = self.cpu_queue[cpu_id.data() as usize][i as usize];
-            let proc: Option<Arc<ProcessControlBlock>> = cpu_queue_i.dequeue();
-            if proc.is_some() {
-                return proc;
-            }
-        }
-        // return 一个空值
-        None
+        return self.dequeue_on(cpu_id);
+    }
+
+    /// cpu的队列中最高的优先级
+    fn highest_prio(&self, cpu_id: ProcessorId) -> Option<usize> {
+        return self.cpu_queue[cpu_id.data() as usize]
+            .locked_queue
+            .lock_irqsave()
+            .highest_prio();
     }
 
     pub fn rt_queue_len(&mut self, cpu_id: ProcessorId) -> usize {
-        let mut sum = 0;
-        for prio in 0..SchedulerRT::MAX_RT_PRIO {
-            sum += self.cpu_queue[cpu_id.data() as usize][prio as usize].get_rt_queue_size();
-        }
-        return sum as usize;
+        return self.cpu_queue[cpu_id.data() as usize]
+            .locked_queue
+            .lock_irqsave()
+            .nr_running;
     }
 
-    #[allow(dead_code)]
-    #[inline]
-    pub fn load_list_len(&mut self, cpu_id: u32) -> usize {
-        return self.load_list[cpu_id as usize].len();
+    /// 在进程切换之前调用，记录cpu上即将执行的进程的优先级
+    pub fn set_cpu_curr(&self, cpu_id: ProcessorId, pcb: &Arc<ProcessControlBlock>) {
+        let prio = if is_rt_task(pcb) {
+            rt_prio(pcb)
+        } else {
+            MAX_RT_PRIO
+        };
+        self.cpu_queue[cpu_id.data() as usize]
+            .curr_prio
+            .store(prio, Ordering::SeqCst);
+    }
+
+    /// 把进程从它所在的cpu的运行队列中移除
+    ///
+    /// ## 返回值
+    ///
+    /// 进程是否在运行队列中
+    pub fn remove(&mut self, pcb: &Arc<ProcessControlBlock>) -> bool {
+        let cpu_id = match pcb.sched_info().on_cpu() {
+            Some(cpu_id) => cpu_id,
+            None => return false,
+        };
+        let prio = rt_prio(pcb);
+        let mut queue = self.cpu_queue[cpu_id.data() as usize]
+            .locked_queue
+            .lock_irqsave();
+        if queue.queues[prio]
+            .extract_if(|p| Arc::ptr_eq(p, pcb))
+            .next()
+            .is_none()
+        {
+            return false;
+        }
+        queue.dec(prio);
+        if queue.nr_running == 0 {
+            self.rt_overload.fetch_sub(1, Ordering::SeqCst);
+        }
+        return true;
     }
 
     pub fn enqueue_front(&mut self, pcb: Arc<ProcessControlBlock>) {
-        let cpu_id = current_cpu_id().data() as usize;
-        let priority = pcb.sched_info().priority().data() as usize;
+        self.enqueue_on(current_cpu_id(), pcb, true);
+    }
+
+    /// 从优先级为prio的队列中取出一个可以迁移到dst上的进程
+    fn take_migratable(
+        &mut self,
+        src: ProcessorId,
+        prio: usize,
+        dst: ProcessorId,
+    ) -> Option<Arc<ProcessControlBlock>> {
+        let mut queue = self.cpu_queue[src.data() as usize]
+            .locked_queue
+            .lock_irqsave();
+        if queue.highest_prio() != Some(prio) {
+            return None;
+        }
+        let pcb = queue.take_migratable(prio, dst)?;
+        if queue.nr_running == 0 {
+            self.rt_overload.fetch_sub(1, Ordering::SeqCst);
+        }
+        return Some(pcb);
+    }
 
-        self.cpu_queue[cpu_id][priority].enqueue_front(pcb);
+    /// cpu即将执行优先级低于this_prio的进程时调用：从其他cpu的队列中拉取一个优先级更高的进程
+    ///
+    /// ## 返回值
+    ///
+    /// 是否拉取到了进程
+    fn pull_rt_task(&mut self, this_cpu: ProcessorId, this_prio: usize) -> bool {
+        if self.rt_overload.load(Ordering::SeqCst) == 0 {
+            return false;
+        }
+        let cpu_num = unsafe { smp_get_total_cpu() };
+
+        // 找到等待的进程优先级最高的cpu
+        let mut best: Option<(ProcessorId, usize)> = None;
+        for cpu in 0..cpu_num {
+            let cpu = ProcessorId::new(cpu);
+            if cpu == this_cpu {
+                continue;
+            }
+            if let Some(prio) = self.highest_prio(cpu) {
+                if prio < this_prio && best.map_or(true, |(_, p)| prio < p) {
+                    best = Some((cpu, prio));
+                }
+            }
+        }
+        let (src, prio) = match best {
+            Some(b) => b,
+            None => return false,
+        };
+
+        let pcb = match self.take_migratable(src, prio, this_cpu) {
+            Some(pcb) => pcb,
+            None => return false,
+        };
+        sched_stat_migrate(&pcb);
+        pcb.sched_info().set_on_cpu(Some(this_cpu));
+        self.enqueue_on(this_cpu, pcb, false);
+        return true;
+    }
+
+    /// 当前cpu的队列中还有进程在等待时调用：把优先级最高的等待者推送到一个正在执行更低优先级进程的cpu上
+    fn push_rt_task(&mut self, this_cpu: ProcessorId) {
+        let prio = match self.highest_prio(this_cpu) {
+            Some(prio) => prio,
+            None => return,
+        };
+        let cpu_num = unsafe { smp_get_total_cpu() };
+
+        // 选择正在执行的进程优先级最低、并且没有更高优先级的进程在等待的cpu
+        let mut target: Option<(ProcessorId, usize)> = None;
+        for cpu in 0..cpu_num {
+            let cpu = ProcessorId::new(cpu);
+            if cpu == this_cpu {
+                continue;
+            }
+            let curr_prio = self.cpu_queue[cpu.data() as usize]
+                .curr_prio
+                .load(Ordering::SeqCst);
+            if curr_prio <= prio || self.highest_prio(cpu).map_or(false, |p| p <= prio) {
+                continue;
+            }
+            if target.map_or(true, |(_, p)| curr_prio > p) {
+                target = Some((cpu, curr_prio));
+            }
+        }
+        let (dst, _) = match target {
+            Some(t) => t,
+            None => return,
+        };
+
+        let pcb = match self.take_migratable(this_cpu, prio, dst) {
+            Some(pcb) => pcb,
+            None => return,
+        };
+        sched_stat_migrate(&pcb);
+        pcb.sched_info().set_on_cpu(Some(dst));
+        self.enqueue_on(dst, pcb, false);
+    }
+
+    /// 在进入具体的调度器之前调用：如果有需要，先从其他cpu拉取实时进程
+    ///
+    /// ## 返回值
+    ///
+    /// 当前cpu的队列中是否有实时进程
+    pub fn balance(&mut self, cpu_id: ProcessorId) -> bool {
+        if self.rt_queue_len(cpu_id) != 0 {
+            return true;
+        }
+        let current = ProcessManager::current_pcb();
+        let this_prio = if is_rt_task(&current)
+            && current.sched_info().inner_lock_read_irqsave().state() == ProcessState::Runnable
+        {
+            rt_prio(&current)
+        } else {
+            MAX_RT_PRIO
+        };
+        return self.pull_rt_task(cpu_id, this_prio);
+    }
+
+    /// 队列中已经没有实时进程时的调度：当前的实时进程可以继续运行，否则交给CFS调度器
+    fn sched_fallback(current_runnable_rt: bool) -> Option<Arc<ProcessControlBlock>> {
+        if current_runnable_rt {
+            return None;
+        }
+        return __get_cfs_scheduler().sched();
     }
 
     pub fn timer_update_jiffies(&self) {
-        ProcessManager::current_pcb()
-            .sched_info()
-            .increase_rt_time_slice(-1);
+        let current = ProcessManager::current_pcb();
+        current.sched_info().increase_rt_time_slice(-1);
+        // RR进程的时间片耗尽后，让出cpu给同优先级的其他进程
+        if current.sched_info().rt_time_slice() <= 0
+            && current.sched_info().inner_lock_read_irqsave().policy() == SchedPolicy::RR
+        {
+            current.flags().insert(ProcessFlags::NEED_SCHEDULE);
+        }
     }
 }
 
@@ -171,67 +414,76 @@ impl Scheduler for SchedulerRT {
     /// @brief 在当前cpu上进行调度。
     /// 请注意，进入该函数之前，需要关中断
     fn sched(&mut self) -> Option<Arc<ProcessControlBlock>> {
-        ProcessManager::current_pcb()
-            .flags()
-            .remove(ProcessFlags::NEED_SCHEDULE);
-        // 正常流程下，这里一定是会pick到next的pcb的，如果是None的话，要抛出错误
+        assert!(CurrentIrqArch::is_irq_enabled() == false);
+
+        let current = ProcessManager::current_pcb();
+        current.flags().remove(ProcessFlags::NEED_SCHEDULE);
         let cpu_id = current_cpu_id();
-        let proc: Arc<ProcessControlBlock> =
-            self.pick_next_task_rt(cpu_id).expect("No RT process found");
-        let priority = proc.sched_info().priority();
-        let policy = proc.sched_info().inner_lock_read_irqsave().policy();
-        match policy {
-            // 如果是fifo策略，则可以一直占有cpu直到有优先级更高的任务就绪(即使优先级相同也不行)或者主动放弃(等待资源)
-            SchedPolicy::FIFO => {
-                // 如果挑选的进程优先级小于当前进程，则不进行切换
-                if proc.sched_info().priority()
-                    <= ProcessManager::current_pcb().sched_info().priority()
-                {
-                    sched_enqueue(proc, false);
-                } else {
-                    // 将当前的进程加进队列
-                    sched_enqueue(ProcessManager::current_pcb(), false);
-                    compiler_fence(core::sync::atomic::Ordering::SeqCst);
-                    return Some(proc);
+        let state = current.sched_info().inner_lock_read_irqsave().state();
+        let current_rt = is_rt_task(&current) && current.sched_info().cpu_allowed(cpu_id);
+
+        // 等待的进程可能刚刚被其他cpu拉走了
+        let next_prio = match self.highest_prio(cpu_id) {
+            Some(prio) => prio,
+            None => return Self::sched_fallback(current_rt && state == ProcessState::Runnable),
+        };
+        let mut expired = false;
+        if current_rt && state == ProcessState::Runnable {
+            let curr_prio = rt_prio(&current);
+            let policy = current.sched_info().inner_lock_read_irqsave().policy();
+            expired = policy == SchedPolicy::RR && current.sched_info().rt_time_slice() <= 0;
+            // FIFO进程一直占有cpu，直到有优先级更高的进程就绪或者主动放弃；
+            // RR进程在时间片耗尽之前，也不会被同优先级的进程抢占
+            let keep = curr_prio < next_prio || (curr_prio == next_prio && !expired);
+            if keep {
+                if expired {
+                    current
+                        .sched_info()
+                        .set_rt_time_slice(SchedulerRT::RR_TIMESLICE);
                 }
+                return None;
             }
+        }
 
-            // RR调度策略需要考虑时间片
-            SchedPolicy::RR => {
-                // 同等优先级的，考虑切换
-                if proc.sched_info().priority()
-                    >= ProcessManager::current_pcb().sched_info().priority()
-                {
-                    // 判断这个进程时间片是否耗尽，若耗尽则将其时间片赋初值然后入队
-                    if proc.sched_info().rt_time_slice() <= 0 {
-                        proc.sched_info()
-                            .set_rt_time_slice(SchedulerRT::RR_TIMESLICE as isize);
-                        proc.flags().insert(ProcessFlags::NEED_SCHEDULE);
-                        sched_enqueue(proc, false);
-                    }
-                    // 目标进程时间片未耗尽，切换到目标进程
-                    else {
-                        // 将当前进程加进队列
-                        sched_enqueue(ProcessManager::current_pcb(), false);
-                        compiler_fence(core::sync::atomic::Ordering::SeqCst);
-                        return Some(proc);
-                    }
-                }
-                // curr优先级更大，说明一定是实时进程，将所选进程入队列，此时需要入队首
-                else {
-                    self.cpu_queue[cpu_id.data() as usize][priority.data() as usize]
-                        .enqueue_front(proc);
+        let next = match self.pick_next_task_rt(cpu_id) {
+            Some(next) => next,
+            None => return Self::sched_fallback(current_rt && state == ProcessState::Runnable),
+        };
+        // 当前进程在即将睡眠时被唤醒，因此又出现在了当前cpu的队列中，直接继续运行
+        if Arc::ptr_eq(&next, &current) {
+            return None;
+        }
+
+        if next.sched_info().rt_time_slice() <= 0 {
+            next.sched_info()
+                .set_rt_time_slice(SchedulerRT::RR_TIMESLICE);
+        }
+
+        compiler_fence(Ordering::SeqCst);
+        if state == ProcessState::Runnable {
+            if current_rt && !expired {
+                // 被更高优先级的进程抢占，放回同优先级队列的头部，之后最先恢复执行
+                self.enqueue_front(current.clone());
+            } else {
+                if expired {
+                    current
+                        .sched_info()
+                        .set_rt_time_slice(SchedulerRT::RR_TIMESLICE);
                 }
+                sched_enqueue(current.clone(), false);
             }
-            _ => panic!("unsupported schedule policy"),
         }
-        return None;
+        compiler_fence(Ordering::SeqCst);
+
+        // 还有进程在等待，尝试让它们在其他cpu上执行
+        if self.rt_queue_len(cpu_id) != 0 {
+            self.push_rt_task(cpu_id);
+        }
+        return Some(next);
     }
 
     fn enqueue(&mut self, pcb: Arc<ProcessControlBlock>) {
         let cpu_id = pcb.sched_info().on_cpu().unwrap();
-        let cpu_queue = &mut self.cpu_queue[cpu_id.data() as usize];
-        let priority = pcb.sched_info().priority().data() as usize;
-        cpu_queue[priority].enqueue(pcb);
+        self.enqueue_on(cpu_id, pcb, false);
     }
 }
@@ -0,0 +1,498 @@
+//! 调度器的统计信息与事件跟踪
+//!
+//! - 每个cpu的计数器：上下文切换次数、迁移次数、唤醒次数、空闲时间、进程在运行队列中等待的时间
+//! - 每个cpu以及每个进程的延迟直方图：从被唤醒到开始运行的延迟，以及每次在运行队列中等待的时间
+//! - 每个cpu一个无锁的环形缓冲区，记录最近的`sched_switch`/`sched_wakeup`事件
+//!
+//! 这些信息通过`/proc/schedstat`、`/proc/<pid>/schedstat`以及`/proc/sched_trace`导出。
+
+use core::{
+    fmt::Write,
+    sync::atomic::{AtomicU64, Ordering},
+};
+
+use alloc::{string::String, sync::Arc, vec::Vec};
+
+use crate::{
+    arch::CurrentIrqArch,
+    exception::InterruptArch,
+    include::bindings::bindings::smp_get_total_cpu,
+    kinfo,
+    libs::lazy_init::Lazy,
+    mm::percpu::PerCpuCounter,
+    process::{ProcessControlBlock, ProcessState},
+    smp::{core::smp_get_processor_id, cpu::ProcessorId},
+    time::hrtimer::ktime_get_ns,
+};
+
+/// 直方图的桶数。第i个桶统计[2^(i-1), 2^i)微秒的样本，最后一个桶统计更长的样本
+pub const SCHED_HIST_BUCKETS: usize = 20;
+/// 每个cpu的跟踪缓冲区能够保存的事件数，必须是2的幂
+const SCHED_TRACE_ENTRIES: usize = 512;
+
+static SCHED_STAT: Lazy<SchedStat> = Lazy::new();
+
+/// 延迟对应的直方图的桶
+#[inline]
+fn hist_bucket(ns: u64) -> usize {
+    let us = ns / 1000;
+    return ((u64::BITS - us.leading_zeros()) as usize).min(SCHED_HIST_BUCKETS - 1);
+}
+
+/// 直方图第i个桶的上界（单位：微秒），最后一个桶没有上界
+pub fn hist_bucket_limit_us(i: usize) -> Option<u64> {
+    if i + 1 >= SCHED_HIST_BUCKETS {
+        return None;
+    }
+    return Some(1 << i);
+}
+
+/// 进程的调度统计信息
+///
+/// 只有进程所在的cpu会修改它，因此使用原子变量只是为了能够在其他cpu上读取
+#[derive(Debug)]
+pub struct TaskSchedStat {
+    /// 在cpu上运行的总时间（纳秒）
+    run_time_ns: AtomicU64,
+    /// 在运行队列中等待的总时间（纳秒）
+    run_delay_ns: AtomicU64,
+    /// 被调度到cpu上的次数
+    pcount: AtomicU64,
+    /// 被迁移到其他cpu的次数
+    nr_migrations: AtomicU64,
+    /// 最近一次开始运行的时刻
+    last_arrival: AtomicU64,
+    /// 最近一次进入运行队列的时刻，0表示不在运行队列中
+    last_queued: AtomicU64,
+    /// 最近一次被唤醒的时刻，0表示已经开始运行
+    last_wakeup: AtomicU64,
+    wakeup_latency: [AtomicU64; SCHED_HIST_BUCKETS],
+    runq_wait: [AtomicU64; SCHED_HIST_BUCKETS],
+}
+
+impl TaskSchedStat {
+    pub const fn new() -> Self {
+        const ZERO: AtomicU64 = AtomicU64::new(0);
+        return Self {
+            run_time_ns: ZERO,
+            run_delay_ns: ZERO,
+            pcount: ZERO,
+            nr_migrations: ZERO,
+            last_arrival: ZERO,
+            last_queued: ZERO,
+            last_wakeup: ZERO,
+            wakeup_latency: [ZERO; SCHED_HIST_BUCKETS],
+            runq_wait: [ZERO; SCHED_HIST_BUCKETS],
+        };
+    }
+
+    pub fn run_time_ns(&self) -> u64 {
+        return self.run_time_ns.load(Ordering::Relaxed);
+    }
+
+    pub fn run_delay_ns(&self) -> u64 {
+        return self.run_delay_ns.load(Ordering::Relaxed);
+    }
+
+    pub fn pcount(&self) -> u64 {
+        return self.pcount.load(Ordering::Relaxed);
+    }
+
+    pub fn nr_migrations(&self) -> u64 {
+        return self.nr_migrations.load(Ordering::Relaxed);
+    }
+
+    pub fn wakeup_latency(&self) -> [u64; SCHED_HIST_BUCKETS] {
+        return core::array::from_fn(|i| self.wakeup_latency[i].load(Ordering::Relaxed));
+    }
+
+    pub fn runq_wait(&self) -> [u64; SCHED_HIST_BUCKETS] {
+        return core::array::from_fn(|i| self.runq_wait[i].load(Ordering::Relaxed));
+    }
+}
+
+/// 跟踪事件的类型
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum SchedTraceEvent {
+    /// arg0: prev pid, arg1: prev状态, arg2: next pid
+    Switch = 1,
+    /// arg0: 被唤醒的pid, arg1: 目标cpu, arg2: 发起唤醒的pid
+    Wakeup = 2,
+}
+
+/// 跟踪缓冲区中的一项
+///
+/// `seq`为0表示正在写入，否则为该项的序号加一。读者在读取前后比较`seq`，以丢弃被覆盖的项
+#[derive(Debug)]
+struct TraceEntry {
+    seq: AtomicU64,
+    ts: AtomicU64,
+    event: AtomicU64,
+    args: [AtomicU64; 3],
+}
+
+impl TraceEntry {
+    const fn new() -> Self {
+        const ZERO: AtomicU64 = AtomicU64::new(0);
+        return Self {
+            seq: ZERO,
+            ts: ZERO,
+            event: ZERO,
+            args: [ZERO; 3],
+        };
+    }
+}
+
+/// 读取到的跟踪事件
+#[derive(Debug, Clone, Copy)]
+pub struct SchedTraceRecord {
+    pub cpu: ProcessorId,
+    pub ts: u64,
+    pub event: SchedTraceEvent,
+    pub args: [u64; 3],
+}
+
+/// 每个cpu的跟踪缓冲区：只有所在的cpu（关中断时）写入，任何cpu都可以无锁地读取
+#[derive(Debug)]
+struct TraceRing {
+    /// 下一个要写入的序号
+    head: AtomicU64,
+    entries: Vec<TraceEntry>,
+}
+
+impl TraceRing {
+    fn new() -> Self {
+        let mut entries = Vec::with_capacity(SCHED_TRACE_ENTRIES);
+        entries.resize_with(SCHED_TRACE_ENTRIES, TraceEntry::new);
+        return Self {
+            head: AtomicU64::new(0),
+            entries,
+        };
+    }
+
+    /// 写入一个事件，调用者需要关中断
+    fn write(&self, event: SchedTraceEvent, args: [u64; 3]) {
+        let seq = self.head.load(Ordering::Relaxed);
+        let entry = &self.entries[seq as usize & (SCHED_TRACE_ENTRIES - 1)];
+        entry.seq.store(0, Ordering::Relaxed);
+        core::sync::atomic::fence(Ordering::Release);
+        entry.ts.store(ktime_get_ns(), Ordering::Relaxed);
+        entry.event.store(event as u64, Ordering::Relaxed);
+        for (a, v) in entry.args.iter().zip(args) {
+            a.store(v, Ordering::Relaxed);
+        }
+        entry.seq.store(seq + 1, Ordering::Release);
+        self.head.store(seq + 1, Ordering::Release);
+    }
+
+    /// 按照时间顺序读取缓冲区中仍然有效的事件
+    fn read(&self, cpu: ProcessorId, out: &mut Vec<SchedTraceRecord>) {
+        let head = self.head.load(Ordering::Acquire);
+        let start = head.saturating_sub(SCHED_TRACE_ENTRIES as u64);
+        for seq in start..head {
+            let entry = &self.entries[seq as usize & (SCHED_TRACE_ENTRIES - 1)];
+            if entry.seq.load(Ordering::Acquire) != seq + 1 {
+                continue;
+            }
+            let ts = entry.ts.load(Ordering::Relaxed);
+            let event = entry.event.load(Ordering::Relaxed);
+            let args: [u64; 3] = core::array::from_fn(|i| entry.args[i].load(Ordering::Relaxed));
+            core::sync::atomic::fence(Ordering::Acquire);
+            if entry.seq.load(Ordering::Relaxed) != seq + 1 {
+                // 读取期间被覆盖了
+                continue;
+            }
+            let event = match event {
+                1 => SchedTraceEvent::Switch,
+                2 => SchedTraceEvent::Wakeup,
+                _ => continue,
+            };
+            out.push(SchedTraceRecord {
+                cpu,
+                ts,
+                event,
+                args,
+            });
+        }
+    }
+}
+
+/// 全局的调度统计信息
+#[derive(Debug)]
+struct SchedStat {
+    nr_switches: PerCpuCounter,
+    nr_migrations: PerCpuCounter,
+    nr_wakeups: PerCpuCounter,
+    idle_ns: PerCpuCounter,
+    run_delay_ns: PerCpuCounter,
+    wakeup_latency: Vec<PerCpuCounter>,
+    runq_wait: Vec<PerCpuCounter>,
+    trace: Vec<TraceRing>,
+}
+
+/// 初始化调度统计信息。在SMP初始化之后调用，在此之前的事件不会被统计
+pub fn sched_stat_init() {
+    let cpu_num = unsafe { smp_get_total_cpu() } as usize;
+    let counter = || PerCpuCounter::new().expect("sched_stat: per-cpu area exhausted");
+    let hist = || (0..SCHED_HIST_BUCKETS).map(|_| counter()).collect();
+    let mut trace = Vec::with_capacity(cpu_num);
+    trace.resize_with(cpu_num, TraceRing::new);
+
+    SCHED_STAT.init(SchedStat {
+        nr_switches: counter(),
+        nr_migrations: counter(),
+        nr_wakeups: counter(),
+        idle_ns: counter(),
+        run_delay_ns: counter(),
+        wakeup_latency: hist(),
+        runq_wait: hist(),
+        trace,
+    });
+    kinfo!("Sched stat initialized");
+}
+
+impl SchedStat {
+    /// 在当前cpu的跟踪缓冲区中记录一个事件
+    fn trace(&self, event: SchedTraceEvent, args: [u64; 3]) {
+        let cpu = smp_get_processor_id().data() as usize;
+        if let Some(ring) = self.trace.get(cpu) {
+            let _guard = unsafe { CurrentIrqArch::save_and_disable_irq() };
+            ring.write(event, args);
+        }
+    }
+}
+
+#[inline]
+fn state_code(state: ProcessState) -> u64 {
+    return match state {
+        ProcessState::Runnable => 0,
+        ProcessState::Blocked(true) => 1,
+        ProcessState::Blocked(false) => 2,
+        ProcessState::Stopped => 3,
+        ProcessState::Exited(_) => 4,
+    };
+}
+
+/// 状态码对应的字符，与Linux的sched_switch事件相同
+pub fn state_char(code: u64) -> char {
+    return match code {
+        0 => 'R',
+        1 => 'S',
+        2 => 'D',
+        3 => 'T',
+        _ => 'X',
+    };
+}
+
+/// 进程进入运行队列时调用
+#[inline]
+pub fn sched_stat_enqueue(pcb: &Arc<ProcessControlBlock>) {
+    if pcb.pid().into() == 0 {
+        return;
+    }
+    pcb.sched_info()
+        .stat()
+        .last_queued
+        .store(ktime_get_ns(), Ordering::Relaxed);
+}
+
+/// 进程被唤醒之后调用（此时它已经被加入了运行队列）
+pub fn sched_stat_wakeup(pcb: &Arc<ProcessControlBlock>, waker: &Arc<ProcessControlBlock>) {
+    let stat = match SCHED_STAT.try_get() {
+        Some(stat) => stat,
+        None => return,
+    };
+    pcb.sched_info()
+        .stat()
+        .last_wakeup
+        .store(ktime_get_ns(), Ordering::Relaxed);
+    stat.nr_wakeups.this_cpu_inc();
+    let target = pcb
+        .sched_info()
+        .on_cpu()
+        .map_or(u64::MAX, |cpu| cpu.data() as u64);
+    stat.trace(
+        SchedTraceEvent::Wakeup,
+        [pcb.pid().data() as u64, target, waker.pid().data() as u64],
+    );
+}
+
+/// 进程被迁移到另一个cpu时调用
+#[inline]
+pub fn sched_stat_migrate(pcb: &Arc<ProcessControlBlock>) {
+    pcb.sched_info()
+        .stat()
+        .nr_migrations
+        .fetch_add(1, Ordering::Relaxed);
+    if let Some(stat) = SCHED_STAT.try_get() {
+        stat.nr_migrations.this_cpu_inc();
+    }
+}
+
+/// 在进程切换之前调用（需要关中断）
+pub fn sched_stat_switch(prev: &Arc<ProcessControlBlock>, next: &Arc<ProcessControlBlock>) {
+    let stat = match SCHED_STAT.try_get() {
+        Some(stat) => stat,
+        None => return,
+    };
+    let now = ktime_get_ns();
+    stat.nr_switches.this_cpu_inc();
+
+    // prev的运行时间
+    let prev_stat = prev.sched_info().stat();
+    let ran = now.saturating_sub(prev_stat.last_arrival.load(Ordering::Relaxed));
+    prev_stat.run_time_ns.fetch_add(ran, Ordering::Relaxed);
+    if prev.pid().into() == 0 {
+        stat.idle_ns.this_cpu_add(ran);
+    }
+
+    // next在运行队列中等待的时间，以及从被唤醒到开始运行的延迟
+    let next_stat = next.sched_info().stat();
+    let queued = next_stat.last_queued.swap(0, Ordering::Relaxed);
+    if queued != 0 {
+        let delay = now.saturating_sub(queued);
+        next_stat.run_delay_ns.fetch_add(delay, Ordering::Relaxed);
+        next_stat.runq_wait[hist_bucket(delay)].fetch_add(1, Ordering::Relaxed);
+        stat.run_delay_ns.this_cpu_add(delay);
+        stat.runq_wait[hist_bucket(delay)].this_cpu_inc();
+    }
+    let woken = next_stat.last_wakeup.swap(0, Ordering::Relaxed);
+    if woken != 0 {
+        let latency = now.saturating_sub(woken);
+        next_stat.wakeup_latency[hist_bucket(latency)].fetch_add(1, Ordering::Relaxed);
+        stat.wakeup_latency[hist_bucket(latency)].this_cpu_inc();
+    }
+    next_stat.last_arrival.store(now, Ordering::Relaxed);
+    next_stat.pcount.fetch_add(1, Ordering::Relaxed);
+
+    let prev_state = prev.sched_info().inner_lock_read_irqsave().state();
+    stat.trace(
+        SchedTraceEvent::Switch,
+        [
+            prev.pid().data() as u64,
+            state_code(prev_state),
+            next.pid().data() as u64,
+        ],
+    );
+}
+
+/// 生成`/proc/schedstat`的内容
+pub fn sched_stat_show() -> String {
+    let mut s = String::new();
+    let stat = match SCHED_STAT.try_get() {
+        Some(stat) => stat,
+        None => return s,
+    };
+    writeln!(s, "timestamp {}", ktime_get_ns()).ok();
+    writeln!(
+        s,
+        "{:<8}{:>16}{:>16}{:>16}{:>20}{:>20}",
+        "cpu", "switches", "migrations", "wakeups", "idle_ns", "run_delay_ns"
+    )
+    .ok();
+    for cpu in 0..stat.trace.len() {
+        let id = ProcessorId::new(cpu as u32);
+        writeln!(
+            s,
+            "{:<8}{:>16}{:>16}{:>16}{:>20}{:>20}",
+            alloc::format!("cpu{}", cpu),
+            stat.nr_switches.read_cpu(id),
+            stat.nr_migrations.read_cpu(id),
+            stat.nr_wakeups.read_cpu(id),
+            stat.idle_ns.read_cpu(id),
+            stat.run_delay_ns.read_cpu(id),
+        )
+        .ok();
+    }
+
+    let sum = |hist: &Vec<PerCpuCounter>| -> [u64; SCHED_HIST_BUCKETS] {
+        let mut r = [0; SCHED_HIST_BUCKETS];
+        for (i, c) in hist.iter().enumerate() {
+            r[i] = c.sum();
+        }
+        r
+    };
+    s.push_str(&sched_hist_show(
+        "wakeup_latency",
+        &sum(&stat.wakeup_latency),
+    ));
+    s.push_str(&sched_hist_show("runq_wait", &sum(&stat.runq_wait)));
+    return s;
+}
+
+/// 把直方图格式化为`name <=1us:N <=2us:N ... >XXXus:N`的一行
+pub fn sched_hist_show(name: &str, hist: &[u64; SCHED_HIST_BUCKETS]) -> String {
+    let mut s = String::from(name);
+    for (i, count) in hist.iter().enumerate() {
+        match hist_bucket_limit_us(i) {
+            Some(limit) => write!(s, " <{}us:{}", limit, count).ok(),
+            None => write!(s, " >={}us:{}", 1u64 << (i - 1), count).ok(),
+        };
+    }
+    s.push('\n');
+    return s;
+}
+
+/// 生成`/proc/<pid>/schedstat`的内容
+///
+/// 第一行与Linux相同：运行时间（纳秒）、等待时间（纳秒）、被调度的次数
+pub fn task_sched_stat_show(pcb: &Arc<ProcessControlBlock>) -> String {
+    let stat = pcb.sched_info().stat();
+    let mut s = String::new();
+    writeln!(
+        s,
+        "{} {} {}",
+        stat.run_time_ns(),
+        stat.run_delay_ns(),
+        stat.pcount()
+    )
+    .ok();
+    writeln!(s, "migrations {}", stat.nr_migrations()).ok();
+    s.push_str(&sched_hist_show("wakeup_latency", &stat.wakeup_latency()));
+    s.push_str(&sched_hist_show("runq_wait", &stat.runq_wait()));
+    return s;
+}
+
+/// 读取所有cpu的跟踪缓冲区中的事件，按照时间排序
+pub fn sched_trace_records() -> Vec<SchedTraceRecord> {
+    let mut records = Vec::new();
+    if let Some(stat) = SCHED_STAT.try_get() {
+        for (cpu, ring) in stat.trace.iter().enumerate() {
+            ring.read(ProcessorId::new(cpu as u32), &mut records);
+        }
+    }
+    records.sort_by_key(|r| r.ts);
+    return records;
+}
+
+/// 生成`/proc/sched_trace`的内容
+pub fn sched_trace_show() -> String {
+    let mut s = String::new();
+    for r in sched_trace_records() {
+        write!(
+            s,
+            "[{:03}] {}.{:09}: ",
+            r.cpu.data(),
+            r.ts / 1_000_000_000,
+            r.ts % 1_000_000_000
+        )
+        .ok();
+        match r.event {
+            SchedTraceEvent::Switch => writeln!(
+                s,
+                "sched_switch: prev_pid={} prev_state={} ==> next_pid={}",
+                r.args[0],
+                state_char(r.args[1]),
+                r.args[2]
+            )
+            .ok(),
+            SchedTraceEvent::Wakeup => writeln!(
+                s,
+                "sched_wakeup: pid={} target_cpu={:03} waker_pid={}",
+                r.args[0], r.args[1] as i64, r.args[2]
+            )
+            .ok(),
+        };
+    }
+    return s;
+}
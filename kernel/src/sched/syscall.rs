@@ -1,11 +1,24 @@
+use alloc::sync::Arc;
 use system_error::SystemError;
 
 use crate::{
-    arch::CurrentIrqArch, exception::InterruptArch, process::ProcessManager,
-    smp::core::smp_get_processor_id, syscall::Syscall,
+    arch::CurrentIrqArch,
+    exception::InterruptArch,
+    include::bindings::bindings::smp_get_total_cpu,
+    libs::cpumask::CpuMask,
+    process::{Pid, ProcessControlBlock, ProcessManager},
+    smp::core::smp_get_processor_id,
+    syscall::{
+        user_access::{UserBufferReader, UserBufferWriter},
+        Syscall,
+    },
 };
 
-use super::core::{do_sched, CPU_EXECUTING};
+use super::{
+    core::{do_sched, sched_setaffinity, CPU_EXECUTING},
+    rt::__get_rt_scheduler,
+    stat::sched_stat_switch,
+};
 
 impl Syscall {
     /// @brief 让系统立即运行调度器的系统调用
@@ -27,6 +40,9 @@ impl Syscall {
             // kdebug!("sched: current_pcb: {:?}, next_pcb: {:?}\n", current_pcb, next_pcb);
             if current_pcb.pid() != next_pcb.pid() {
                 CPU_EXECUTING.set(smp_get_processor_id(), next_pcb.pid());
+                __get_rt_scheduler().set_cpu_curr(smp_get_processor_id(), &next_pcb);
+                sched_stat_switch(&current_pcb, &next_pcb);
+                next_pcb.sched_info().set_executing(true);
                 unsafe { ProcessManager::switch_process(current_pcb, next_pcb) };
             }
         }
@@ -37,4 +53,69 @@ impl Syscall {
     pub fn sched_yield() -> Result<usize, SystemError> {
         return Syscall::sched(false);
     }
+
+    /// # 设置进程的cpu亲和性
+    ///
+    /// ## 参数
+    ///
+    /// - `pid` - 进程号，0表示当前进程
+    /// - `len` - 用户态cpu位图的字节数
+    /// - `user_mask` - 用户态的cpu位图
+    ///
+    /// ## 返回值
+    ///
+    /// - `Err(SystemError::EINVAL)` - 位图中没有在线的cpu
+    /// - `Err(SystemError::ESRCH)` - 进程不存在
+    pub fn sched_setaffinity(
+        pid: Pid,
+        len: usize,
+        user_mask: *const u8,
+    ) -> Result<usize, SystemError> {
+        let pcb = Self::affinity_target(pid)?;
+        let len = core::cmp::min(len, CpuMask::bytes_len());
+        let reader = UserBufferReader::new(user_mask, len, true)?;
+        let mask = CpuMask::from_bytes(reader.read_from_user::<u8>(0)?);
+
+        sched_setaffinity(&pcb, &mask)?;
+        return Ok(0);
+    }
+
+    /// # 获取进程的cpu亲和性
+    ///
+    /// ## 参数
+    ///
+    /// - `pid` - 进程号，0表示当前进程
+    /// - `len` - 用户态缓冲区的字节数，必须能容纳所有的cpu，并且是usize大小的整数倍
+    /// - `user_mask` - 用户态缓冲区
+    ///
+    /// ## 返回值
+    ///
+    /// 成功时返回写入的字节数
+    pub fn sched_getaffinity(
+        pid: Pid,
+        len: usize,
+        user_mask: *mut u8,
+    ) -> Result<usize, SystemError> {
+        let cpu_num = unsafe { smp_get_total_cpu() } as usize;
+        if len.saturating_mul(8) < cpu_num || len & (core::mem::size_of::<usize>() - 1) != 0 {
+            return Err(SystemError::EINVAL);
+        }
+        let pcb = Self::affinity_target(pid)?;
+
+        let size = core::cmp::min(len, CpuMask::bytes_len());
+        let mut writer = UserBufferWriter::new(user_mask, size, true)?;
+        let written = pcb
+            .sched_info()
+            .cpus_allowed()
+            .to_bytes(writer.buffer::<u8>(0)?);
+
+        return Ok(written);
+    }
+
+    fn affinity_target(pid: Pid) -> Result<Arc<ProcessControlBlock>, SystemError> {
+        if pid.data() == 0 {
+            return Ok(ProcessManager::current_pcb());
+        }
+        return ProcessManager::find(pid).ok_or(SystemError::ESRCH);
+    }
 }
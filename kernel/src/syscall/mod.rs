@@ -7,7 +7,10 @@ use core::{
 use crate::{
     arch::{ipc::signal::SigSet, syscall::nr::*},
     driver::base::device::device_number::DeviceNumber,
-    libs::{futex::constant::FutexFlag, rand::GRandFlags},
+    libs::{
+        futex::constant::{FutexArg, FutexFlag},
+        rand::GRandFlags,
+    },
     mm::syscall::MremapFlags,
     net::syscall::MsgHdr,
     process::{
@@ -26,11 +29,12 @@ use crate::{
     filesystem::vfs::{
         fcntl::{AtFlags, FcntlCommand},
         file::FileMode,
+        page_cache::page_cache_sync_all,
         syscall::{ModeType, PosixKstat},
         MAX_PATHLEN,
     },
     include::bindings::bindings::PAGE_4K_SIZE,
-    kinfo,
+    kerror, kinfo,
     libs::align::page_align_up,
     mm::{verify_area, MemoryManagementArch, VirtAddr},
     net::syscall::SockAddr,
@@ -670,8 +674,11 @@ impl Syscall {
                 verify_area(uaddr, core::mem::size_of::<u32>())?;
                 verify_area(uaddr2, core::mem::size_of::<u32>())?;
 
+                let cmd = FutexArg::from_bits(operation.bits() & FutexFlag::FUTEX_CMD_MASK.bits())
+                    .ok_or(SystemError::ENOSYS)?;
+
                 let mut timespec = None;
-                if utime != 0 && operation.contains(FutexFlag::FLAGS_HAS_TIMEOUT) {
+                if utime != 0 && cmd.has_timeout() {
                     let reader = UserBufferReader::new(
                         utime as *const TimeSpec,
                         core::mem::size_of::<TimeSpec>(),
@@ -897,10 +904,12 @@ impl Syscall {
             }
 
             SYS_FSYNC => {
-                kwarn!("SYS_FSYNC has not yet been implemented");
-                Ok(0)
+                let fd = args[0] as i32;
+                Self::fsync(fd)
             }
 
+            SYS_SYNC => Self::sync(),
+
             #[cfg(target_arch = "x86_64")]
             SYS_CHMOD => {
                 let pathname = args[0] as *const u8;
@@ -920,9 +929,17 @@ impl Syscall {
             }
 
             SYS_SCHED_GETAFFINITY => {
-                // todo: 这个系统调用还没有实现
+                let pid = Pid::new(args[0]);
+                let len = args[1];
+                let user_mask = args[2] as *mut u8;
+                Self::sched_getaffinity(pid, len, user_mask)
+            }
 
-                Err(SystemError::ENOSYS)
+            SYS_SCHED_SETAFFINITY => {
+                let pid = Pid::new(args[0]);
+                let len = args[1];
+                let user_mask = args[2] as *const u8;
+                Self::sched_setaffinity(pid, len, user_mask)
             }
 
             #[cfg(target_arch = "x86_64")]
@@ -986,6 +1003,10 @@ impl Syscall {
     }
 
     pub fn reboot() -> Result<usize, SystemError> {
+        // 重启之前把页缓存中的脏页写回磁盘
+        if let Err(e) = page_cache_sync_all() {
+            kerror!("reboot: failed to sync page cache: {:?}", e);
+        }
         unsafe { cpu_reset() };
     }
 }
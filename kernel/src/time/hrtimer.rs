@@ -0,0 +1,201 @@
+//! 高精度定时器
+//!
+//! 时间轮的精度受限于时钟中断的频率（HZ），无法满足微秒级的定时需求。
+//! 高精度定时器以纳秒为单位，按照到期时间保存在每个cpu的红黑树中，
+//! 由本地时钟事件设备（例如x86_64的APIC定时器）在单次触发模式下，
+//! 在最早的定时器到期的时刻产生中断，并在硬中断上下文中执行到期的定时器。
+
+use alloc::{boxed::Box, sync::Arc, vec::Vec};
+use core::intrinsics::unlikely;
+
+use crate::{
+    arch::CurrentTimeArch,
+    include::bindings::bindings::MAX_CPU_NUM,
+    kerror,
+    libs::{
+        rbtree::RBTree,
+        spinlock::{SpinLock, SpinLockGuard},
+    },
+    smp::{core::smp_get_processor_id, cpu::ProcessorId},
+};
+
+use super::{tick::tick_program_next_event, timer::TimerFunction, TimeArch};
+
+/// 红黑树中的键：(到期时间, 序号)。序号保证到期时间相同的定时器按照加入的先后顺序触发
+type HrTimerKey = (u64, u64);
+
+lazy_static! {
+    /// 每个cpu的高精度定时器队列
+    static ref HRTIMER_BASES: Vec<SpinLock<HrTimerBase>> = {
+        let mut bases = Vec::with_capacity(MAX_CPU_NUM as usize);
+        for _ in 0..MAX_CPU_NUM {
+            bases.push(SpinLock::new(HrTimerBase::new()));
+        }
+        bases
+    };
+}
+
+/// 获取单调递增的时间（单位：纳秒）
+#[inline]
+pub fn ktime_get_ns() -> u64 {
+    return CurrentTimeArch::cycles2ns(CurrentTimeArch::get_cycles()) as u64;
+}
+
+#[derive(Debug)]
+struct HrTimerBase {
+    timers: RBTree<HrTimerKey, Arc<HrTimer>>,
+    next_seq: u64,
+}
+
+impl HrTimerBase {
+    fn new() -> Self {
+        return Self {
+            timers: RBTree::new(),
+            next_seq: 0,
+        };
+    }
+
+    fn first_expires(&self) -> Option<u64> {
+        return self.timers.get_first().map(|(key, _)| key.0);
+    }
+}
+
+#[derive(Debug)]
+pub struct HrTimer {
+    inner: SpinLock<InnerHrTimer>,
+}
+
+#[derive(Debug)]
+pub struct InnerHrTimer {
+    /// 到期时间（单位：纳秒，与ktime_get_ns()使用相同的时间基准）
+    expires_ns: u64,
+    /// 定时器需要执行的函数结构体
+    func: Option<Box<dyn TimerFunction>>,
+    /// 判断该计时器是否触发
+    triggered: bool,
+    /// 定时器所在的cpu以及它在红黑树中的键，None表示不在队列中
+    pos: Option<(ProcessorId, HrTimerKey)>,
+}
+
+impl HrTimer {
+    /// 创建一个高精度定时器
+    ///
+    /// ## 参数
+    ///
+    /// - `func` - 定时器到期时执行的函数。它在硬中断上下文中执行，不能睡眠
+    /// - `expires_ns` - 到期时间（单位：纳秒，参见`ktime_get_ns()`）
+    pub fn new(func: Box<dyn TimerFunction>, expires_ns: u64) -> Arc<Self> {
+        return Arc::new(HrTimer {
+            inner: SpinLock::new(InnerHrTimer {
+                expires_ns,
+                func: Some(func),
+                triggered: false,
+                pos: None,
+            }),
+        });
+    }
+
+    fn inner(&self) -> SpinLockGuard<InnerHrTimer> {
+        return self.inner.lock_irqsave();
+    }
+
+    /// 在当前cpu上启动定时器
+    ///
+    /// 如果它成为了当前cpu上最早到期的定时器，则重新设置时钟事件设备。
+    pub fn start(self: &Arc<Self>) {
+        self.cancel();
+        let cpu = smp_get_processor_id();
+        let mut base = HRTIMER_BASES[cpu.data() as usize].lock_irqsave();
+        let mut inner = self.inner();
+        let key = (inner.expires_ns, base.next_seq);
+        base.next_seq += 1;
+        inner.pos = Some((cpu, key));
+        drop(inner);
+
+        let is_first = base.first_expires().map_or(true, |first| key.0 < first);
+        base.timers.insert(key, self.clone());
+        drop(base);
+
+        if is_first {
+            tick_program_next_event();
+        }
+    }
+
+    /// 修改到期时间并重新启动定时器
+    pub fn restart(self: &Arc<Self>, expires_ns: u64) {
+        self.cancel();
+        self.inner().expires_ns = expires_ns;
+        self.start();
+    }
+
+    /// ## 取消定时器
+    ///
+    /// ## 返回值
+    ///
+    /// 定时器是否在取消之前处于等待状态
+    pub fn cancel(&self) -> bool {
+        loop {
+            let pos = self.inner().pos;
+            let (cpu, key) = match pos {
+                Some(pos) => pos,
+                None => return false,
+            };
+
+            // 加锁顺序与start()相同：先锁队列，再锁定时器
+            let mut base = HRTIMER_BASES[cpu.data() as usize].lock_irqsave();
+            let mut inner = self.inner();
+            if inner.pos != Some((cpu, key)) {
+                // 加锁期间定时器已经触发或者被重新启动
+                continue;
+            }
+            inner.pos = None;
+            base.timers.remove(&key);
+            return true;
+        }
+    }
+
+    /// ## 判断定时器是否已经触发
+    pub fn timeout(&self) -> bool {
+        return self.inner().triggered;
+    }
+
+    fn run(&self) {
+        let mut inner = self.inner();
+        inner.triggered = true;
+        let func = inner.func.take();
+        drop(inner);
+        let r = func.map(|mut f| f.run()).unwrap_or(Ok(()));
+        if unlikely(r.is_err()) {
+            kerror!(
+                "Failed to run hrtimer function: {self:?} {:?}",
+                r.as_ref().err().unwrap()
+            );
+        }
+    }
+}
+
+/// 获取指定cpu上最早到期的高精度定时器的到期时间（单位：纳秒）
+pub fn hrtimer_next_expire(cpu: ProcessorId) -> Option<u64> {
+    return HRTIMER_BASES[cpu.data() as usize]
+        .lock_irqsave()
+        .first_expires();
+}
+
+/// 在时钟事件中断中调用：执行当前cpu上所有已经到期的高精度定时器
+pub fn hrtimer_interrupt() {
+    let cpu = smp_get_processor_id();
+    loop {
+        let now = ktime_get_ns();
+        let mut base = HRTIMER_BASES[cpu.data() as usize].lock_irqsave();
+        match base.first_expires() {
+            Some(expires) if expires <= now => {}
+            _ => return,
+        }
+        let (_, timer) = base.timers.pop_first().unwrap();
+        timer.inner().pos = None;
+        drop(base);
+
+        // 执行定时器函数时不持有队列的锁，定时器函数可以启动新的定时器
+        timer.run();
+    }
+}
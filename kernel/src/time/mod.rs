@@ -9,9 +9,11 @@ use crate::arch::CurrentTimeArch;
 use self::timekeep::ktime_get_real_ns;
 
 pub mod clocksource;
+pub mod hrtimer;
 pub mod jiffies;
 pub mod sleep;
 pub mod syscall;
+pub mod tick;
 pub mod timeconv;
 pub mod timekeep;
 pub mod timekeeping;
@@ -425,4 +427,10 @@ impl From<Duration> for smoltcp::time::Duration {
 pub trait TimeArch {
     /// Get CPU cycles (Read from register)
     fn get_cycles() -> usize;
+
+    /// 将CPU时钟周期数转换为纳秒
+    fn cycles2ns(cycles: usize) -> usize;
+
+    /// 设置当前cpu的本地时钟事件设备，在delta_ns纳秒之后产生一次时钟中断
+    fn set_next_event(delta_ns: u64);
 }
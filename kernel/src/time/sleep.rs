@@ -4,36 +4,43 @@ use alloc::{boxed::Box, sync::Arc};
 use system_error::SystemError;
 
 use crate::{
-    arch::{sched::sched, CurrentIrqArch, CurrentTimeArch},
+    arch::{sched::sched, CurrentIrqArch},
     exception::InterruptArch,
-    include::bindings::bindings::{useconds_t, Cpu_tsc_freq},
+    include::bindings::bindings::useconds_t,
     process::ProcessManager,
     time::timekeeping::getnstimeofday,
 };
 
 use super::{
-    timer::{next_n_us_timer_jiffies, Timer, WakeUpHelper},
-    TimeArch, TimeSpec,
+    hrtimer::{ktime_get_ns, HrTimer},
+    timer::WakeUpHelper,
+    TimeSpec, NSEC_PER_SEC,
 };
 
+/// 短于这个时间（单位：纳秒）的休眠直接忙等，因为进程切换本身的开销与之相当
+const NANOSLEEP_SPIN_NS: u64 = 10000;
+
 /// @brief 休眠指定时间（单位：纳秒）
 ///
+/// 使用高精度定时器进行定时，精度不受时钟中断频率的限制
+///
 /// @param sleep_time 指定休眠的时间
 ///
 /// @return Ok(TimeSpec) 剩余休眠时间
 ///
 /// @return Err(SystemError) 错误码
 pub fn nanosleep(sleep_time: TimeSpec) -> Result<TimeSpec, SystemError> {
-    if sleep_time.tv_nsec < 0 || sleep_time.tv_nsec >= 1000000000 {
+    if sleep_time.tv_nsec < 0 || sleep_time.tv_nsec >= NSEC_PER_SEC as i64 || sleep_time.tv_sec < 0
+    {
         return Err(SystemError::EINVAL);
     }
-    // 对于小于500us的时间，使用spin/rdtsc来进行定时
-    if sleep_time.tv_nsec < 500000 && sleep_time.tv_sec == 0 {
-        let expired_tsc: u64 = unsafe {
-            CurrentTimeArch::get_cycles() as u64
-                + (sleep_time.tv_nsec as u64 * Cpu_tsc_freq) / 1000000000
-        };
-        while (CurrentTimeArch::get_cycles() as u64) < expired_tsc {
+    let total_sleep_time_ns: u64 = (sleep_time.tv_sec as u64)
+        .saturating_mul(NSEC_PER_SEC as u64)
+        .saturating_add(sleep_time.tv_nsec as u64);
+
+    if total_sleep_time_ns < NANOSLEEP_SPIN_NS {
+        let expires = ktime_get_ns() + total_sleep_time_ns;
+        while ktime_get_ns() < expires {
             spin_loop()
         }
         return Ok(TimeSpec {
@@ -42,22 +49,24 @@ pub fn nanosleep(sleep_time: TimeSpec) -> Result<TimeSpec, SystemError> {
         });
     }
 
-    let total_sleep_time_us: u64 =
-        sleep_time.tv_sec as u64 * 1000000 + sleep_time.tv_nsec as u64 / 1000;
     // 创建定时器
     let handler: Box<WakeUpHelper> = WakeUpHelper::new(ProcessManager::current_pcb());
-    let timer: Arc<Timer> = Timer::new(handler, next_n_us_timer_jiffies(total_sleep_time_us));
+    let timer: Arc<HrTimer> =
+        HrTimer::new(handler, ktime_get_ns().saturating_add(total_sleep_time_ns));
 
     let irq_guard: crate::exception::IrqFlagsGuard =
         unsafe { CurrentIrqArch::save_and_disable_irq() };
     ProcessManager::mark_sleep(true).ok();
 
     let start_time = getnstimeofday();
-    timer.activate();
+    timer.start();
 
     drop(irq_guard);
     sched();
 
+    // 被提前唤醒（例如收到信号）时，定时器还在等待
+    timer.cancel();
+
     let end_time = getnstimeofday();
     // 返回正确的剩余时间
     let real_sleep_time = end_time - start_time;
@@ -0,0 +1,194 @@
+//! 时钟中断的模拟与NO_HZ空闲
+//!
+//! 本地时钟事件设备工作在单次触发模式下，每次中断之后都由这里计算下一次中断的时刻：
+//! 下一个周期性时钟中断（tick）与最早的高精度定时器二者中较早的那一个。
+//!
+//! cpu进入空闲状态时，如果近期没有定时器到期，则停止周期性的时钟中断，
+//! 只在时间轮或者高精度定时器中的下一个定时器到期时唤醒cpu（NO_HZ空闲）。
+//! cpu退出空闲状态时恢复周期性的时钟中断。
+
+use alloc::vec::Vec;
+
+use crate::{
+    arch::CurrentTimeArch,
+    include::bindings::bindings::MAX_CPU_NUM,
+    libs::spinlock::SpinLock,
+    sched::core::sched_update_jiffies,
+    smp::{core::smp_get_processor_id, cpu::ProcessorId, kick_cpu},
+};
+
+use super::{
+    clocksource::HZ,
+    hrtimer::{hrtimer_interrupt, hrtimer_next_expire, ktime_get_ns},
+    timer::{clock, run_local_timers, timer_next_expire},
+    TimeArch, NSEC_PER_SEC, NSEC_PER_USEC,
+};
+
+/// 周期性时钟中断的间隔（单位：纳秒）
+pub const TICK_NSEC: u64 = NSEC_PER_SEC as u64 / HZ;
+/// 时钟事件设备能够设置的最小间隔（单位：纳秒）
+const MIN_DELTA_NS: u64 = 1000;
+/// 停止时钟中断之后，cpu最长的空闲时间（单位：纳秒）
+const NOHZ_MAX_IDLE_NS: u64 = NSEC_PER_SEC as u64;
+
+lazy_static! {
+    static ref TICK_SCHED: Vec<SpinLock<TickSched>> = {
+        let mut ts = Vec::with_capacity(MAX_CPU_NUM as usize);
+        for _ in 0..MAX_CPU_NUM {
+            ts.push(SpinLock::new(TickSched::new()));
+        }
+        ts
+    };
+}
+
+/// 每个cpu的时钟中断状态
+#[derive(Debug)]
+struct TickSched {
+    /// 本地时钟事件设备是否已经切换到单次触发模式
+    active: bool,
+    /// 下一个周期性时钟中断的时刻（单位：纳秒）
+    next_tick: u64,
+    /// 是否已经停止了周期性的时钟中断
+    stopped: bool,
+    /// 停止时钟中断期间，下一次需要唤醒cpu的时刻（单位：纳秒）
+    idle_expires: u64,
+}
+
+impl TickSched {
+    const fn new() -> Self {
+        Self {
+            active: false,
+            next_tick: 0,
+            stopped: false,
+            idle_expires: 0,
+        }
+    }
+
+    /// 下一次需要产生时钟中断的时刻（不考虑高精度定时器）
+    fn next_event(&self) -> u64 {
+        if self.stopped {
+            return self.idle_expires;
+        }
+        return self.next_tick;
+    }
+}
+
+/// 在本地时钟事件设备切换到单次触发模式之后调用，开始在当前cpu上模拟周期性的时钟中断
+pub fn tick_setup_local() {
+    let cpu = smp_get_processor_id();
+    let mut ts = TICK_SCHED[cpu.data() as usize].lock_irqsave();
+    ts.active = true;
+    ts.stopped = false;
+    ts.next_tick = ktime_get_ns() + TICK_NSEC;
+    drop(ts);
+    tick_program_next_event();
+}
+
+/// 根据下一个tick和最早的高精度定时器，设置当前cpu的时钟事件设备
+pub fn tick_program_next_event() {
+    let cpu = smp_get_processor_id();
+    let ts = TICK_SCHED[cpu.data() as usize].lock_irqsave();
+    if !ts.active {
+        // 时钟事件设备尚未初始化，第一次设置时会把高精度定时器考虑进去
+        return;
+    }
+    let mut next = ts.next_event();
+    if let Some(expires) = hrtimer_next_expire(cpu) {
+        next = next.min(expires);
+    }
+    let delta = next.saturating_sub(ktime_get_ns()).max(MIN_DELTA_NS);
+    CurrentTimeArch::set_next_event(delta);
+    drop(ts);
+}
+
+/// 本地时钟事件设备的中断处理函数
+///
+/// 请注意，该函数只能被时钟中断处理程序调用
+pub fn tick_handle_event() {
+    let cpu = smp_get_processor_id();
+    let now = ktime_get_ns();
+    let mut ts = TICK_SCHED[cpu.data() as usize].lock_irqsave();
+    if ts.stopped && now >= ts.idle_expires {
+        // 空闲期间等待的定时器到期了，恢复周期性的时钟中断，直到cpu再次进入空闲状态
+        ts.stopped = false;
+        ts.next_tick = now;
+    }
+    let do_tick = !ts.stopped && now >= ts.next_tick;
+    if do_tick {
+        // 中断被推迟时，跳过已经错过的tick，而不是连续补上
+        ts.next_tick += ((now - ts.next_tick) / TICK_NSEC + 1) * TICK_NSEC;
+    }
+    drop(ts);
+
+    if do_tick {
+        sched_update_jiffies();
+        run_local_timers();
+    }
+
+    hrtimer_interrupt();
+    tick_program_next_event();
+}
+
+/// cpu即将进入空闲状态时调用（需要关中断）：如果近期没有定时器到期，则停止周期性的时钟中断
+pub fn tick_nohz_idle_enter() {
+    let cpu = smp_get_processor_id();
+    let mut ts = TICK_SCHED[cpu.data() as usize].lock_irqsave();
+    if !ts.active || ts.stopped {
+        return;
+    }
+
+    let now = ktime_get_ns();
+    // 时间轮中的定时器以jiffies（微秒）为单位
+    let delta = match timer_next_expire(cpu) {
+        Some(expires) => {
+            (expires.saturating_sub(clock()) * NSEC_PER_USEC as u64).min(NOHZ_MAX_IDLE_NS)
+        }
+        None => NOHZ_MAX_IDLE_NS,
+    };
+    if delta < 2 * TICK_NSEC {
+        // 下一个定时器马上就要到期，停止时钟中断没有意义
+        return;
+    }
+    ts.stopped = true;
+    ts.idle_expires = now + delta;
+    drop(ts);
+    tick_program_next_event();
+}
+
+/// cpu退出空闲状态时调用：恢复周期性的时钟中断
+pub fn tick_nohz_idle_exit() {
+    let cpu = smp_get_processor_id();
+    let mut ts = TICK_SCHED[cpu.data() as usize].lock_irqsave();
+    if !ts.stopped {
+        return;
+    }
+    ts.stopped = false;
+    ts.next_tick = ktime_get_ns() + TICK_NSEC;
+    drop(ts);
+    tick_program_next_event();
+}
+
+/// 向其他cpu的时间轮中加入定时器之后调用
+///
+/// 如果那个cpu停止了时钟中断，并且要在定时器到期之后才会被唤醒，则唤醒它，让它按照新的定时器重新计算空闲时间。
+/// 否则定时器最多可能被推迟`NOHZ_MAX_IDLE_NS`才执行
+///
+/// ## 参数
+///
+/// - `cpu` - 时间轮所属的cpu
+/// - `expire_jiffies` - 定时器的到期时间（单位：jiffies）
+pub fn tick_nohz_timer_added(cpu: ProcessorId, expire_jiffies: u64) {
+    if cpu == smp_get_processor_id() {
+        return;
+    }
+    // tick_nohz_idle_enter持有这把锁读取时间轮，因此要么它能看到新的定时器，要么这里能看到它停止了时钟中断
+    let ts = TICK_SCHED[cpu.data() as usize].lock_irqsave();
+    if !ts.stopped {
+        return;
+    }
+    let expires = ktime_get_ns() + expire_jiffies.saturating_sub(clock()) * NSEC_PER_USEC as u64;
+    if expires < ts.idle_expires {
+        drop(ts);
+        kick_cpu(cpu).ok();
+    }
+}
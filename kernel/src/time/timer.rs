@@ -1,13 +1,14 @@
 use core::{
+    cmp::max,
     fmt::Debug,
     intrinsics::unlikely,
-    sync::atomic::{compiler_fence, AtomicBool, AtomicU64, Ordering},
+    sync::atomic::{compiler_fence, AtomicU64, Ordering},
 };
 
 use alloc::{
     boxed::Box,
-    collections::LinkedList,
     sync::{Arc, Weak},
+    vec::Vec,
 };
 use system_error::SystemError;
 
@@ -17,19 +18,44 @@ use crate::{
         softirq::{softirq_vectors, SoftirqNumber, SoftirqVec},
         InterruptArch,
     },
+    include::bindings::bindings::MAX_CPU_NUM,
     kerror, kinfo,
-    libs::spinlock::{SpinLock, SpinLockGuard},
+    libs::spinlock::{LockClass, SpinLock, SpinLockGuard},
     process::{ProcessControlBlock, ProcessManager},
+    smp::{core::smp_get_processor_id, cpu::ProcessorId},
 };
 
-use super::timekeeping::update_wall_time;
+use super::{tick::tick_nohz_timer_added, timekeeping::update_wall_time};
 
 const MAX_TIMEOUT: i64 = i64::MAX;
-const TIMER_RUN_CYCLE_THRESHOLD: usize = 20;
 static TIMER_JIFFIES: AtomicU64 = AtomicU64::new(0);
 
+/// 时间轮的精度：一个刻度对应2^TIMER_WHEEL_SHIFT个jiffies（约1ms）
+const TIMER_WHEEL_SHIFT: u64 = 10;
+/// 第一级时间轮的槽位数为2^TVR_BITS
+const TVR_BITS: u64 = 8;
+/// 其余每一级时间轮的槽位数为2^TVN_BITS
+const TVN_BITS: u64 = 6;
+const TVR_SIZE: usize = 1 << TVR_BITS;
+const TVN_SIZE: usize = 1 << TVN_BITS;
+const TVR_MASK: u64 = (TVR_SIZE - 1) as u64;
+const TVN_MASK: u64 = (TVN_SIZE - 1) as u64;
+/// 除第一级以外，时间轮的级数
+const TVN_LEVELS: u64 = 4;
+/// 时间轮能够表示的最大时长（刻度），更远的定时器先放在最后一级，到期前会被重新分配
+const MAX_WHEEL_DELTA: u64 = (1 << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1;
+
+static TIMER_WHEEL_LOCK_CLASS: LockClass = LockClass::new("timer_wheel");
+
 lazy_static! {
-    pub static ref TIMER_LIST: SpinLock<LinkedList<Arc<Timer>>> = SpinLock::new(LinkedList::new());
+    /// 每个cpu的时间轮
+    static ref TIMER_WHEELS: Vec<SpinLock<TimerWheel>> = {
+        let mut wheels = Vec::with_capacity(MAX_CPU_NUM as usize);
+        for _ in 0..MAX_CPU_NUM {
+            wheels.push(SpinLock::new_with_class(TimerWheel::new(), &TIMER_WHEEL_LOCK_CLASS));
+        }
+        wheels
+    };
 }
 
 /// 定时器要执行的函数的特征
@@ -76,6 +102,8 @@ impl Timer {
                 timer_func: Some(timer_func),
                 self_ref: Weak::default(),
                 triggered: false,
+                pinned_cpu: None,
+                pos: None,
             }),
         });
 
@@ -88,35 +116,106 @@ impl Timer {
         return self.inner.lock_irqsave();
     }
 
-    /// @brief 将定时器插入到定时器链表中
+    /// @brief 将定时器加入时间轮
+    ///
+    /// 如果定时器被固定在某个cpu上，则加入那个cpu的时间轮，否则加入当前cpu的时间轮。
+    /// 如果定时器已经在时间轮中，则按照新的到期时间重新加入
     pub fn activate(&self) {
-        let mut timer_list = TIMER_LIST.lock_irqsave();
-        let inner_guard = self.inner();
+        let cpu = self.inner().pinned_cpu.unwrap_or(smp_get_processor_id());
+        self.activate_on(cpu);
+    }
 
-        // 链表为空，则直接插入
-        if timer_list.is_empty() {
-            // FIXME push_timer
+    /// 将定时器加入指定cpu的时间轮，由该cpu执行定时器函数
+    pub fn activate_on(&self, cpu: ProcessorId) {
+        let this = self.inner().self_ref.upgrade().unwrap();
+        self.detach();
 
-            timer_list.push_back(inner_guard.self_ref.upgrade().unwrap());
+        let mut wheel = TIMER_WHEELS[cpu.data() as usize].lock_irqsave();
+        let mut inner_guard = self.inner();
+        let expire_jiffies = inner_guard.expire_jiffies;
+        wheel.insert(this, &mut inner_guard, cpu);
+        drop(inner_guard);
+        drop(wheel);
+        tick_nohz_timer_added(cpu, expire_jiffies);
+    }
 
-            drop(inner_guard);
-            drop(timer_list);
-            compiler_fence(Ordering::SeqCst);
+    /// 把定时器固定在指定的cpu上（None表示不固定）。
+    ///
+    /// 如果定时器已经在其它cpu的时间轮中，那么把它迁移到指定的cpu上
+    pub fn pin_to(&self, cpu: Option<ProcessorId>) {
+        self.inner().pinned_cpu = cpu;
+        if let Some(cpu) = cpu {
+            self.migrate(cpu);
+        }
+    }
 
-            return;
+    /// 把尚未到期的定时器迁移到指定cpu的时间轮中
+    ///
+    /// ## 返回值
+    ///
+    /// 定时器是否在时间轮中（未到期、未被取消）
+    pub fn migrate(&self, cpu: ProcessorId) -> bool {
+        let this = self.inner().self_ref.upgrade().unwrap();
+        loop {
+            let old_cpu = match self.inner().pos {
+                Some(pos) => pos.cpu,
+                None => return false,
+            };
+            if old_cpu == cpu {
+                return true;
+            }
+
+            // 按照cpu号从小到大的顺序加锁
+            let (mut old_wheel, mut new_wheel) = if old_cpu < cpu {
+                let old = TIMER_WHEELS[old_cpu.data() as usize].lock_irqsave();
+                let new = TIMER_WHEELS[cpu.data() as usize].lock_irqsave();
+                (old, new)
+            } else {
+                let new = TIMER_WHEELS[cpu.data() as usize].lock_irqsave();
+                let old = TIMER_WHEELS[old_cpu.data() as usize].lock_irqsave();
+                (old, new)
+            };
+            let mut inner_guard = self.inner();
+            match inner_guard.pos {
+                Some(pos) if pos.cpu == old_cpu => {
+                    old_wheel.remove(pos);
+                    inner_guard.pos = None;
+                    let expire_jiffies = inner_guard.expire_jiffies;
+                    new_wheel.insert(this, &mut inner_guard, cpu);
+                    drop(inner_guard);
+                    drop(new_wheel);
+                    drop(old_wheel);
+                    tick_nohz_timer_added(cpu, expire_jiffies);
+                    return true;
+                }
+                // 加锁期间，定时器到期、被取消或者被迁移了
+                _ => continue,
+            }
         }
-        let mut split_pos: usize = 0;
-        for (pos, elt) in timer_list.iter().enumerate() {
-            if elt.inner().expire_jiffies > inner_guard.expire_jiffies {
-                split_pos = pos;
-                break;
+    }
+
+    /// 把定时器从时间轮中移除
+    ///
+    /// ## 返回值
+    ///
+    /// 定时器是否在时间轮中
+    fn detach(&self) -> bool {
+        loop {
+            let cpu = match self.inner().pos {
+                Some(pos) => pos.cpu,
+                None => return false,
+            };
+            let mut wheel = TIMER_WHEELS[cpu.data() as usize].lock_irqsave();
+            let mut inner_guard = self.inner();
+            match inner_guard.pos {
+                Some(pos) if pos.cpu == cpu => {
+                    wheel.remove(pos);
+                    inner_guard.pos = None;
+                    return true;
+                }
+                _ => continue,
             }
         }
-        let mut temp_list: LinkedList<Arc<Timer>> = timer_list.split_off(split_pos);
-        timer_list.push_back(inner_guard.self_ref.upgrade().unwrap());
-        timer_list.append(&mut temp_list);
-        drop(inner_guard);
-        drop(timer_list);
     }
 
     #[inline]
@@ -140,13 +239,12 @@ impl Timer {
     }
 
     /// ## 取消定时器任务
+    ///
+    /// ## 返回值
+    ///
+    /// 定时器是否在取消之前处于等待状态
     pub fn cancel(&self) -> bool {
-        let this_arc = self.inner().self_ref.upgrade().unwrap();
-        TIMER_LIST
-            .lock_irqsave()
-            .extract_if(|x| Arc::ptr_eq(&this_arc, x))
-            .for_each(drop);
-        true
+        return self.detach();
     }
 }
 
@@ -161,74 +259,267 @@ pub struct InnerTimer {
     self_ref: Weak<Timer>,
     /// 判断该计时器是否触发
     triggered: bool,
+    /// 定时器被固定在哪个cpu上
+    pinned_cpu: Option<ProcessorId>,
+    /// 定时器在时间轮中的位置，None表示不在时间轮中
+    pos: Option<TimerPos>,
 }
 
+/// 定时器在时间轮中的位置
+#[derive(Debug, Clone, Copy)]
+struct TimerPos {
+    cpu: ProcessorId,
+    /// 槽位的编号（各级时间轮的槽位依次编号）
+    bucket: usize,
+    /// 在槽位中的下标
+    index: usize,
+}
+
+/// 一个cpu的分级时间轮
+///
+/// 第一级有TVR_SIZE个槽位，每个槽位对应一个刻度；第n级（n>=1）的每个槽位对应
+/// 2^(TVR_BITS+(n-1)*TVN_BITS)个刻度。第一级时间轮转完一圈时，把上一级的下一个槽位中的
+/// 定时器重新分配（cascade）到下面的时间轮中。插入和删除的时间复杂度都是O(1)。
 #[derive(Debug)]
-pub struct DoTimerSoftirq {
-    running: AtomicBool,
+struct TimerWheel {
+    /// 下一个要处理的刻度
+    clk: u64,
+    /// 所有的槽位
+    buckets: Vec<Vec<Arc<Timer>>>,
+    /// 时间轮中定时器的数量
+    nr_timers: usize,
 }
 
-impl DoTimerSoftirq {
-    pub fn new() -> Self {
-        return DoTimerSoftirq {
-            running: AtomicBool::new(false),
+impl TimerWheel {
+    fn new() -> Self {
+        let mut buckets = Vec::new();
+        buckets.resize_with(TVR_SIZE + TVN_LEVELS as usize * TVN_SIZE, Vec::new);
+        return Self {
+            clk: 0,
+            buckets,
+            nr_timers: 0,
         };
     }
 
-    fn set_run(&self) -> bool {
-        let x = self
-            .running
-            .compare_exchange(false, true, Ordering::Acquire, Ordering::Relaxed);
-        return x.is_ok();
+    /// jiffies对应的刻度（向上取整，保证定时器不会提前触发）
+    #[inline]
+    fn jiffies_to_tick(jiffies: u64) -> u64 {
+        return (jiffies >> TIMER_WHEEL_SHIFT)
+            + ((jiffies & ((1 << TIMER_WHEEL_SHIFT) - 1)) != 0) as u64;
     }
 
-    fn clear_run(&self) {
-        self.running.store(false, Ordering::Release);
+    /// 计算在指定刻度到期的定时器应该放在哪个槽位
+    fn bucket_of(&self, expires: u64) -> usize {
+        if expires < self.clk {
+            // 已经到期，放在下一个要处理的槽位
+            return (self.clk & TVR_MASK) as usize;
+        }
+        let mut delta = expires - self.clk;
+        let mut expires = expires;
+        if delta < TVR_SIZE as u64 {
+            return (expires & TVR_MASK) as usize;
+        }
+        if delta > MAX_WHEEL_DELTA {
+            delta = MAX_WHEEL_DELTA;
+            expires = self.clk + delta;
+        }
+        let mut level = 0;
+        while level < TVN_LEVELS - 1 && delta >= 1 << (TVR_BITS + (level + 1) * TVN_BITS) {
+            level += 1;
+        }
+        let shift = TVR_BITS + level * TVN_BITS;
+        return TVR_SIZE + level as usize * TVN_SIZE + ((expires >> shift) & TVN_MASK) as usize;
     }
-}
-impl SoftirqVec for DoTimerSoftirq {
-    fn run(&self) {
-        if !self.set_run() {
-            return;
+
+    fn insert(&mut self, timer: Arc<Timer>, inner: &mut InnerTimer, cpu: ProcessorId) {
+        if self.nr_timers == 0 {
+            // 空闲的时间轮可能很久没有处理了，直接跳到当前时刻
+            self.clk = max(self.clk, clock() >> TIMER_WHEEL_SHIFT);
         }
-        // 最多只处理TIMER_RUN_CYCLE_THRESHOLD个计时器
-        for _ in 0..TIMER_RUN_CYCLE_THRESHOLD {
-            // kdebug!("DoTimerSoftirq run");
-            let timer_list = TIMER_LIST.try_lock_irqsave();
-            if timer_list.is_err() {
-                continue;
-            }
-            let mut timer_list = timer_list.unwrap();
+        self.enqueue(timer, inner, cpu);
+    }
 
-            if timer_list.is_empty() {
-                break;
-            }
+    /// 按照定时器的到期时间，把它放入对应的槽位
+    fn enqueue(&mut self, timer: Arc<Timer>, inner: &mut InnerTimer, cpu: ProcessorId) {
+        let bucket = self.bucket_of(Self::jiffies_to_tick(inner.expire_jiffies));
+        inner.pos = Some(TimerPos {
+            cpu,
+            bucket,
+            index: self.buckets[bucket].len(),
+        });
+        self.buckets[bucket].push(timer);
+        self.nr_timers += 1;
+    }
+
+    fn remove(&mut self, pos: TimerPos) -> Arc<Timer> {
+        let bucket = &mut self.buckets[pos.bucket];
+        let timer = bucket.swap_remove(pos.index);
+        // 原来的最后一个定时器被移动到了pos.index处
+        if let Some(moved) = bucket.get(pos.index) {
+            moved.inner().pos.as_mut().unwrap().index = pos.index;
+        }
+        self.nr_timers -= 1;
+        return timer;
+    }
 
-            let timer_list_front = timer_list.pop_front().unwrap();
-            // kdebug!("to lock timer_list_front");
-            let mut timer_list_front_guard = None;
-            for _ in 0..10 {
-                let x = timer_list_front.inner.try_lock_irqsave();
-                if x.is_err() {
-                    continue;
+    /// 把第level+1级时间轮的第slot个槽位中的定时器重新分配到下面的时间轮中
+    fn cascade(&mut self, level: u64, slot: usize) {
+        let bucket = TVR_SIZE + level as usize * TVN_SIZE + slot;
+        let timers = core::mem::take(&mut self.buckets[bucket]);
+        self.nr_timers -= timers.len();
+        for timer in timers {
+            let mut inner_guard = timer.inner();
+            let cpu = inner_guard.pos.unwrap().cpu;
+            self.enqueue(timer.clone(), &mut inner_guard, cpu);
+        }
+    }
+
+    /// 取出截止到now（刻度）为止到期的所有定时器
+    fn collect_expired(&mut self, now: u64, expired: &mut Vec<Arc<Timer>>) {
+        if self.nr_timers == 0 {
+            self.clk = max(self.clk, now + 1);
+            return;
+        }
+        while self.clk <= now && self.nr_timers > 0 {
+            let index = (self.clk & TVR_MASK) as usize;
+            if index == 0 {
+                for level in 0..TVN_LEVELS {
+                    let slot = ((self.clk >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK) as usize;
+                    self.cascade(level, slot);
+                    if slot != 0 {
+                        break;
+                    }
                 }
-                timer_list_front_guard = Some(x.unwrap());
             }
-            if timer_list_front_guard.is_none() {
-                continue;
+
+            let timers = core::mem::take(&mut self.buckets[index]);
+            self.nr_timers -= timers.len();
+            for timer in timers {
+                timer.inner().pos = None;
+                expired.push(timer);
             }
-            let timer_list_front_guard = timer_list_front_guard.unwrap();
-            if timer_list_front_guard.expire_jiffies > TIMER_JIFFIES.load(Ordering::SeqCst) {
-                drop(timer_list_front_guard);
-                timer_list.push_front(timer_list_front);
+            self.clk += 1;
+        }
+        if self.nr_timers == 0 {
+            self.clk = max(self.clk, now + 1);
+        }
+    }
+
+    /// 是否有定时器可能已经到期
+    fn has_pending(&self, now: u64) -> bool {
+        return self.nr_timers > 0 && self.clk <= now;
+    }
+
+    /// 时间轮下一次需要被处理的刻度（不晚于最早的定时器的到期时间）
+    ///
+    /// 第一级时间轮中的定时器的到期刻度是精确的；更高级的时间轮中的定时器，
+    /// 返回它们被cascade的刻度作为下界。
+    fn next_expiry(&self) -> Option<u64> {
+        if self.nr_timers == 0 {
+            return None;
+        }
+        let mut next = u64::MAX;
+        for offset in 0..TVR_SIZE as u64 {
+            let tick = self.clk + offset;
+            if !self.buckets[(tick & TVR_MASK) as usize].is_empty() {
+                next = tick;
                 break;
             }
-            drop(timer_list_front_guard);
-            drop(timer_list);
-            timer_list_front.run();
         }
+        for level in 0..TVN_LEVELS {
+            let shift = TVR_BITS + level * TVN_BITS;
+            let base = TVR_SIZE + level as usize * TVN_SIZE;
+            // 当前槽位在本轮已经被cascade过，其中的定时器要等到下一圈
+            for offset in 1..=TVN_SIZE as u64 {
+                let slot = (self.clk >> shift) + offset;
+                if !self.buckets[base + (slot & TVN_MASK) as usize].is_empty() {
+                    next = next.min(slot << shift);
+                    break;
+                }
+            }
+        }
+        return Some(next);
+    }
+}
+
+/// 获取指定cpu的时间轮中，下一个定时器的到期时间（单位：jiffies）
+///
+/// 在停止时钟中断之前调用，用于计算cpu最多可以空闲多长时间。
+pub fn timer_next_expire(cpu: ProcessorId) -> Option<u64> {
+    return TIMER_WHEELS[cpu.data() as usize]
+        .lock_irqsave()
+        .next_expiry()
+        .map(|tick| tick << TIMER_WHEEL_SHIFT);
+}
 
-        self.clear_run();
+/// 把一个cpu上的所有定时器迁移到另一个cpu上（例如cpu下线时）
+pub fn migrate_timers(from: ProcessorId, to: ProcessorId) {
+    if from == to {
+        return;
+    }
+    let (mut from_wheel, mut to_wheel) = if from < to {
+        let f = TIMER_WHEELS[from.data() as usize].lock_irqsave();
+        let t = TIMER_WHEELS[to.data() as usize].lock_irqsave();
+        (f, t)
+    } else {
+        let t = TIMER_WHEELS[to.data() as usize].lock_irqsave();
+        let f = TIMER_WHEELS[from.data() as usize].lock_irqsave();
+        (f, t)
+    };
+    let mut earliest: Option<u64> = None;
+    for bucket in 0..from_wheel.buckets.len() {
+        let timers = core::mem::take(&mut from_wheel.buckets[bucket]);
+        for timer in timers {
+            let mut inner_guard = timer.inner();
+            earliest = Some(earliest.map_or(inner_guard.expire_jiffies, |e| {
+                e.min(inner_guard.expire_jiffies)
+            }));
+            to_wheel.insert(timer.clone(), &mut inner_guard, to);
+        }
+    }
+    from_wheel.nr_timers = 0;
+    drop(to_wheel);
+    drop(from_wheel);
+
+    if let Some(expire_jiffies) = earliest {
+        tick_nohz_timer_added(to, expire_jiffies);
+    }
+}
+
+/// 在时钟中断中调用：如果当前cpu的时间轮中有定时器到期，则触发定时器软中断
+pub fn run_local_timers() {
+    let now = clock() >> TIMER_WHEEL_SHIFT;
+    let cpu = smp_get_processor_id();
+    if let Ok(wheel) = TIMER_WHEELS[cpu.data() as usize].try_lock_irqsave() {
+        if !wheel.has_pending(now) {
+            return;
+        }
+    }
+    softirq_vectors().raise_softirq(SoftirqNumber::TIMER);
+}
+
+#[derive(Debug)]
+pub struct DoTimerSoftirq;
+
+impl DoTimerSoftirq {
+    pub fn new() -> Self {
+        return DoTimerSoftirq;
+    }
+}
+
+impl SoftirqVec for DoTimerSoftirq {
+    fn run(&self) {
+        // 只处理当前cpu的时间轮，不同cpu之间互不干扰
+        let cpu = smp_get_processor_id();
+        let now = clock() >> TIMER_WHEEL_SHIFT;
+        let mut expired = Vec::new();
+        TIMER_WHEELS[cpu.data() as usize]
+            .lock_irqsave()
+            .collect_expired(now, &mut expired);
+
+        for timer in expired {
+            timer.run();
+        }
     }
 }
 
@@ -293,28 +584,6 @@ pub fn schedule_timeout(mut timeout: i64) -> Result<i64, SystemError> {
     }
 }
 
-pub fn timer_get_first_expire() -> Result<u64, SystemError> {
-    // FIXME
-    // kdebug!("rs_timer_get_first_expire,timer_jif = {:?}", TIMER_JIFFIES);
-    for _ in 0..10 {
-        match TIMER_LIST.try_lock_irqsave() {
-            Ok(timer_list) => {
-                // kdebug!("rs_timer_get_first_expire TIMER_LIST lock successfully");
-                if timer_list.is_empty() {
-                    // kdebug!("timer_list is empty");
-                    return Ok(0);
-                } else {
-                    // kdebug!("timer_list not empty");
-                    return Ok(timer_list.front().unwrap().inner().expire_jiffies);
-                }
-            }
-            // 加锁失败返回啥？？
-            Err(_) => continue,
-        }
-    }
-    return Err(SystemError::EAGAIN_OR_EWOULDBLOCK);
-}
-
 /// 更新系统时间片
 ///
 /// todo: 这里的实现有问题，貌似把HPET的500us当成了500个jiffies，然后update_wall_time()里面也硬编码了这个500us